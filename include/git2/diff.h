@@ -48,7 +48,7 @@ enum {
 	GIT_DIFF_IGNORE_WHITESPACE_EOL = (1 << 4),
 	/** Exclude submodules from the diff completely */
 	GIT_DIFF_IGNORE_SUBMODULES = (1 << 5),
-	/** Use the "patience diff" algorithm (currently unimplemented) */
+	/** Use the "patience diff" algorithm */
 	GIT_DIFF_PATIENCE = (1 << 6),
 	/** Include ignored files in the diff list */
 	GIT_DIFF_INCLUDE_IGNORED = (1 << 7),
@@ -86,6 +86,23 @@ enum {
 	 *  mode set to tree.  Note: the tree SHA will not be available.
 	 */
 	GIT_DIFF_INCLUDE_TYPECHANGE_TREES  = (1 << 16),
+	/** When comparing the working directory to the index, record the new
+	 *  stat data of files which were touched but whose content did not
+	 *  change, and write the index back out.  The next diff won't have to
+	 *  read those files again.
+	 */
+	GIT_DIFF_UPDATE_INDEX = (1 << 17),
+	/** Use the "histogram diff" algorithm, which is usually faster than
+	 *  the default and gives hunks like patience diff does.  If this and
+	 *  GIT_DIFF_PATIENCE are both set, patience is used.
+	 */
+	GIT_DIFF_HISTOGRAM = (1 << 18),
+	/** Have git_diff_foreach() load and diff files on several threads.
+	 *  The callbacks are still made from the calling thread, one delta
+	 *  at a time and in order, but files are read ahead of them, so a
+	 *  callback shouldn't change the files which are still to come.
+	 */
+	GIT_DIFF_PARALLEL = (1 << 19),
 };
 
 /**
@@ -181,6 +198,48 @@ typedef struct {
 	int           binary;
 } git_diff_delta;
 
+/**
+ * Flags to control the behavior of `git_diff_find_similar`.  A
+ * combination of these can be passed in the `flags` value of the
+ * `git_diff_find_options`.
+ */
+enum {
+	/** Look for renames of deleted files (the default) */
+	GIT_DIFF_FIND_RENAMES = (1 << 0),
+	/** Look for copies of deleted and modified files */
+	GIT_DIFF_FIND_COPIES = (1 << 1),
+	/** Look for copies of unmodified files too; this only finds anything
+	 *  if the diff was made with GIT_DIFF_INCLUDE_UNMODIFIED
+	 */
+	GIT_DIFF_FIND_COPIES_FROM_UNMODIFIED = (1 << 2),
+	/** Treat untracked files as added, so they can be renames or copies */
+	GIT_DIFF_FIND_FOR_UNTRACKED = (1 << 3),
+	/** Only find files whose content is exactly the same */
+	GIT_DIFF_FIND_EXACT_MATCH_ONLY = (1 << 4),
+};
+
+/**
+ * Structure describing options for `git_diff_find_similar`.
+ *
+ * Setting all values of the structure to zero will yield the default
+ * values, as will passing NULL in place of the structure.
+ *
+ * - flags: a combination of the GIT_DIFF_FIND_... values above
+ * - rename_threshold: similarity at or above which an added file is
+ *   a rename of a deleted one
+ * - copy_threshold: similarity at or above which an added file is a
+ *   copy of another
+ * - rename_limit: the search for files which are similar but not the
+ *   same is skipped when the number of added files times the number
+ *   of files they could come from is more than this squared
+ */
+typedef struct {
+	unsigned int flags;			/**< defaults to GIT_DIFF_FIND_RENAMES */
+	uint16_t rename_threshold;	/**< defaults to 50 */
+	uint16_t copy_threshold;	/**< defaults to 50 */
+	unsigned int rename_limit;	/**< defaults to diff.renameLimit or 1000 */
+} git_diff_find_options;
+
 /**
  * When iterating over a diff, callback that will be made per file.
  */
@@ -259,6 +318,12 @@ typedef int (*git_diff_data_fn)(
  */
 typedef struct git_diff_patch git_diff_patch;
 
+/**
+ * The diff stats hold the number of lines added and removed in each file
+ * of a diff list, and in all of them together.
+ */
+typedef struct git_diff_stats git_diff_stats;
+
 
 /** @name Diff List Generator Functions
  *
@@ -374,6 +439,28 @@ GIT_EXTERN(int) git_diff_merge(
 	git_diff_list *onto,
 	const git_diff_list *from);
 
+/**
+ * Find renamed and copied files in a diff list.
+ *
+ * Added files whose content is the same as, or similar enough to, a
+ * deleted file become RENAMED records in place of the two, with the
+ * `old_file` of the deleted one and the `similarity` of their content.
+ * If copies are looked for, an added file similar to a file which is
+ * still there becomes a COPIED record.  Each deleted file is only
+ * renamed once; files with the same content are paired up first.
+ *
+ * Renamed and copied records keep the place of the added file in the
+ * list, so this should be the last thing done to it; merging another
+ * list into it afterwards won't do anything sensible with them.
+ *
+ * @param diff Diff list to look for renames and copies in
+ * @param options Options for what to look for, or NULL for defaults
+ * @return 0 on success, -1 on failure
+ */
+GIT_EXTERN(int) git_diff_find_similar(
+	git_diff_list *diff,
+	const git_diff_find_options *options);
+
 /**@}*/
 
 
@@ -603,6 +690,62 @@ GIT_EXTERN(int) git_diff_patch_get_line_in_hunk(
 	size_t hunk_idx,
 	size_t line_of_hunk);
 
+/**
+ * Count the lines added and removed by the deltas in a diff list.
+ *
+ * This runs the text diff of each file like `git_diff_foreach()` would,
+ * but only counts the changed lines, without making any callbacks or
+ * keeping the text of the hunks and lines around.  Binary files are
+ * counted as changed files with no lines.  You have to call
+ * `git_diff_stats_free()` when you are done with the stats.
+ *
+ * @param out Output parameter for the stats
+ * @param diff Diff list object
+ * @return 0 on success, <0 on error
+ */
+GIT_EXTERN(int) git_diff_get_stats(
+	git_diff_stats **out,
+	git_diff_list *diff);
+
+/**
+ * Get the number of files which changed in the diff stats.
+ */
+GIT_EXTERN(size_t) git_diff_stats_files_changed(
+	const git_diff_stats *stats);
+
+/**
+ * Get the total number of lines added in the diff stats.
+ */
+GIT_EXTERN(size_t) git_diff_stats_insertions(
+	const git_diff_stats *stats);
+
+/**
+ * Get the total number of lines removed in the diff stats.
+ */
+GIT_EXTERN(size_t) git_diff_stats_deletions(
+	const git_diff_stats *stats);
+
+/**
+ * Get the number of lines added and removed for one delta.
+ *
+ * @param insertions Output count of lines added, may be NULL
+ * @param deletions Output count of lines removed, may be NULL
+ * @param stats The diff stats
+ * @param idx Index of the delta in the diff list the stats came from
+ * @return 0 on success, GIT_ENOTFOUND if idx is out of range
+ */
+GIT_EXTERN(int) git_diff_stats_for_delta(
+	size_t *insertions,
+	size_t *deletions,
+	const git_diff_stats *stats,
+	size_t idx);
+
+/**
+ * Free a git_diff_stats object.
+ */
+GIT_EXTERN(void) git_diff_stats_free(
+	git_diff_stats *stats);
+
 /**@}*/
 
 
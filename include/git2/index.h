@@ -47,6 +47,9 @@ GIT_BEGIN_DECL
 #define GIT_IDXENTRY_UNPACKED			(1 << 8)
 #define GIT_IDXENTRY_NEW_SKIP_WORKTREE (1 << 9)
 
+/* unchanged since it was checked, as far as the filesystem monitor knows */
+#define GIT_IDXENTRY_FSMONITOR_VALID	(1 << 10)
+
 /*
  * Extended on-disk flags:
  */
@@ -91,11 +94,32 @@ typedef struct git_index_reuc_entry {
 	char *path;
 } git_index_reuc_entry;
 
-/** Capabilities of system that affect index actions. */
+/**
+ * Capabilities of system that affect index actions.
+ *
+ * `GIT_INDEXCAP_OFFSET_TABLE` makes the index record a table of where
+ * its entries start when it's written, so large indexes can be loaded
+ * by several threads at once.  The table isn't written for version 4
+ * indexes, whose entries can only be read in order.
+ *
+ * `GIT_INDEXCAP_SPLIT_INDEX` writes the index as a small file holding
+ * what changed since a larger shared index, which only gets rewritten
+ * once the changes make up more than `splitIndex.maxPercentChange` of
+ * the entries (20% by default).
+ *
+ * `GIT_INDEXCAP_UNTRACKED_CACHE` keeps a list of the untracked files in
+ * each directory in the index, so status and diff can skip reading
+ * directories which haven't changed since.  The list is kept up to date
+ * whenever they look for untracked but not ignored files, and saved the
+ * next time the index is written.
+ */
 enum {
 	GIT_INDEXCAP_IGNORE_CASE = 1,
 	GIT_INDEXCAP_NO_FILEMODE = 2,
 	GIT_INDEXCAP_NO_SYMLINKS = 4,
+	GIT_INDEXCAP_OFFSET_TABLE = 8,
+	GIT_INDEXCAP_SPLIT_INDEX = 16,
+	GIT_INDEXCAP_UNTRACKED_CACHE = 32,
 	GIT_INDEXCAP_FROM_OWNER  = ~0u
 };
 
@@ -153,7 +177,9 @@ GIT_EXTERN(unsigned int) git_index_caps(const git_index *index);
  *
  * If you pass `GIT_INDEXCAP_FROM_OWNER` for the caps, then the
  * capabilities will be read from the config of the owner object,
- * looking at `core.ignorecase`, `core.filemode`, `core.symlinks`.
+ * looking at `core.ignorecase`, `core.filemode`, `core.symlinks`,
+ * `index.recordOffsetTable`, `core.splitIndex`,
+ * `splitIndex.maxPercentChange` and `core.untrackedCache`.
  *
  * @param index An existing index object
  * @param caps A combination of GIT_INDEXCAP values
@@ -161,6 +187,30 @@ GIT_EXTERN(unsigned int) git_index_caps(const git_index *index);
  */
 GIT_EXTERN(int) git_index_set_caps(git_index *index, unsigned int caps);
 
+/**
+ * Get the version of the on-disk index format.
+ *
+ * This is the version the index was read with, or the one chosen
+ * with `git_index_set_version`.  Valid values are 2, 3 or 4.
+ *
+ * @param index An existing index object
+ * @return the index version
+ */
+GIT_EXTERN(unsigned int) git_index_version(git_index *index);
+
+/**
+ * Set the version of the on-disk index format to write.
+ *
+ * Version 4 stores each path relative to the one before it, which
+ * makes indexes of deep trees considerably smaller.  Version 2 indexes
+ * containing entries with extended flags are written as version 3.
+ *
+ * @param index An existing index object
+ * @param version The version to write, 2, 3 or 4
+ * @return 0 on success, -1 on failure
+ */
+GIT_EXTERN(int) git_index_set_version(git_index *index, unsigned int version);
+
 /**
  * Update the contents of an existing index object in memory
  * by reading from the hard disk.
@@ -475,6 +525,76 @@ GIT_EXTERN(int) git_index_reuc_remove(git_index *index, int position);
 
 /**@}*/
 
+/** @name Filesystem Monitor Functions
+ *
+ * A filesystem monitor tells the index which paths in the working
+ * directory changed, so status and diff don't need to look at the rest.
+ * What it said last is kept in the index as a token, together with
+ * which entries were unchanged at the time.
+ */
+/**@{*/
+
+/**
+ * Callback asking a filesystem monitor what changed in the working
+ * directory.
+ *
+ * It's given the token the monitor handed out the last time, or NULL
+ * if there isn't one (in which case everything is taken to have
+ * changed).  It should call `git_index_fsmonitor_changed()` for every
+ * path which changed since then, and `git_index_fsmonitor_set_token()`
+ * with a token standing for the present moment.
+ *
+ * @param index the index asking
+ * @param token the token from the last time, or NULL
+ * @param payload the payload given to `git_index_set_fsmonitor()`
+ * @return 0 on success, or non-zero to give up, which makes the
+ *         comparison fail with GIT_EUSER
+ */
+typedef int (*git_index_fsmonitor_cb)(
+	git_index *index, const char *token, void *payload);
+
+/**
+ * Set the filesystem monitor of an index.
+ *
+ * The monitor is asked what changed each time the working directory
+ * is compared to the index.  Entries which neither it nor a later
+ * check found to have changed aren't looked at again, and with
+ * `GIT_INDEXCAP_UNTRACKED_CACHE` neither are such directories.
+ *
+ * @param index an existing index object
+ * @param callback the monitor, or NULL to stop using one
+ * @param payload passed to the callback
+ */
+GIT_EXTERN(void) git_index_set_fsmonitor(
+	git_index *index, git_index_fsmonitor_cb callback, void *payload);
+
+/**
+ * Tell the index that a path in the working directory changed.
+ *
+ * This is meant for filesystem monitors, but can be called at any
+ * time.  If `path` is a directory, everything in it counts as changed;
+ * the empty path means the whole working directory.
+ *
+ * @param index an existing index object
+ * @param path the path which changed, relative to the working directory
+ * @return 0 or an error code
+ */
+GIT_EXTERN(int) git_index_fsmonitor_changed(git_index *index, const char *path);
+
+/**
+ * Set the token standing for what the filesystem monitor has reported.
+ *
+ * The token is given to the monitor next time, and saved in the index
+ * when it's written.
+ *
+ * @param index an existing index object
+ * @param token the new token, or NULL to forget it
+ * @return 0 or an error code
+ */
+GIT_EXTERN(int) git_index_fsmonitor_set_token(git_index *index, const char *token);
+
+/**@}*/
+
 /** @} */
 GIT_END_DECL
 #endif
@@ -41,6 +41,31 @@ GIT_EXTERN(int) git_packbuilder_new(git_packbuilder **out, git_repository *repo)
  */
 GIT_EXTERN(void) git_packbuilder_set_threads(git_packbuilder *pb, unsigned int n);
 
+/**
+ * Add a delta island pattern
+ *
+ * Every reference whose name matches the extended regular expression
+ * `regex` is assigned to a delta island named after the substrings
+ * matched by the capture groups of the regex (joined by '-'); all the
+ * references matched by a regex without capture groups share a single
+ * island. The patterns are tried in the order they were added, and the
+ * first one to match a reference wins.
+ *
+ * When at least one pattern has been added, an object will only be
+ * stored as a delta against a base which is reachable from every island
+ * the object itself is reachable from, so that packs served for a
+ * subset of the references never need to be re-deltified.
+ *
+ * The patterns from the "pack.island" configuration variable are added
+ * automatically when the packbuilder is created.
+ *
+ * @param pb The packbuilder
+ * @param regex The pattern to match reference names against
+ *
+ * @return 0 or an error code
+ */
+GIT_EXTERN(int) git_packbuilder_add_island(git_packbuilder *pb, const char *regex);
+
 /**
  * Insert a single object
  *
@@ -77,6 +102,38 @@ GIT_EXTERN(int) git_packbuilder_insert_tree(git_packbuilder *pb, const git_oid *
  */
 GIT_EXTERN(int) git_packbuilder_write(git_packbuilder *pb, const char *file);
 
+/**
+ * Create the new pack and pass each chunk of it to the callback
+ *
+ * The pack is produced incrementally, one object at a time, so that it
+ * can be streamed to a file descriptor or over the network without
+ * ever being held in memory in its entirety.
+ *
+ * @param pb The packbuilder
+ * @param cb The callback to call with each chunk of the pack; returning
+ *           a negative value aborts the write
+ * @param payload Payload for the callback
+ *
+ * @return 0 or an error code
+ */
+GIT_EXTERN(int) git_packbuilder_foreach(git_packbuilder *pb, int (*cb)(void *buf, size_t size, void *payload), void *payload);
+
+/**
+ * Get the total number of objects the packbuilder will write out
+ *
+ * @param pb The packbuilder
+ * @return the number of objects in the packfile
+ */
+GIT_EXTERN(uint32_t) git_packbuilder_object_count(git_packbuilder *pb);
+
+/**
+ * Get the number of objects the packbuilder has already written out
+ *
+ * @param pb The packbuilder
+ * @return the number of objects which have already been written
+ */
+GIT_EXTERN(uint32_t) git_packbuilder_written(git_packbuilder *pb);
+
 /**
  * Free the packbuilder and all associated data
  *
@@ -21,6 +21,9 @@
 #include "repository.h"
 #include "filter.h"
 #include "blob.h"
+#include "index.h"
+
+typedef struct checkout_writer checkout_writer;
 
 struct checkout_diff_data
 {
@@ -28,111 +31,470 @@ struct checkout_diff_data
 	size_t workdir_len;
 	git_checkout_opts *checkout_opts;
 	git_repository *owner;
+	git_index *index;
+	checkout_writer *writer;
 	bool can_symlink;
 	bool found_submodules;
 	bool create_submodules;
+	bool index_updated;
 	int error;
 	size_t total_steps;
 	size_t completed_steps;
 };
 
+/*
+ * Write a file out, and fill in `st` with what it looks like afterwards
+ * (or zero it, if that can't be known) for the index.
+ */
 static int buffer_to_file(
-	git_buf *buffer,
+	struct stat *st,
+	const char *data,
+	size_t len,
 	const char *path,
-	mode_t dir_mode,
 	int file_open_flags,
 	mode_t file_mode)
 {
 	int fd, error, error_close;
+	bool set_mode = ((file_mode & 0100) != 0);
 
-	if ((error = git_futils_mkpath2file(path, dir_mode)) < 0)
-		return error;
+	memset(st, 0, sizeof(*st));
 
-	if ((fd = p_open(path, file_open_flags, file_mode)) < 0)
+	if ((fd = p_open(path, file_open_flags, file_mode)) < 0) {
+		giterr_set(GITERR_OS, "Failed to open '%s' for writing", path);
 		return fd;
+	}
+
+	if ((error = p_write(fd, data, len)) < 0)
+		giterr_set(GITERR_OS, "Failed to write to '%s'", path);
 
-	error = p_write(fd, git_buf_cstr(buffer), git_buf_len(buffer));
+	/* setting the mode changes the ctime, so stat after that instead */
+	if (!error && !set_mode && p_fstat(fd, st) < 0)
+		memset(st, 0, sizeof(*st));
 
 	error_close = p_close(fd);
 
 	if (!error)
 		error = error_close;
 
-	if (!error &&
-		(file_mode & 0100) != 0 &&
-		(error = p_chmod(path, file_mode)) < 0)
-		giterr_set(GITERR_OS, "Failed to set permissions on '%s'", path);
+	if (!error && set_mode) {
+		if ((error = p_chmod(path, file_mode)) < 0)
+			giterr_set(GITERR_OS, "Failed to set permissions on '%s'", path);
+		else if (p_stat(path, st) < 0)
+			memset(st, 0, sizeof(*st));
+	}
 
 	return error;
 }
 
+static void report_progress(
+		struct checkout_diff_data *data,
+		const char *path)
+{
+	if (data->checkout_opts->progress_cb)
+		data->checkout_opts->progress_cb(
+				path,
+				data->completed_steps,
+				data->total_steps,
+				data->checkout_opts->progress_payload);
+}
+
+/*
+ * A file (or link) to be written by the checkout writer.  The blob is
+ * read and filtered on the calling thread, and `data` points either into
+ * the blob or into `content`.
+ */
+typedef struct {
+	git_blob *blob;
+	git_buf content;
+	const char *data;
+	size_t len;
+	git_buf path;
+	const char *progress_path;
+	mode_t mode;
+	bool is_link;
+	bool done;
+	struct stat st; /* the file as written, or zeroed */
+	int error;
+	int error_class;
+	char *error_message;
+} checkout_write;
+
+/* How many threads write files out; it's mostly waiting on the disk */
+#define CHECKOUT_WRITER_THREADS 4
+
+/* The most files, and the most bytes, which may be waiting to be written */
+#define CHECKOUT_WRITE_AHEAD 64
+#define CHECKOUT_WRITE_AHEAD_BYTES (16 * 1024 * 1024)
+
+/*
+ * Writes files out on a few threads, while the calling thread reads the
+ * blobs (the object database and attributes aren't safe to use from other
+ * threads) and creates the directories.  The writes go around a ring, and
+ * the calling thread retires them in order, so progress is reported in
+ * the same order and the first error is the one that's returned.  Once
+ * there's an error nothing more is queued, and the writes already going
+ * are retired before it's returned.  Items [retired, queued) are in use,
+ * and [taken, queued) are still waiting for a thread.
+ */
+struct checkout_writer {
+	struct checkout_diff_data *data;
+	git_buf last_dir; /* the last directory which was made */
+	size_t retired, taken, queued;
+	size_t pending_bytes;
+	int error; /* the first one, in order */
+	checkout_write writes[CHECKOUT_WRITE_AHEAD];
+#ifdef GIT_THREADS
+	git_mutex lock;
+	git_cond wake; /* there's work, or it's time to stop */
+	git_cond done; /* a write was finished */
+	int shutdown;
+	size_t nr_threads;
+	git_thread threads[CHECKOUT_WRITER_THREADS];
+#endif
+};
+
 static int blob_content_to_file(
+	checkout_write *write,
 	git_blob *blob,
-	const char *path,
-	mode_t entry_filemode,
 	git_checkout_opts *opts)
 {
-	int error = -1, nb_filters = 0;
-	mode_t file_mode = opts->file_mode;
-	bool dont_free_filtered = false;
-	git_buf unfiltered = GIT_BUF_INIT, filtered = GIT_BUF_INIT;
+	int error = 0, nb_filters = 0;
+	git_buf unfiltered = GIT_BUF_INIT;
 	git_vector filters = GIT_VECTOR_INIT;
 
-	if (opts->disable_filters ||
+	if (!opts->disable_filters &&
 		(nb_filters = git_filters_load(
 			&filters,
 			git_object_owner((git_object *)blob),
-			path,
-			GIT_FILTER_TO_WORKTREE)) == 0) {
+			git_buf_cstr(&write->path),
+			GIT_FILTER_TO_WORKTREE)) < 0)
+		return nb_filters;
+
+	if (nb_filters > 0) {
+		if (!(error = git_blob__getbuf(&unfiltered, blob)) &&
+			!(error = git_filters_apply(&write->content, &unfiltered, &filters)))
+		{
+			write->data = git_buf_cstr(&write->content);
+			write->len  = git_buf_len(&write->content);
+		}
+	} else {
+		/* write straight from the blob */
+		write->data = blob->odb_object->raw.data;
+		write->len  = blob->odb_object->raw.len;
+	}
+
+	git_filters_free(&filters);
+	git_buf_free(&unfiltered);
 
-		/* Create a fake git_buf from the blob raw data... */
-		filtered.ptr = blob->odb_object->raw.data;
-		filtered.size = blob->odb_object->raw.len;
+	return error;
+}
+
+static int blob_content_to_link(checkout_write *write, git_blob *blob)
+{
+	int error;
+
+	if ((error = git_blob__getbuf(&write->content, blob)) < 0)
+		return error;
+
+	write->is_link = true;
+	write->data = git_buf_cstr(&write->content);
+	write->len  = git_buf_len(&write->content);
+
+	return 0;
+}
+
+/* This is the part which may be done on another thread */
+static int checkout_write_out(checkout_write *write, checkout_writer *writer)
+{
+	git_checkout_opts *opts = writer->data->checkout_opts;
+	const char *path = git_buf_cstr(&write->path);
 
-		/* ... and make sure it doesn't get unexpectedly freed */
-		dont_free_filtered = true;
+	int error;
+
+	if (!write->is_link)
+		return buffer_to_file(&write->st,
+			write->data, write->len, path, opts->file_open_flags, write->mode);
+
+	if (!writer->data->can_symlink)
+		return git_futils_fake_symlink(write->data, path);
+
+	if (!(error = p_symlink(write->data, path)) && p_lstat(path, &write->st) < 0)
+		memset(&write->st, 0, sizeof(write->st));
+
+	return error;
+}
+
+/*
+ * Give the index entry the stat data of the file which was just written
+ * for it, so that the next status needn't read the file to know that it
+ * hasn't changed.  Files opened without truncating them may hold more
+ * than was written, and are left alone.
+ */
+static void checkout_write_update_index(
+	struct checkout_diff_data *data, checkout_write *write)
+{
+	git_index_entry *entry;
+	mode_t mode;
+
+	if (!data->index || !write->st.st_mtime ||
+		(!write->is_link &&
+		 (data->checkout_opts->file_open_flags & (O_TRUNC | O_EXCL)) == 0))
+		return;
+
+	entry = git_index_get_bypath(data->index, write->progress_path, 0);
+	if (!entry || git_oid_cmp(&entry->oid, git_object_id((git_object *)write->blob)))
+		return;
+
+	mode = entry->mode;
+	git_index__init_entry_from_stat(&write->st, entry);
+	entry->mode = mode;
+
+	/* the contents are known to match, even if the timestamp is racy */
+	entry->flags_extended |= GIT_IDXENTRY_UPTODATE;
+
+	data->index_updated = true;
+}
+
+static void checkout_write_save_error(checkout_write *write)
+{
+	const git_error *e = giterr_last();
+
+	/* errors are kept per thread, so save it for the caller */
+	write->error_class = e ? e->klass : GITERR_OS;
+	write->error_message = git__strdup(e ? e->message : "failed to write file");
+	giterr_clear();
+}
+
+static void checkout_write_clear(checkout_write *write)
+{
+	git_blob_free(write->blob);
+	git_buf_free(&write->content);
+	git_buf_free(&write->path);
+	git__free(write->error_message);
+	memset(write, 0, sizeof(*write));
+}
+
+#ifdef GIT_THREADS
+
+static void *checkout_writer_run(void *payload)
+{
+	checkout_writer *writer = payload;
+	checkout_write *write;
+
+	git_mutex_lock(&writer->lock);
+
+	for (;;) {
+		while (!writer->shutdown && writer->taken == writer->queued)
+			git_cond_wait(&writer->wake, &writer->lock);
+
+		if (writer->shutdown)
+			break;
+
+		write = &writer->writes[writer->taken++ % CHECKOUT_WRITE_AHEAD];
+
+		git_mutex_unlock(&writer->lock);
+
+		if ((write->error = checkout_write_out(write, writer)) < 0)
+			checkout_write_save_error(write);
+
+		git_mutex_lock(&writer->lock);
+
+		write->done = true;
+		git_cond_broadcast(&writer->done);
 	}
 
-	if (nb_filters < 0)
-		return nb_filters;
+	git_mutex_unlock(&writer->lock);
 
-	if (nb_filters > 0)	 {
-		if ((error = git_blob__getbuf(&unfiltered, blob)) < 0)
-			goto cleanup;
+	return NULL;
+}
+
+#endif
 
-		if ((error = git_filters_apply(&filtered, &unfiltered, &filters)) < 0)
-			goto cleanup;
+static int checkout_writer_init(
+	checkout_writer *writer, struct checkout_diff_data *data)
+{
+	memset(writer, 0, sizeof(*writer));
+
+	writer->data = data;
+	git_buf_init(&writer->last_dir, 0);
+
+#ifdef GIT_THREADS
+	git_mutex_init(&writer->lock);
+	git_cond_init(&writer->wake);
+	git_cond_init(&writer->done);
+
+	/* if no thread starts, the files just get written as they come */
+	for (writer->nr_threads = 0;
+		 writer->nr_threads < CHECKOUT_WRITER_THREADS;
+		 writer->nr_threads++)
+	{
+		if (git_thread_create(&writer->threads[writer->nr_threads],
+				NULL, checkout_writer_run, writer) != 0)
+			break;
 	}
+#endif
 
-	/* Allow overriding of file mode */
-	if (!file_mode)
-		file_mode = entry_filemode;
+	return 0;
+}
 
-	error = buffer_to_file(&filtered, path, opts->dir_mode, opts->file_open_flags, file_mode);
+/*
+ * Wait for the oldest write, report it done, and make room for another.
+ * Only the first error is kept, as the ones after it wouldn't have been
+ * seen when writing one file after the other.
+ */
+static void checkout_writer_retire(checkout_writer *writer)
+{
+	checkout_write *write =
+		&writer->writes[writer->retired % CHECKOUT_WRITE_AHEAD];
+	struct checkout_diff_data *data = writer->data;
+
+#ifdef GIT_THREADS
+	git_mutex_lock(&writer->lock);
+	while (!write->done)
+		git_cond_wait(&writer->done, &writer->lock);
+	git_mutex_unlock(&writer->lock);
+#endif
+
+	if (write->error < 0) {
+		if (!writer->error) {
+			giterr_set(write->error_class, "%s", write->error_message);
+			writer->error = write->error;
+		}
+	} else
+		checkout_write_update_index(data, write);
 
-cleanup:
-	git_filters_free(&filters);
-	git_buf_free(&unfiltered);
-	if (!dont_free_filtered)
-		git_buf_free(&filtered);
+	data->completed_steps++;
+	report_progress(data, write->progress_path);
 
-	return error;
+	writer->pending_bytes -= write->len;
+	writer->retired++;
+	checkout_write_clear(write);
+}
+
+/* Retire all the writes which are going, and return the first error */
+static int checkout_writer_drain(checkout_writer *writer)
+{
+	while (writer->retired < writer->queued)
+		checkout_writer_retire(writer);
+
+	return writer->error;
+}
+
+/*
+ * Report a file which failed before it could be queued, in its turn:
+ * after the ones before it, whose errors come first.
+ */
+static int checkout_writer_fail(
+	checkout_writer *writer, const char *path, int error)
+{
+	if (checkout_writer_drain(writer) < 0)
+		return writer->error;
+
+	writer->data->completed_steps++;
+	report_progress(writer->data, path);
+
+	return (writer->error = error);
 }
 
-static int blob_content_to_link(git_blob *blob, const char *path, bool can_symlink)
+/*
+ * Make the directory for a file, unless it was made for the last one
+ * (or that one went into a subdirectory of it); files come in order, so
+ * most directories are only made once.
+ */
+static int checkout_writer_mkdir(checkout_writer *writer, const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	size_t dir_len = slash ? (size_t)(slash - path) : 0;
+
+	if (dir_len <= git_buf_len(&writer->last_dir) &&
+		strncmp(path, git_buf_cstr(&writer->last_dir), dir_len) == 0 &&
+		(dir_len == git_buf_len(&writer->last_dir) ||
+		 writer->last_dir.ptr[dir_len] == '/'))
+		return 0;
+
+	if (git_futils_mkpath2file(path, writer->data->checkout_opts->dir_mode) < 0)
+		return -1;
+
+	return git_buf_set(&writer->last_dir, path, dir_len);
+}
+
+/*
+ * Hand a write over to the threads, making room for it first.  Without
+ * any threads the file is written right away.
+ */
+static int checkout_writer_queue(checkout_writer *writer, checkout_write *write)
 {
-	git_buf linktarget = GIT_BUF_INIT;
 	int error;
 
-	if ((error = git_blob__getbuf(&linktarget, blob)) < 0)
-		return error;
+	if (writer->error < 0) {
+		checkout_write_clear(write);
+		return writer->error;
+	}
 
-	if (can_symlink)
-		error = p_symlink(git_buf_cstr(&linktarget), path);
-	else
-		error = git_futils_fake_symlink(git_buf_cstr(&linktarget), path);
+	if ((error = checkout_writer_mkdir(writer, git_buf_cstr(&write->path))) < 0) {
+		const char *path = write->progress_path;
+
+		checkout_write_clear(write);
+		return checkout_writer_fail(writer, path, error);
+	}
+
+	while (!writer->error &&
+		(writer->queued - writer->retired == CHECKOUT_WRITE_AHEAD ||
+		 (writer->queued > writer->retired &&
+		  writer->pending_bytes + write->len > CHECKOUT_WRITE_AHEAD_BYTES)))
+		checkout_writer_retire(writer);
 
-	git_buf_free(&linktarget);
+	if (writer->error < 0) {
+		checkout_write_clear(write);
+		return checkout_writer_drain(writer);
+	}
+
+	writer->pending_bytes += write->len;
+	memcpy(&writer->writes[writer->queued % CHECKOUT_WRITE_AHEAD],
+		write, sizeof(checkout_write));
+
+#ifdef GIT_THREADS
+	if (writer->nr_threads > 0) {
+		git_mutex_lock(&writer->lock);
+		writer->queued++;
+		git_cond_signal(&writer->wake);
+		git_mutex_unlock(&writer->lock);
+		return 0;
+	}
+#endif
+
+	write = &writer->writes[writer->queued++ % CHECKOUT_WRITE_AHEAD];
+	if ((write->error = checkout_write_out(write, writer)) < 0)
+		checkout_write_save_error(write);
+	write->done = true;
+
+	return checkout_writer_drain(writer);
+}
+
+/* Retire the writes which are still going, and stop the threads */
+static int checkout_writer_finish(checkout_writer *writer)
+{
+	int error = checkout_writer_drain(writer);
+
+#ifdef GIT_THREADS
+	{
+		size_t i;
+
+		git_mutex_lock(&writer->lock);
+		writer->shutdown = 1;
+		git_cond_broadcast(&writer->wake);
+		git_mutex_unlock(&writer->lock);
+
+		for (i = 0; i < writer->nr_threads; ++i)
+			git_thread_join(writer->threads[i], NULL);
+
+		git_cond_free(&writer->wake);
+		git_cond_free(&writer->done);
+		git_mutex_free(&writer->lock);
+	}
+#endif
+
+	git_buf_free(&writer->last_dir);
 
 	return error;
 }
@@ -159,42 +521,33 @@ static int checkout_submodule(
 	return 0;
 }
 
-static void report_progress(
-		struct checkout_diff_data *data,
-		const char *path)
-{
-	if (data->checkout_opts->progress_cb)
-		data->checkout_opts->progress_cb(
-				path,
-				data->completed_steps,
-				data->total_steps,
-				data->checkout_opts->progress_payload);
-}
-
 static int checkout_blob(
 	struct checkout_diff_data *data,
 	const git_diff_file *file)
 {
-	git_blob *blob;
+	checkout_write write;
 	int error;
 
-	git_buf_truncate(data->path, data->workdir_len);
-	if (git_buf_joinpath(data->path, git_buf_cstr(data->path), file->path) < 0)
-		return -1;
-
-	if ((error = git_blob_lookup(&blob, data->owner, &file->oid)) < 0)
-		return error;
+	memset(&write, 0, sizeof(write));
+	write.progress_path = file->path;
+	write.mode = data->checkout_opts->file_mode ?
+		data->checkout_opts->file_mode : file->mode; /* allow overriding */
 
-	if (S_ISLNK(file->mode))
-		error = blob_content_to_link(
-			blob, git_buf_cstr(data->path), data->can_symlink);
-	else
-		error = blob_content_to_file(
-			blob, git_buf_cstr(data->path), file->mode, data->checkout_opts);
+	if (git_buf_joinpath(&write.path, git_buf_cstr(data->path), file->path) < 0) {
+		git_buf_free(&write.path);
+		return -1;
+	}
 
-	git_blob_free(blob);
+	if ((error = git_blob_lookup(&write.blob, data->owner, &file->oid)) < 0 ||
+		(error = S_ISLNK(file->mode) ?
+			blob_content_to_link(&write, write.blob) :
+			blob_content_to_file(&write, write.blob, data->checkout_opts)) < 0)
+	{
+		checkout_write_clear(&write);
+		return checkout_writer_fail(data->writer, file->path, error);
+	}
 
-	return error;
+	return checkout_writer_queue(data->writer, &write);
 }
 
 static int checkout_remove_the_old(
@@ -244,6 +597,11 @@ static int checkout_create_the_new(
 			 (opts->checkout_strategy & GIT_CHECKOUT_CREATE_MISSING) != 0)
 		do_checkout = true;
 
+	/* the files before this one are reported first, and may have failed */
+	if (do_notify && data->writer != NULL &&
+		(error = checkout_writer_drain(data->writer)) < 0)
+		do_notify = false;
+
 	if (do_notify) {
 		if (opts->skipped_notify_cb(
 			delta->old_file.path, &delta->old_file.oid,
@@ -261,11 +619,9 @@ static int checkout_create_the_new(
 			data->found_submodules = true;
 		}
 
-		if (!is_submodule && !data->create_submodules) {
+		/* progress is reported when the file has been written */
+		if (!is_submodule && !data->create_submodules)
 			error = checkout_blob(data, &delta->old_file);
-			data->completed_steps++;
-			report_progress(data, delta->old_file.path);
-		}
 
 		else if (is_submodule && data->create_submodules) {
 			error = checkout_submodule(data, &delta->old_file);
@@ -324,9 +680,14 @@ static void normalize_options(git_checkout_opts *normalized, git_checkout_opts *
 		normalized->file_open_flags = O_CREAT | O_TRUNC | O_WRONLY;
 }
 
-int git_checkout_index(
+/*
+ * Check out the files in the index.  The index is written out afterwards
+ * if `index_changed`, or if the stat data of any files was taken for it.
+ */
+static int checkout_index(
 	git_repository *repo,
-	git_checkout_opts *opts)
+	git_checkout_opts *opts,
+	bool index_changed)
 {
 	git_diff_list *diff = NULL;
 
@@ -334,15 +695,21 @@ int git_checkout_index(
 	git_checkout_opts checkout_opts;
 
 	struct checkout_diff_data data;
+	checkout_writer writer;
 	git_buf workdir = GIT_BUF_INIT;
 
-	int error;
+	int error, finish_error;
 
 	assert(repo);
 
-	if ((error = git_repository__ensure_not_bare(repo, "checkout")) < 0)
+	memset(&data, 0, sizeof(data));
+
+	if ((error = git_repository_index__weakptr(&data.index, repo)) < 0)
 		return error;
 
+	if ((error = git_repository__ensure_not_bare(repo, "checkout")) < 0)
+		goto cleanup;
+
 	diff_opts.flags =
 		GIT_DIFF_INCLUDE_UNTRACKED |
 		GIT_DIFF_INCLUDE_TYPECHANGE |
@@ -359,8 +726,6 @@ int git_checkout_index(
 
 	normalize_options(&checkout_opts, opts);
 
-	memset(&data, 0, sizeof(data));
-
 	data.path = &workdir;
 	data.workdir_len = git_buf_len(&workdir);
 	data.checkout_opts = &checkout_opts;
@@ -384,9 +749,24 @@ int git_checkout_index(
 
 	if (!(error = git_diff_foreach(
 			diff, &data, checkout_remove_the_old, NULL, NULL)) &&
-		!(error = git_diff_foreach(
-			diff, &data, checkout_create_the_new, NULL, NULL)) &&
-		data.found_submodules)
+		!(error = checkout_writer_init(&writer, &data)))
+	{
+		data.writer = &writer;
+
+		error = git_diff_foreach(
+			diff, &data, checkout_create_the_new, NULL, NULL);
+
+		if (error == GIT_EUSER)
+			error = (data.error != 0) ? data.error : -1;
+
+		finish_error = checkout_writer_finish(&writer);
+		if (!error)
+			error = finish_error;
+
+		data.writer = NULL;
+	}
+
+	if (!error && data.found_submodules)
 	{
 		data.create_submodules = true;
 		error = git_diff_foreach(
@@ -399,12 +779,24 @@ cleanup:
 	if (error == GIT_EUSER)
 		error = (data.error != 0) ? data.error : -1;
 
+	/* even after an error, the files which were written are known */
+	if ((index_changed || data.index_updated) &&
+		git_index_write(data.index) < 0 && !error)
+		error = -1;
+
 	git_diff_list_free(diff);
 	git_buf_free(&workdir);
 
 	return error;
 }
 
+int git_checkout_index(
+	git_repository *repo,
+	git_checkout_opts *opts)
+{
+	return checkout_index(repo, opts, false);
+}
+
 int git_checkout_tree(
 	git_repository *repo,
 	git_object *treeish,
@@ -428,10 +820,8 @@ int git_checkout_tree(
 	if ((error = git_index_read_tree(index, tree)) < 0)
 		goto cleanup;
 
-	if ((error = git_index_write(index)) < 0)
-		goto cleanup;
-
-	error = git_checkout_index(repo, opts);
+	/* the index is written once, with the new files' stat data */
+	error = checkout_index(repo, opts, true);
 
 cleanup:
 	git_index_free(index);
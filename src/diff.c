@@ -10,6 +10,8 @@
 #include "config.h"
 #include "attr_file.h"
 #include "filter.h"
+#include "index.h"
+#include "thread-utils.h"
 
 static char *diff_prefix_from_pathspec(const git_strarray *pathspec)
 {
@@ -473,6 +475,38 @@ void git_diff_list_addref(git_diff_list *diff)
 	GIT_REFCOUNT_INC(diff);
 }
 
+static int oid_for_workdir_file(
+	git_repository *repo,
+	const git_index_entry *item,
+	git_vector *filters,
+	git_oid *oid)
+{
+	int result;
+	git_file fd;
+	git_buf full_path = GIT_BUF_INIT;
+
+	if (!git__is_sizet(item->file_size)) {
+		giterr_set(GITERR_OS, "File size overflow for 32-bit systems");
+		return -1;
+	}
+
+	if (git_buf_joinpath(
+		&full_path, git_repository_workdir(repo), item->path) < 0)
+		return -1;
+
+	if ((fd = git_futils_open_ro(full_path.ptr)) < 0)
+		result = fd;
+	else {
+		result = git_odb__hashfd_filtered(
+			oid, fd, (size_t)item->file_size, GIT_OBJ_BLOB, filters);
+		p_close(fd);
+	}
+
+	git_buf_free(&full_path);
+
+	return result;
+}
+
 static int oid_for_workdir_item(
 	git_repository *repo,
 	const git_index_entry *item,
@@ -502,24 +536,13 @@ static int oid_for_workdir_item(
 		}
 	} else if (S_ISLNK(item->mode))
 		result = git_odb__hashlink(oid, full_path.ptr);
-	else if (!git__is_sizet(item->file_size)) {
-		giterr_set(GITERR_OS, "File size overflow for 32-bit systems");
-		result = -1;
-	} else {
+	else {
 		git_vector filters = GIT_VECTOR_INIT;
 
 		result = git_filters_load(
 			&filters, repo, item->path, GIT_FILTER_TO_ODB);
-		if (result >= 0) {
-			int fd = git_futils_open_ro(full_path.ptr);
-			if (fd < 0)
-				result = fd;
-			else {
-				result = git_odb__hashfd_filtered(
-					oid, fd, (size_t)item->file_size, GIT_OBJ_BLOB, &filters);
-				p_close(fd);
-			}
-		}
+		if (result >= 0)
+			result = oid_for_workdir_file(repo, item, &filters, oid);
 
 		git_filters_free(&filters);
 	}
@@ -531,20 +554,290 @@ static int oid_for_workdir_item(
 
 #define MODE_BITS_MASK 0000777
 
+/*
+ * Entries written by something that doesn't record sub-second times
+ * only have the seconds to compare.
+ */
+static bool diff_time_matches(
+	const git_index_time *old_time, const git_index_time *new_time)
+{
+	return old_time->seconds == new_time->seconds &&
+		(!old_time->nanoseconds ||
+		 old_time->nanoseconds == new_time->nanoseconds);
+}
+
+/*
+ * The contents of the workdir file match the index entry, so remember
+ * its current stat data to avoid reading the file next time.
+ */
+static void diff_update_index_stat(
+	git_diff_list *diff,
+	git_index *index,
+	const git_index_entry *oitem,
+	const git_index_entry *nitem)
+{
+	git_index_entry *entry =
+		git_index_get_bypath(index, oitem->path, git_index_entry_stage(oitem));
+
+	if (entry == NULL)
+		return;
+
+	entry->ctime = nitem->ctime;
+	entry->mtime = nitem->mtime;
+	entry->dev = nitem->dev;
+	entry->ino = nitem->ino;
+	entry->uid = nitem->uid;
+	entry->gid = nitem->gid;
+	entry->file_size = nitem->file_size;
+
+	diff->index_updated = true;
+}
+
+/*
+ * The workdir file was found to match the index entry, so there's no need
+ * to look at it again until the filesystem monitor reports a change.
+ */
+static void diff_mark_fsmonitor_valid(
+	git_diff_list *diff, git_index *index, const git_index_entry *oitem)
+{
+	git_index_entry *entry;
+
+	if (!index->fsmonitor_ready ||
+		(oitem->flags_extended & GIT_IDXENTRY_FSMONITOR_VALID) != 0)
+		return;
+
+	entry = git_index_get_bypath(index, oitem->path, git_index_entry_stage(oitem));
+	if (entry == NULL)
+		return;
+
+	entry->flags_extended |= GIT_IDXENTRY_FSMONITOR_VALID;
+
+	if ((diff->opts.flags & GIT_DIFF_UPDATE_INDEX) != 0)
+		diff->index_updated = true;
+}
+
+/*
+ * A workdir file whose stat data doesn't match, so that its contents
+ * have to be hashed to know if it was modified.  These are put off until
+ * the whole diff has been made, and then hashed on several threads.
+ */
+typedef struct {
+	git_diff_delta *delta;
+	size_t pos; /* of the delta in the list */
+	git_index_entry oitem; /* what the iterators gave, with paths */
+	git_index_entry nitem; /* from the delta */
+	git_vector filters;
+	git_oid oid;
+	int error;
+	int error_class;
+	char *error_message;
+} diff_hash_item;
+
+typedef struct {
+	git_repository *repo;
+	git_vector *items;
+	git_atomic next;
+} diff_hasher;
+
+/* Don't start a thread for fewer files than this */
+#define DIFF_HASH_PER_THREAD 8
+
+static void diff_hash_item_free(diff_hash_item *item)
+{
+	git_filters_free(&item->filters);
+	git__free(item->error_message);
+	git__free(item);
+}
+
+static void diff_hash_items_free(git_vector *items)
+{
+	diff_hash_item *item;
+	unsigned int i;
+
+	git_vector_foreach(items, i, item)
+		diff_hash_item_free(item);
+	git_vector_free(items);
+}
+
+static int diff_hash_item_add(
+	git_vector *items,
+	git_diff_list *diff,
+	git_delta_t status,
+	const git_index_entry *oitem,
+	uint32_t omode,
+	const git_index_entry *nitem,
+	uint32_t nmode)
+{
+	diff_hash_item *item = git__calloc(1, sizeof(diff_hash_item));
+	GITERR_CHECK_ALLOC(item);
+
+	/* attributes can't be looked up from other threads, so the filters
+	 * to apply are found now
+	 */
+	if (git_filters_load(
+			&item->filters, diff->repo, nitem->path, GIT_FILTER_TO_ODB) < 0 ||
+		diff_delta__from_two(
+			diff, status, oitem, omode, nitem, nmode, NULL) < 0 ||
+		git_vector_insert(items, item) < 0)
+	{
+		diff_hash_item_free(item);
+		return -1;
+	}
+
+	item->pos   = diff->deltas.length - 1;
+	item->delta = git_vector_get(&diff->deltas, item->pos);
+
+	item->oitem = *oitem;
+	item->oitem.path = (char *)item->delta->old_file.path;
+	item->nitem = *nitem;
+	item->nitem.path = (char *)item->delta->old_file.path;
+
+	return 0;
+}
+
+static void *diff_hasher_run(void *payload)
+{
+	diff_hasher *hasher = payload;
+	diff_hash_item *item;
+	int i;
+
+	while ((i = git_atomic_inc(&hasher->next) - 1) <
+		(int)hasher->items->length)
+	{
+		item = git_vector_get(hasher->items, i);
+
+		item->error = oid_for_workdir_file(
+			hasher->repo, &item->nitem, &item->filters, &item->oid);
+
+		/* errors are kept per thread, so save it for the caller */
+		if (item->error < 0) {
+			const git_error *e = giterr_last();
+
+			item->error_class = e ? e->klass : GITERR_OS;
+			item->error_message = git__strdup(
+				e ? e->message : "failed to hash workdir file");
+			giterr_clear();
+		}
+	}
+
+	return NULL;
+}
+
+static int diff_delta_is_null(git_vector *v, size_t idx)
+{
+	return (v->contents[idx] == NULL);
+}
+
+/*
+ * Hash the files which were put off, in parallel when there are enough
+ * of them, and then fill in their deltas in the order they came.  The
+ * ones which turn out to be the same as before are unmodified after all.
+ */
+static int diff_hash_items(
+	git_diff_list *diff, git_index *index, git_vector *items)
+{
+	diff_hasher hasher;
+	diff_hash_item *item;
+	bool reverse = (diff->opts.flags & GIT_DIFF_REVERSE) != 0;
+	bool removed = false;
+	unsigned int i;
+	int error = 0;
+#ifdef GIT_THREADS
+	git_thread *threads = NULL;
+	size_t nr_threads = 0;
+	int cpus = git_online_cpus();
+#endif
+
+	if (!items->length)
+		return 0;
+
+	hasher.repo  = diff->repo;
+	hasher.items = items;
+	git_atomic_set(&hasher.next, 0);
+
+#ifdef GIT_THREADS
+	if (cpus > 1 && items->length >= 2 * DIFF_HASH_PER_THREAD) {
+		nr_threads = items->length / DIFF_HASH_PER_THREAD;
+		if (nr_threads > (size_t)cpus)
+			nr_threads = cpus;
+		nr_threads--; /* this thread hashes too */
+
+		threads = git__calloc(nr_threads, sizeof(git_thread));
+		GITERR_CHECK_ALLOC(threads);
+
+		for (i = 0; i < nr_threads; ++i) {
+			if (git_thread_create(&threads[i], NULL, diff_hasher_run, &hasher))
+				break;
+		}
+		nr_threads = i;
+	}
+#endif
+
+	diff_hasher_run(&hasher);
+
+#ifdef GIT_THREADS
+	for (i = 0; i < nr_threads; ++i)
+		git_thread_join(threads[i], NULL);
+	git__free(threads);
+#endif
+
+	git_vector_foreach(items, i, item) {
+		git_diff_file *wd_file, *other_file;
+
+		if (item->error < 0) {
+			if (!error) {
+				giterr_set(item->error_class, "%s", item->error_message);
+				error = -1;
+			}
+			continue;
+		}
+
+		wd_file    = reverse ? &item->delta->old_file : &item->delta->new_file;
+		other_file = reverse ? &item->delta->new_file : &item->delta->old_file;
+
+		git_oid_cpy(&wd_file->oid, &item->oid);
+		wd_file->flags |= GIT_DIFF_FILE_VALID_OID;
+
+		if (wd_file->mode != other_file->mode ||
+			!git_oid_equal(&other_file->oid, &item->oid))
+			continue;
+
+		item->delta->status = GIT_DELTA_UNMODIFIED;
+
+		if (index != NULL) {
+			if ((diff->opts.flags & GIT_DIFF_UPDATE_INDEX) != 0)
+				diff_update_index_stat(diff, index, &item->oitem, &item->nitem);
+
+			diff_mark_fsmonitor_valid(diff, index, &item->oitem);
+		}
+
+		if ((diff->opts.flags & GIT_DIFF_INCLUDE_UNMODIFIED) == 0) {
+			git__free(item->delta);
+			diff->deltas.contents[item->pos] = NULL;
+			removed = true;
+		}
+	}
+
+	if (removed)
+		git_vector_remove_matching(&diff->deltas, diff_delta_is_null);
+
+	return error;
+}
+
 static int maybe_modified(
 	git_iterator *old_iter,
 	const git_index_entry *oitem,
 	git_iterator *new_iter,
 	const git_index_entry *nitem,
-	git_diff_list *diff)
+	git_diff_list *diff,
+	git_vector *to_hash)
 {
 	git_oid noid, *use_noid = NULL;
 	git_delta_t status = GIT_DELTA_MODIFIED;
 	unsigned int omode = oitem->mode;
 	unsigned int nmode = nitem->mode;
 	bool new_is_workdir = (new_iter->type == GIT_ITERATOR_WORKDIR);
-
-	GIT_UNUSED(old_iter);
+	git_index *index = git_iterator_get_index(old_iter);
 
 	if (!diff_path_matches_pathspec(diff, oitem->path))
 		return 0;
@@ -586,25 +879,35 @@ static int maybe_modified(
 			 omode == nmode)
 		status = GIT_DELTA_UNMODIFIED;
 
+	/* nothing changed since the file was last found to be unmodified */
+	else if (new_is_workdir && index != NULL && omode == nmode &&
+			 git_index__fsmonitor_valid(index, oitem))
+		status = GIT_DELTA_UNMODIFIED;
+
 	/* if we have an unknown OID and a workdir iterator, then check some
 	 * circumstances that can accelerate things or need special handling
 	 */
 	else if (git_oid_iszero(&nitem->oid) && new_is_workdir) {
-		/* TODO: add check against index file st_mtime to avoid racy-git */
-
-		/* if the stat data looks exactly alike, then assume the same */
+		/* if the stat data looks exactly alike, then assume the same,
+		 * unless the file may have changed after the index was written
+		 */
 		if (omode == nmode &&
 			oitem->file_size == nitem->file_size &&
 			(!(diff->diffcaps & GIT_DIFFCAPS_TRUST_CTIME) ||
-			 (oitem->ctime.seconds == nitem->ctime.seconds)) &&
-			oitem->mtime.seconds == nitem->mtime.seconds &&
+			 diff_time_matches(&oitem->ctime, &nitem->ctime)) &&
+			diff_time_matches(&oitem->mtime, &nitem->mtime) &&
 			(!(diff->diffcaps & GIT_DIFFCAPS_USE_DEV) ||
 			 (oitem->dev == nitem->dev)) &&
 			oitem->ino == nitem->ino &&
 			oitem->uid == nitem->uid &&
-			oitem->gid == nitem->gid)
+			oitem->gid == nitem->gid &&
+			(index == NULL || !git_index__is_racy(index, oitem))) {
 			status = GIT_DELTA_UNMODIFIED;
 
+			if (index != NULL)
+				diff_mark_fsmonitor_valid(diff, index, oitem);
+		}
+
 		else if (S_ISGITLINK(nmode)) {
 			git_submodule *sub;
 
@@ -635,13 +938,25 @@ static int maybe_modified(
 
 	/* if we got here and decided that the files are modified, but we
 	 * haven't calculated the OID of the new item, then calculate it now
+	 * (or later along with the other workdir files, if we can)
 	 */
 	if (status != GIT_DELTA_UNMODIFIED && git_oid_iszero(&nitem->oid)) {
-		if (oid_for_workdir_item(diff->repo, nitem, &noid) < 0)
+		if (to_hash != NULL && new_is_workdir && S_ISREG(nitem->mode))
+			return diff_hash_item_add(
+				to_hash, diff, status, oitem, omode, nitem, nmode);
+		else if (oid_for_workdir_item(diff->repo, nitem, &noid) < 0)
 			return -1;
-		else if (omode == nmode && git_oid_equal(&oitem->oid, &noid))
+		else if (omode == nmode && git_oid_equal(&oitem->oid, &noid)) {
 			status = GIT_DELTA_UNMODIFIED;
 
+			if (index != NULL && new_is_workdir) {
+				if ((diff->opts.flags & GIT_DIFF_UPDATE_INDEX) != 0)
+					diff_update_index_stat(diff, index, oitem, nitem);
+
+				diff_mark_fsmonitor_valid(diff, index, oitem);
+			}
+		}
+
 		/* store calculated oid so we don't have to recalc later */
 		use_noid = &noid;
 	}
@@ -684,6 +999,14 @@ static bool entry_is_prefixed(
 			prefix_item->path[pathlen] == '/');
 }
 
+/* is this item a subtree which a tree iterator hasn't gone into yet? */
+static bool entry_is_subtree(
+	git_iterator *iter, const git_index_entry *item)
+{
+	return (item != NULL && iter->type == GIT_ITERATOR_TREE &&
+		S_ISDIR(item->mode));
+}
+
 static int diff_from_iterators(
 	git_repository *repo,
 	const git_diff_options *opts, /**< can be NULL for defaults */
@@ -695,6 +1018,8 @@ static int diff_from_iterators(
 	git_buf ignore_prefix = GIT_BUF_INIT;
 	git_diff_list *diff = git_diff_list_alloc(repo, opts);
 	git_vector_cmp entry_compare;
+	git_vector to_hash = GIT_VECTOR_INIT;
+	git_index *index;
 
 	if (!diff)
 		goto fail;
@@ -731,6 +1056,33 @@ static int diff_from_iterators(
 	/* run iterators building diffs */
 	while (oitem || nitem) {
 
+		/* skip subtrees which are the same on both sides without loading
+		 * them, and go into the ones which are not
+		 */
+		if (entry_is_subtree(old_iter, oitem) &&
+			entry_is_subtree(new_iter, nitem) &&
+			entry_compare(oitem, nitem) == 0 &&
+			git_oid_cmp(&oitem->oid, &nitem->oid) == 0 &&
+			(diff->opts.flags & GIT_DIFF_INCLUDE_UNMODIFIED) == 0)
+		{
+			if (git_iterator_advance(old_iter, &oitem) < 0 ||
+				git_iterator_advance(new_iter, &nitem) < 0)
+				goto fail;
+			continue;
+		}
+
+		if (entry_is_subtree(old_iter, oitem)) {
+			if (git_iterator_advance_into_directory(old_iter, &oitem) < 0)
+				goto fail;
+			continue;
+		}
+
+		if (entry_is_subtree(new_iter, nitem)) {
+			if (git_iterator_advance_into_directory(new_iter, &nitem) < 0)
+				goto fail;
+			continue;
+		}
+
 		/* create DELETED records for old items not matched in new */
 		if (oitem && (!nitem || entry_compare(oitem, nitem) < 0)) {
 			if (diff_delta__from_one(diff, GIT_DELTA_DELETED, oitem) < 0)
@@ -856,16 +1208,32 @@ static int diff_from_iterators(
 		else {
 			assert(oitem && nitem && entry_compare(oitem, nitem) == 0);
 
-			if (maybe_modified(old_iter, oitem, new_iter, nitem, diff) < 0 ||
+			if (maybe_modified(
+					old_iter, oitem, new_iter, nitem, diff, &to_hash) < 0 ||
 				git_iterator_advance(old_iter, &oitem) < 0 ||
 				git_iterator_advance(new_iter, &nitem) < 0)
 				goto fail;
 		}
 	}
 
+	index = git_iterator_get_index(old_iter);
+
+	if (diff_hash_items(diff, index, &to_hash) < 0)
+		goto fail;
+
+	/* save what we learned about untracked files, too */
+	if (index != NULL && index->untracked != NULL && index->untracked->dirty &&
+		new_iter->type == GIT_ITERATOR_WORKDIR &&
+		(diff->opts.flags & GIT_DIFF_UPDATE_INDEX) != 0)
+		diff->index_updated = true;
+
+	if (diff->index_updated && git_index_write(index) < 0)
+		goto fail;
+
 	git_iterator_free(old_iter);
 	git_iterator_free(new_iter);
 	git_buf_free(&ignore_prefix);
+	diff_hash_items_free(&to_hash);
 
 	*diff_ptr = diff;
 	return 0;
@@ -874,6 +1242,7 @@ fail:
 	git_iterator_free(old_iter);
 	git_iterator_free(new_iter);
 	git_buf_free(&ignore_prefix);
+	diff_hash_items_free(&to_hash);
 
 	git_diff_list_free(diff);
 	*diff_ptr = NULL;
@@ -893,13 +1262,21 @@ int git_diff_tree_to_tree(
 
 	assert(repo && old_tree && new_tree && diff);
 
-	if (git_iterator_for_tree_range(&a, repo, old_tree, prefix, prefix) < 0 ||
-		git_iterator_for_tree_range(&b, repo, new_tree, prefix, prefix) < 0)
-		return -1;
+	/* subtrees with the same oid on both sides need not be gone into */
+	if (git_iterator_for_tree_range_with_subtrees(
+			&a, repo, old_tree, prefix, prefix) < 0 ||
+		git_iterator_for_tree_range_with_subtrees(
+			&b, repo, new_tree, prefix, prefix) < 0)
+		goto on_error;
 
 	git__free(prefix);
 
 	return diff_from_iterators(repo, opts, a, b, diff);
+
+on_error:
+	git__free(prefix);
+	git_iterator_free(a);
+	return -1;
 }
 
 int git_diff_index_to_tree(
@@ -927,6 +1304,19 @@ on_error:
 	return -1;
 }
 
+/* The untracked cache can only be used if we don't want ignored files */
+static int diff_workdir_iterator(
+	git_iterator **iter,
+	git_repository *repo,
+	const git_diff_options *opts,
+	const char *prefix)
+{
+	if (opts != NULL && (opts->flags & GIT_DIFF_INCLUDE_IGNORED) != 0)
+		return git_iterator_for_workdir_range(iter, repo, prefix, prefix);
+
+	return git_iterator_for_workdir_untracked(iter, repo, prefix, prefix);
+}
+
 int git_diff_workdir_to_index(
 	git_repository *repo,
 	const git_diff_options *opts,
@@ -940,7 +1330,7 @@ int git_diff_workdir_to_index(
 	assert(repo && diff);
 
 	if ((error = git_iterator_for_index_range(&a, repo, prefix, prefix)) < 0 ||
-	    (error = git_iterator_for_workdir_range(&b, repo, prefix, prefix)) < 0)
+	    (error = diff_workdir_iterator(&b, repo, opts, prefix)) < 0)
 		goto on_error;
 
 	git__free(prefix);
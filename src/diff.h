@@ -38,6 +38,7 @@ struct git_diff_list {
 	git_iterator_type_t old_src;
 	git_iterator_type_t new_src;
 	uint32_t diffcaps;
+	bool index_updated; /* see GIT_DIFF_UPDATE_INDEX */
 };
 
 extern void git_diff__cleanup_modes(
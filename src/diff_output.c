@@ -12,6 +12,7 @@
 #include <ctype.h>
 #include "fileops.h"
 #include "filter.h"
+#include "xdiff/xinclude.h"
 
 static int read_next_int(const char **str, int *value)
 {
@@ -140,7 +141,7 @@ static int diff_delta_is_binary_by_content(
 
 	if ((file->flags & KNOWN_BINARY_FLAGS) == 0) {
 		search.ptr  = map->data;
-		search.size = min(map->len, 4000);
+		search.size = min(map->len, DIFF_BINARY_CHECK_SIZE);
 
 		if (git_buf_is_binary(&search))
 			file->flags |= GIT_DIFF_FILE_BINARY;
@@ -197,10 +198,22 @@ static void setup_xdiff_options(
 		param->flags |= XDF_IGNORE_WHITESPACE_CHANGE;
 	if (opts->flags & GIT_DIFF_IGNORE_WHITESPACE_EOL)
 		param->flags |= XDF_IGNORE_WHITESPACE_AT_EOL;
+
+	if (opts->flags & GIT_DIFF_PATIENCE)
+		param->flags |= XDF_PATIENCE_DIFF;
+	else if (opts->flags & GIT_DIFF_HISTOGRAM)
+		param->flags |= XDF_HISTOGRAM_DIFF;
 }
 
 
-static int get_blob_content(
+/* are the hunks and lines of the text diff wanted? */
+static bool diff_context_wants_lines(diff_context *ctxt)
+{
+	return (ctxt->hunk_cb != NULL || ctxt->data_cb != NULL ||
+		ctxt->stats != NULL);
+}
+
+static int read_blob_content(
 	diff_context *ctxt,
 	git_diff_delta *delta,
 	git_diff_file *file,
@@ -267,6 +280,67 @@ static int get_blob_content(
 	return diff_delta_is_binary_by_content(ctxt, delta, file, map);
 }
 
+static int get_blob_content(
+	diff_context *ctxt,
+	git_diff_delta *delta,
+	git_diff_file *file,
+	git_map *map,
+	git_blob **blob)
+{
+	int error;
+
+	/* the object database can't be read from two threads at once */
+	if (ctxt->odb_lock == NULL)
+		return read_blob_content(ctxt, delta, file, map, blob);
+
+	git_mutex_lock(ctxt->odb_lock);
+	error = read_blob_content(ctxt, delta, file, map, blob);
+	git_mutex_unlock(ctxt->odb_lock);
+
+	return error;
+}
+
+/*
+ * Read just enough of a workdir file to tell if it's binary, for when
+ * nobody wants the text of the diff.  The oid still has to cover the
+ * whole file, but it's hashed as the file is read (unless there are
+ * filters to apply, which need it all at once).
+ */
+static int get_workdir_content_head(
+	git_diff_file *file,
+	git_map *map,
+	git_file fd,
+	git_vector *filters)
+{
+	int read_len;
+
+	if ((file->flags & GIT_DIFF_FILE_VALID_OID) == 0) {
+		if (git_odb__hashfd_filtered(&file->oid, fd,
+				(size_t)file->size, GIT_OBJ_BLOB, filters) < 0)
+			return -1;
+
+		file->flags |= GIT_DIFF_FILE_VALID_OID;
+
+		if (p_lseek(fd, 0, SEEK_SET) < 0) {
+			giterr_set(GITERR_OS, "Failed to seek in '%s'", file->path);
+			return -1;
+		}
+	}
+
+	map->data = git__malloc(DIFF_BINARY_CHECK_SIZE);
+	GITERR_CHECK_ALLOC(map->data);
+	file->flags |= GIT_DIFF_FILE_FREE_DATA;
+
+	if ((read_len = p_read(fd, map->data, DIFF_BINARY_CHECK_SIZE)) < 0) {
+		giterr_set(GITERR_OS, "Failed to read '%s'", file->path);
+		return -1;
+	}
+
+	map->len = read_len;
+
+	return 0;
+}
+
 static int get_workdir_sm_content(
 	diff_context *ctxt,
 	git_diff_file *file,
@@ -316,7 +390,8 @@ static int get_workdir_content(
 	diff_context *ctxt,
 	git_diff_delta *delta,
 	git_diff_file *file,
-	git_map *map)
+	git_map *map,
+	git_vector *prepped_filters)
 {
 	int error = 0;
 	git_buf path = GIT_BUF_INIT;
@@ -356,7 +431,7 @@ static int get_workdir_content(
 	}
 	else {
 		git_file fd = git_futils_open_ro(path.ptr);
-		git_vector filters = GIT_VECTOR_INIT;
+		git_vector filters = GIT_VECTOR_INIT, *use_filters = prepped_filters;
 
 		if (fd < 0) {
 			error = fd;
@@ -370,19 +445,25 @@ static int get_workdir_content(
 			delta->binary == 1)
 			goto close_and_cleanup;
 
-		error = git_filters_load(
-			&filters, ctxt->repo, file->path, GIT_FILTER_TO_ODB);
-		if (error < 0)
+		/* the filters may have been found when the patch was prepped */
+		if (prepped_filters != NULL)
+			error = (int)prepped_filters->length;
+		else if ((error = git_filters_load(
+				&filters, ctxt->repo, file->path, GIT_FILTER_TO_ODB)) < 0)
 			goto close_and_cleanup;
+		else
+			use_filters = &filters;
 
-		if (error == 0) { /* note: git_filters_load returns filter count */
+		if (!diff_context_wants_lines(ctxt))
+			error = get_workdir_content_head(file, map, fd, use_filters);
+		else if (error == 0) { /* note: git_filters_load returns filter count */
 			error = git_futils_mmap_ro(map, fd, 0, (size_t)file->size);
 			file->flags |= GIT_DIFF_FILE_UNMAP_DATA;
 		} else {
 			git_buf raw = GIT_BUF_INIT, filtered = GIT_BUF_INIT;
 
 			if (!(error = git_futils_readbuffer_fd(&raw, fd, (size_t)file->size)) &&
-				!(error = git_filters_apply(&filtered, &raw, &filters)))
+				!(error = git_filters_apply(&filtered, &raw, use_filters)))
 			{
 				map->len  = git_buf_len(&filtered);
 				map->data = git_buf_detach(&filtered);
@@ -510,6 +591,11 @@ static git_diff_patch *diff_patch_alloc(
 	return patch;
 }
 
+static git_vector *diff_patch_filters(git_diff_patch *patch)
+{
+	return (patch->flags & GIT_DIFF_PATCH_PREPPED) ? &patch->filters : NULL;
+}
+
 static int diff_patch_load(
 	diff_context *ctxt, git_diff_patch *patch)
 {
@@ -520,7 +606,9 @@ static int diff_patch_load(
 	if ((patch->flags & GIT_DIFF_PATCH_LOADED) != 0)
 		return 0;
 
-	error = diff_delta_is_binary_by_attr(ctxt, patch);
+	/* attributes were already looked at if the patch was prepped */
+	if ((patch->flags & GIT_DIFF_PATCH_PREPPED) == 0)
+		error = diff_delta_is_binary_by_attr(ctxt, patch);
 
 	patch->old_data.data = "";
 	patch->old_data.len  = 0;
@@ -533,8 +621,7 @@ static int diff_patch_load(
 	if (delta->binary == 1)
 		goto cleanup;
 
-	if (!ctxt->hunk_cb &&
-		!ctxt->data_cb &&
+	if (!diff_context_wants_lines(ctxt) &&
 		(ctxt->opts->flags & GIT_DIFF_SKIP_BINARY_CHECK) != 0)
 		goto cleanup;
 
@@ -546,6 +633,8 @@ static int diff_patch_load(
 		delta->new_file.flags |= GIT_DIFF_FILE_NO_DATA;
 		break;
 	case GIT_DELTA_MODIFIED:
+	case GIT_DELTA_RENAMED:
+	case GIT_DELTA_COPIED:
 		break;
 	case GIT_DELTA_UNTRACKED:
 		delta->old_file.flags |= GIT_DIFF_FILE_NO_DATA;
@@ -572,7 +661,8 @@ static int diff_patch_load(
 	if ((delta->old_file.flags & GIT_DIFF_FILE_NO_DATA) == 0 &&
 		patch->old_src == GIT_ITERATOR_WORKDIR) {
 		if ((error = get_workdir_content(
-				ctxt, delta, &delta->old_file, &patch->old_data)) < 0)
+				ctxt, delta, &delta->old_file, &patch->old_data,
+				diff_patch_filters(patch))) < 0)
 			goto cleanup;
 		if (delta->binary == 1)
 			goto cleanup;
@@ -581,7 +671,8 @@ static int diff_patch_load(
 	if ((delta->new_file.flags & GIT_DIFF_FILE_NO_DATA) == 0 &&
 		patch->new_src == GIT_ITERATOR_WORKDIR) {
 		if ((error = get_workdir_content(
-				ctxt, delta, &delta->new_file, &patch->new_data)) < 0)
+				ctxt, delta, &delta->new_file, &patch->new_data,
+				diff_patch_filters(patch))) < 0)
 			goto cleanup;
 		if (delta->binary == 1)
 			goto cleanup;
@@ -686,6 +777,24 @@ static int diff_patch_cb(void *priv, mmbuffer_t *bufs, int len)
 	return ctxt->cb_error;
 }
 
+/* An xdiff emitter which only counts the lines of each change */
+static int diff_stats_emit(
+	xdfenv_t *xe, xdchange_t *xscr, xdemitcb_t *ecb, xdemitconf_t const *xecfg)
+{
+	git_diff_patch *patch = ecb->priv;
+	diff_file_stats *stats = patch->ctxt->stats;
+
+	GIT_UNUSED(xe);
+	GIT_UNUSED(xecfg);
+
+	for (; xscr != NULL; xscr = xscr->next) {
+		stats->deletions  += (size_t)xscr->chg1;
+		stats->insertions += (size_t)xscr->chg2;
+	}
+
+	return 0;
+}
+
 static int diff_patch_generate(
 	diff_context *ctxt, git_diff_patch *patch)
 {
@@ -703,7 +812,10 @@ static int diff_patch_generate(
 	if ((patch->flags & GIT_DIFF_PATCH_DIFFABLE) == 0)
 		return 0;
 
-	if (!ctxt->file_cb && !ctxt->hunk_cb)
+	/* nobody to tell about the hunks and lines (and maybe only part
+	 * of the content was loaded)
+	 */
+	if (!diff_context_wants_lines(ctxt))
 		return 0;
 
 	patch->ctxt = ctxt;
@@ -902,38 +1014,28 @@ static int diff_patch_line_cb(
 }
 
 
-int git_diff_foreach(
-	git_diff_list *diff,
-	void *cb_data,
-	git_diff_file_fn file_cb,
-	git_diff_hunk_fn hunk_cb,
-	git_diff_data_fn data_cb)
+static int diff_foreach_serial(diff_context *ctxt)
 {
 	int error = 0;
-	diff_context ctxt;
 	size_t idx;
 	git_diff_patch patch;
 
-	diff_context_init(
-		&ctxt, diff, diff->repo, &diff->opts,
-		cb_data, file_cb, hunk_cb, data_cb);
-
-	diff_patch_init(&ctxt, &patch);
+	diff_patch_init(ctxt, &patch);
 
-	git_vector_foreach(&diff->deltas, idx, patch.delta) {
+	git_vector_foreach(&ctxt->diff->deltas, idx, patch.delta) {
 
 		/* check flags against patch status */
-		if (git_diff_delta__should_skip(ctxt.opts, patch.delta))
+		if (git_diff_delta__should_skip(ctxt->opts, patch.delta))
 			continue;
 
-		if (!(error = diff_patch_load(&ctxt, &patch))) {
+		if (!(error = diff_patch_load(ctxt, &patch))) {
 
 			/* invoke file callback */
-			error = diff_delta_file_callback(&ctxt, patch.delta, idx);
+			error = diff_delta_file_callback(ctxt, patch.delta, idx);
 
 			/* generate diffs and invoke hunk and line callbacks */
 			if (!error)
-				error = diff_patch_generate(&ctxt, &patch);
+				error = diff_patch_generate(ctxt, &patch);
 
 			diff_patch_unload(&patch);
 		}
@@ -942,6 +1044,344 @@ int git_diff_foreach(
 			break;
 	}
 
+	return error;
+}
+
+#ifdef GIT_THREADS
+
+/* The most deltas which may be loaded and diffed ahead of the callbacks */
+#define DIFF_PARALLEL_AHEAD 32
+
+/*
+ * A delta which is loaded and diffed on a worker thread, with the hunks
+ * and lines kept in the patch until the callbacks can be made for it.
+ */
+typedef struct {
+	git_diff_patch patch;
+	size_t idx; /* of the delta */
+	bool done;
+	int error;
+	int error_class;
+	char *error_message;
+} diff_parallel_item;
+
+/*
+ * The calling thread preps deltas in order and puts them in a ring of
+ * items; the workers take them from there in the same order, and then
+ * the calling thread waits for each in turn to be done and makes its
+ * callbacks.  Items [delivered, queued) are in use, and [taken, queued)
+ * are still waiting for a worker.
+ */
+typedef struct {
+	diff_context *ctxt; /* the caller's */
+	diff_context worker_ctxt; /* what the workers start with */
+	git_mutex lock;
+	git_cond wake; /* there's work, or it's time to stop */
+	git_cond done; /* an item was finished */
+	git_mutex odb_lock; /* the calling thread holds it outside of waits */
+	size_t delivered, taken, queued;
+	int shutdown;
+	diff_parallel_item items[DIFF_PARALLEL_AHEAD];
+} diff_parallel;
+
+static void diff_parallel_save_error(diff_parallel_item *item, int error)
+{
+	const git_error *e = giterr_last();
+
+	/* errors are kept per thread, so save it for the caller */
+	item->error = error;
+	item->error_class = e ? e->klass : GITERR_INVALID;
+	item->error_message = git__strdup(e ? e->message : "failed to diff file");
+	giterr_clear();
+}
+
+static void *diff_parallel_run(void *payload)
+{
+	diff_parallel *par = payload;
+	diff_parallel_item *item;
+	diff_context ctxt;
+	int error;
+
+	memcpy(&ctxt, &par->worker_ctxt, sizeof(ctxt));
+
+	git_mutex_lock(&par->lock);
+
+	for (;;) {
+		while (!par->shutdown && par->taken == par->queued)
+			git_cond_wait(&par->wake, &par->lock);
+
+		if (par->shutdown)
+			break;
+
+		item = &par->items[par->taken++ % DIFF_PARALLEL_AHEAD];
+
+		git_mutex_unlock(&par->lock);
+
+		if (!item->error) {
+			ctxt.cb_data  = &item->patch;
+			ctxt.cb_error = 0;
+
+			if (!(error = diff_patch_load(&ctxt, &item->patch)))
+				error = diff_patch_generate(&ctxt, &item->patch);
+
+			/* the collecting callbacks only fail when out of memory */
+			if (error == GIT_EUSER)
+				error = -1;
+			if (error < 0)
+				diff_parallel_save_error(item, error);
+		}
+
+		git_mutex_lock(&par->lock);
+
+		item->done = true;
+		git_cond_broadcast(&par->done);
+	}
+
+	git_mutex_unlock(&par->lock);
+
+	return NULL;
+}
+
+static void diff_parallel_item_clear(diff_parallel_item *item)
+{
+	git_filters_free(&item->patch.filters);
+	diff_patch_free(&item->patch);
+	git__free(item->error_message);
+	memset(item, 0, sizeof(*item));
+}
+
+/*
+ * Do what can only be done on the calling thread: the attributes of the
+ * files are looked up, and submodules are loaded here and now.
+ */
+static void diff_parallel_prep(
+	diff_parallel *par, diff_parallel_item *item, git_diff_delta *delta, size_t idx)
+{
+	diff_context *ctxt = par->ctxt;
+	git_diff_patch *patch = &item->patch;
+	git_diff_file *wd_file = NULL;
+	int error;
+
+	diff_patch_init(ctxt, patch);
+	patch->delta = delta;
+	item->idx = idx;
+
+	if ((error = diff_delta_is_binary_by_attr(ctxt, patch)) < 0) {
+		diff_parallel_save_error(item, error);
+		return;
+	}
+
+	patch->flags |= GIT_DIFF_PATCH_PREPPED;
+
+	if (patch->old_src == GIT_ITERATOR_WORKDIR)
+		wd_file = &delta->old_file;
+	else if (patch->new_src == GIT_ITERATOR_WORKDIR)
+		wd_file = &delta->new_file;
+
+	if (S_ISGITLINK(delta->old_file.mode) || S_ISGITLINK(delta->new_file.mode))
+		error = diff_patch_load(ctxt, patch);
+	else if (wd_file != NULL && S_ISREG(wd_file->mode))
+		error = git_filters_load(
+			&patch->filters, ctxt->repo, wd_file->path, GIT_FILTER_TO_ODB);
+
+	if (error < 0)
+		diff_parallel_save_error(item, error);
+}
+
+/* Make the callbacks for a delta which a worker is done with */
+static int diff_parallel_deliver(diff_parallel *par, diff_parallel_item *item)
+{
+	diff_context *ctxt = par->ctxt;
+	git_diff_patch *patch = &item->patch;
+	diff_patch_hunk *hunk;
+	diff_patch_line *line;
+	size_t h, l;
+	int error;
+
+	if (item->error < 0) {
+		giterr_set(item->error_class, "%s", item->error_message);
+		return item->error;
+	}
+
+	if ((error = diff_delta_file_callback(ctxt, patch->delta, item->idx)) < 0)
+		return error;
+
+	for (h = 0; h < patch->hunks_size; ++h) {
+		hunk = &patch->hunks[h];
+
+		if (ctxt->hunk_cb != NULL &&
+			ctxt->hunk_cb(ctxt->cb_data, patch->delta, &hunk->range,
+				hunk->header, hunk->header_len))
+			return (ctxt->cb_error = GIT_EUSER);
+
+		for (l = 0; l < hunk->line_count; ++l) {
+			line = &patch->lines[hunk->line_start + l];
+
+			if (ctxt->data_cb != NULL &&
+				ctxt->data_cb(ctxt->cb_data, patch->delta, &hunk->range,
+					line->origin, line->ptr, line->len))
+				return (ctxt->cb_error = GIT_EUSER);
+		}
+	}
+
+	return 0;
+}
+
+static int diff_parallel_deliver_next(diff_parallel *par)
+{
+	diff_parallel_item *item =
+		&par->items[par->delivered % DIFF_PARALLEL_AHEAD];
+	int error;
+
+	git_mutex_unlock(&par->odb_lock);
+
+	git_mutex_lock(&par->lock);
+	while (!item->done)
+		git_cond_wait(&par->done, &par->lock);
+	git_mutex_unlock(&par->lock);
+
+	git_mutex_lock(&par->odb_lock);
+
+	error = diff_parallel_deliver(par, item);
+
+	diff_parallel_item_clear(item);
+	par->delivered++;
+
+	return error;
+}
+
+static int diff_foreach_parallel(diff_context *ctxt)
+{
+	diff_parallel *par;
+	git_thread *threads;
+	git_diff_delta *delta;
+	git_odb *odb;
+	size_t idx, nr_threads, i;
+	int cpus = git_online_cpus(), error = 0;
+
+	/* even one CPU can read some files while it diffs others */
+	nr_threads = (cpus > 1) ? (size_t)cpus : 2;
+	if (nr_threads > ctxt->diff->deltas.length)
+		nr_threads = ctxt->diff->deltas.length;
+
+	/* the odb is set up lazily, and so not from a worker thread */
+	if (git_repository_odb__weakptr(&odb, ctxt->repo) < 0)
+		return -1;
+
+	par = git__calloc(1, sizeof(diff_parallel));
+	GITERR_CHECK_ALLOC(par);
+
+	threads = git__calloc(nr_threads, sizeof(git_thread));
+	if (!threads) {
+		git__free(par);
+		return -1;
+	}
+
+	/* the hunks and lines are collected, like for git_diff_get_patch() */
+	par->ctxt = ctxt;
+	memcpy(&par->worker_ctxt, ctxt, sizeof(diff_context));
+	par->worker_ctxt.file_cb = NULL;
+	if (ctxt->hunk_cb != NULL || ctxt->data_cb != NULL) {
+		par->worker_ctxt.hunk_cb = diff_patch_hunk_cb;
+		par->worker_ctxt.data_cb = diff_patch_line_cb;
+	}
+	par->worker_ctxt.odb_lock = &par->odb_lock;
+
+	git_mutex_init(&par->lock);
+	git_cond_init(&par->wake);
+	git_cond_init(&par->done);
+	git_mutex_init(&par->odb_lock);
+
+	/*
+	 * Looking up attributes and submodules and the caller's callbacks
+	 * may all read objects, so the workers only get the odb while this
+	 * thread is waiting for them.
+	 */
+	git_mutex_lock(&par->odb_lock);
+
+	for (i = 0; i < nr_threads; ++i) {
+		if (git_thread_create(&threads[i], NULL, diff_parallel_run, par) != 0)
+			break;
+	}
+	nr_threads = i;
+
+	git_vector_foreach(&ctxt->diff->deltas, idx, delta) {
+		if (!nr_threads)
+			break;
+
+		if (git_diff_delta__should_skip(ctxt->opts, delta))
+			continue;
+
+		/* wait for a free item, making the callbacks that are due */
+		if (par->queued - par->delivered == DIFF_PARALLEL_AHEAD &&
+			(error = diff_parallel_deliver_next(par)) < 0)
+			break;
+
+		diff_parallel_prep(
+			par, &par->items[par->queued % DIFF_PARALLEL_AHEAD], delta, idx);
+
+		git_mutex_lock(&par->lock);
+		par->queued++;
+		git_cond_signal(&par->wake);
+		git_mutex_unlock(&par->lock);
+	}
+
+	while (!error && par->delivered < par->queued)
+		error = diff_parallel_deliver_next(par);
+
+	git_mutex_unlock(&par->odb_lock);
+
+	git_mutex_lock(&par->lock);
+	par->shutdown = 1;
+	git_cond_broadcast(&par->wake);
+	git_mutex_unlock(&par->lock);
+
+	for (i = 0; i < nr_threads; ++i)
+		git_thread_join(threads[i], NULL);
+
+	/* anything left over was stopped short by an error */
+	for (; par->delivered < par->queued; par->delivered++)
+		diff_parallel_item_clear(
+			&par->items[par->delivered % DIFF_PARALLEL_AHEAD]);
+
+	git_cond_free(&par->wake);
+	git_cond_free(&par->done);
+	git_mutex_free(&par->lock);
+	git_mutex_free(&par->odb_lock);
+	git__free(threads);
+	git__free(par);
+
+	/* without any threads, do it the usual way */
+	if (!nr_threads)
+		return diff_foreach_serial(ctxt);
+
+	return error;
+}
+
+#endif
+
+int git_diff_foreach(
+	git_diff_list *diff,
+	void *cb_data,
+	git_diff_file_fn file_cb,
+	git_diff_hunk_fn hunk_cb,
+	git_diff_data_fn data_cb)
+{
+	int error;
+	diff_context ctxt;
+
+	diff_context_init(
+		&ctxt, diff, diff->repo, &diff->opts,
+		cb_data, file_cb, hunk_cb, data_cb);
+
+#ifdef GIT_THREADS
+	if ((diff->opts.flags & GIT_DIFF_PARALLEL) != 0 &&
+		diff->deltas.length > 1)
+		error = diff_foreach_parallel(&ctxt);
+	else
+#endif
+		error = diff_foreach_serial(&ctxt);
+
 	if (error == GIT_EUSER)
 		giterr_clear(); /* don't let error message leak */
 
@@ -1078,6 +1518,17 @@ static int print_oid_range(diff_print_info *pi, const git_diff_delta *delta)
 	return 0;
 }
 
+static int print_similarity(diff_print_info *pi, const git_diff_delta *delta)
+{
+	const char *how = (delta->status == GIT_DELTA_RENAMED) ? "rename" : "copy";
+
+	git_buf_printf(pi->buf, "similarity index %u%%\n", delta->similarity);
+	git_buf_printf(pi->buf, "%s from %s\n", how, delta->old_file.path);
+	git_buf_printf(pi->buf, "%s to %s\n", how, delta->new_file.path);
+
+	return git_buf_oom(pi->buf) ? -1 : 0;
+}
+
 static int print_patch_file(
 	void *data, const git_diff_delta *delta, float progress)
 {
@@ -1086,6 +1537,7 @@ static int print_patch_file(
 	const char *oldpath = delta->old_file.path;
 	const char *newpfx = pi->diff->opts.new_prefix;
 	const char *newpath = delta->new_file.path;
+	bool moved_only = false;
 
 	GIT_UNUSED(progress);
 
@@ -1101,21 +1553,32 @@ static int print_patch_file(
 	git_buf_clear(pi->buf);
 	git_buf_printf(pi->buf, "diff --git %s%s %s%s\n", oldpfx, delta->old_file.path, newpfx, delta->new_file.path);
 
-	if (print_oid_range(pi, delta) < 0)
-		return -1;
+	if (delta->status == GIT_DELTA_RENAMED || delta->status == GIT_DELTA_COPIED) {
+		if (print_similarity(pi, delta) < 0)
+			return -1;
 
-	if (git_oid_iszero(&delta->old_file.oid)) {
-		oldpfx = "";
-		oldpath = "/dev/null";
-	}
-	if (git_oid_iszero(&delta->new_file.oid)) {
-		newpfx = "";
-		newpath = "/dev/null";
+		/* there's nothing more to say about a file which was only moved */
+		moved_only = (delta->old_file.mode == delta->new_file.mode &&
+			git_oid_equal(&delta->old_file.oid, &delta->new_file.oid));
 	}
 
-	if (delta->binary != 1) {
-		git_buf_printf(pi->buf, "--- %s%s\n", oldpfx, oldpath);
-		git_buf_printf(pi->buf, "+++ %s%s\n", newpfx, newpath);
+	if (!moved_only) {
+		if (print_oid_range(pi, delta) < 0)
+			return -1;
+
+		if (git_oid_iszero(&delta->old_file.oid)) {
+			oldpfx = "";
+			oldpath = "/dev/null";
+		}
+		if (git_oid_iszero(&delta->new_file.oid)) {
+			newpfx = "";
+			newpath = "/dev/null";
+		}
+
+		if (delta->binary != 1) {
+			git_buf_printf(pi->buf, "--- %s%s\n", oldpfx, oldpath);
+			git_buf_printf(pi->buf, "+++ %s%s\n", newpfx, newpath);
+		}
 	}
 
 	if (git_buf_oom(pi->buf))
@@ -1127,7 +1590,7 @@ static int print_patch_file(
 		return GIT_EUSER;
 	}
 
-	if (delta->binary != 1)
+	if (delta->binary != 1 || moved_only)
 		return 0;
 
 	git_buf_clear(pi->buf);
@@ -1322,6 +1785,105 @@ cleanup:
 }
 
 
+int git_diff_get_stats(git_diff_stats **out, git_diff_list *diff)
+{
+	int error = 0;
+	diff_context ctxt;
+	git_diff_patch patch;
+	git_diff_stats *stats;
+	size_t idx;
+
+	assert(out && diff);
+
+	*out = NULL;
+
+	stats = git__calloc(1, sizeof(git_diff_stats) +
+		diff->deltas.length * sizeof(diff_file_stats));
+	GITERR_CHECK_ALLOC(stats);
+
+	stats->files_len = diff->deltas.length;
+
+	diff_context_init(
+		&ctxt, diff, diff->repo, &diff->opts, NULL, NULL, NULL, NULL);
+	ctxt.xdiff_config.emit_func = (void (*)(void))diff_stats_emit;
+
+	diff_patch_init(&ctxt, &patch);
+
+	git_vector_foreach(&diff->deltas, idx, patch.delta) {
+		diff_file_stats *file = &stats->files[idx];
+
+		if (git_diff_delta__should_skip(ctxt.opts, patch.delta))
+			continue;
+
+		ctxt.stats = file;
+
+		if (!(error = diff_patch_load(&ctxt, &patch)))
+			error = diff_patch_generate(&ctxt, &patch);
+
+		if (!error && patch.delta->status != GIT_DELTA_UNMODIFIED) {
+			stats->files_changed++;
+			stats->insertions += file->insertions;
+			stats->deletions  += file->deletions;
+		}
+
+		diff_patch_unload(&patch);
+
+		if (error < 0)
+			break;
+	}
+
+	if (error < 0)
+		git_diff_stats_free(stats);
+	else
+		*out = stats;
+
+	return error;
+}
+
+size_t git_diff_stats_files_changed(const git_diff_stats *stats)
+{
+	assert(stats);
+	return stats->files_changed;
+}
+
+size_t git_diff_stats_insertions(const git_diff_stats *stats)
+{
+	assert(stats);
+	return stats->insertions;
+}
+
+size_t git_diff_stats_deletions(const git_diff_stats *stats)
+{
+	assert(stats);
+	return stats->deletions;
+}
+
+int git_diff_stats_for_delta(
+	size_t *insertions,
+	size_t *deletions,
+	const git_diff_stats *stats,
+	size_t idx)
+{
+	assert(stats);
+
+	if (idx >= stats->files_len) {
+		giterr_set(GITERR_INVALID, "Index out of range for delta in diff");
+		return GIT_ENOTFOUND;
+	}
+
+	if (insertions)
+		*insertions = stats->files[idx].insertions;
+	if (deletions)
+		*deletions = stats->files[idx].deletions;
+
+	return 0;
+}
+
+void git_diff_stats_free(git_diff_stats *stats)
+{
+	git__free(stats);
+}
+
 size_t git_diff_num_deltas(git_diff_list *diff)
 {
 	assert(diff);
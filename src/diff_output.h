@@ -14,6 +14,9 @@
 
 #define MAX_DIFF_FILESIZE 0x20000000
 
+/* how much of the start of a file is looked at to tell if it's binary */
+#define DIFF_BINARY_CHECK_SIZE 4000
+
 enum {
 	GIT_DIFF_PATCH_ALLOCATED  = (1 << 0),
 	GIT_DIFF_PATCH_PREPPED    = (1 << 1),
@@ -22,6 +25,12 @@ enum {
 	GIT_DIFF_PATCH_DIFFED     = (1 << 4),
 };
 
+/* lines added and removed in one file */
+typedef struct {
+	size_t insertions;
+	size_t deletions;
+} diff_file_stats;
+
 /* context for performing diffs */
 typedef struct {
 	git_repository   *repo;
@@ -33,6 +42,8 @@ typedef struct {
 	void *cb_data;
 	int   cb_error;
 	git_diff_range cb_range;
+	diff_file_stats *stats; /* count lines here instead of reporting them */
+	git_mutex *odb_lock; /* held while reading blobs, if set */
 	xdemitconf_t xdiff_config;
 	xpparam_t    xdiff_params;
 } diff_context;
@@ -67,6 +78,7 @@ struct git_diff_patch {
 	git_blob *new_blob;
 	git_map  old_data;
 	git_map  new_data;
+	git_vector filters; /* for the workdir content, if found when prepped */
 	uint32_t flags;
 	diff_patch_hunk *hunks;
 	size_t hunks_asize, hunks_size;
@@ -74,6 +86,14 @@ struct git_diff_patch {
 	size_t lines_asize, lines_size;
 };
 
+struct git_diff_stats {
+	size_t files_changed;
+	size_t insertions;
+	size_t deletions;
+	size_t files_len;
+	diff_file_stats files[GIT_FLEX_ARRAY]; /* one per delta */
+};
+
 /* context for performing diff on a single delta */
 typedef struct {
 	git_diff_patch *patch;
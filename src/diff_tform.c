@@ -0,0 +1,714 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+#include "common.h"
+#include "diff.h"
+#include "diff_output.h"
+#include "hashsig.h"
+#include "oidmap.h"
+#include "fileops.h"
+#include "filter.h"
+#include "config.h"
+#include "git2/blob.h"
+
+GIT__USE_OIDMAP;
+
+#define DEFAULT_THRESHOLD 50
+#define DEFAULT_RENAME_LIMIT 1000
+
+/*
+ * A piece of content which is in more of the possible sources than this
+ * is too common to tell us where a file came from, so it isn't used to
+ * pick which sources to compare it with.
+ */
+#define MAX_CHUNK_SOURCES 64
+
+/* The most sources whose whole content is compared with each file */
+#define MAX_CANDIDATES 16
+
+typedef struct similar_file similar_file;
+
+/* An added file, or one which could have been renamed or copied */
+struct similar_file {
+	git_diff_delta *delta;
+	git_diff_file *file; /* the side of the delta to compare */
+	git_iterator_type_t src;
+	git_hashsig *sig; /* belongs to the cache */
+	similar_file *next_same; /* another source with the same content */
+	similar_file *from; /* the source this target was found to come from */
+	unsigned int score;
+	unsigned int renamed:1; /* a source which was renamed, or a rename */
+};
+
+typedef struct {
+	uint32_t hash;
+	uint32_t bytes;
+	uint32_t source;
+} similar_posting;
+
+typedef struct {
+	similar_file *target;
+	similar_file *source;
+	unsigned int score;
+} similar_match;
+
+typedef struct {
+	git_diff_list *diff;
+	git_diff_find_options opts;
+	git_oid empty_oid;
+	git_oidmap *same; /* the first source with some content, by its id */
+	git_oidmap *sigs; /* signatures we've made, by the content's id */
+	similar_file *sources;
+	size_t sources_len;
+	similar_file *targets;
+	size_t targets_len;
+	similar_match *matches;
+	size_t matches_len, matches_alloc;
+} similar_state;
+
+static int similar_normalize_options(
+	similar_state *st, const git_diff_find_options *given)
+{
+	git_config *cfg;
+	int32_t limit;
+	int error;
+
+	if (given != NULL)
+		memcpy(&st->opts, given, sizeof(st->opts));
+	else
+		memset(&st->opts, 0, sizeof(st->opts));
+
+	if (!st->opts.flags)
+		st->opts.flags = GIT_DIFF_FIND_RENAMES;
+
+	if (st->opts.flags & GIT_DIFF_FIND_COPIES_FROM_UNMODIFIED)
+		st->opts.flags |= GIT_DIFF_FIND_COPIES;
+
+	if (!st->opts.rename_threshold)
+		st->opts.rename_threshold = DEFAULT_THRESHOLD;
+	if (!st->opts.copy_threshold)
+		st->opts.copy_threshold = DEFAULT_THRESHOLD;
+
+	if (!st->opts.rename_limit) {
+		st->opts.rename_limit = DEFAULT_RENAME_LIMIT;
+
+		if ((error = git_repository_config__weakptr(&cfg, st->diff->repo)) < 0)
+			return error;
+
+		if (!git_config_get_int32(&limit, cfg, "diff.renamelimit") && limit > 0)
+			st->opts.rename_limit = (unsigned int)limit;
+		giterr_clear();
+	}
+
+	return 0;
+}
+
+static bool similar_is_target(similar_state *st, const git_diff_delta *delta)
+{
+	if (delta->status == GIT_DELTA_UNTRACKED)
+		return (st->opts.flags & GIT_DIFF_FIND_FOR_UNTRACKED) != 0;
+
+	return (delta->status == GIT_DELTA_ADDED);
+}
+
+static bool similar_is_source(similar_state *st, const git_diff_delta *delta)
+{
+	switch (delta->status) {
+	case GIT_DELTA_DELETED:
+		return true;
+	case GIT_DELTA_MODIFIED:
+		return (st->opts.flags & GIT_DIFF_FIND_COPIES) != 0;
+	case GIT_DELTA_UNMODIFIED:
+		return (st->opts.flags & GIT_DIFF_FIND_COPIES_FROM_UNMODIFIED) != 0;
+	default:
+		return false;
+	}
+}
+
+/* Only files and links get renamed, and links only to other links */
+static bool similar_is_file(const git_diff_file *file)
+{
+	return (S_ISREG(file->mode) || S_ISLNK(file->mode));
+}
+
+static int similar_collect(similar_state *st)
+{
+	git_diff_delta *delta;
+	similar_file *f;
+	unsigned int i;
+
+	st->sources = git__calloc(st->diff->deltas.length, sizeof(similar_file));
+	GITERR_CHECK_ALLOC(st->sources);
+	st->targets = git__calloc(st->diff->deltas.length, sizeof(similar_file));
+	GITERR_CHECK_ALLOC(st->targets);
+
+	git_vector_foreach(&st->diff->deltas, i, delta) {
+		if (similar_is_target(st, delta) && similar_is_file(&delta->new_file)) {
+			f = &st->targets[st->targets_len++];
+			f->delta = delta;
+			f->file  = &delta->new_file;
+			f->src   = st->diff->new_src;
+		}
+		else if (similar_is_source(st, delta) && similar_is_file(&delta->old_file)) {
+			f = &st->sources[st->sources_len++];
+			f->delta = delta;
+			f->file  = &delta->old_file;
+			f->src   = st->diff->old_src;
+		}
+	}
+
+	return 0;
+}
+
+static int similar_read_workdir(git_buf *out, similar_state *st, git_diff_file *file)
+{
+	git_repository *repo = st->diff->repo;
+	git_buf path = GIT_BUF_INIT, raw = GIT_BUF_INIT;
+	git_vector filters = GIT_VECTOR_INIT;
+	int error;
+
+	if ((error = git_buf_joinpath(
+			&path, git_repository_workdir(repo), file->path)) < 0 ||
+		(error = git_futils_readbuffer(&raw, path.ptr)) < 0 ||
+		(error = git_filters_load(
+			&filters, repo, file->path, GIT_FILTER_TO_ODB)) < 0)
+		goto cleanup;
+
+	/* note: git_filters_load returns the filter count */
+	if (error > 0)
+		error = git_filters_apply(out, &raw, &filters);
+	else
+		git_buf_swap(out, &raw);
+
+	if (!error && (file->flags & GIT_DIFF_FILE_VALID_OID) == 0) {
+		error = git_odb_hash(&file->oid, out->ptr, out->size, GIT_OBJ_BLOB);
+		if (!error)
+			file->flags |= GIT_DIFF_FILE_VALID_OID;
+	}
+
+cleanup:
+	git_filters_free(&filters);
+	git_buf_free(&raw);
+	git_buf_free(&path);
+	return error;
+}
+
+static int similar_cache_sig(similar_state *st, similar_file *f, git_hashsig *sig)
+{
+	khiter_t pos;
+	int error;
+
+	pos = kh_put(oid, st->sigs, &f->file->oid, &error);
+	if (error < 0) {
+		git_hashsig_free(sig);
+		giterr_set_oom();
+		return -1;
+	}
+
+	kh_value(st->sigs, pos) = sig;
+	f->sig = sig;
+	return 0;
+}
+
+/*
+ * Get the signature of a file's content, which is shared by every file
+ * with the same content.  Files in the working directory get their id
+ * worked out on the way, if it wasn't known.
+ */
+static int similar_sign(similar_state *st, similar_file *f)
+{
+	git_diff_file *file = f->file;
+	git_off_t max_size = st->diff->opts.max_size;
+	git_hashsig *sig;
+	khiter_t pos;
+	int error;
+
+	if (f->sig != NULL)
+		return 0;
+
+	if (max_size <= 0)
+		max_size = MAX_DIFF_FILESIZE;
+
+	/* too big to compare, like it's too big to diff */
+	if (file->size > max_size)
+		return 0;
+
+	if ((file->flags & GIT_DIFF_FILE_VALID_OID) != 0) {
+		pos = kh_get(oid, st->sigs, &file->oid);
+		if (pos != kh_end(st->sigs)) {
+			f->sig = kh_value(st->sigs, pos);
+			return 0;
+		}
+	}
+
+	if (f->src == GIT_ITERATOR_WORKDIR) {
+		git_buf content = GIT_BUF_INIT;
+
+		if (!S_ISREG(file->mode))
+			return 0;
+
+		if (!(error = similar_read_workdir(&content, st, file))) {
+			pos = kh_get(oid, st->sigs, &file->oid);
+			if (pos != kh_end(st->sigs))
+				f->sig = kh_value(st->sigs, pos);
+			else if (!(error = git_hashsig_create(&sig, content.ptr, content.size)))
+				error = similar_cache_sig(st, f, sig);
+		}
+
+		git_buf_free(&content);
+	} else {
+		git_blob *blob;
+
+		if ((error = git_blob_lookup(&blob, st->diff->repo, &file->oid)) < 0)
+			return error;
+
+		if (!(error = git_hashsig_create(&sig,
+				git_blob_rawcontent(blob), git_blob_rawsize(blob))))
+			error = similar_cache_sig(st, f, sig);
+
+		git_blob_free(blob);
+	}
+
+	return error;
+}
+
+/* Empty files are too alike to say one of them was renamed to another */
+static bool similar_has_content(similar_state *st, similar_file *f)
+{
+	if ((f->file->flags & GIT_DIFF_FILE_VALID_OID) == 0)
+		return (f->file->size > 0);
+
+	return !git_oid_iszero(&f->file->oid) &&
+		!git_oid_equal(&f->file->oid, &st->empty_oid);
+}
+
+static void similar_pair(
+	similar_state *st, similar_file *target, similar_file *source, unsigned int score)
+{
+	bool may_rename = (source->delta->status == GIT_DELTA_DELETED &&
+		!source->renamed && (st->opts.flags & GIT_DIFF_FIND_RENAMES) != 0);
+
+	if (may_rename && score >= st->opts.rename_threshold)
+		source->renamed = target->renamed = 1;
+	else if ((st->opts.flags & GIT_DIFF_FIND_COPIES) == 0 ||
+		score < st->opts.copy_threshold)
+		return;
+
+	target->from  = source;
+	target->score = score;
+}
+
+/* Pair up the files whose content is exactly the same */
+static int similar_find_exact(similar_state *st)
+{
+	similar_file *t, *s, *found;
+	khiter_t pos;
+	size_t i;
+	int error;
+
+	/* put the first of each set of the same files at the front */
+	for (i = st->sources_len; i > 0; --i) {
+		s = &st->sources[i - 1];
+
+		if (!similar_has_content(st, s))
+			continue;
+
+		pos = kh_put(oid, st->same, &s->file->oid, &error);
+		if (error < 0) {
+			giterr_set_oom();
+			return -1;
+		}
+
+		s->next_same = (error == 0) ? kh_value(st->same, pos) : NULL;
+		kh_value(st->same, pos) = s;
+	}
+
+	for (i = 0; i < st->targets_len; ++i) {
+		t = &st->targets[i];
+
+		/* the id of files in the working directory may not be known;
+		 * their content will be needed later if they aren't found here
+		 */
+		if ((t->file->flags & GIT_DIFF_FILE_VALID_OID) == 0 &&
+			t->file->size > 0 && t->src == GIT_ITERATOR_WORKDIR &&
+			S_ISREG(t->file->mode)) {
+			if ((st->opts.flags & GIT_DIFF_FIND_EXACT_MATCH_ONLY) == 0)
+				error = similar_sign(st, t);
+			else {
+				git_buf content = GIT_BUF_INIT;
+				error = similar_read_workdir(&content, st, t->file);
+				git_buf_free(&content);
+			}
+
+			if (error < 0)
+				return error;
+		}
+
+		if ((t->file->flags & GIT_DIFF_FILE_VALID_OID) == 0 ||
+			!similar_has_content(st, t) ||
+			(pos = kh_get(oid, st->same, &t->file->oid)) == kh_end(st->same))
+			continue;
+
+		found = NULL;
+
+		for (s = kh_value(st->same, pos); s != NULL; s = s->next_same) {
+			if ((s->file->mode & S_IFMT) != (t->file->mode & S_IFMT))
+				continue;
+
+			if (s->delta->status == GIT_DELTA_DELETED && !s->renamed) {
+				found = s;
+				break;
+			}
+
+			if (found == NULL)
+				found = s;
+		}
+
+		if (found != NULL)
+			similar_pair(st, t, found, 100);
+	}
+
+	return 0;
+}
+
+static int similar_posting_cmp(const void *a, const void *b)
+{
+	const similar_posting *pa = a, *pb = b;
+
+	if (pa->hash != pb->hash)
+		return (pa->hash < pb->hash) ? -1 : 1;
+	if (pa->source != pb->source)
+		return (pa->source < pb->source) ? -1 : 1;
+	return 0;
+}
+
+static int similar_match_cmp(const void *a, const void *b)
+{
+	const similar_match *ma = a, *mb = b;
+
+	if (ma->score != mb->score)
+		return (ma->score > mb->score) ? -1 : 1;
+	if (ma->target != mb->target)
+		return (ma->target < mb->target) ? -1 : 1;
+	if (ma->source != mb->source)
+		return (ma->source < mb->source) ? -1 : 1;
+	return 0;
+}
+
+static int similar_add_match(
+	similar_state *st, similar_file *target, similar_file *source, unsigned int score)
+{
+	similar_match *m;
+
+	if (st->matches_len == st->matches_alloc) {
+		size_t new_alloc = st->matches_alloc ? st->matches_alloc * 2 : 64;
+		similar_match *grown = git__realloc(
+			st->matches, new_alloc * sizeof(similar_match));
+		GITERR_CHECK_ALLOC(grown);
+
+		st->matches = grown;
+		st->matches_alloc = new_alloc;
+	}
+
+	m = &st->matches[st->matches_len++];
+	m->target = target;
+	m->source = source;
+	m->score  = score;
+
+	return 0;
+}
+
+/* The first posting for `hash`, or `len` if there isn't one */
+static size_t similar_postings_find(
+	const similar_posting *postings, size_t len, uint32_t hash)
+{
+	size_t lo = 0, hi = len, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (postings[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Find the sources most worth comparing with a target: those with the
+ * most bytes of the less common pieces of the target's content.
+ */
+static size_t similar_candidates(
+	size_t *out,
+	similar_state *st,
+	const git_hashsig *sig,
+	const similar_posting *postings,
+	size_t postings_len,
+	size_t *votes,
+	size_t *touched)
+{
+	size_t i, j, start, end, ntouched = 0, nout = 0;
+	unsigned int min_score = min(st->opts.rename_threshold, st->opts.copy_threshold);
+
+	for (i = 0; i < sig->nchunks; ++i) {
+		const git_hashsig_chunk *chunk = &sig->chunks[i];
+
+		start = similar_postings_find(postings, postings_len, chunk->hash);
+		for (end = start; end < postings_len && postings[end].hash == chunk->hash; ++end)
+			/* count them */;
+
+		if (end - start > MAX_CHUNK_SOURCES)
+			continue;
+
+		for (j = start; j < end; ++j) {
+			size_t source = postings[j].source;
+
+			if (votes[source] == 0)
+				touched[ntouched++] = source;
+			votes[source] += min(postings[j].bytes, chunk->bytes);
+		}
+	}
+
+	for (i = 0; i < ntouched; ++i) {
+		size_t source = touched[i], larger, smaller;
+		const git_hashsig *other = st->sources[source].sig;
+
+		/* files of very different sizes can't be similar enough */
+		larger  = (sig->size > other->size) ? sig->size : other->size;
+		smaller = min(sig->size, other->size);
+
+		if ((uint64_t)smaller * 100 >= (uint64_t)larger * min_score) {
+			/* keep the best few, best first */
+			for (j = nout; j > 0 && votes[out[j - 1]] < votes[source]; --j)
+				if (j < MAX_CANDIDATES)
+					out[j] = out[j - 1];
+
+			if (j < MAX_CANDIDATES) {
+				out[j] = source;
+				if (nout < MAX_CANDIDATES)
+					nout++;
+			}
+		}
+	}
+
+	for (i = 0; i < ntouched; ++i)
+		votes[touched[i]] = 0;
+
+	return nout;
+}
+
+/* Pair up files which are similar enough, most similar first */
+static int similar_find_inexact(similar_state *st)
+{
+	similar_posting *postings = NULL;
+	size_t postings_len = 0, *votes = NULL, *touched = NULL;
+	size_t candidates[MAX_CANDIDATES], ncandidates;
+	size_t i, j, targets = 0, sources = 0;
+	unsigned int min_score = min(st->opts.rename_threshold, st->opts.copy_threshold);
+	similar_file *t, *s;
+	int error = 0;
+
+	for (i = 0; i < st->targets_len; ++i)
+		if (st->targets[i].from == NULL && S_ISREG(st->targets[i].file->mode))
+			targets++;
+
+	for (i = 0; i < st->sources_len; ++i) {
+		s = &st->sources[i];
+		if (S_ISREG(s->file->mode) &&
+			((st->opts.flags & GIT_DIFF_FIND_COPIES) != 0 || !s->renamed))
+			sources++;
+	}
+
+	if (!targets || !sources ||
+		(uint64_t)targets * sources >
+		(uint64_t)st->opts.rename_limit * st->opts.rename_limit)
+		return 0;
+
+	/* index the pieces of every source's content */
+	for (i = 0; i < st->sources_len; ++i) {
+		s = &st->sources[i];
+
+		if (!S_ISREG(s->file->mode) ||
+			((st->opts.flags & GIT_DIFF_FIND_COPIES) == 0 && s->renamed) ||
+			!similar_has_content(st, s))
+			continue;
+
+		if ((error = similar_sign(st, s)) < 0)
+			goto cleanup;
+
+		if (s->sig != NULL)
+			postings_len += s->sig->nchunks;
+	}
+
+	postings = git__malloc((postings_len + 1) * sizeof(similar_posting));
+	votes    = git__calloc(st->sources_len, sizeof(size_t));
+	touched  = git__malloc(st->sources_len * sizeof(size_t));
+	if (!postings || !votes || !touched) {
+		giterr_set_oom();
+		error = -1;
+		goto cleanup;
+	}
+
+	postings_len = 0;
+	for (i = 0; i < st->sources_len; ++i) {
+		s = &st->sources[i];
+
+		if (s->sig == NULL ||
+			((st->opts.flags & GIT_DIFF_FIND_COPIES) == 0 && s->renamed))
+			continue;
+
+		for (j = 0; j < s->sig->nchunks; ++j) {
+			postings[postings_len].hash   = s->sig->chunks[j].hash;
+			postings[postings_len].bytes  = s->sig->chunks[j].bytes;
+			postings[postings_len].source = (uint32_t)i;
+			postings_len++;
+		}
+	}
+
+	qsort(postings, postings_len, sizeof(similar_posting), similar_posting_cmp);
+
+	for (i = 0; i < st->targets_len; ++i) {
+		t = &st->targets[i];
+
+		if (t->from != NULL || !S_ISREG(t->file->mode) ||
+			!similar_has_content(st, t))
+			continue;
+
+		if ((error = similar_sign(st, t)) < 0)
+			goto cleanup;
+		if (t->sig == NULL)
+			continue;
+
+		ncandidates = similar_candidates(
+			candidates, st, t->sig, postings, postings_len, votes, touched);
+
+		for (j = 0; j < ncandidates; ++j) {
+			unsigned int score;
+
+			s = &st->sources[candidates[j]];
+			score = (unsigned int)git_hashsig_compare(s->sig, t->sig);
+
+			if (score >= min_score &&
+				(error = similar_add_match(st, t, s, score)) < 0)
+				goto cleanup;
+		}
+	}
+
+	qsort(st->matches, st->matches_len, sizeof(similar_match), similar_match_cmp);
+
+	for (i = 0; i < st->matches_len; ++i) {
+		similar_match *m = &st->matches[i];
+
+		if (m->target->from == NULL)
+			similar_pair(st, m->target, m->source, m->score);
+	}
+
+cleanup:
+	git__free(postings);
+	git__free(votes);
+	git__free(touched);
+	return error;
+}
+
+static int similar_delta_is_null(git_vector *v, size_t idx)
+{
+	return (v->contents[idx] == NULL);
+}
+
+/* Turn the targets which were paired up into renames and copies */
+static void similar_apply(similar_state *st)
+{
+	git_vector *deltas = &st->diff->deltas;
+	git_diff_delta *delta;
+	similar_file *t;
+	unsigned int i;
+	size_t j;
+
+	for (j = 0; j < st->targets_len; ++j) {
+		t = &st->targets[j];
+		if (t->from == NULL)
+			continue;
+
+		delta = t->delta;
+		memcpy(&delta->old_file, t->from->file, sizeof(git_diff_file));
+		delta->old_file.flags &= ~(GIT_DIFF_FILE_FREE_DATA |
+			GIT_DIFF_FILE_UNMAP_DATA | GIT_DIFF_FILE_NO_DATA);
+
+		delta->status = t->renamed ? GIT_DELTA_RENAMED : GIT_DELTA_COPIED;
+		delta->similarity = t->score;
+	}
+
+	/* the deleted files which were renamed aren't needed any more */
+	for (j = 0; j < st->sources_len; ++j) {
+		if (!st->sources[j].renamed)
+			continue;
+
+		git_vector_foreach(deltas, i, delta) {
+			if (delta == st->sources[j].delta) {
+				git__free(delta);
+				deltas->contents[i] = NULL;
+				break;
+			}
+		}
+	}
+
+	git_vector_remove_matching(deltas, similar_delta_is_null);
+}
+
+int git_diff_find_similar(
+	git_diff_list *diff,
+	const git_diff_find_options *opts)
+{
+	similar_state st;
+	int error;
+
+	assert(diff);
+
+	memset(&st, 0, sizeof(st));
+	st.diff = diff;
+
+	if ((error = similar_normalize_options(&st, opts)) < 0 ||
+		(error = git_odb_hash(&st.empty_oid, "", 0, GIT_OBJ_BLOB)) < 0 ||
+		(error = similar_collect(&st)) < 0)
+		goto cleanup;
+
+	if (!st.targets_len || !st.sources_len)
+		goto cleanup;
+
+	if ((st.same = git_oidmap_alloc()) == NULL ||
+		(st.sigs = git_oidmap_alloc()) == NULL) {
+		giterr_set_oom();
+		error = -1;
+		goto cleanup;
+	}
+
+	if ((error = similar_find_exact(&st)) < 0)
+		goto cleanup;
+
+	if ((st.opts.flags & GIT_DIFF_FIND_EXACT_MATCH_ONLY) == 0 &&
+		(error = similar_find_inexact(&st)) < 0)
+		goto cleanup;
+
+	similar_apply(&st);
+
+cleanup:
+	if (st.same != NULL)
+		git_oidmap_free(st.same);
+
+	if (st.sigs != NULL) {
+		git_hashsig *sig;
+
+		kh_foreach_value(st.sigs, sig, git_hashsig_free(sig));
+		git_oidmap_free(st.sigs);
+	}
+
+	git__free(st.sources);
+	git__free(st.targets);
+	git__free(st.matches);
+
+	return error;
+}
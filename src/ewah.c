@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+
+#include "ewah.h"
+
+/*
+ * The compressed bitmap is a sequence of "running length words", each
+ * followed by the literal words it announces.  A running length word
+ * holds the value of the clean words (bit 0), how many of them there
+ * are (bits 1-32) and how many literal words follow (bits 33-63).
+ */
+#define RLW_RUNNING_LEN_MAX 0xffffffffu
+#define RLW_LITERALS_MAX 0x7fffffffu
+
+#define rlw_running_bit(w) ((w) & 1)
+#define rlw_running_len(w) (((w) >> 1) & RLW_RUNNING_LEN_MAX)
+#define rlw_literals(w) ((w) >> 33)
+
+#define WORDS(bits) (((bits) + 63) / 64)
+
+int git_ewah_init(git_ewah *bitmap, size_t bits)
+{
+	bitmap->bits = bits;
+	bitmap->words = git__calloc(WORDS(bits) + 1, sizeof(uint64_t));
+	GITERR_CHECK_ALLOC(bitmap->words);
+
+	return 0;
+}
+
+void git_ewah_free(git_ewah *bitmap)
+{
+	git__free(bitmap->words);
+	bitmap->words = NULL;
+	bitmap->bits = 0;
+}
+
+size_t git_ewah_count(const git_ewah *bitmap)
+{
+	size_t i, count = 0;
+	uint64_t w;
+
+	for (i = 0; i < WORDS(bitmap->bits); ++i)
+		for (w = bitmap->words[i]; w; w &= w - 1)
+			count++;
+
+	return count;
+}
+
+static uint32_t get_uint32(const unsigned char *buffer)
+{
+	return ((uint32_t)buffer[0] << 24) | ((uint32_t)buffer[1] << 16) |
+		((uint32_t)buffer[2] << 8) | buffer[3];
+}
+
+static uint64_t get_uint64(const unsigned char *buffer)
+{
+	return ((uint64_t)get_uint32(buffer) << 32) | get_uint32(buffer + 4);
+}
+
+static int ewah_error(void)
+{
+	giterr_set(GITERR_INVALID, "Corrupted EWAH bitmap");
+	return -1;
+}
+
+int git_ewah_read(git_ewah *bitmap, size_t *out_size, const char *buffer, size_t buffer_size)
+{
+	const unsigned char *data = (const unsigned char *)buffer;
+	size_t nwords, nbits, pos = 0, i = 0, words_len;
+
+	memset(bitmap, 0x0, sizeof(git_ewah));
+
+	if (buffer_size < 12)
+		return ewah_error();
+
+	nbits = get_uint32(data);
+	nwords = get_uint32(data + 4);
+	data += 8;
+
+	if (nwords > (buffer_size - 12) / 8)
+		return ewah_error();
+
+	if (git_ewah_init(bitmap, nbits) < 0)
+		return -1;
+
+	words_len = WORDS(nbits);
+
+	while (i < nwords) {
+		uint64_t rlw = get_uint64(data + 8 * i++);
+		size_t running = (size_t)rlw_running_len(rlw);
+		size_t literals = (size_t)rlw_literals(rlw);
+
+		/* trailing clean zeroes don't matter */
+		if (running > words_len - pos) {
+			if (rlw_running_bit(rlw))
+				goto on_error;
+			running = words_len - pos;
+		}
+
+		if (rlw_running_bit(rlw))
+			memset(bitmap->words + pos, 0xff, running * sizeof(uint64_t));
+		pos += running;
+
+		if (literals > nwords - i || literals > words_len - pos)
+			goto on_error;
+
+		while (literals--)
+			bitmap->words[pos++] = get_uint64(data + 8 * i++);
+	}
+
+	/* clear anything past the last bit */
+	if (nbits % 64)
+		bitmap->words[words_len - 1] &= ((uint64_t)1 << (nbits % 64)) - 1;
+
+	/* skip the position of the last running length word */
+	*out_size = 8 + nwords * 8 + 4;
+	return 0;
+
+on_error:
+	git_ewah_free(bitmap);
+	return ewah_error();
+}
+
+static void put_uint32(git_buf *out, uint32_t value)
+{
+	unsigned char raw[4];
+
+	raw[0] = (unsigned char)(value >> 24);
+	raw[1] = (unsigned char)(value >> 16);
+	raw[2] = (unsigned char)(value >> 8);
+	raw[3] = (unsigned char)value;
+
+	git_buf_put(out, (char *)raw, 4);
+}
+
+int git_ewah_write(git_buf *out, const git_ewah *bitmap)
+{
+	size_t nwords = WORDS(bitmap->bits), n = 0, rlw = 0, i;
+	uint64_t *compressed;
+
+	/* at worst, every other word needs a running length word */
+	compressed = git__calloc(nwords * 2 + 1, sizeof(uint64_t));
+	GITERR_CHECK_ALLOC(compressed);
+
+	n = 1;
+
+	for (i = 0; i < nwords; ++i) {
+		uint64_t w = bitmap->words[i];
+
+		if (w == 0 && rlw_literals(compressed[rlw]) == 0 &&
+			rlw_running_len(compressed[rlw]) < RLW_RUNNING_LEN_MAX) {
+			compressed[rlw] += (uint64_t)1 << 1;
+			continue;
+		}
+
+		if (w == 0 || rlw_literals(compressed[rlw]) == RLW_LITERALS_MAX) {
+			rlw = n++;
+			if (w == 0) {
+				compressed[rlw] += (uint64_t)1 << 1;
+				continue;
+			}
+		}
+
+		compressed[rlw] += (uint64_t)1 << 33;
+		compressed[n++] = w;
+	}
+
+	put_uint32(out, (uint32_t)bitmap->bits);
+	put_uint32(out, (uint32_t)n);
+
+	for (i = 0; i < n; ++i) {
+		put_uint32(out, (uint32_t)(compressed[i] >> 32));
+		put_uint32(out, (uint32_t)compressed[i]);
+	}
+
+	put_uint32(out, (uint32_t)rlw);
+
+	git__free(compressed);
+	return git_buf_oom(out) ? -1 : 0;
+}
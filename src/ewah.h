@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+
+#ifndef INCLUDE_ewah_h__
+#define INCLUDE_ewah_h__
+
+#include "common.h"
+#include "buffer.h"
+
+/*
+ * A bitmap which is kept uncompressed in memory, but read and written
+ * in git's EWAH compressed format.
+ */
+typedef struct {
+	uint64_t *words;
+	size_t bits;
+} git_ewah;
+
+int git_ewah_init(git_ewah *bitmap, size_t bits);
+void git_ewah_free(git_ewah *bitmap);
+
+/* Number of bits which are set */
+size_t git_ewah_count(const git_ewah *bitmap);
+
+/*
+ * Read a bitmap from `buffer`, storing the number of bytes it took up
+ * in `out_size`.
+ */
+int git_ewah_read(git_ewah *bitmap, size_t *out_size, const char *buffer, size_t buffer_size);
+int git_ewah_write(git_buf *out, const git_ewah *bitmap);
+
+GIT_INLINE(void) git_ewah_set(git_ewah *bitmap, size_t bit)
+{
+	assert(bit < bitmap->bits);
+	bitmap->words[bit / 64] |= ((uint64_t)1 << (bit % 64));
+}
+
+GIT_INLINE(int) git_ewah_get(const git_ewah *bitmap, size_t bit)
+{
+	if (bit >= bitmap->bits)
+		return 0;
+
+	return (bitmap->words[bit / 64] >> (bit % 64)) & 1;
+}
+
+#endif
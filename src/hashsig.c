@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+#include "hashsig.h"
+
+#define HASHSIG_MAX_CHUNK 64
+
+static int hashsig_chunk_cmp(const void *a, const void *b)
+{
+	const git_hashsig_chunk *ca = a, *cb = b;
+
+	if (ca->hash != cb->hash)
+		return (ca->hash < cb->hash) ? -1 : 1;
+	return 0;
+}
+
+int git_hashsig_create(git_hashsig **out, const char *buf, size_t len)
+{
+	git_hashsig *sig;
+	size_t max_chunks = 0, i, n;
+	const char *scan = buf, *end = buf + len;
+
+	/* every line is at least one piece, and so is every 64 bytes */
+	for (i = 0; i < len; ++i)
+		if (buf[i] == '\n')
+			max_chunks++;
+	max_chunks += len / HASHSIG_MAX_CHUNK + 1;
+
+	sig = git__malloc(sizeof(git_hashsig) + max_chunks * sizeof(git_hashsig_chunk));
+	GITERR_CHECK_ALLOC(sig);
+
+	sig->size = len;
+	sig->nchunks = 0;
+
+	while (scan < end) {
+		uint32_t hash = 0x1234;
+		const char *start = scan;
+
+		while (scan < end && scan - start < HASHSIG_MAX_CHUNK) {
+			char c = *scan++;
+
+			hash = (hash << 7) ^ (hash >> 25);
+			hash += (unsigned char)c;
+
+			if (c == '\n')
+				break;
+		}
+
+		sig->chunks[sig->nchunks].hash  = hash;
+		sig->chunks[sig->nchunks].bytes = (uint32_t)(scan - start);
+		sig->nchunks++;
+	}
+
+	qsort(sig->chunks, sig->nchunks, sizeof(git_hashsig_chunk), hashsig_chunk_cmp);
+
+	/* count up the pieces which are the same */
+	for (i = 0, n = 0; i < sig->nchunks; ++i) {
+		if (n > 0 && sig->chunks[n - 1].hash == sig->chunks[i].hash)
+			sig->chunks[n - 1].bytes += sig->chunks[i].bytes;
+		else
+			sig->chunks[n++] = sig->chunks[i];
+	}
+	sig->nchunks = n;
+
+	*out = sig;
+	return 0;
+}
+
+void git_hashsig_free(git_hashsig *sig)
+{
+	git__free(sig);
+}
+
+int git_hashsig_compare(const git_hashsig *a, const git_hashsig *b)
+{
+	size_t i = 0, j = 0;
+	uint64_t common = 0, larger;
+
+	larger = (a->size > b->size) ? a->size : b->size;
+	if (larger == 0)
+		return 100;
+
+	while (i < a->nchunks && j < b->nchunks) {
+		const git_hashsig_chunk *ca = &a->chunks[i], *cb = &b->chunks[j];
+
+		if (ca->hash < cb->hash)
+			i++;
+		else if (ca->hash > cb->hash)
+			j++;
+		else {
+			common += min(ca->bytes, cb->bytes);
+			i++;
+			j++;
+		}
+	}
+
+	return (int)((common * 100) / larger);
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+#ifndef INCLUDE_hashsig_h__
+#define INCLUDE_hashsig_h__
+
+#include "common.h"
+
+/* How many bytes of content there are of one distinct piece */
+typedef struct {
+	uint32_t hash;
+	uint32_t bytes;
+} git_hashsig_chunk;
+
+/*
+ * A signature of some content, for telling how similar it is to other
+ * content, the way git's rename detection does.  The content is cut
+ * into lines, with long lines cut every 64 bytes, and the signature
+ * counts the bytes there are of each piece.
+ */
+typedef struct {
+	size_t size; /* of the content */
+	size_t nchunks;
+	git_hashsig_chunk chunks[GIT_FLEX_ARRAY]; /* sorted by hash */
+} git_hashsig;
+
+extern int git_hashsig_create(git_hashsig **out, const char *buf, size_t len);
+extern void git_hashsig_free(git_hashsig *sig);
+
+/*
+ * How similar the content of two signatures is, from 0 to 100: the
+ * bytes which are in both, as a share of the larger of the two.
+ */
+extern int git_hashsig_compare(const git_hashsig *a, const git_hashsig *b);
+
+#endif
@@ -13,6 +13,9 @@
 #include "tree.h"
 #include "tree-cache.h"
 #include "hash.h"
+#include "ewah.h"
+#include "varint.h"
+#include "untracked.h"
 #include "git2/odb.h"
 #include "git2/oid.h"
 #include "git2/blob.h"
@@ -29,10 +32,31 @@ static const size_t INDEX_HEADER_SIZE = 12;
 
 static const unsigned int INDEX_VERSION_NUMBER = 2;
 static const unsigned int INDEX_VERSION_NUMBER_EXT = 3;
+static const unsigned int INDEX_VERSION_NUMBER_COMP = 4;
 
 static const unsigned int INDEX_HEADER_SIG = 0x44495243;
 static const char INDEX_EXT_TREECACHE_SIG[] = {'T', 'R', 'E', 'E'};
 static const char INDEX_EXT_UNMERGED_SIG[] = {'R', 'E', 'U', 'C'};
+static const char INDEX_EXT_OFFSETS_SIG[] = {'I', 'E', 'O', 'T'};
+static const char INDEX_EXT_END_OF_ENTRIES_SIG[] = {'E', 'O', 'I', 'E'};
+static const char INDEX_EXT_LINK_SIG[] = {'l', 'i', 'n', 'k'};
+static const char INDEX_EXT_UNTRACKED_SIG[] = {'U', 'N', 'T', 'R'};
+static const char INDEX_EXT_FSMONITOR_SIG[] = {'F', 'S', 'M', 'N'};
+
+/* The version of the filesystem monitor extension with a string token */
+#define INDEX_FSMONITOR_VERSION 2
+
+#define INDEX_SHARED_PREFIX "sharedindex."
+
+/* Default share of entries a split index may hold before it's merged back */
+#define INDEX_SPLIT_MAX_CHANGE 20
+
+/* Version of the offset table, and the number of entries per block */
+#define INDEX_OFFSETS_VERSION 1
+#define INDEX_OFFSETS_BLOCK_ENTRIES 1000
+
+/* End of entries offset and hash of the other extensions' headers */
+#define INDEX_END_OF_ENTRIES_SIZE (4 + GIT_OID_RAWSZ)
 
 #define INDEX_OWNER(idx) ((git_repository *)(GIT_REFCOUNT_OWNER(idx)))
 
@@ -81,6 +105,35 @@ struct entry_long {
 	char path[1]; /* arbitrary length */
 };
 
+/* A run of consecutive entries, as recorded in the offset table */
+struct entry_block {
+	size_t offset;
+	size_t end;
+	size_t first;
+	size_t nr;
+};
+
+/* The link from a split index to its shared index */
+struct index_link {
+	git_oid base;
+	git_ewah deleted;
+	git_ewah replaced;
+};
+
+/*
+ * What write_index() puts in the file.  The first `stripped` entries
+ * replace entries of the shared index, and are written without their
+ * path.  Shared indexes get no extensions of their own.
+ */
+struct index_writer {
+	git_vector *entries;
+	git_vector *sorted; /* every entry, in the order they're on disk */
+	size_t stripped;
+	struct index_link *link;
+	unsigned int shared:1;
+	git_oid checksum;
+};
+
 struct entry_srch_key {
 	const char *path;
 	int stage;
@@ -88,16 +141,19 @@ struct entry_srch_key {
 
 /* local declarations */
 static size_t read_extension(git_index *index, const char *buffer, size_t buffer_size);
-static size_t read_entry(git_index_entry *dest, const void *buffer, size_t buffer_size);
+static int read_entry(size_t *out_size, git_index_entry *dest, git_pool *pool, unsigned int version, const char *last, const void *buffer, size_t buffer_size);
 static int read_header(struct index_header *dest, const void *buffer);
 
 static int parse_index(git_index *index, const char *buffer, size_t buffer_size);
 static int is_index_extended(git_index *index);
-static int write_index(git_index *index, git_filebuf *file);
+static int write_index(git_index *index, git_filebuf *file, struct index_writer *writer);
+static int prepare_split_index(git_index *index, struct index_writer *writer, git_vector *out);
+static void index_link_free(struct index_link *link);
 
 static int index_find(git_index *index, const char *path, int stage);
+static int index_error_invalid(const char *message);
 
-static void index_entry_free(git_index_entry *entry);
+static void index_entry_free(git_index *index, git_index_entry *entry);
 static void index_entry_reuc_free(git_index_reuc_entry *reuc);
 
 GIT_INLINE(int) index_entry_stage(const git_index_entry *entry)
@@ -270,6 +326,13 @@ int git_index_open(git_index **index_out, const char *index_path)
 	if (git_vector_init(&index->entries, 32, index_cmp) < 0)
 		return -1;
 
+	if (git_pool_init(&index->path_pool, 1, 0) < 0 ||
+		git_pool_init(&index->split_base_pool, 1, 0) < 0)
+		return -1;
+
+	index->version = INDEX_VERSION_NUMBER;
+	index->split_max_change = INDEX_SPLIT_MAX_CHANGE;
+
 	index->entries_cmp_path = index_cmp_path;
 	index->entries_search = index_srch;
 	index->entries_search_path = index_srch_path;
@@ -292,7 +355,7 @@ static void index_free(git_index *index)
 
 	git_index_clear(index);
 	git_vector_foreach(&index->entries, i, e) {
-		index_entry_free(e);
+		index_entry_free(index, e);
 	}
 	git_vector_free(&index->entries);
 	git_vector_foreach(&index->reuc, i, reuc) {
@@ -321,8 +384,7 @@ void git_index_clear(git_index *index)
 	for (i = 0; i < index->entries.length; ++i) {
 		git_index_entry *e;
 		e = git_vector_get(&index->entries, i);
-		git__free(e->path);
-		git__free(e);
+		index_entry_free(index, e);
 	}
 
 	for (i = 0; i < index->reuc.length; ++i) {
@@ -334,10 +396,34 @@ void git_index_clear(git_index *index)
 
 	git_vector_clear(&index->entries);
 	git_vector_clear(&index->reuc);
-	index->last_modified = 0;
+	memset(&index->last_modified, 0x0, sizeof(git_index_time));
+
+	git__free(index->entry_arena);
+	index->entry_arena = NULL;
+	index->entry_arena_len = 0;
+	git_pool_clear(&index->path_pool);
 
 	git_tree_cache_free(index->tree);
 	index->tree = NULL;
+
+	git_untracked_cache_free(index->untracked);
+	index->untracked = NULL;
+
+	git__free(index->fsmonitor_token);
+	index->fsmonitor_token = NULL;
+	if (index->fsmonitor_dirty != NULL) {
+		git_ewah_free(index->fsmonitor_dirty);
+		git__free(index->fsmonitor_dirty);
+		index->fsmonitor_dirty = NULL;
+	}
+	index->fsmonitor_ready = 0;
+
+	git__free(index->split_base);
+	index->split_base = NULL;
+	index->split_base_len = 0;
+	git_pool_clear(&index->split_base_pool);
+	index_link_free(index->split_link);
+	index->split_link = NULL;
 }
 
 int git_index_set_caps(git_index *index, unsigned int caps)
@@ -351,6 +437,7 @@ int git_index_set_caps(git_index *index, unsigned int caps)
 	if (caps == GIT_INDEXCAP_FROM_OWNER) {
 		git_config *cfg;
 		int val;
+		int32_t max_change;
 
 		if (INDEX_OWNER(index) == NULL ||
 			git_repository_config__weakptr(&cfg, INDEX_OWNER(index)) < 0)
@@ -366,11 +453,23 @@ int git_index_set_caps(git_index *index, unsigned int caps)
 			index->distrust_filemode = (val == 0);
 		if (git_config_get_bool(&val, cfg, "core.symlinks") == 0)
 			index->no_symlinks = (val == 0);
+		if (git_config_get_bool(&val, cfg, "index.recordOffsetTable") == 0)
+			index->offset_table = (val != 0);
+		if (git_config_get_bool(&val, cfg, "core.splitIndex") == 0)
+			index->split_index = (val != 0);
+		if (git_config_get_bool(&val, cfg, "core.untrackedCache") == 0)
+			index->untracked_cache = (val != 0);
+		if (git_config_get_int32(&max_change, cfg, "splitIndex.maxPercentChange") == 0 &&
+			max_change >= 0 && max_change <= 100)
+			index->split_max_change = (unsigned int)max_change;
 	}
 	else {
 		index->ignore_case = ((caps & GIT_INDEXCAP_IGNORE_CASE) != 0);
 		index->distrust_filemode = ((caps & GIT_INDEXCAP_NO_FILEMODE) != 0);
 		index->no_symlinks = ((caps & GIT_INDEXCAP_NO_SYMLINKS) != 0);
+		index->offset_table = ((caps & GIT_INDEXCAP_OFFSET_TABLE) != 0);
+		index->split_index = ((caps & GIT_INDEXCAP_SPLIT_INDEX) != 0);
+		index->untracked_cache = ((caps & GIT_INDEXCAP_UNTRACKED_CACHE) != 0);
 	}
 
 	if (old_ignore_case != index->ignore_case)
@@ -385,14 +484,40 @@ unsigned int git_index_caps(const git_index *index)
 {
 	return ((index->ignore_case ? GIT_INDEXCAP_IGNORE_CASE : 0) |
 			(index->distrust_filemode ? GIT_INDEXCAP_NO_FILEMODE : 0) |
-			(index->no_symlinks ? GIT_INDEXCAP_NO_SYMLINKS : 0));
+			(index->no_symlinks ? GIT_INDEXCAP_NO_SYMLINKS : 0) |
+			(index->offset_table ? GIT_INDEXCAP_OFFSET_TABLE : 0) |
+			(index->split_index ? GIT_INDEXCAP_SPLIT_INDEX : 0) |
+			(index->untracked_cache ? GIT_INDEXCAP_UNTRACKED_CACHE : 0));
+}
+
+unsigned int git_index_version(git_index *index)
+{
+	assert(index);
+
+	return index->version;
+}
+
+int git_index_set_version(git_index *index, unsigned int version)
+{
+	assert(index);
+
+	if (version < INDEX_VERSION_NUMBER ||
+		version > INDEX_VERSION_NUMBER_COMP) {
+		giterr_set(GITERR_INDEX, "Invalid version number");
+		return -1;
+	}
+
+	index->version = version;
+
+	return 0;
 }
 
 int git_index_read(git_index *index)
 {
-	int error, updated;
-	git_buf buffer = GIT_BUF_INIT;
-	time_t mtime;
+	int error;
+	git_file fd;
+	struct stat st;
+	git_map map;
 
 	assert(index->index_file_path);
 
@@ -402,53 +527,201 @@ int git_index_read(git_index *index)
 		return 0;
 	}
 
-	/* We don't want to update the mtime if we fail to parse the index */
-	mtime = index->last_modified;
-	error = git_futils_readbuffer_updated(
-		&buffer, index->index_file_path, &mtime, &updated);
+	if ((fd = git_futils_open_ro(index->index_file_path)) < 0)
+		return fd;
+
+	if (p_fstat(fd, &st) < 0 || !git__is_sizet(st.st_size)) {
+		p_close(fd);
+		giterr_set(GITERR_OS, "Invalid regular file stat for '%s'",
+			index->index_file_path);
+		return -1;
+	}
+
+	/* Nothing to do if the file hasn't changed since we read it */
+	if (index->last_modified.seconds > (git_time_t)st.st_mtime ||
+		(index->last_modified.seconds == (git_time_t)st.st_mtime &&
+		 index->last_modified.nanoseconds >= GIT_STAT_MTIME_NSEC(&st))) {
+		p_close(fd);
+		return 0;
+	}
+
+	if ((size_t)st.st_size < INDEX_HEADER_SIZE + INDEX_FOOTER_SIZE) {
+		p_close(fd);
+		return index_error_invalid("insufficient buffer space");
+	}
+
+	/*
+	 * The index is parsed straight out of the mapped file; entries
+	 * and paths get copied into the index's own storage in bulk.
+	 */
+	error = git_futils_mmap_ro(&map, fd, 0, (size_t)st.st_size);
+	p_close(fd);
 	if (error < 0)
 		return error;
 
-	if (updated) {
-		git_index_clear(index);
-		error = parse_index(index, buffer.ptr, buffer.size);
-
-		if (!error)
-			index->last_modified = mtime;
+	git_index_clear(index);
+	error = parse_index(index, map.data, map.len);
 
-		git_buf_free(&buffer);
+	/* We don't want to update the mtime if we fail to parse the index */
+	if (!error) {
+		index->last_modified.seconds = (git_time_t)st.st_mtime;
+		index->last_modified.nanoseconds = GIT_STAT_MTIME_NSEC(&st);
 	}
 
+	git_futils_mmap_free(&map);
 	return error;
 }
 
+static int shared_index_path(git_buf *out, git_index *index, const git_oid *oid)
+{
+	char hex[GIT_OID_HEXSZ + 1];
+
+	if (git_path_dirname_r(out, index->index_file_path) < 0)
+		return -1;
+
+	git_oid_tostr(hex, sizeof(hex), oid);
+
+	return git_buf_joinpath(out, out->ptr, INDEX_SHARED_PREFIX) < 0 ?
+		-1 : git_buf_puts(out, hex);
+}
+
+int git_index__is_racy_time(const git_index *index, const git_index_time *mtime)
+{
+	const git_index_time *stamp = &index->last_modified;
+
+	/* never written out, so there's nothing to race against */
+	if (!stamp->seconds)
+		return 0;
+
+	if (stamp->seconds != mtime->seconds)
+		return stamp->seconds < mtime->seconds;
+
+	/* without sub-second timestamps, the same second is racy */
+	if (!stamp->nanoseconds || !mtime->nanoseconds)
+		return 1;
+
+	return stamp->nanoseconds <= mtime->nanoseconds;
+}
+
+int git_index__is_racy(const git_index *index, const git_index_entry *entry)
+{
+	return git_index__is_racy_time(index, &entry->mtime);
+}
+
+/*
+ * The index we're about to write will be newer than any racily clean
+ * entry, and the stat data alone would make it look clean forever
+ * after.  Check the contents of those entries now and "smudge" the ones
+ * which changed by zeroing their size, so they can't match on stat.
+ * Entries marked up to date were just taken from files which are known
+ * to match, and are trusted for this one write.
+ */
+static void truncate_racily_clean(git_index *index)
+{
+	git_repository *repo = INDEX_OWNER(index);
+	git_index_entry *entry;
+	git_oid oid;
+	unsigned int i;
+
+	if (repo == NULL || git_repository_workdir(repo) == NULL)
+		return;
+
+	git_vector_foreach(&index->entries, i, entry) {
+		if ((entry->flags_extended & GIT_IDXENTRY_UPTODATE) != 0) {
+			entry->flags_extended &= ~GIT_IDXENTRY_UPTODATE;
+			continue;
+		}
+
+		if (!S_ISREG(entry->mode) || !entry->file_size ||
+			!git_index__is_racy(index, entry))
+			continue;
+
+		/* a missing file shows up as deleted regardless */
+		if (git_repository_hashfile(
+				&oid, repo, entry->path, GIT_OBJ_BLOB, NULL) < 0) {
+			giterr_clear();
+			continue;
+		}
+
+		if (git_oid_cmp(&oid, &entry->oid) != 0)
+			entry->file_size = 0;
+	}
+}
+
 int git_index_write(git_index *index)
 {
 	git_filebuf file = GIT_FILEBUF_INIT;
 	struct stat indexst;
-	int error;
+	struct index_writer writer;
+	git_vector case_sorted, split_entries = GIT_VECTOR_INIT;
+	git_oid old_base;
+	int error, had_base = (index->split_base != NULL);
 
 	git_vector_sort(&index->entries);
 	git_vector_sort(&index->reuc);
 
+	truncate_racily_clean(index);
+
+	memset(&writer, 0x0, sizeof(writer));
+	writer.entries = &index->entries;
+
+	/* If index->entries is sorted case-insensitively, then we need
+	 * to re-sort it case-sensitively before writing */
+	if (index->ignore_case) {
+		if ((error = git_vector_dup(&case_sorted, &index->entries, index_cmp)) < 0)
+			return error;
+
+		git_vector_sort(&case_sorted);
+		writer.entries = &case_sorted;
+	}
+
+	writer.sorted = writer.entries;
+
+	/* The extended flag has to be right before we compare entries */
+	is_index_extended(index);
+	git_oid_cpy(&old_base, &index->split_base_oid);
+
+	if (index->split_index &&
+		(error = prepare_split_index(index, &writer, &split_entries)) < 0)
+		goto done;
+
 	if ((error = git_filebuf_open(
 			 &file, index->index_file_path, GIT_FILEBUF_HASH_CONTENTS)) < 0)
-		return error;
+		goto done;
 
-	if ((error = write_index(index, &file)) < 0) {
+	if ((error = write_index(index, &file, &writer)) < 0) {
 		git_filebuf_cleanup(&file);
-		return error;
+		goto done;
 	}
 
 	if ((error = git_filebuf_commit(&file, GIT_INDEX_FILE_MODE)) < 0)
-		return error;
+		goto done;
 
 	if (p_stat(index->index_file_path, &indexst) == 0) {
-		index->last_modified = indexst.st_mtime;
+		index->last_modified.seconds = (git_time_t)indexst.st_mtime;
+		index->last_modified.nanoseconds = GIT_STAT_MTIME_NSEC(&indexst);
 		index->on_disk = 1;
 	}
 
-	return 0;
+	if (index->untracked != NULL)
+		index->untracked->dirty = 0;
+
+	/* Nothing refers to the shared index we've just replaced */
+	if (had_base && index->split_base != NULL &&
+		git_oid_cmp(&old_base, &index->split_base_oid) != 0) {
+		git_buf path = GIT_BUF_INIT;
+
+		if (shared_index_path(&path, index, &old_base) == 0)
+			p_unlink(path.ptr);
+		git_buf_free(&path);
+	}
+
+done:
+	if (index->ignore_case)
+		git_vector_free(&case_sorted);
+	git_vector_free(&split_entries);
+	index_link_free(writer.link);
+	return error;
 }
 
 unsigned int git_index_entrycount(git_index *index)
@@ -482,8 +755,8 @@ void git_index__init_entry_from_stat(struct stat *st, git_index_entry *entry)
 {
 	entry->ctime.seconds = (git_time_t)st->st_ctime;
 	entry->mtime.seconds = (git_time_t)st->st_mtime;
-	/* entry->mtime.nanoseconds = st->st_mtimensec; */
-	/* entry->ctime.nanoseconds = st->st_ctimensec; */
+	entry->ctime.nanoseconds = GIT_STAT_CTIME_NSEC(st);
+	entry->mtime.nanoseconds = GIT_STAT_MTIME_NSEC(st);
 	entry->dev  = st->st_rdev;
 	entry->ino  = st->st_ino;
 	entry->mode = index_create_mode(st->st_mode);
@@ -598,10 +871,19 @@ static git_index_entry *index_entry_dup(const git_index_entry *source_entry)
 	return entry;
 }
 
-static void index_entry_free(git_index_entry *entry)
+/*
+ * Entries read from disk belong to the index's entry arena and path
+ * pool, and are released all at once when the index is cleared.
+ */
+static void index_entry_free(git_index *index, git_index_entry *entry)
 {
 	if (!entry)
 		return;
+
+	if (entry >= index->entry_arena &&
+		entry < index->entry_arena + index->entry_arena_len)
+		return;
+
 	git__free(entry->path);
 	git__free(entry);
 }
@@ -614,6 +896,10 @@ static int index_insert(git_index *index, git_index_entry *entry, int replace)
 
 	assert(index && entry && entry->path != NULL);
 
+	/* nothing's known about whether a new entry has changed since */
+	entry->flags_extended &=
+		~(GIT_IDXENTRY_FSMONITOR_VALID | GIT_IDXENTRY_UPTODATE);
+
 	/* make sure that the path length flag is correct */
 	path_length = strlen(entry->path);
 
@@ -639,8 +925,7 @@ static int index_insert(git_index *index, git_index_entry *entry, int replace)
 		return git_vector_insert(&index->entries, entry);
 
 	/* exists, replace it */
-	git__free((*existing)->path);
-	git__free(*existing);
+	index_entry_free(index, *existing);
 	*existing = entry;
 
 	return 0;
@@ -688,10 +973,11 @@ int git_index_add_from_workdir(git_index *index, const char *path)
 		goto on_error;
 
 	git_tree_cache_invalidate_path(index->tree, entry->path);
+	git_untracked_cache_invalidate_path(index->untracked, entry->path);
 	return 0;
 
 on_error:
-	index_entry_free(entry);
+	index_entry_free(index, entry);
 	return ret;
 }
 
@@ -705,11 +991,12 @@ int git_index_add(git_index *index, const git_index_entry *source_entry)
 		return -1;
 
 	if ((ret = index_insert(index, entry, 1)) < 0) {
-		index_entry_free(entry);
+		index_entry_free(index, entry);
 		return ret;
 	}
 
 	git_tree_cache_invalidate_path(index->tree, entry->path);
+	git_untracked_cache_invalidate_path(index->untracked, entry->path);
 	return 0;
 }
 
@@ -725,13 +1012,15 @@ int git_index_remove(git_index *index, const char *path, int stage)
 		return position;
 
 	entry = git_vector_get(&index->entries, position);
-	if (entry != NULL)
+	if (entry != NULL) {
 		git_tree_cache_invalidate_path(index->tree, entry->path);
+		git_untracked_cache_invalidate_path(index->untracked, entry->path);
+	}
 
 	error = git_vector_remove(&index->entries, (unsigned int)position);
 
 	if (!error)
-		index_entry_free(entry);
+		index_entry_free(index, entry);
 
 	return error;
 }
@@ -810,6 +1099,9 @@ int git_index_conflict_add(git_index *index,
 
 		if ((ret = index_insert(index, entries[i], 1)) < 0)
 			goto on_error;
+
+		git_tree_cache_invalidate_path(index->tree, entries[i]->path);
+		git_untracked_cache_invalidate_path(index->untracked, entries[i]->path);
 	}
 
     return 0;
@@ -817,7 +1109,7 @@ int git_index_conflict_add(git_index *index,
 on_error:
 	for (i = 0; i < 3; i++) {
 		if (entries[i] != NULL)
-			index_entry_free(entries[i]);
+			index_entry_free(index, entries[i]);
 	}
 
 	return ret;
@@ -893,6 +1185,8 @@ int git_index_conflict_remove(git_index *index, const char *path)
 			continue;
 		}
 
+		git_tree_cache_invalidate_path(index->tree, conflict_entry->path);
+		git_untracked_cache_invalidate_path(index->untracked, conflict_entry->path);
 		git_vector_remove(&index->entries, (unsigned int)pos);
 	}
 
@@ -911,7 +1205,18 @@ static int index_conflicts_match(git_vector *v, size_t idx)
 
 void git_index_conflict_cleanup(git_index *index)
 {
+	unsigned int i;
+	git_index_entry *entry;
+
 	assert(index);
+
+	git_vector_foreach(&index->entries, i, entry) {
+		if (index_entry_stage(entry) > 0) {
+			git_tree_cache_invalidate_path(index->tree, entry->path);
+			git_untracked_cache_invalidate_path(index->untracked, entry->path);
+		}
+	}
+
 	git_vector_remove_matching(&index->entries, index_conflicts_match);
 }
 
@@ -1082,7 +1387,61 @@ static int read_reuc(git_index *index, const char *buffer, size_t size)
 	return 0;
 }
 
-static size_t read_entry(git_index_entry *dest, const void *buffer, size_t buffer_size)
+/*
+ * Read a version 4 path, which is stored as the number of bytes to
+ * drop from the end of the previous entry's path followed by the bytes
+ * to append to what remains.
+ */
+static int read_compressed_path(
+	size_t *out_size,
+	git_index_entry *dest,
+	git_pool *pool,
+	const char *last,
+	const char *path_ptr,
+	size_t buffer_size)
+{
+	size_t strip, varint_len, last_len, suffix_len;
+	const char *suffix, *suffix_end;
+	char *path;
+
+	last_len = last ? strlen(last) : 0;
+
+	varint_len = git_decode_varint(&strip, (const unsigned char *)path_ptr, buffer_size);
+	if (varint_len == 0 || strip > last_len)
+		return index_error_invalid("incorrect prefix compression");
+
+	suffix = path_ptr + varint_len;
+	suffix_end = memchr(suffix, '\0', buffer_size - varint_len);
+	if (suffix_end == NULL)
+		return index_error_invalid("invalid entry");
+
+	suffix_len = suffix_end - suffix;
+
+	path = git_pool_malloc(pool, (uint32_t)(last_len - strip + suffix_len + 1));
+	GITERR_CHECK_ALLOC(path);
+
+	memcpy(path, last, last_len - strip);
+	memcpy(path + last_len - strip, suffix, suffix_len);
+	path[last_len - strip + suffix_len] = '\0';
+
+	dest->path = path;
+	*out_size = varint_len + suffix_len + 1;
+	return 0;
+}
+
+/*
+ * Parse the on-disk entry at `buffer` into `dest`, copying its path into
+ * `pool`.  The size of the on-disk entry is stored in `out_size`.  For
+ * version 4 indexes, `last` is the path of the entry before this one.
+ */
+static int read_entry(
+	size_t *out_size,
+	git_index_entry *dest,
+	git_pool *pool,
+	unsigned int version,
+	const char *last,
+	const void *buffer,
+	size_t buffer_size)
 {
 	size_t path_length, entry_size;
 	uint16_t flags_raw;
@@ -1090,7 +1449,7 @@ static size_t read_entry(git_index_entry *dest, const void *buffer, size_t buffe
 	const struct entry_short *source = buffer;
 
 	if (INDEX_FOOTER_SIZE + minimal_entry_size > buffer_size)
-		return 0;
+		return index_error_invalid("invalid entry");
 
 	memset(dest, 0x0, sizeof(git_index_entry));
 
@@ -1116,6 +1475,18 @@ static size_t read_entry(git_index_entry *dest, const void *buffer, size_t buffe
 	} else
 		path_ptr = source->path;
 
+	if (version >= INDEX_VERSION_NUMBER_COMP) {
+		size_t header_size = path_ptr - (const char *)buffer;
+
+		if (INDEX_FOOTER_SIZE + header_size > buffer_size ||
+			read_compressed_path(&path_length, dest, pool, last, path_ptr,
+				buffer_size - INDEX_FOOTER_SIZE - header_size) < 0)
+			return index_error_invalid("invalid entry");
+
+		*out_size = header_size + path_length;
+		return 0;
+	}
+
 	path_length = dest->flags & GIT_IDXENTRY_NAMEMASK;
 
 	/* if this is a very long string, we must find its
@@ -1125,7 +1496,7 @@ static size_t read_entry(git_index_entry *dest, const void *buffer, size_t buffe
 
 		path_end = memchr(path_ptr, '\0', buffer_size);
 		if (path_end == NULL)
-			return 0;
+			return index_error_invalid("invalid entry");
 
 		path_length = path_end - path_ptr;
 	}
@@ -1136,12 +1507,13 @@ static size_t read_entry(git_index_entry *dest, const void *buffer, size_t buffe
 		entry_size = short_entry_size(path_length);
 
 	if (INDEX_FOOTER_SIZE + entry_size > buffer_size)
-		return 0;
+		return index_error_invalid("invalid entry");
 
-	dest->path = git__strdup(path_ptr);
-	assert(dest->path);
+	dest->path = git_pool_strndup(pool, path_ptr, path_length);
+	GITERR_CHECK_ALLOC(dest->path);
 
-	return entry_size;
+	*out_size = entry_size;
+	return 0;
 }
 
 static int read_header(struct index_header *dest, const void *buffer)
@@ -1153,14 +1525,134 @@ static int read_header(struct index_header *dest, const void *buffer)
 		return index_error_invalid("incorrect header signature");
 
 	dest->version = ntohl(source->version);
-	if (dest->version != INDEX_VERSION_NUMBER_EXT &&
-		dest->version != INDEX_VERSION_NUMBER)
+	if (dest->version < INDEX_VERSION_NUMBER ||
+		dest->version > INDEX_VERSION_NUMBER_COMP)
 		return index_error_invalid("incorrect header version");
 
 	dest->entry_count = ntohl(source->entry_count);
 	return 0;
 }
 
+static void index_link_free(struct index_link *link)
+{
+	if (link == NULL)
+		return;
+
+	git_ewah_free(&link->deleted);
+	git_ewah_free(&link->replaced);
+	git__free(link);
+}
+
+/*
+ * Read the link to the shared index of a split index.  The entries are
+ * merged with the shared index's once the whole file has been read.
+ */
+static int read_link(git_index *index, const char *buffer, size_t size)
+{
+	struct index_link *link;
+	size_t len;
+
+	if (size < GIT_OID_RAWSZ || index->split_link != NULL)
+		return -1;
+
+	link = git__calloc(1, sizeof(struct index_link));
+	GITERR_CHECK_ALLOC(link);
+
+	git_oid_fromraw(&link->base, (const unsigned char *)buffer);
+	buffer += GIT_OID_RAWSZ;
+	size -= GIT_OID_RAWSZ;
+
+	index->split_link = link;
+
+	/* both bitmaps may be left out if they're empty */
+	if (size == 0)
+		return 0;
+
+	if (git_ewah_read(&link->deleted, &len, buffer, size) < 0)
+		return -1;
+	buffer += len;
+	size -= len;
+
+	if (git_ewah_read(&link->replaced, &len, buffer, size) < 0 || len != size)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Read the filesystem monitor's token, and which entries weren't known
+ * to be unchanged; those only get marked once all the entries are read.
+ * Other versions of the extension have tokens we can't use.
+ */
+static int read_fsmonitor(git_index *index, const char *buffer, size_t size)
+{
+	const char *token_end;
+	uint32_t raw;
+	size_t len;
+
+	if (size < 4)
+		return -1;
+
+	memcpy(&raw, buffer, 4);
+	if (ntohl(raw) != INDEX_FSMONITOR_VERSION)
+		return 0;
+
+	if ((token_end = memchr(buffer + 4, '\0', size - 4)) == NULL ||
+		(size_t)(buffer + size - token_end) < 1 + 4)
+		return -1;
+
+	git__free(index->fsmonitor_token);
+	index->fsmonitor_token = git__strdup(buffer + 4);
+	GITERR_CHECK_ALLOC(index->fsmonitor_token);
+
+	size -= (token_end + 1 + 4) - buffer;
+	buffer = token_end + 1 + 4;
+
+	if (index->fsmonitor_dirty == NULL) {
+		index->fsmonitor_dirty = git__calloc(1, sizeof(git_ewah));
+		GITERR_CHECK_ALLOC(index->fsmonitor_dirty);
+	}
+
+	if (git_ewah_read(index->fsmonitor_dirty, &len, buffer, size) < 0 || len != size)
+		return -1;
+
+	return 0;
+}
+
+/* Mark the entries the filesystem monitor extension didn't list as dirty */
+static int apply_fsmonitor(git_index *index)
+{
+	git_vector sorted = GIT_VECTOR_INIT;
+	git_index_entry *entry;
+	unsigned int i;
+	int error = 0;
+
+	/* the bitmap goes by the entries' on-disk order */
+	if ((error = git_vector_dup(&sorted, &index->entries, index_cmp)) < 0)
+		goto done;
+
+	git_vector_sort(&sorted);
+
+	if (index->fsmonitor_dirty->bits > sorted.length) {
+		error = index_error_invalid("filesystem monitor data for missing entries");
+		goto done;
+	}
+
+	git_vector_foreach(&sorted, i, entry) {
+		if (git_ewah_get(index->fsmonitor_dirty, i))
+			entry->flags_extended &= ~GIT_IDXENTRY_FSMONITOR_VALID;
+		else
+			entry->flags_extended |= GIT_IDXENTRY_FSMONITOR_VALID;
+	}
+
+done:
+	git_vector_free(&sorted);
+	git_ewah_free(index->fsmonitor_dirty);
+	git__free(index->fsmonitor_dirty);
+	index->fsmonitor_dirty = NULL;
+	return error;
+}
+
 static size_t read_extension(git_index *index, const char *buffer, size_t buffer_size)
 {
 	const struct index_extension *source;
@@ -1177,8 +1669,12 @@ static size_t read_extension(git_index *index, const char *buffer, size_t buffer
 	if (buffer_size - total_size < INDEX_FOOTER_SIZE)
 		return 0;
 
+	if (memcmp(dest.signature, INDEX_EXT_LINK_SIG, 4) == 0) {
+		if (read_link(index, buffer + 8, dest.extension_size) < 0)
+			return 0;
+	}
 	/* optional extension */
-	if (dest.signature[0] >= 'A' && dest.signature[0] <= 'Z') {
+	else if (dest.signature[0] >= 'A' && dest.signature[0] <= 'Z') {
 		/* tree cache */
 		if (memcmp(dest.signature, INDEX_EXT_TREECACHE_SIG, 4) == 0) {
 			if (git_tree_cache_read(&index->tree, buffer + 8, dest.extension_size) < 0)
@@ -1186,6 +1682,16 @@ static size_t read_extension(git_index *index, const char *buffer, size_t buffer
 		} else if (memcmp(dest.signature, INDEX_EXT_UNMERGED_SIG, 4) == 0) {
 			if (read_reuc(index, buffer + 8, dest.extension_size) < 0)
 				return 0;
+		} else if (memcmp(dest.signature, INDEX_EXT_UNTRACKED_SIG, 4) == 0) {
+			git_untracked_cache_free(index->untracked);
+			index->untracked = NULL;
+
+			if (git_untracked_cache_read(
+					&index->untracked, buffer + 8, dest.extension_size) < 0)
+				return 0;
+		} else if (memcmp(dest.signature, INDEX_EXT_FSMONITOR_SIG, 4) == 0) {
+			if (read_fsmonitor(index, buffer + 8, dest.extension_size) < 0)
+				return 0;
 		}
 		/* else, unsupported extension. We cannot parse this, but we can skip
 		 * it by returning `total_size */
@@ -1198,56 +1704,473 @@ static size_t read_extension(git_index *index, const char *buffer, size_t buffer
 	return total_size;
 }
 
-static int parse_index(git_index *index, const char *buffer, size_t buffer_size)
+/*
+ * Look for the "end of index entries" extension, which has to be the
+ * last one in the file, and check it against the headers of the other
+ * extensions.  Returns the offset where the extensions start, or 0 if
+ * there's no such extension or it can't be trusted.
+ */
+static size_t read_end_of_entries(const char *buffer, size_t buffer_size)
 {
-	unsigned int i;
-	struct index_header header;
-	git_oid checksum_calculated, checksum_expected;
+	const char *eoie, *ext;
+	git_hash_ctx *ctx;
+	git_oid expected, actual;
+	uint32_t raw;
+	size_t offset;
 
-#define seek_forward(_increase) { \
-	if (_increase >= buffer_size) \
-		return index_error_invalid("ran out of data while parsing"); \
-	buffer += _increase; \
-	buffer_size -= _increase;\
-}
+	if (buffer_size < INDEX_HEADER_SIZE + sizeof(struct index_extension) +
+		INDEX_END_OF_ENTRIES_SIZE + INDEX_FOOTER_SIZE)
+		return 0;
 
-	if (buffer_size < INDEX_HEADER_SIZE + INDEX_FOOTER_SIZE)
-		return index_error_invalid("insufficient buffer space");
+	eoie = buffer + buffer_size - INDEX_FOOTER_SIZE -
+		INDEX_END_OF_ENTRIES_SIZE - sizeof(struct index_extension);
 
-	/* Precalculate the SHA1 of the files's contents -- we'll match it to
-	 * the provided SHA1 in the footer */
-	git_hash_buf(&checksum_calculated, buffer, buffer_size - INDEX_FOOTER_SIZE);
+	if (memcmp(eoie, INDEX_EXT_END_OF_ENTRIES_SIG, 4) != 0)
+		return 0;
 
-	/* Parse header */
-	if (read_header(&header, buffer) < 0)
-		return -1;
+	memcpy(&raw, eoie + 4, 4);
+	if (ntohl(raw) != INDEX_END_OF_ENTRIES_SIZE)
+		return 0;
 
-	seek_forward(INDEX_HEADER_SIZE);
+	memcpy(&raw, eoie + 8, 4);
+	offset = ntohl(raw);
+	if (offset < INDEX_HEADER_SIZE || offset > (size_t)(eoie - buffer))
+		return 0;
 
-	git_vector_clear(&index->entries);
+	if ((ctx = git_hash_new_ctx()) == NULL)
+		return 0;
 
-	/* Parse all the entries */
-	for (i = 0; i < header.entry_count && buffer_size > INDEX_FOOTER_SIZE; ++i) {
-		size_t entry_size;
-		git_index_entry *entry;
+	for (ext = buffer + offset; ext < eoie; ) {
+		size_t ext_size;
 
-		entry = git__malloc(sizeof(git_index_entry));
-		GITERR_CHECK_ALLOC(entry);
+		if ((size_t)(eoie - ext) < sizeof(struct index_extension))
+			break;
 
-		entry_size = read_entry(entry, buffer, buffer_size);
+		memcpy(&raw, ext + 4, 4);
+		ext_size = ntohl(raw);
 
-		/* 0 bytes read means an object corruption */
-		if (entry_size == 0)
-			return index_error_invalid("invalid entry");
+		git_hash_update(ctx, ext, sizeof(struct index_extension));
+		ext += sizeof(struct index_extension);
 
-		if (git_vector_insert(&index->entries, entry) < 0)
-			return -1;
+		if (ext_size > (size_t)(eoie - ext))
+			break;
+		ext += ext_size;
+	}
+
+	git_hash_final(&actual, ctx);
+	git_hash_free_ctx(ctx);
+
+	git_oid_fromraw(&expected, (const unsigned char *)eoie + 12);
+	if (ext != eoie || git_oid_cmp(&expected, &actual) != 0)
+		return 0;
+
+	return offset;
+}
+
+/*
+ * Read the table of entry offsets, if the index has one and it matches
+ * the header.  An offset table which doesn't add up is ignored, and the
+ * entries are read one after the other.
+ */
+static int read_offset_table(
+	struct entry_block **out,
+	size_t *out_nr,
+	const char *buffer,
+	size_t buffer_size,
+	size_t entry_count)
+{
+	const char *ext, *end, *table = NULL;
+	struct entry_block *blocks;
+	size_t extensions, table_size = 0, nr, i, first = 0;
+	uint32_t raw;
+
+	*out = NULL;
+	*out_nr = 0;
+
+	if ((extensions = read_end_of_entries(buffer, buffer_size)) == 0)
+		return 0;
+
+	end = buffer + buffer_size - INDEX_FOOTER_SIZE;
+	for (ext = buffer + extensions; ext + sizeof(struct index_extension) <= end; ) {
+		memcpy(&raw, ext + 4, 4);
+
+		if (memcmp(ext, INDEX_EXT_OFFSETS_SIG, 4) == 0) {
+			table = ext + sizeof(struct index_extension);
+			table_size = ntohl(raw);
+			break;
+		}
+
+		ext += sizeof(struct index_extension) + ntohl(raw);
+	}
+
+	if (table == NULL || table_size < 4 || (table_size - 4) % 8 != 0)
+		return 0;
+
+	memcpy(&raw, table, 4);
+	if (ntohl(raw) != INDEX_OFFSETS_VERSION)
+		return 0;
+
+	if ((nr = (table_size - 4) / 8) == 0)
+		return 0;
+
+	blocks = git__calloc(nr, sizeof(struct entry_block));
+	GITERR_CHECK_ALLOC(blocks);
+
+	for (i = 0; i < nr; ++i) {
+		memcpy(&raw, table + 4 + i * 8, 4);
+		blocks[i].offset = ntohl(raw);
+		memcpy(&raw, table + 8 + i * 8, 4);
+		blocks[i].nr = ntohl(raw);
+		blocks[i].first = first;
+		first += blocks[i].nr;
+
+		if (i > 0)
+			blocks[i - 1].end = blocks[i].offset;
+	}
+	blocks[nr - 1].end = extensions;
+
+	/* The blocks must cover all the entries, in order */
+	if (blocks[0].offset != INDEX_HEADER_SIZE || first != entry_count)
+		goto invalid;
+
+	for (i = 0; i < nr; ++i)
+		if (blocks[i].end <= blocks[i].offset)
+			goto invalid;
+
+	*out = blocks;
+	*out_nr = nr;
+	return 0;
+
+invalid:
+	git__free(blocks);
+	return 0;
+}
+
+struct entry_reader {
+	git_index *index;
+	const char *buffer;
+	const struct entry_block *blocks;
+	size_t nr_blocks;
+	git_pool pool;
+	int error;
+#ifdef GIT_THREADS
+	git_thread thread;
+	int threaded;
+#endif
+};
+
+static void *read_entry_blocks(void *data)
+{
+	struct entry_reader *reader = data;
+	size_t b, i, entry_size;
+
+	for (b = 0; b < reader->nr_blocks && !reader->error; ++b) {
+		const struct entry_block *block = &reader->blocks[b];
+		const char *ptr = reader->buffer + block->offset;
+		size_t remaining = block->end - block->offset;
+
+		for (i = 0; i < block->nr; ++i) {
+			git_index_entry *entry = &reader->index->entry_arena[block->first + i];
+
+			/* read_entry() wants to see room for the footer */
+			if (read_entry(&entry_size, entry, &reader->pool,
+					reader->index->version, NULL,
+					ptr, remaining + INDEX_FOOTER_SIZE) < 0 ||
+				entry_size > remaining) {
+				reader->error = -1;
+				break;
+			}
+
+			ptr += entry_size;
+			remaining -= entry_size;
+		}
+
+		if (remaining != 0)
+			reader->error = -1;
+	}
+
+	return NULL;
+}
+
+/*
+ * Read the entries block by block, spreading the blocks over as many
+ * threads as we have CPUs.  The checksum of the file is computed on
+ * this thread in the meantime.
+ */
+static int read_entries_by_block(
+	git_index *index,
+	git_oid *checksum,
+	const char *buffer,
+	size_t buffer_size,
+	const struct entry_block *blocks,
+	size_t nr_blocks)
+{
+	struct entry_reader *readers;
+	size_t nr_readers = 1, i, next = 0;
+	int error = 0;
+
+#ifdef GIT_THREADS
+	nr_readers = git_online_cpus();
+	if (nr_readers < 1)
+		nr_readers = 1;
+	if (nr_readers > nr_blocks)
+		nr_readers = nr_blocks;
+#endif
+
+	readers = git__calloc(nr_readers, sizeof(struct entry_reader));
+	GITERR_CHECK_ALLOC(readers);
+
+	for (i = 0; i < nr_readers; ++i) {
+		size_t count = (nr_blocks - next) / (nr_readers - i);
+
+		readers[i].index = index;
+		readers[i].buffer = buffer;
+		readers[i].blocks = blocks + next;
+		readers[i].nr_blocks = count;
+
+		if (git_pool_init(&readers[i].pool, 1, 0) < 0) {
+			while (i > 0)
+				git_pool_clear(&readers[--i].pool);
+			git__free(readers);
+			return -1;
+		}
+
+		next += count;
+	}
+
+#ifdef GIT_THREADS
+	for (i = 1; i < nr_readers; ++i)
+		readers[i].threaded = !git_thread_create(
+			&readers[i].thread, NULL, read_entry_blocks, &readers[i]);
+#endif
+
+	git_hash_buf(checksum, buffer, buffer_size - INDEX_FOOTER_SIZE);
+
+	for (i = 0; i < nr_readers; ++i) {
+#ifdef GIT_THREADS
+		if (readers[i].threaded) {
+			git_thread_join(readers[i].thread, NULL);
+			continue;
+		}
+#endif
+		read_entry_blocks(&readers[i]);
+	}
+
+	for (i = 0; i < nr_readers; ++i) {
+		if (readers[i].error)
+			error = -1;
+		git_pool_merge(&index->path_pool, &readers[i].pool);
+	}
+
+	git__free(readers);
+
+	if (error < 0)
+		return index_error_invalid("invalid entry");
+
+	for (i = 0; i < index->entry_arena_len; ++i)
+		if (git_vector_insert(&index->entries, &index->entry_arena[i]) < 0)
+			return -1;
+
+	return 0;
+}
+
+/*
+ * Merge the entries of a split index with the ones of its shared index:
+ * the shared entries that aren't deleted, with the first entries of the
+ * split index taking the place of the ones which are replaced, and then
+ * the rest of the split index.  The shared entries are kept around in
+ * `split_base` to compare against when the index is written again.
+ */
+static int read_shared_index(git_index *index)
+{
+	struct index_link *link = index->split_link;
+	git_buf path = GIT_BUF_INIT;
+	git_index *base = NULL;
+	git_index_entry *merged = NULL, *split = index->entry_arena;
+	size_t split_len = index->entry_arena_len, replaced, i, n = 0, r = 0;
+	int error = -1;
+
+	if (shared_index_path(&path, index, &link->base) < 0)
+		goto done;
+
+	if (!git_path_isfile(path.ptr)) {
+		giterr_set(GITERR_INDEX, "Shared index '%s' not found", path.ptr);
+		goto done;
+	}
+
+	if (git_index_open(&base, path.ptr) < 0)
+		goto done;
+
+	if (base->split_base != NULL || link->deleted.bits > base->entry_arena_len ||
+		link->replaced.bits > base->entry_arena_len) {
+		index_error_invalid("corrupted link to the shared index");
+		goto done;
+	}
+
+	replaced = git_ewah_count(&link->replaced);
+	if (replaced > split_len) {
+		index_error_invalid("corrupted link to the shared index");
+		goto done;
+	}
+
+	for (i = 0; i < replaced; ++i)
+		if (split[i].path[0] != '\0') {
+			index_error_invalid("replacement entry has a path");
+			goto done;
+		}
+
+	merged = git__calloc(base->entry_arena_len + split_len + 1, sizeof(git_index_entry));
+	GITERR_CHECK_ALLOC(merged);
+
+	for (i = 0; i < base->entry_arena_len; ++i) {
+		git_index_entry *shared = &base->entry_arena[i];
+		git_index_entry *entry = &merged[n];
+
+		if (git_ewah_get(&link->replaced, i)) {
+			memcpy(entry, &split[r++], sizeof(git_index_entry));
+			entry->path = shared->path;
+			entry->flags = (entry->flags & ~GIT_IDXENTRY_NAMEMASK) |
+				(shared->flags & GIT_IDXENTRY_NAMEMASK);
+		} else
+			memcpy(entry, shared, sizeof(git_index_entry));
+
+		if (!git_ewah_get(&link->deleted, i))
+			n++;
+	}
+
+	for (i = replaced; i < split_len; ++i)
+		memcpy(&merged[n++], &split[i], sizeof(git_index_entry));
+
+	git_vector_clear(&index->entries);
+	if (git_vector_reserve(&index->entries, n) < 0)
+		goto done;
+
+	for (i = 0; i < n; ++i)
+		if (git_vector_insert(&index->entries, &merged[i]) < 0)
+			goto done;
 
-		seek_forward(entry_size);
+	index->entries.sorted = 0;
+	git_vector_sort(&index->entries);
+
+	git__free(index->entry_arena);
+	index->entry_arena = merged;
+	index->entry_arena_len = n;
+	merged = NULL;
+
+	/* take the shared entries and their paths over */
+	git_pool_merge(&index->path_pool, &base->path_pool);
+	index->split_base = base->entry_arena;
+	index->split_base_len = base->entry_arena_len;
+	git_oid_cpy(&index->split_base_oid, &link->base);
+
+	git_vector_clear(&base->entries);
+	base->entry_arena = NULL;
+	base->entry_arena_len = 0;
+
+	error = 0;
+
+done:
+	if (error < 0)
+		git_vector_clear(&index->entries);
+
+	index_link_free(index->split_link);
+	index->split_link = NULL;
+
+	git__free(merged);
+	git_index_free(base);
+	git_buf_free(&path);
+	return error;
+}
+
+static int parse_index(git_index *index, const char *buffer, size_t buffer_size)
+{
+	unsigned int i;
+	struct index_header header;
+	git_oid checksum_calculated, checksum_expected;
+	struct entry_block *blocks;
+	size_t nr_blocks;
+
+#define seek_forward(_increase) { \
+	if (_increase >= buffer_size) \
+		return index_error_invalid("ran out of data while parsing"); \
+	buffer += _increase; \
+	buffer_size -= _increase;\
+}
+
+	if (buffer_size < INDEX_HEADER_SIZE + INDEX_FOOTER_SIZE)
+		return index_error_invalid("insufficient buffer space");
+
+	/* Parse header */
+	if (read_header(&header, buffer) < 0)
+		return -1;
+
+	git_vector_clear(&index->entries);
+
+	index->version = header.version;
+
+	if (header.entry_count > (buffer_size - INDEX_HEADER_SIZE - INDEX_FOOTER_SIZE) / minimal_entry_size)
+		return index_error_invalid("too many entries for the index size");
+
+	/*
+	 * All the entries we read live in a single array, and their paths
+	 * in the index's path pool; only entries added or replaced later
+	 * on are allocated on their own.
+	 */
+	if (header.entry_count > 0) {
+		index->entry_arena = git__calloc(header.entry_count, sizeof(git_index_entry));
+		GITERR_CHECK_ALLOC(index->entry_arena);
+		index->entry_arena_len = header.entry_count;
+
+		if (git_vector_reserve(&index->entries, header.entry_count) < 0)
+			return -1;
 	}
 
-	if (i != header.entry_count)
-		return index_error_invalid("header entries changed while parsing");
+	/*
+	 * Version 4 entries can't be read without the one before, so their
+	 * offsets are never recorded.
+	 */
+	if (header.version >= INDEX_VERSION_NUMBER_COMP)
+		blocks = NULL;
+	else if (read_offset_table(&blocks, &nr_blocks, buffer, buffer_size, header.entry_count) < 0)
+		return -1;
+
+	if (blocks != NULL) {
+		/* The offset table lets us read the entries in parallel */
+		size_t extensions = blocks[nr_blocks - 1].end;
+		int error = read_entries_by_block(index, &checksum_calculated,
+			buffer, buffer_size, blocks, nr_blocks);
+
+		git__free(blocks);
+		if (error < 0)
+			return error;
+
+		seek_forward(extensions);
+	} else {
+		/* Precalculate the SHA1 of the files's contents -- we'll match it to
+		 * the provided SHA1 in the footer */
+		git_hash_buf(&checksum_calculated, buffer, buffer_size - INDEX_FOOTER_SIZE);
+
+		seek_forward(INDEX_HEADER_SIZE);
+
+		/* Parse all the entries */
+		for (i = 0; i < header.entry_count && buffer_size > INDEX_FOOTER_SIZE; ++i) {
+			size_t entry_size;
+			git_index_entry *entry = &index->entry_arena[i];
+			const char *last = i ? index->entry_arena[i - 1].path : NULL;
+
+			if (read_entry(&entry_size, entry, &index->path_pool,
+					header.version, last, buffer, buffer_size) < 0)
+				return -1;
+
+			if (git_vector_insert(&index->entries, entry) < 0)
+				return -1;
+
+			seek_forward(entry_size);
+		}
+
+		if (i != header.entry_count)
+			return index_error_invalid("header entries changed while parsing");
+	}
 
 	/* There's still space for some extensions! */
 	while (buffer_size > INDEX_FOOTER_SIZE) {
@@ -1276,6 +2199,13 @@ static int parse_index(git_index *index, const char *buffer, size_t buffer_size)
 	/* force sorting in the vector: the entries are
 	 * assured to be sorted on the index */
 	index->entries.sorted = 1;
+
+	if (index->split_link != NULL && read_shared_index(index) < 0)
+		return -1;
+
+	if (index->fsmonitor_dirty != NULL)
+		return apply_fsmonitor(index);
+
 	return 0;
 }
 
@@ -1297,20 +2227,46 @@ static int is_index_extended(git_index *index)
 	return extended;
 }
 
-static int write_disk_entry(git_filebuf *file, git_index_entry *entry)
+/*
+ * Write `entry` out.  For version 4 indexes, its path is written relative
+ * to `last`, the path of the entry written before it.
+ */
+static int write_disk_entry(
+	size_t *out_size,
+	git_filebuf *file,
+	git_index_entry *entry,
+	unsigned int version,
+	const char *last)
 {
 	void *mem = NULL;
 	struct entry_short *ondisk;
-	size_t path_len, disk_size;
+	size_t path_len, disk_size, same_len = 0, varint_len = 0;
+	unsigned char varint[16];
 	char *path;
 
 	path_len = strlen(entry->path);
 
-	if (entry->flags & GIT_IDXENTRY_EXTENDED)
+	if (version >= INDEX_VERSION_NUMBER_COMP) {
+		size_t last_len = last ? strlen(last) : 0;
+
+		while (same_len < last_len && same_len < path_len &&
+			last[same_len] == entry->path[same_len])
+			same_len++;
+
+		varint_len = git_encode_varint(varint, last_len - same_len);
+
+		disk_size = (entry->flags & GIT_IDXENTRY_EXTENDED) ?
+			offsetof(struct entry_long, path) :
+			offsetof(struct entry_short, path);
+		disk_size += varint_len + path_len - same_len + 1;
+	}
+	else if (entry->flags & GIT_IDXENTRY_EXTENDED)
 		disk_size = long_entry_size(path_len);
 	else
 		disk_size = short_entry_size(path_len);
 
+	*out_size = disk_size;
+
 	if (git_filebuf_reserve(file, &mem, disk_size) < 0)
 		return -1;
 
@@ -1346,44 +2302,75 @@ static int write_disk_entry(git_filebuf *file, git_index_entry *entry)
 	if (entry->flags & GIT_IDXENTRY_EXTENDED) {
 		struct entry_long *ondisk_ext;
 		ondisk_ext = (struct entry_long *)ondisk;
-		ondisk_ext->flags_extended = htons(entry->flags_extended);
+		ondisk_ext->flags_extended =
+			htons(entry->flags_extended & GIT_IDXENTRY_EXTENDED_FLAGS);
 		path = ondisk_ext->path;
 	}
 	else
 		path = ondisk->path;
 
-	memcpy(path, entry->path, path_len);
+	if (varint_len > 0) {
+		memcpy(path, varint, varint_len);
+		path += varint_len;
+	}
+
+	memcpy(path, entry->path + same_len, path_len - same_len);
 
 	return 0;
 }
 
-static int write_entries(git_index *index, git_filebuf *file)
+/*
+ * Write out the entries.  If `blocks` is given, the entries are also
+ * split in blocks of INDEX_OFFSETS_BLOCK_ENTRIES for the offset table.
+ */
+static int write_entries(
+	git_filebuf *file,
+	git_vector *out,
+	size_t stripped,
+	unsigned int version,
+	struct entry_block *blocks)
 {
 	int error = 0;
 	unsigned int i;
-	git_vector case_sorted;
-	git_index_entry *entry;
-	git_vector *out = &index->entries;
+	git_index_entry *entry, stripped_entry;
+	size_t offset = INDEX_HEADER_SIZE, entry_size;
+	const char *last = NULL;
+
+	git_vector_foreach(out, i, entry) {
+		if (i < stripped) {
+			memcpy(&stripped_entry, entry, sizeof(git_index_entry));
+			stripped_entry.path = "";
+			stripped_entry.flags &= ~GIT_IDXENTRY_NAMEMASK;
+			entry = &stripped_entry;
+		}
 
-	/* If index->entries is sorted case-insensitively, then we need
-	 * to re-sort it case-sensitively before writing */
-	if (index->ignore_case) {
-		git_vector_dup(&case_sorted, &index->entries, index_cmp);
-		git_vector_sort(&case_sorted);
-		out = &case_sorted;
-	}
+		if (blocks && i % INDEX_OFFSETS_BLOCK_ENTRIES == 0) {
+			struct entry_block *block = &blocks[i / INDEX_OFFSETS_BLOCK_ENTRIES];
+			block->offset = offset;
+			block->first = i;
+		}
 
-	git_vector_foreach(out, i, entry)
-		if ((error = write_disk_entry(file, entry)) < 0)
+		if ((error = write_disk_entry(&entry_size, file, entry, version, last)) < 0)
 			break;
 
-	if (index->ignore_case)
-		git_vector_free(&case_sorted);
+		offset += entry_size;
+		last = entry->path;
+
+		if (blocks) {
+			struct entry_block *block = &blocks[i / INDEX_OFFSETS_BLOCK_ENTRIES];
+			block->nr++;
+			block->end = offset;
+		}
+	}
 
 	return error;
 }
 
-static int write_extension(git_filebuf *file, struct index_extension *header, git_buf *data)
+/*
+ * Write an extension.  Its header is also fed to `headers`, if given,
+ * for the "end of index entries" extension.
+ */
+static int write_extension(git_filebuf *file, struct index_extension *header, git_buf *data, git_hash_ctx *headers)
 {
 	struct index_extension ondisk;
 	int error = 0;
@@ -1392,6 +2379,9 @@ static int write_extension(git_filebuf *file, struct index_extension *header, gi
 	memcpy(&ondisk, header, 4);
 	ondisk.extension_size = htonl(header->extension_size);
 
+	if (headers)
+		git_hash_update(headers, &ondisk, sizeof(struct index_extension));
+
 	if ((error = git_filebuf_write(file, &ondisk, sizeof(struct index_extension))) == 0)
 		error = git_filebuf_write(file, data->ptr, data->size);
 
@@ -1420,7 +2410,7 @@ static int create_reuc_extension_data(git_buf *reuc_buf, git_index_reuc_entry *r
 	return 0;
 }
 
-static int write_reuc_extension(git_index *index, git_filebuf *file)
+static int write_reuc_extension(git_index *index, git_filebuf *file, git_hash_ctx *headers)
 {
 	git_buf reuc_buf = GIT_BUF_INIT;
 	git_vector *out = &index->reuc;
@@ -1438,7 +2428,7 @@ static int write_reuc_extension(git_index *index, git_filebuf *file)
 	memcpy(&extension.signature, INDEX_EXT_UNMERGED_SIG, 4);
 	extension.extension_size = reuc_buf.size;
 
-	error = write_extension(file, &extension, &reuc_buf);
+	error = write_extension(file, &extension, &reuc_buf, headers);
 
 	git_buf_free(&reuc_buf);
 
@@ -1446,39 +2436,431 @@ done:
 	return error;
 }
 
-static int write_index(git_index *index, git_filebuf *file)
+static int write_tree_extension(git_index *index, git_filebuf *file, git_hash_ctx *headers)
+{
+	git_buf buf = GIT_BUF_INIT;
+	struct index_extension extension;
+	int error;
+
+	if ((error = git_tree_cache_write(&buf, index->tree)) < 0)
+		goto done;
+
+	memset(&extension, 0x0, sizeof(struct index_extension));
+	memcpy(&extension.signature, INDEX_EXT_TREECACHE_SIG, 4);
+	extension.extension_size = (uint32_t)buf.size;
+
+	error = write_extension(file, &extension, &buf, headers);
+
+done:
+	git_buf_free(&buf);
+	return error;
+}
+
+static int write_untracked_extension(git_index *index, git_filebuf *file, git_hash_ctx *headers)
+{
+	git_buf buf = GIT_BUF_INIT;
+	struct index_extension extension;
+	int error;
+
+	if ((error = git_untracked_cache_write(&buf, index->untracked)) < 0)
+		goto done;
+
+	memset(&extension, 0x0, sizeof(struct index_extension));
+	memcpy(&extension.signature, INDEX_EXT_UNTRACKED_SIG, 4);
+	extension.extension_size = (uint32_t)buf.size;
+
+	error = write_extension(file, &extension, &buf, headers);
+
+done:
+	git_buf_free(&buf);
+	return error;
+}
+
+static int write_fsmonitor_extension(
+	git_index *index, git_vector *entries, git_filebuf *file, git_hash_ctx *headers)
+{
+	git_buf buf = GIT_BUF_INIT;
+	struct index_extension extension;
+	git_ewah dirty;
+	git_index_entry *entry;
+	unsigned int i;
+	uint32_t raw;
+	size_t size_pos;
+	int error = -1;
+
+	if (git_ewah_init(&dirty, entries->length) < 0)
+		return -1;
+
+	git_vector_foreach(entries, i, entry) {
+		if ((entry->flags_extended & GIT_IDXENTRY_FSMONITOR_VALID) == 0)
+			git_ewah_set(&dirty, i);
+	}
+
+	raw = htonl(INDEX_FSMONITOR_VERSION);
+	git_buf_put(&buf, (char *)&raw, 4);
+	git_buf_put(&buf, index->fsmonitor_token, strlen(index->fsmonitor_token) + 1);
+
+	/* the size of the bitmap goes in front of it */
+	size_pos = buf.size;
+	git_buf_put(&buf, (char *)&raw, 4);
+
+	if (git_ewah_write(&buf, &dirty) < 0 || git_buf_oom(&buf))
+		goto done;
+
+	raw = htonl((uint32_t)(buf.size - size_pos - 4));
+	memcpy(buf.ptr + size_pos, &raw, 4);
+
+	memset(&extension, 0x0, sizeof(struct index_extension));
+	memcpy(&extension.signature, INDEX_EXT_FSMONITOR_SIG, 4);
+	extension.extension_size = (uint32_t)buf.size;
+
+	error = write_extension(file, &extension, &buf, headers);
+
+done:
+	git_ewah_free(&dirty);
+	git_buf_free(&buf);
+	return error;
+}
+
+static int write_offsets_extension(
+	git_filebuf *file, struct entry_block *blocks, size_t nr_blocks, git_hash_ctx *headers)
+{
+	git_buf buf = GIT_BUF_INIT;
+	struct index_extension extension;
+	uint32_t raw;
+	size_t i;
+	int error;
+
+	raw = htonl(INDEX_OFFSETS_VERSION);
+	git_buf_put(&buf, (char *)&raw, 4);
+
+	for (i = 0; i < nr_blocks; ++i) {
+		raw = htonl((uint32_t)blocks[i].offset);
+		git_buf_put(&buf, (char *)&raw, 4);
+		raw = htonl((uint32_t)blocks[i].nr);
+		git_buf_put(&buf, (char *)&raw, 4);
+	}
+
+	if (git_buf_oom(&buf))
+		return -1;
+
+	memset(&extension, 0x0, sizeof(struct index_extension));
+	memcpy(&extension.signature, INDEX_EXT_OFFSETS_SIG, 4);
+	extension.extension_size = (uint32_t)buf.size;
+
+	error = write_extension(file, &extension, &buf, headers);
+
+	git_buf_free(&buf);
+	return error;
+}
+
+static int write_end_of_entries_extension(
+	git_filebuf *file, size_t offset, git_hash_ctx *headers)
+{
+	git_buf buf = GIT_BUF_INIT;
+	struct index_extension extension;
+	git_oid hash;
+	uint32_t raw;
+	int error;
+
+	git_hash_final(&hash, headers);
+
+	raw = htonl((uint32_t)offset);
+	git_buf_put(&buf, (char *)&raw, 4);
+	git_buf_put(&buf, (char *)hash.id, GIT_OID_RAWSZ);
+
+	if (git_buf_oom(&buf))
+		return -1;
+
+	memset(&extension, 0x0, sizeof(struct index_extension));
+	memcpy(&extension.signature, INDEX_EXT_END_OF_ENTRIES_SIG, 4);
+	extension.extension_size = (uint32_t)buf.size;
+
+	error = write_extension(file, &extension, &buf, NULL);
+
+	git_buf_free(&buf);
+	return error;
+}
+
+static int write_link_extension(
+	git_filebuf *file, struct index_link *link, git_hash_ctx *headers)
+{
+	git_buf buf = GIT_BUF_INIT;
+	struct index_extension extension;
+	int error = -1;
+
+	git_buf_put(&buf, (char *)link->base.id, GIT_OID_RAWSZ);
+
+	if (git_ewah_write(&buf, &link->deleted) < 0 ||
+		git_ewah_write(&buf, &link->replaced) < 0)
+		goto done;
+
+	memset(&extension, 0x0, sizeof(struct index_extension));
+	memcpy(&extension.signature, INDEX_EXT_LINK_SIG, 4);
+	extension.extension_size = (uint32_t)buf.size;
+
+	error = write_extension(file, &extension, &buf, headers);
+
+done:
+	git_buf_free(&buf);
+	return error;
+}
+
+static int write_index(git_index *index, git_filebuf *file, struct index_writer *writer)
 {
 	git_oid hash_final;
 
 	struct index_header header;
 
-	int is_extended;
+	unsigned int version;
+	int error = -1;
+	struct entry_block *blocks = NULL;
+	size_t nr_blocks = 0, entries_end;
+	git_hash_ctx *headers = NULL;
 
 	assert(index && file);
 
-	is_extended = is_index_extended(index);
+	version = index->version;
+
+	/* Extended flags need at least version 3 */
+	if (is_index_extended(index) && version < INDEX_VERSION_NUMBER_EXT)
+		version = INDEX_VERSION_NUMBER_EXT;
 
 	header.signature = htonl(INDEX_HEADER_SIG);
-	header.version = htonl(is_extended ? INDEX_VERSION_NUMBER_EXT : INDEX_VERSION_NUMBER);
-	header.entry_count = htonl((uint32_t)index->entries.length);
+	header.version = htonl(version);
+	header.entry_count = htonl((uint32_t)writer->entries->length);
 
 	if (git_filebuf_write(file, &header, sizeof(struct index_header)) < 0)
 		return -1;
 
-	if (write_entries(index, file) < 0)
-		return -1;
+	/*
+	 * Record where each block of entries starts, and where the entries
+	 * end, so readers can split up the work of loading them.
+	 */
+	if (index->offset_table && version < INDEX_VERSION_NUMBER_COMP) {
+		nr_blocks = (writer->entries->length + INDEX_OFFSETS_BLOCK_ENTRIES - 1) /
+			INDEX_OFFSETS_BLOCK_ENTRIES;
+
+		blocks = git__calloc(nr_blocks + 1, sizeof(struct entry_block));
+		GITERR_CHECK_ALLOC(blocks);
+
+		if ((headers = git_hash_new_ctx()) == NULL)
+			goto done;
+	}
+
+	if (write_entries(file, writer->entries, writer->stripped, version, blocks) < 0)
+		goto done;
 
-	/* TODO: write tree cache extension */
+	entries_end = nr_blocks ? blocks[nr_blocks - 1].end : 0;
+
+	/* a single block isn't worth a table */
+	if (nr_blocks > 1 &&
+		write_offsets_extension(file, blocks, nr_blocks, headers) < 0)
+		goto done;
+
+	/* write the link to the shared index */
+	if (writer->link != NULL &&
+		write_link_extension(file, writer->link, headers) < 0)
+		goto done;
+
+	/* write the tree cache extension */
+	if (!writer->shared && index->tree != NULL &&
+		write_tree_extension(index, file, headers) < 0)
+		goto done;
 
 	/* write the reuc extension */
-	if (index->reuc.length > 0 && write_reuc_extension(index, file) < 0)
-		return -1;
+	if (!writer->shared && index->reuc.length > 0 &&
+		write_reuc_extension(index, file, headers) < 0)
+		goto done;
+
+	/* write the untracked cache extension */
+	if (!writer->shared && index->untracked_cache && index->untracked != NULL &&
+		write_untracked_extension(index, file, headers) < 0)
+		goto done;
+
+	/* write the filesystem monitor extension */
+	if (!writer->shared && index->fsmonitor_token != NULL &&
+		write_fsmonitor_extension(index, writer->sorted, file, headers) < 0)
+		goto done;
+
+	/* the end of entries extension must come last */
+	if (headers != NULL && entries_end > 0 &&
+		write_end_of_entries_extension(file, entries_end, headers) < 0)
+		goto done;
 
 	/* get out the hash for all the contents we've appended to the file */
 	git_filebuf_hash(&hash_final, file);
+	git_oid_cpy(&writer->checksum, &hash_final);
 
 	/* write it at the end of the file */
-	return git_filebuf_write(file, hash_final.id, GIT_OID_RAWSZ);
+	error = git_filebuf_write(file, hash_final.id, GIT_OID_RAWSZ);
+
+done:
+	if (headers)
+		git_hash_free_ctx(headers);
+	git__free(blocks);
+	return error;
+}
+
+/*
+ * Write all of the entries to a new shared index, named after its
+ * checksum, and make it the base for split indexes from now on.
+ */
+static int write_shared_index(git_index *index, git_vector *entries)
+{
+	git_filebuf file = GIT_FILEBUF_INIT;
+	git_buf path = GIT_BUF_INIT;
+	struct index_writer writer;
+	git_index_entry *base = NULL, *entry;
+	git_pool paths;
+	unsigned int i;
+	int error = -1;
+
+	memset(&writer, 0x0, sizeof(writer));
+	writer.entries = entries;
+	writer.shared = 1;
+
+	if (git_pool_init(&paths, 1, 0) < 0)
+		return -1;
+
+	if (git_path_dirname_r(&path, index->index_file_path) < 0 ||
+		git_buf_joinpath(&path, path.ptr, INDEX_SHARED_PREFIX "new") < 0 ||
+		git_filebuf_open(&file, path.ptr, GIT_FILEBUF_HASH_CONTENTS) < 0)
+		goto done;
+
+	if (write_index(index, &file, &writer) < 0 ||
+		shared_index_path(&path, index, &writer.checksum) < 0 ||
+		git_filebuf_commit_at(&file, path.ptr, GIT_INDEX_FILE_MODE) < 0)
+		goto done;
+
+	if ((base = git__calloc(entries->length + 1, sizeof(git_index_entry))) == NULL)
+		goto done;
+
+	git_vector_foreach(entries, i, entry) {
+		memcpy(&base[i], entry, sizeof(git_index_entry));
+
+		if ((base[i].path = git_pool_strdup(&paths, entry->path)) == NULL)
+			goto done;
+	}
+
+	/* the paths of the old base go away with it */
+	git__free(index->split_base);
+	index->split_base = base;
+	index->split_base_len = entries->length;
+	git_pool_swap(&index->split_base_pool, &paths);
+	git_oid_cpy(&index->split_base_oid, &writer.checksum);
+
+	base = NULL;
+	error = 0;
+
+done:
+	git__free(base);
+	git_pool_clear(&paths);
+	git_filebuf_cleanup(&file);
+	git_buf_free(&path);
+	return error;
+}
+
+static int index_entry_unchanged(const git_index_entry *a, const git_index_entry *b)
+{
+	return (a->ctime.seconds == b->ctime.seconds &&
+		a->ctime.nanoseconds == b->ctime.nanoseconds &&
+		a->mtime.seconds == b->mtime.seconds &&
+		a->mtime.nanoseconds == b->mtime.nanoseconds &&
+		a->dev == b->dev && a->ino == b->ino && a->mode == b->mode &&
+		a->uid == b->uid && a->gid == b->gid &&
+		a->file_size == b->file_size &&
+		a->flags == b->flags &&
+		(a->flags_extended & GIT_IDXENTRY_EXTENDED_FLAGS) ==
+			(b->flags_extended & GIT_IDXENTRY_EXTENDED_FLAGS) &&
+		git_oid_cmp(&a->oid, &b->oid) == 0);
+}
+
+/*
+ * Work out what goes in a split index: the entries which replace ones
+ * in the shared index, in its order, followed by the new ones, and
+ * which of the shared entries are gone.  If that's too much of the
+ * index, all of it goes to a new shared index instead.
+ */
+static int prepare_split_index(git_index *index, struct index_writer *writer, git_vector *out)
+{
+	git_vector *entries = writer->entries, added = GIT_VECTOR_INIT;
+	git_index_entry *entry, *shared;
+	size_t i = 0, j = 0, changes = 0;
+	struct index_link *link;
+	int error = -1;
+
+	link = git__calloc(1, sizeof(struct index_link));
+	GITERR_CHECK_ALLOC(link);
+	writer->link = link;
+
+	if (git_vector_init(out, 32, NULL) < 0 || git_vector_init(&added, 32, NULL) < 0)
+		goto done;
+
+	if (index->split_base != NULL) {
+		if (git_ewah_init(&link->deleted, index->split_base_len) < 0 ||
+			git_ewah_init(&link->replaced, index->split_base_len) < 0)
+			goto done;
+
+		/* both lists are sorted, so walk them side by side */
+		while (i < entries->length || j < index->split_base_len) {
+			int cmp;
+
+			entry = git_vector_get(entries, i);
+			shared = &index->split_base[j];
+
+			if (i >= entries->length)
+				cmp = 1;
+			else if (j >= index->split_base_len)
+				cmp = -1;
+			else
+				cmp = index_cmp(entry, shared);
+
+			if (cmp < 0) {
+				if (git_vector_insert(&added, entry) < 0)
+					goto done;
+				changes++, i++;
+			} else if (cmp > 0) {
+				git_ewah_set(&link->deleted, j);
+				changes++, j++;
+			} else {
+				if (!index_entry_unchanged(entry, shared)) {
+					git_ewah_set(&link->replaced, j);
+					if (git_vector_insert(out, entry) < 0)
+						goto done;
+					changes++;
+				}
+				i++, j++;
+			}
+		}
+	}
+
+	if (index->split_base == NULL ||
+		changes * 100 > index->split_max_change * entries->length) {
+		git_ewah_free(&link->deleted);
+		git_ewah_free(&link->replaced);
+		git_vector_clear(out);
+		git_vector_clear(&added);
+
+		if (write_shared_index(index, entries) < 0 ||
+			git_ewah_init(&link->deleted, 0) < 0 ||
+			git_ewah_init(&link->replaced, 0) < 0)
+			goto done;
+	}
+
+	git_oid_cpy(&link->base, &index->split_base_oid);
+
+	writer->stripped = out->length;
+	git_vector_foreach(&added, i, entry)
+		if (git_vector_insert(out, entry) < 0)
+			goto done;
+
+	writer->entries = out;
+	error = 0;
+
+done:
+	git_vector_free(&added);
+	return error;
 }
 
 int git_index_entry_stage(const git_index_entry *entry)
@@ -1512,7 +2894,7 @@ static int read_tree_cb(const char *root, const git_tree_entry *tentry, void *da
 	git_buf_free(&path);
 
 	if (index_insert(index, entry, 0) < 0) {
-		index_entry_free(entry);
+		index_entry_free(index, entry);
 		return -1;
 	}
 
@@ -1521,12 +2903,129 @@ static int read_tree_cb(const char *root, const git_tree_entry *tentry, void *da
 
 int git_index_read_tree(git_index *index, git_tree *tree)
 {
+	int error;
+
 	git_index_clear(index);
 
-	return git_tree_walk(tree, read_tree_cb, GIT_TREEWALK_POST, index);
+	if ((error = git_tree_walk(tree, read_tree_cb, GIT_TREEWALK_POST, index)) < 0)
+		return error;
+
+	/* The index now matches the tree exactly; prime the tree cache */
+	return git_tree_cache_read_tree(&index->tree, tree);
 }
 
 git_repository *git_index_owner(const git_index *index)
 {
 	return INDEX_OWNER(index);
 }
+
+void git_index_set_fsmonitor(
+	git_index *index, git_index_fsmonitor_cb callback, void *payload)
+{
+	assert(index);
+
+	index->fsmonitor = callback;
+	index->fsmonitor_payload = payload;
+	index->fsmonitor_ready = 0;
+}
+
+int git_index_fsmonitor_changed(git_index *index, const char *path)
+{
+	git_buf changed = GIT_BUF_INIT;
+	git_index_entry *entry;
+	unsigned int pos;
+	size_t len = strlen(path);
+	int cmp;
+
+	assert(index && path);
+
+	/* a trailing slash only says it's a directory */
+	while (len > 0 && path[len - 1] == '/')
+		len--;
+
+	if (len == 0) {
+		git_vector_foreach(&index->entries, pos, entry)
+			entry->flags_extended &= ~GIT_IDXENTRY_FSMONITOR_VALID;
+
+		if (index->untracked != NULL && index->untracked->root != NULL) {
+			git_untracked_dir_invalidate(index->untracked->root);
+			index->untracked->dirty = 1;
+		}
+
+		return 0;
+	}
+
+	if (git_buf_set(&changed, path, len) < 0)
+		return -1;
+
+	/* the path itself, and everything in it if it's a directory */
+	for (pos = git_index__prefix_position(index, changed.ptr);
+		(entry = git_index_get_byindex(index, pos)) != NULL; ++pos) {
+		cmp = index->ignore_case ?
+			strncasecmp(entry->path, changed.ptr, len) :
+			strncmp(entry->path, changed.ptr, len);
+
+		if (cmp != 0)
+			break;
+
+		if (entry->path[len] == '\0' || entry->path[len] == '/')
+			entry->flags_extended &= ~GIT_IDXENTRY_FSMONITOR_VALID;
+	}
+
+	git_untracked_cache_invalidate_path(index->untracked, changed.ptr);
+
+	git_buf_free(&changed);
+	return 0;
+}
+
+int git_index_fsmonitor_set_token(git_index *index, const char *token)
+{
+	char *copy = NULL;
+
+	assert(index);
+
+	if (token != NULL) {
+		copy = git__strdup(token);
+		GITERR_CHECK_ALLOC(copy);
+	}
+
+	git__free(index->fsmonitor_token);
+	index->fsmonitor_token = copy;
+
+	return 0;
+}
+
+int git_index__fsmonitor_refresh(git_index *index)
+{
+	char *token;
+	int error = 0;
+
+	if (index->fsmonitor == NULL)
+		return 0;
+
+	/* the monitor hands out a new token as it's asked */
+	token = index->fsmonitor_token;
+	index->fsmonitor_token = NULL;
+	index->fsmonitor_ready = 0;
+
+	/* without a token, there's no telling what changed */
+	if (token == NULL)
+		error = git_index_fsmonitor_changed(index, "");
+
+	if (!error && index->fsmonitor(index, token, index->fsmonitor_payload)) {
+		giterr_clear();
+		error = GIT_EUSER;
+	}
+
+	if (error < 0) {
+		/* it may not have told us everything, so trust nothing */
+		git_index_fsmonitor_changed(index, "");
+		git__free(index->fsmonitor_token);
+		index->fsmonitor_token = token;
+		return error;
+	}
+
+	git__free(token);
+	index->fsmonitor_ready = 1;
+	return 0;
+}
@@ -10,7 +10,10 @@
 #include "fileops.h"
 #include "filebuf.h"
 #include "vector.h"
+#include "pool.h"
 #include "tree-cache.h"
+#include "untracked.h"
+#include "ewah.h"
 #include "git2/odb.h"
 #include "git2/index.h"
 
@@ -22,17 +25,47 @@ struct git_index {
 
 	char *index_file_path;
 
-	time_t last_modified;
+	/* mtime of the index file when we last read or wrote it */
+	git_index_time last_modified;
 	git_vector entries;
 
+	/* on-disk format version, see git_index_set_version() */
+	unsigned int version;
+
+	/* entries read from disk and their paths, see index_entry_free() */
+	git_index_entry *entry_arena;
+	size_t entry_arena_len;
+	git_pool path_pool;
+
 	unsigned int on_disk:1;
 
 	unsigned int ignore_case:1;
 	unsigned int distrust_filemode:1;
 	unsigned int no_symlinks:1;
+	unsigned int offset_table:1;
+	unsigned int split_index:1;
+	unsigned int untracked_cache:1;
 
 	git_tree_cache *tree;
 
+	/* see git_iterator_for_workdir_untracked() */
+	git_untracked_cache *untracked;
+
+	/* see git_index_set_fsmonitor() */
+	git_index_fsmonitor_cb fsmonitor;
+	void *fsmonitor_payload;
+	char *fsmonitor_token;
+	git_ewah *fsmonitor_dirty; /* read from disk, until the entries are */
+	unsigned int fsmonitor_ready:1; /* the monitor was asked since */
+
+	/* the shared index of a split index, see prepare_split_index() */
+	git_oid split_base_oid;
+	git_index_entry *split_base;
+	size_t split_base_len;
+	git_pool split_base_pool; /* paths of a split_base we wrote ourselves */
+	unsigned int split_max_change;
+	struct index_link *split_link;
+
 	git_vector reuc;
 
 	git_vector_cmp entries_cmp_path;
@@ -43,6 +76,27 @@ struct git_index {
 
 extern void git_index__init_entry_from_stat(struct stat *st, git_index_entry *entry);
 
+/*
+ * Whether the entry was modified so close to the time the index was
+ * written that its stat data can't be trusted to find later changes.
+ */
+extern int git_index__is_racy(const git_index *index, const git_index_entry *entry);
+extern int git_index__is_racy_time(const git_index *index, const git_index_time *mtime);
+
 extern unsigned int git_index__prefix_position(git_index *index, const char *path);
 
+/*
+ * Ask the filesystem monitor what changed since it was last asked, if
+ * there is one.  Afterwards, entries which are still marked with
+ * GIT_IDXENTRY_FSMONITOR_VALID needn't be checked for changes.
+ */
+extern int git_index__fsmonitor_refresh(git_index *index);
+
+GIT_INLINE(bool) git_index__fsmonitor_valid(
+	const git_index *index, const git_index_entry *entry)
+{
+	return (index->fsmonitor_ready &&
+		(entry->flags_extended & GIT_IDXENTRY_FSMONITOR_VALID) != 0);
+}
+
 #endif
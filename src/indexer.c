@@ -17,7 +17,7 @@
 #include "posix.h"
 #include "pack.h"
 #include "filebuf.h"
-#include "sha1.h"
+#include "hash.h"
 
 #define UINT31_MAX (0x7FFFFFFF)
 
@@ -33,13 +33,14 @@ struct git_indexer {
 	size_t nr_objects;
 	git_vector objects;
 	git_filebuf file;
-	unsigned int fanout[256];
+	unsigned int fanout[256]; /* objects per leading byte */
 	git_oid hash;
 };
 
 struct git_indexer_stream {
 	unsigned int parsed_header :1,
-		opened_pack;
+		opened_pack :1,
+		registered_pack :1;
 	struct git_pack_file *pack;
 	git_filebuf pack_file;
 	git_filebuf index_file;
@@ -47,14 +48,39 @@ struct git_indexer_stream {
 	size_t nr_objects;
 	git_vector objects;
 	git_vector deltas;
-	unsigned int fanout[256];
+	unsigned int fanout[256]; /* objects per leading byte */
 	git_oid hash;
 	git_transfer_progress_callback progress_cb;
 	void *progress_payload;
+
+	/* running hash of the pack, lagging behind by the trailer's size */
+	git_hash_ctx *trailer_ctx;
+	char inbuf[GIT_OID_RAWSZ];
+	size_t inbuf_len;
+
+	/*
+	 * The entry being received.  Entries are parsed straight out of
+	 * the buffers handed to git_indexer_stream_add(); whatever part of
+	 * a header has arrived is kept in `hdr`, and the zlib stream and
+	 * the hash of the object carry over from one call to the next.
+	 */
+	size_t nr_received;
+	git_off_t entry_start;
+	git_otype entry_type;
+	size_t entry_size;
+	size_t entry_inflated;
+	uint32_t entry_crc;
+	unsigned char hdr[64];
+	size_t hdr_len;
+	unsigned int in_entry_data :1,
+		zstream_ready :1;
+	z_stream zstream;
+	git_hash_ctx *entry_ctx;
 };
 
 struct delta_info {
 	git_off_t delta_off;
+	uint32_t crc;
 };
 
 const git_oid *git_indexer_hash(git_indexer *idx)
@@ -156,6 +182,13 @@ int git_indexer_stream_new(
 	idx->progress_cb = progress_cb;
 	idx->progress_payload = progress_payload;
 
+	idx->trailer_ctx = git_hash_new_ctx();
+	idx->entry_ctx = git_hash_new_ctx();
+	if (!idx->trailer_ctx || !idx->entry_ctx) {
+		giterr_set_oom();
+		goto cleanup;
+	}
+
 	error = git_buf_joinpath(&path, prefix, suff);
 	if (error < 0)
 		goto cleanup;
@@ -172,61 +205,17 @@ int git_indexer_stream_new(
 cleanup:
 	git_buf_free(&path);
 	git_filebuf_cleanup(&idx->pack_file);
+	if (idx->trailer_ctx)
+		git_hash_free_ctx(idx->trailer_ctx);
+	if (idx->entry_ctx)
+		git_hash_free_ctx(idx->entry_ctx);
 	git__free(idx);
 	return -1;
 }
 
-/* Try to store the delta so we can try to resolve it later */
-static int store_delta(git_indexer_stream *idx, git_off_t entry_start, size_t entry_size, git_otype type)
+static int save_entry(git_indexer_stream *idx, const git_oid *oid, git_off_t entry_start, uint32_t crc)
 {
-	git_mwindow *w = NULL;
-	struct delta_info *delta;
-	git_rawobj obj;
-	int error;
-
-	assert(type == GIT_OBJ_REF_DELTA || type == GIT_OBJ_OFS_DELTA);
-
-	if (type == GIT_OBJ_REF_DELTA) {
-		idx->off += GIT_OID_RAWSZ;
-	} else {
-		git_off_t base_off;
-
-		base_off = get_delta_base(idx->pack, &w, &idx->off, type, entry_start);
-		git_mwindow_close(&w);
-		if (base_off < 0)
-			return (int)base_off;
-	}
-
-	error = packfile_unpack_compressed(&obj, idx->pack, &w, &idx->off, entry_size, type);
-	if (error == GIT_EBUFS) {
-		idx->off = entry_start;
-		return GIT_EBUFS;
-	} else if (error < 0){
-		return -1;
-	}
-
-	delta = git__calloc(1, sizeof(struct delta_info));
-	GITERR_CHECK_ALLOC(delta);
-	delta->delta_off = entry_start;
-
-	git__free(obj.data);
-
-	if (git_vector_insert(&idx->deltas, delta) < 0)
-		return -1;
-
-	return 0;
-}
-
-static int hash_and_save(git_indexer_stream *idx, git_rawobj *obj, git_off_t entry_start)
-{
-	int i;
-	git_oid oid;
-	void *packed;
-	size_t entry_size;
-	unsigned int left;
 	struct entry *entry;
-	git_mwindow *w = NULL;
-	git_mwindow_file *mwf = &idx->pack->mwf;
 	struct git_pack_entry *pentry;
 
 	entry = git__calloc(1, sizeof(*entry));
@@ -239,173 +228,515 @@ static int hash_and_save(git_indexer_stream *idx, git_rawobj *obj, git_off_t ent
 		entry->offset = (uint32_t)entry_start;
 	}
 
-	/* FIXME: Parse the object instead of hashing it */
-	if (git_odb__hashobj(&oid, obj) < 0) {
-		giterr_set(GITERR_INDEXER, "Failed to hash object");
+	pentry = git__malloc(sizeof(struct git_pack_entry));
+	if (pentry == NULL) {
+		git__free(entry);
 		return -1;
 	}
 
-	pentry = git__malloc(sizeof(struct git_pack_entry));
-	GITERR_CHECK_ALLOC(pentry);
-
-	git_oid_cpy(&pentry->sha1, &oid);
+	git_oid_cpy(&pentry->sha1, oid);
 	pentry->offset = entry_start;
 	if (git_vector_insert(&idx->pack->cache, pentry) < 0)
 		goto on_error;
 
-	git_oid_cpy(&entry->oid, &oid);
-	entry->crc = crc32(0L, Z_NULL, 0);
-
-	entry_size = (size_t)(idx->off - entry_start);
-	packed = git_mwindow_open(mwf, &w, entry_start, entry_size, &left);
-	if (packed == NULL)
-		goto on_error;
-
-	entry->crc = htonl(crc32(entry->crc, packed, (uInt)entry_size));
-	git_mwindow_close(&w);
+	git_oid_cpy(&entry->oid, oid);
+	entry->crc = crc;
 
 	/* Add the object to the list */
-	if (git_vector_insert(&idx->objects, entry) < 0)
+	if (git_vector_insert(&idx->objects, entry) < 0) {
+		git_vector_pop(&idx->pack->cache);
 		goto on_error;
-
-	for (i = oid.id[0]; i < 256; ++i) {
-		idx->fanout[i]++;
 	}
 
+	idx->fanout[oid->id[0]]++;
+
 	return 0;
 
 on_error:
 	git__free(entry);
 	git__free(pentry);
-	git__free(obj->data);
 	return -1;
 }
 
+static int hash_and_save(git_indexer_stream *idx, git_rawobj *obj, git_off_t entry_start, uint32_t crc)
+{
+	git_oid oid;
+
+	if (git_odb__hashobj(&oid, obj) < 0) {
+		giterr_set(GITERR_INDEXER, "Failed to hash object");
+		return -1;
+	}
+
+	return save_entry(idx, &oid, entry_start, crc);
+}
+
 static void do_progress_callback(git_indexer_stream *idx, git_transfer_progress *stats)
 {
 	if (!idx->progress_cb) return;
 	idx->progress_cb(stats, idx->progress_payload);
 }
 
-int git_indexer_stream_add(git_indexer_stream *idx, const void *data, size_t size, git_transfer_progress *stats)
+/*
+ * Feed the pack data to the running hash, always holding back the last
+ * GIT_OID_RAWSZ bytes seen: they are the pack trailer if the stream
+ * ends here, and must not be part of the hash.
+ */
+static void hash_partially(git_indexer_stream *idx, const char *data, size_t size)
 {
-	int error;
-	struct git_pack_header hdr;
-	size_t processed; 
-	git_mwindow_file *mwf = &idx->pack->mwf;
+	size_t to_expell, to_keep;
 
-	assert(idx && data && stats);
+	if (size == 0)
+		return;
 
-	processed = stats->indexed_objects;
+	/* Easy case, dump the buffer and the data minus the last 20 bytes */
+	if (size >= GIT_OID_RAWSZ) {
+		git_hash_update(idx->trailer_ctx, idx->inbuf, idx->inbuf_len);
+		git_hash_update(idx->trailer_ctx, data, size - GIT_OID_RAWSZ);
 
-	if (git_filebuf_write(&idx->pack_file, data, size) < 0)
-		return -1;
+		data += size - GIT_OID_RAWSZ;
+		memcpy(idx->inbuf, data, GIT_OID_RAWSZ);
 
-	/* Make sure we set the new size of the pack */
-	if (idx->opened_pack) {
-		idx->pack->mwf.size += size;
-		//printf("\nadding %zu for %zu\n", size, idx->pack->mwf.size);
-	} else {
-		if (open_pack(&idx->pack, idx->pack_file.path_lock) < 0)
-			return -1;
-		idx->opened_pack = 1;
-		mwf = &idx->pack->mwf;
-		if (git_mwindow_file_register(&idx->pack->mwf) < 0)
-			return -1;
+		idx->inbuf_len = GIT_OID_RAWSZ;
+		return;
 	}
 
-	if (!idx->parsed_header) {
-		if ((unsigned)idx->pack->mwf.size < sizeof(hdr))
-			return 0;
+	/* We now know the new data is less than 20 bytes */
+	if (idx->inbuf_len + size <= GIT_OID_RAWSZ) {
+		memcpy(idx->inbuf + idx->inbuf_len, data, size);
+		idx->inbuf_len += size;
+		return;
+	}
 
-		if (parse_header(&hdr, idx->pack) < 0)
-			return -1;
+	/* We need to partially drain the buffer and then append */
+	to_keep   = GIT_OID_RAWSZ - size;
+	to_expell = idx->inbuf_len - to_keep;
 
-		idx->parsed_header = 1;
-		idx->nr_objects = ntohl(hdr.hdr_entries);
-		idx->off = sizeof(struct git_pack_header);
+	git_hash_update(idx->trailer_ctx, idx->inbuf, to_expell);
 
-		/* for now, limit to 2^32 objects */
-		assert(idx->nr_objects == (size_t)((unsigned int)idx->nr_objects));
+	memmove(idx->inbuf, idx->inbuf + to_expell, to_keep);
+	memcpy(idx->inbuf + to_keep, data, size);
+	idx->inbuf_len += size - to_expell;
+}
 
-		if (git_vector_init(&idx->pack->cache, (unsigned int)idx->nr_objects, cache_cmp) < 0)
-			return -1;
+static int entry_error(const char *message)
+{
+	giterr_set(GITERR_INDEXER, "Indexing error: %s", message);
+	return -1;
+}
 
-		idx->pack->has_cache = 1;
-		if (git_vector_init(&idx->objects, (unsigned int)idx->nr_objects, objects_cmp) < 0)
-			return -1;
+/*
+ * Parse the entry header gathered so far in `idx->hdr`: the type and
+ * inflated size, followed for deltas by the location of their base.
+ * Returns GIT_EBUFS if the header hasn't arrived in full yet.
+ */
+static int parse_entry_header(size_t *used_out, git_indexer_stream *idx)
+{
+	const unsigned char *buf = idx->hdr;
+	size_t len = idx->hdr_len, used = 0, size;
+	unsigned int shift = 4;
+	unsigned char c;
+	git_otype type;
 
-		if (git_vector_init(&idx->deltas, (unsigned int)(idx->nr_objects / 2), NULL) < 0)
-			return -1;
+	if (len == 0)
+		return GIT_EBUFS;
 
-		stats->received_objects = 0;
-		stats->indexed_objects = 0;
-		stats->total_objects = (unsigned int)idx->nr_objects;
-		do_progress_callback(idx, stats);
+	c = buf[used++];
+	type = (c >> 4) & 7;
+	size = c & 15;
+	while (c & 0x80) {
+		if (len <= used)
+			return GIT_EBUFS;
+		if (bitsizeof(size_t) <= shift)
+			return entry_error("object size overflow");
+
+		c = buf[used++];
+		size += (size_t)(c & 0x7f) << shift;
+		shift += 7;
 	}
 
-	/* Now that we have data in the pack, let's try to parse it */
+	switch (type) {
+	case GIT_OBJ_COMMIT:
+	case GIT_OBJ_TREE:
+	case GIT_OBJ_BLOB:
+	case GIT_OBJ_TAG:
+		break;
+
+	case GIT_OBJ_OFS_DELTA: {
+		git_off_t base_offset;
+
+		if (len <= used)
+			return GIT_EBUFS;
+
+		c = buf[used++];
+		base_offset = c & 127;
+		while (c & 128) {
+			if (len <= used)
+				return GIT_EBUFS;
+			base_offset += 1;
+			if (!base_offset || MSB(base_offset, 7))
+				return entry_error("delta offset overflow");
+			c = buf[used++];
+			base_offset = (base_offset << 7) + (c & 127);
+		}
 
-	/* As the file grows any windows we try to use will be out of date */
-	git_mwindow_free_all(mwf);
-	while (processed < idx->nr_objects) {
-		git_rawobj obj;
-		git_off_t entry_start = idx->off;
-		size_t entry_size;
-		git_otype type;
-		git_mwindow *w = NULL;
+		if (base_offset <= 0 || base_offset >= idx->entry_start)
+			return entry_error("delta base out of bounds");
+		break;
+	}
 
-		if (idx->pack->mwf.size <= idx->off + 20)
-			return 0;
+	case GIT_OBJ_REF_DELTA:
+		if (len < used + GIT_OID_RAWSZ)
+			return GIT_EBUFS;
+		used += GIT_OID_RAWSZ;
+		break;
 
-		error = git_packfile_unpack_header(&entry_size, &type, mwf, &w, &idx->off);
-		if (error == GIT_EBUFS) {
-			idx->off = entry_start;
-			return 0;
+	default:
+		return entry_error("invalid object type");
+	}
+
+	idx->entry_type = type;
+	idx->entry_size = size;
+	*used_out = used;
+	return 0;
+}
+
+static int begin_entry_data(git_indexer_stream *idx)
+{
+	char hdr[64];
+	int len;
+
+	if (!idx->zstream_ready) {
+		memset(&idx->zstream, 0, sizeof(idx->zstream));
+		if (inflateInit(&idx->zstream) != Z_OK) {
+			giterr_set(GITERR_ZLIB, "Failed to init zlib stream");
+			return -1;
 		}
-		if (error < 0)
+		idx->zstream_ready = 1;
+	} else if (inflateReset(&idx->zstream) != Z_OK) {
+		giterr_set(GITERR_ZLIB, "Failed to reset zlib stream");
+		return -1;
+	}
+
+	idx->entry_inflated = 0;
+	idx->in_entry_data = 1;
+
+	/* Deltas can only be hashed once their base is known */
+	if (idx->entry_type == GIT_OBJ_OFS_DELTA || idx->entry_type == GIT_OBJ_REF_DELTA)
+		return 0;
+
+	len = p_snprintf(hdr, sizeof(hdr), "%s %"PRIuZ,
+		git_object_type2string(idx->entry_type), idx->entry_size);
+
+	git_hash_init(idx->entry_ctx);
+	git_hash_update(idx->entry_ctx, hdr, len + 1);
+
+	return 0;
+}
+
+static int finish_entry(git_indexer_stream *idx, git_transfer_progress *stats)
+{
+	git_oid oid;
+
+	if (idx->entry_inflated != idx->entry_size)
+		return entry_error("object size mismatch");
+
+	if (idx->entry_type == GIT_OBJ_OFS_DELTA || idx->entry_type == GIT_OBJ_REF_DELTA) {
+		struct delta_info *delta = git__calloc(1, sizeof(struct delta_info));
+		GITERR_CHECK_ALLOC(delta);
+
+		delta->delta_off = idx->entry_start;
+		delta->crc = htonl(idx->entry_crc);
+
+		if (git_vector_insert(&idx->deltas, delta) < 0) {
+			git__free(delta);
+			return -1;
+		}
+	} else {
+		git_hash_final(&oid, idx->entry_ctx);
+		if (save_entry(idx, &oid, idx->entry_start, htonl(idx->entry_crc)) < 0)
 			return -1;
 
-		git_mwindow_close(&w);
+		stats->indexed_objects++;
+	}
+
+	idx->in_entry_data = 0;
+	idx->nr_received++;
+	stats->received_objects++;
+	do_progress_callback(idx, stats);
+
+	return 0;
+}
+
+/*
+ * Inflate as much of the current entry as `data` holds, checksumming
+ * the raw bytes and hashing the inflated ones as we go.  Returns the
+ * number of bytes which belonged to the entry.
+ */
+static int inflate_entry(size_t *consumed, git_indexer_stream *idx, const unsigned char *data, size_t size)
+{
+	unsigned char out[8192];
+	size_t produced;
+	int zerr;
+
+	idx->zstream.next_in = (Bytef *)data;
+	idx->zstream.avail_in = (uInt)min(size, (size_t)UINT_MAX);
+
+	do {
+		idx->zstream.next_out = out;
+		idx->zstream.avail_out = sizeof(out);
+
+		zerr = inflate(&idx->zstream, Z_NO_FLUSH);
+		if (zerr == Z_BUF_ERROR && idx->zstream.avail_in == 0)
+			zerr = Z_OK; /* we just need more input */
+		else if (zerr != Z_OK && zerr != Z_STREAM_END) {
+			giterr_set(GITERR_ZLIB, "Failed to inflate packed object");
+			return -1;
+		}
+
+		produced = sizeof(out) - idx->zstream.avail_out;
+		if (produced > idx->entry_size - idx->entry_inflated)
+			return entry_error("object size mismatch");
+
+		if (idx->entry_type != GIT_OBJ_OFS_DELTA &&
+			idx->entry_type != GIT_OBJ_REF_DELTA)
+			git_hash_update(idx->entry_ctx, out, produced);
+
+		idx->entry_inflated += produced;
+	} while (zerr == Z_OK &&
+		(idx->zstream.avail_in > 0 || idx->zstream.avail_out == 0));
+
+	*consumed = idx->zstream.next_in - (Bytef *)data;
+	idx->entry_crc = crc32(idx->entry_crc, data, (uInt)*consumed);
+
+	return zerr == Z_STREAM_END;
+}
+
+/*
+ * Run the entries in `data` through the parser.  Nothing is read back
+ * from the packfile: headers which straddle two buffers are put
+ * together in `idx->hdr`, and the zlib stream of an entry is carried
+ * over to the next call.
+ */
+static int parse_entries(git_indexer_stream *idx, const unsigned char *data, size_t size, git_transfer_progress *stats)
+{
+	size_t used, consumed, prev;
+	int error;
 
-		if (type == GIT_OBJ_REF_DELTA || type == GIT_OBJ_OFS_DELTA) {
-			error = store_delta(idx, entry_start, entry_size, type);
-			if (error == GIT_EBUFS) {
-				idx->off = entry_start;
-				return 0;
-			}
-			if (error < 0)
+	while (size > 0 && idx->nr_received < idx->nr_objects) {
+		if (idx->in_entry_data) {
+			if ((error = inflate_entry(&consumed, idx, data, size)) < 0)
 				return error;
 
-			stats->received_objects++;
-			do_progress_callback(idx, stats);
+			idx->off += consumed;
+			data += consumed;
+			size -= consumed;
+
+			if (error > 0 && finish_entry(idx, stats) < 0)
+				return -1;
+
 			continue;
 		}
 
-		idx->off = entry_start;
-		error = git_packfile_unpack(&obj, idx->pack, &idx->off);
+		if (idx->hdr_len == 0)
+			idx->entry_start = idx->off;
+
+		prev = idx->hdr_len;
+		consumed = min(size, sizeof(idx->hdr) - prev);
+		memcpy(idx->hdr + prev, data, consumed);
+		idx->hdr_len += consumed;
+
+		error = parse_entry_header(&used, idx);
 		if (error == GIT_EBUFS) {
-			idx->off = entry_start;
-			return 0;
+			if (idx->hdr_len == sizeof(idx->hdr))
+				return entry_error("object header too long");
+
+			data += consumed;
+			size -= consumed;
+			continue;
 		}
 		if (error < 0)
+			return error;
+
+		/* Anything past the header is the start of the data */
+		data += used - prev;
+		size -= used - prev;
+		idx->off += used;
+		idx->hdr_len = 0;
+
+		idx->entry_crc = crc32(0L, Z_NULL, 0);
+		idx->entry_crc = crc32(idx->entry_crc, idx->hdr, (uInt)used);
+
+		if (begin_entry_data(idx) < 0)
 			return -1;
+	}
 
-		if (hash_and_save(idx, &obj, entry_start) < 0)
-			goto on_error;
+	return 0;
+}
 
-		git__free(obj.data);
+static int parse_pack_header(git_indexer_stream *idx, const unsigned char **data, size_t *size, git_transfer_progress *stats)
+{
+	struct git_pack_header hdr;
+	size_t consumed;
 
-		stats->indexed_objects = (unsigned int)++processed;
-		stats->received_objects++;
-		do_progress_callback(idx, stats);
+	consumed = min(*size, sizeof(hdr) - idx->hdr_len);
+	memcpy(idx->hdr + idx->hdr_len, *data, consumed);
+	idx->hdr_len += consumed;
+	*data += consumed;
+	*size -= consumed;
+
+	if (idx->hdr_len < sizeof(hdr))
+		return 0;
+
+	memcpy(&hdr, idx->hdr, sizeof(hdr));
+	idx->hdr_len = 0;
+
+	if (hdr.hdr_signature != ntohl(PACK_SIGNATURE)) {
+		giterr_set(GITERR_INDEXER, "Wrong pack signature");
+		return -1;
 	}
 
+	if (!pack_version_ok(hdr.hdr_version)) {
+		giterr_set(GITERR_INDEXER, "Wrong pack version");
+		return -1;
+	}
+
+	idx->parsed_header = 1;
+	idx->nr_objects = ntohl(hdr.hdr_entries);
+	idx->off = sizeof(struct git_pack_header);
+
+	/* for now, limit to 2^32 objects */
+	assert(idx->nr_objects == (size_t)((unsigned int)idx->nr_objects));
+
+	if (git_vector_init(&idx->pack->cache, (unsigned int)idx->nr_objects, cache_cmp) < 0)
+		return -1;
+
+	idx->pack->has_cache = 1;
+	if (git_vector_init(&idx->objects, (unsigned int)idx->nr_objects, objects_cmp) < 0)
+		return -1;
+
+	if (git_vector_init(&idx->deltas, (unsigned int)(idx->nr_objects / 2), NULL) < 0)
+		return -1;
+
+	stats->received_objects = 0;
+	stats->indexed_objects = 0;
+	stats->total_objects = (unsigned int)idx->nr_objects;
+	do_progress_callback(idx, stats);
+
 	return 0;
+}
 
-on_error:
-	git_mwindow_free_all(mwf);
-	return -1;
+int git_indexer_stream_add(git_indexer_stream *idx, const void *data, size_t size, git_transfer_progress *stats)
+{
+	const unsigned char *buf = data;
+
+	assert(idx && data && stats);
+
+	if (git_filebuf_write(&idx->pack_file, data, size) < 0)
+		return -1;
+
+	hash_partially(idx, data, size);
+
+	/* Make sure we set the new size of the pack */
+	if (idx->opened_pack) {
+		idx->pack->mwf.size += size;
+	} else {
+		if (open_pack(&idx->pack, idx->pack_file.path_lock) < 0)
+			return -1;
+		idx->opened_pack = 1;
+		if (git_mwindow_file_register(&idx->pack->mwf) < 0)
+			return -1;
+		idx->registered_pack = 1;
+	}
+
+	if (!idx->parsed_header) {
+		if (parse_pack_header(idx, &buf, &size, stats) < 0)
+			return -1;
+
+		if (!idx->parsed_header)
+			return 0;
+	}
+
+	return parse_entries(idx, buf, size, stats);
+}
+
+/*
+ * Write a version 2 index for the sorted `objects`.  All the tables
+ * are laid out in memory in a single pass over the entries and handed
+ * to the filebuf in one go, followed by the pack trailer and the
+ * checksum of the index itself.  The name of the pack, the hash of the
+ * sorted object names, is stored in `name`.
+ */
+static int write_index(
+	git_oid *name,
+	git_filebuf *file,
+	git_vector *objects,
+	const unsigned int *counts,
+	const git_oid *pack_trailer)
+{
+	git_buf tables = GIT_BUF_INIT, long_offsets = GIT_BUF_INIT;
+	struct git_pack_idx_header *hdr;
+	uint32_t *fanout, *crcs, *offsets, nr_long = 0, total = 0;
+	unsigned char *names;
+	size_t nr = objects->length;
+	struct entry *entry;
+	git_oid idx_hash;
+	unsigned int i;
+	int error = -1;
+
+	if (git_buf_grow(&tables, sizeof(*hdr) + 256 * sizeof(uint32_t) +
+			 nr * (GIT_OID_RAWSZ + 2 * sizeof(uint32_t))) < 0)
+		return -1;
+
+	hdr = (struct git_pack_idx_header *)tables.ptr;
+	fanout = (uint32_t *)(hdr + 1);
+	names = (unsigned char *)(fanout + 256);
+	crcs = (uint32_t *)(names + nr * GIT_OID_RAWSZ);
+	offsets = crcs + nr;
+	tables.size = (char *)(offsets + nr) - tables.ptr;
+
+	hdr->idx_signature = htonl(PACK_IDX_SIGNATURE);
+	hdr->idx_version = htonl(2);
+
+	for (i = 0; i < 256; ++i) {
+		total += counts[i];
+		fanout[i] = htonl(total);
+	}
+
+	git_vector_foreach(objects, i, entry) {
+		memcpy(names + i * GIT_OID_RAWSZ, entry->oid.id, GIT_OID_RAWSZ);
+		crcs[i] = entry->crc;
+
+		if (entry->offset == UINT32_MAX) {
+			uint32_t split[2];
+
+			split[0] = htonl(entry->offset_long >> 32);
+			split[1] = htonl(entry->offset_long & 0xffffffff);
+			git_buf_put(&long_offsets, (char *)split, sizeof(split));
+
+			offsets[i] = htonl(0x80000000 | nr_long++);
+		} else {
+			offsets[i] = htonl(entry->offset);
+		}
+	}
+
+	if (git_buf_oom(&long_offsets))
+		goto cleanup;
+
+	git_hash_buf(name, names, nr * GIT_OID_RAWSZ);
+
+	if (git_filebuf_write(file, tables.ptr, tables.size) < 0 ||
+	    git_filebuf_write(file, long_offsets.ptr, long_offsets.size) < 0 ||
+	    git_filebuf_write(file, pack_trailer, GIT_OID_RAWSZ) < 0 ||
+	    git_filebuf_hash(&idx_hash, file) < 0 ||
+	    git_filebuf_write(file, &idx_hash, GIT_OID_RAWSZ) < 0)
+		goto cleanup;
+
+	error = 0;
+
+cleanup:
+	git_buf_free(&tables);
+	git_buf_free(&long_offsets);
+	return error;
 }
 
 static int index_path_stream(git_buf *path, git_indexer_stream *idx, const char *suffix)
@@ -442,7 +773,7 @@ static int resolve_deltas(git_indexer_stream *idx, git_transfer_progress *stats)
 		if (git_packfile_unpack(&obj, idx->pack, &idx->off) < 0)
 			return -1;
 
-		if (hash_and_save(idx, &obj, delta->delta_off) < 0)
+		if (hash_and_save(idx, &obj, delta->delta_off, delta->crc) < 0)
 			return -1;
 
 		git__free(obj.data);
@@ -455,14 +786,13 @@ static int resolve_deltas(git_indexer_stream *idx, git_transfer_progress *stats)
 
 int git_indexer_stream_finalize(git_indexer_stream *idx, git_transfer_progress *stats)
 {
-	git_mwindow *w = NULL;
-	unsigned int i, long_offsets = 0, left;
-	struct git_pack_idx_header hdr;
 	git_buf filename = GIT_BUF_INIT;
-	struct entry *entry;
-	void *packfile_hash;
-	git_oid file_hash;
-	SHA_CTX ctx;
+	git_oid trailer_hash, file_hash;
+
+	if (!idx->parsed_header || idx->nr_received < idx->nr_objects) {
+		giterr_set(GITERR_INDEXER, "Indexing error: early EOF");
+		return -1;
+	}
 
 	/* Test for this before resolve_deltas(), as it plays with idx->off */
 	if (idx->off < idx->pack->mwf.size - GIT_OID_RAWSZ) {
@@ -470,6 +800,19 @@ int git_indexer_stream_finalize(git_indexer_stream *idx, git_transfer_progress *
 		return -1;
 	}
 
+	if (idx->inbuf_len != GIT_OID_RAWSZ) {
+		giterr_set(GITERR_INDEXER, "Indexing error: unexpected data at the end of the pack");
+		return -1;
+	}
+
+	/* The pack has been hashed as it came in; just check the trailer */
+	git_oid_fromraw(&file_hash, (unsigned char *)idx->inbuf);
+	git_hash_final(&trailer_hash, idx->trailer_ctx);
+	if (git_oid_cmp(&file_hash, &trailer_hash)) {
+		giterr_set(GITERR_INDEXER, "Indexing error: packfile trailer mismatch");
+		return -1;
+	}
+
 	if (idx->deltas.length > 0)
 		if (resolve_deltas(idx, stats) < 0)
 			return -1;
@@ -490,72 +833,9 @@ int git_indexer_stream_finalize(git_indexer_stream *idx, git_transfer_progress *
 	if (git_filebuf_open(&idx->index_file, filename.ptr, GIT_FILEBUF_HASH_CONTENTS) < 0)
 		goto on_error;
 
-	/* Write out the header */
-	hdr.idx_signature = htonl(PACK_IDX_SIGNATURE);
-	hdr.idx_version = htonl(2);
-	git_filebuf_write(&idx->index_file, &hdr, sizeof(hdr));
-
-	/* Write out the fanout table */
-	for (i = 0; i < 256; ++i) {
-		uint32_t n = htonl(idx->fanout[i]);
-		git_filebuf_write(&idx->index_file, &n, sizeof(n));
-	}
-
-	/* Write out the object names (SHA-1 hashes) */
-	SHA1_Init(&ctx);
-	git_vector_foreach(&idx->objects, i, entry) {
-		git_filebuf_write(&idx->index_file, &entry->oid, sizeof(git_oid));
-		SHA1_Update(&ctx, &entry->oid, GIT_OID_RAWSZ);
-	}
-	SHA1_Final(idx->hash.id, &ctx);
-
-	/* Write out the CRC32 values */
-	git_vector_foreach(&idx->objects, i, entry) {
-		git_filebuf_write(&idx->index_file, &entry->crc, sizeof(uint32_t));
-	}
-
-	/* Write out the offsets */
-	git_vector_foreach(&idx->objects, i, entry) {
-		uint32_t n;
-
-		if (entry->offset == UINT32_MAX)
-			n = htonl(0x80000000 | long_offsets++);
-		else
-			n = htonl(entry->offset);
-
-		git_filebuf_write(&idx->index_file, &n, sizeof(uint32_t));
-	}
-
-	/* Write out the long offsets */
-	git_vector_foreach(&idx->objects, i, entry) {
-		uint32_t split[2];
-
-		if (entry->offset != UINT32_MAX)
-			continue;
-
-		split[0] = htonl(entry->offset_long >> 32);
-		split[1] = htonl(entry->offset_long & 0xffffffff);
-
-		git_filebuf_write(&idx->index_file, &split, sizeof(uint32_t) * 2);
-	}
-
-	/* Write out the packfile trailer */
-	packfile_hash = git_mwindow_open(&idx->pack->mwf, &w, idx->pack->mwf.size - GIT_OID_RAWSZ, GIT_OID_RAWSZ, &left);
-	if (packfile_hash == NULL) {
-		git_mwindow_close(&w);
+	if (write_index(&idx->hash, &idx->index_file, &idx->objects,
+			idx->fanout, &file_hash) < 0)
 		goto on_error;
-	}
-
-	memcpy(&file_hash, packfile_hash, GIT_OID_RAWSZ);
-	git_mwindow_close(&w);
-
-	git_filebuf_write(&idx->index_file, &file_hash, sizeof(git_oid));
-
-	/* Write out the packfile trailer to the idx file as well */
-	if (git_filebuf_hash(&file_hash, &idx->index_file) < 0)
-		goto on_error;
-
-	git_filebuf_write(&idx->index_file, &file_hash, sizeof(git_oid));
 
 	/* Figure out what the final name should be */
 	if (index_path_stream(&filename, idx, ".idx") < 0)
@@ -567,6 +847,7 @@ int git_indexer_stream_finalize(git_indexer_stream *idx, git_transfer_progress *
 
 	git_mwindow_free_all(&idx->pack->mwf);
 	p_close(idx->pack->mwf.fd);
+	idx->pack->mwf.fd = -1;
 
 	if (index_path_stream(&filename, idx, ".pack") < 0)
 		goto on_error;
@@ -580,6 +861,7 @@ int git_indexer_stream_finalize(git_indexer_stream *idx, git_transfer_progress *
 on_error:
 	git_mwindow_free_all(&idx->pack->mwf);
 	p_close(idx->pack->mwf.fd);
+	idx->pack->mwf.fd = -1;
 	git_filebuf_cleanup(&idx->index_file);
 	git_buf_free(&filename);
 	return -1;
@@ -602,10 +884,23 @@ void git_indexer_stream_free(git_indexer_stream *idx)
 		git_vector_foreach(&idx->pack->cache, i, pe)
 			git__free(pe);
 		git_vector_free(&idx->pack->cache);
+
+		/* it's still open if the stream was dropped before the end */
+		git_mwindow_free_all(&idx->pack->mwf);
+		if (idx->registered_pack)
+			git_mwindow_file_deregister(&idx->pack->mwf);
+		if (idx->pack->mwf.fd >= 0)
+			p_close(idx->pack->mwf.fd);
 	}
 	git_vector_foreach(&idx->deltas, i, delta)
 		git__free(delta);
 	git_vector_free(&idx->deltas);
+	if (idx->zstream_ready)
+		inflateEnd(&idx->zstream);
+	git_filebuf_cleanup(&idx->index_file);
+	git_filebuf_cleanup(&idx->pack_file);
+	git_hash_free_ctx(idx->entry_ctx);
+	git_hash_free_ctx(idx->trailer_ctx);
 	git__free(idx->pack);
 	git__free(idx);
 }
@@ -676,13 +971,10 @@ int git_indexer_write(git_indexer *idx)
 {
 	git_mwindow *w = NULL;
 	int error;
-	unsigned int i, long_offsets = 0, left;
-	struct git_pack_idx_header hdr;
+	unsigned int left;
 	git_buf filename = GIT_BUF_INIT;
-	struct entry *entry;
 	void *packfile_hash;
 	git_oid file_hash;
-	SHA_CTX ctx;
 
 	git_vector_sort(&idx->objects);
 
@@ -696,90 +988,18 @@ int git_indexer_write(git_indexer *idx)
 	if (error < 0)
 		goto cleanup;
 
-	/* Write out the header */
-	hdr.idx_signature = htonl(PACK_IDX_SIGNATURE);
-	hdr.idx_version = htonl(2);
-	error = git_filebuf_write(&idx->file, &hdr, sizeof(hdr));
-	if (error < 0)
-		goto cleanup;
-
-	/* Write out the fanout table */
-	for (i = 0; i < 256; ++i) {
-		uint32_t n = htonl(idx->fanout[i]);
-		error = git_filebuf_write(&idx->file, &n, sizeof(n));
-		if (error < 0)
-			goto cleanup;
-	}
-
-	/* Write out the object names (SHA-1 hashes) */
-	SHA1_Init(&ctx);
-	git_vector_foreach(&idx->objects, i, entry) {
-		error = git_filebuf_write(&idx->file, &entry->oid, sizeof(git_oid));
-		SHA1_Update(&ctx, &entry->oid, GIT_OID_RAWSZ);
-		if (error < 0)
-			goto cleanup;
-	}
-	SHA1_Final(idx->hash.id, &ctx);
-
-	/* Write out the CRC32 values */
-	git_vector_foreach(&idx->objects, i, entry) {
-		error = git_filebuf_write(&idx->file, &entry->crc, sizeof(uint32_t));
-		if (error < 0)
-			goto cleanup;
-	}
-
-	/* Write out the offsets */
-	git_vector_foreach(&idx->objects, i, entry) {
-		uint32_t n;
-
-		if (entry->offset == UINT32_MAX)
-			n = htonl(0x80000000 | long_offsets++);
-		else
-			n = htonl(entry->offset);
-
-		error = git_filebuf_write(&idx->file, &n, sizeof(uint32_t));
-		if (error < 0)
-			goto cleanup;
-	}
-
-	/* Write out the long offsets */
-	git_vector_foreach(&idx->objects, i, entry) {
-		uint32_t split[2];
-
-		if (entry->offset != UINT32_MAX)
-			continue;
-
-		split[0] = htonl(entry->offset_long >> 32);
-		split[1] = htonl(entry->offset_long & 0xffffffff);
-
-		error = git_filebuf_write(&idx->file, &split, sizeof(uint32_t) * 2);
-		if (error < 0)
-			goto cleanup;
-	}
-
-	/* Write out the packfile trailer */
-
+	/* Read the packfile trailer */
 	packfile_hash = git_mwindow_open(&idx->pack->mwf, &w, idx->pack->mwf.size - GIT_OID_RAWSZ, GIT_OID_RAWSZ, &left);
-	git_mwindow_close(&w);
 	if (packfile_hash == NULL) {
+		git_mwindow_close(&w);
 		error = -1;
 		goto cleanup;
 	}
 
 	memcpy(&file_hash, packfile_hash, GIT_OID_RAWSZ);
-
 	git_mwindow_close(&w);
 
-	error = git_filebuf_write(&idx->file, &file_hash, sizeof(git_oid));
-	if (error < 0)
-		goto cleanup;
-
-	/* Write out the index sha */
-	error = git_filebuf_hash(&file_hash, &idx->file);
-	if (error < 0)
-		goto cleanup;
-
-	error = git_filebuf_write(&idx->file, &file_hash, sizeof(git_oid));
+	error = write_index(&idx->hash, &idx->file, &idx->objects, idx->fanout, &file_hash);
 	if (error < 0)
 		goto cleanup;
 
@@ -824,7 +1044,6 @@ int git_indexer_run(git_indexer *idx, git_transfer_progress *stats)
 		git_oid oid;
 		struct git_pack_entry *pentry;
 		git_mwindow *w = NULL;
-		int i;
 		git_off_t entry_start = off;
 		void *packed;
 		size_t entry_size;
@@ -881,9 +1100,7 @@ int git_indexer_run(git_indexer *idx, git_transfer_progress *stats)
 		if (error < 0)
 			goto cleanup;
 
-		for (i = oid.id[0]; i < 256; ++i) {
-			idx->fanout[i]++;
-		}
+		idx->fanout[oid.id[0]]++;
 
 		git__free(obj.data);
 
@@ -9,6 +9,7 @@
 #include "tree.h"
 #include "ignore.h"
 #include "buffer.h"
+#include "thread-utils.h"
 #include "git2/submodule.h"
 
 #define ITERATOR_BASE_INIT(P,NAME_LC,NAME_UC) do { \
@@ -95,6 +96,7 @@ typedef struct {
 	git_index_entry entry;
 	git_buf path;
 	bool path_has_filename;
+	bool include_trees;
 } tree_iterator;
 
 static const git_tree_entry *tree_iterator__tree_entry(tree_iterator *ti)
@@ -109,12 +111,32 @@ static char *tree_iterator__current_filename(
 	if (!ti->path_has_filename) {
 		if (git_buf_joinpath(&ti->path, ti->path.ptr, te->filename) < 0)
 			return NULL;
+
+		/* a subtree shows up as a directory, like in the workdir */
+		if (ti->include_trees && git_tree_entry__is_tree(te) &&
+			git_buf_putc(&ti->path, '/') < 0)
+			return NULL;
+
 		ti->path_has_filename = true;
 	}
 
 	return ti->path.ptr;
 }
 
+static void tree_iterator__drop_filename(tree_iterator *ti)
+{
+	size_t len = git_buf_len(&ti->path);
+
+	if (!ti->path_has_filename)
+		return;
+
+	if (len > 0 && ti->path.ptr[len - 1] == '/')
+		git_buf_truncate(&ti->path, len - 1);
+
+	git_buf_rtruncate_at_char(&ti->path, '/');
+	ti->path_has_filename = false;
+}
+
 static void tree_iterator__pop_frame(tree_iterator *ti)
 {
 	tree_iterator_frame *tf = ti->stack;
@@ -187,7 +209,8 @@ static tree_iterator_frame *tree_iterator__alloc_frame(
 	return tf;
 }
 
-static int tree_iterator__expand_tree(tree_iterator *ti)
+/* Descend into the subtree at the current entry */
+static int tree_iterator__push_frame(tree_iterator *ti)
 {
 	int error;
 	git_tree *subtree;
@@ -195,35 +218,50 @@ static int tree_iterator__expand_tree(tree_iterator *ti)
 	tree_iterator_frame *tf;
 	char *relpath;
 
-	while (te != NULL && git_tree_entry__is_tree(te)) {
-		if (git_buf_joinpath(&ti->path, ti->path.ptr, te->filename) < 0)
-			return -1;
+	if (git_buf_joinpath(&ti->path, ti->path.ptr, te->filename) < 0)
+		return -1;
 
-		/* check that we have not passed the range end */
-		if (ti->base.end != NULL &&
-			git__prefixcmp(ti->path.ptr, ti->base.end) > 0)
-			return tree_iterator__to_end(ti);
+	/* check that we have not passed the range end */
+	if (ti->base.end != NULL &&
+		git__prefixcmp(ti->path.ptr, ti->base.end) > 0)
+		return tree_iterator__to_end(ti);
 
-		if ((error = git_tree_lookup(&subtree, ti->repo, &te->oid)) < 0)
-			return error;
+	if ((error = git_tree_lookup(&subtree, ti->repo, &te->oid)) < 0)
+		return error;
 
-		relpath = NULL;
+	relpath = NULL;
 
-		/* apply range start to new frame if relevant */
-		if (ti->stack->start &&
-			git__prefixcmp(ti->stack->start, te->filename) == 0)
-		{
-			size_t namelen = strlen(te->filename);
-			if (ti->stack->start[namelen] == '/')
-				relpath = ti->stack->start + namelen + 1;
-		}
+	/* apply range start to new frame if relevant */
+	if (ti->stack->start &&
+		git__prefixcmp(ti->stack->start, te->filename) == 0)
+	{
+		size_t namelen = strlen(te->filename);
+		if (ti->stack->start[namelen] == '/')
+			relpath = ti->stack->start + namelen + 1;
+	}
 
-		if ((tf = tree_iterator__alloc_frame(subtree, relpath)) == NULL)
-			return -1;
+	if ((tf = tree_iterator__alloc_frame(subtree, relpath)) == NULL)
+		return -1;
+
+	tf->next  = ti->stack;
+	ti->stack = tf;
+	tf->next->prev = tf;
+
+	return 0;
+}
+
+static int tree_iterator__expand_tree(tree_iterator *ti)
+{
+	int error;
+	const git_tree_entry *te = tree_iterator__tree_entry(ti);
+
+	/* subtrees are only gone into when asked if they are included */
+	if (ti->include_trees)
+		return 0;
 
-		tf->next  = ti->stack;
-		ti->stack = tf;
-		tf->next->prev = tf;
+	while (te != NULL && git_tree_entry__is_tree(te)) {
+		if ((error = tree_iterator__push_frame(ti)) < 0)
+			return error;
 
 		te = tree_iterator__tree_entry(ti);
 	}
@@ -241,10 +279,7 @@ static int tree_iterator__advance(
 	if (entry != NULL)
 		*entry = NULL;
 
-	if (ti->path_has_filename) {
-		git_buf_rtruncate_at_char(&ti->path, '/');
-		ti->path_has_filename = false;
-	}
+	tree_iterator__drop_filename(ti);
 
 	while (ti->stack != NULL) {
 		te = git_tree_entry_byindex(ti->stack->tree, ++ti->stack->index);
@@ -299,12 +334,30 @@ static int tree_iterator__reset(git_iterator *self)
 	return tree_iterator__expand_tree(ti);
 }
 
-int git_iterator_for_tree_range(
+static int tree_iterator__advance_into_subtree(
+	tree_iterator *ti, const git_index_entry **entry)
+{
+	int error;
+
+	tree_iterator__drop_filename(ti);
+
+	if ((error = tree_iterator__push_frame(ti)) < 0)
+		return error;
+
+	/* an empty subtree (or one out of range) is just skipped */
+	if (tree_iterator__tree_entry(ti) == NULL)
+		return tree_iterator__advance((git_iterator *)ti, entry);
+
+	return tree_iterator__current((git_iterator *)ti, entry);
+}
+
+static int tree_iterator__create(
 	git_iterator **iter,
 	git_repository *repo,
 	git_tree *tree,
 	const char *start,
-	const char *end)
+	const char *end,
+	bool include_trees)
 {
 	int error;
 	tree_iterator *ti;
@@ -315,6 +368,7 @@ int git_iterator_for_tree_range(
 	ITERATOR_BASE_INIT(ti, tree, TREE);
 
 	ti->repo  = repo;
+	ti->include_trees = include_trees;
 	ti->stack = ti->tail = tree_iterator__alloc_frame(tree, ti->base.start);
 
 	if ((error = tree_iterator__expand_tree(ti)) < 0)
@@ -325,6 +379,26 @@ int git_iterator_for_tree_range(
 	return error;
 }
 
+int git_iterator_for_tree_range(
+	git_iterator **iter,
+	git_repository *repo,
+	git_tree *tree,
+	const char *start,
+	const char *end)
+{
+	return tree_iterator__create(iter, repo, tree, start, end, false);
+}
+
+int git_iterator_for_tree_range_with_subtrees(
+	git_iterator **iter,
+	git_repository *repo,
+	git_tree *tree,
+	const char *start,
+	const char *end)
+{
+	return tree_iterator__create(iter, repo, tree, start, end, true);
+}
+
 
 typedef struct {
 	git_iterator base;
@@ -420,8 +494,59 @@ struct workdir_iterator_frame {
 	git_vector entries;
 	unsigned int index;
 	char *start;
+
+	/* listed from the untracked cache, or to be recorded in it */
+	unsigned int cached:1;
+	git_untracked_dir *untracked;
+	git_untracked_stat untracked_st;
 };
 
+#ifdef GIT_THREADS
+
+/*
+ * Directories are read ahead of time by this many threads; the work is
+ * mostly waiting on the filesystem, so it needn't match the CPUs.
+ */
+#define WORKDIR_PREFETCH_THREADS 4
+
+/* The most directories which may be read but not yet asked for */
+#define WORKDIR_PREFETCH_MAX 64
+
+enum {
+	PREFETCH_QUEUED,
+	PREFETCH_RUNNING,
+	PREFETCH_DONE
+};
+
+typedef struct workdir_prefetch_job workdir_prefetch_job;
+struct workdir_prefetch_job {
+	workdir_prefetch_job *next; /* in the queue */
+	git_vector entries;
+	int state;
+	int error;
+	char path[GIT_FLEX_ARRAY];
+};
+
+/*
+ * Reads the subdirectories which the iterator is going to descend into
+ * on a few threads, with git_path_dirload_with_stat() just like the
+ * iterator would; the iterator sorts what it gets back itself, so the
+ * order of iteration doesn't depend on who read a directory.
+ */
+typedef struct {
+	git_mutex lock;
+	git_cond wake; /* there's work, or it's time to stop */
+	git_cond done; /* a job was finished */
+	workdir_prefetch_job *queue;
+	git_vector jobs; /* every job which wasn't taken yet */
+	size_t prefix_len;
+	int shutdown;
+	size_t nr_threads;
+	git_thread threads[WORKDIR_PREFETCH_THREADS];
+} workdir_prefetch;
+
+#endif
+
 typedef struct {
 	git_iterator base;
 	git_repository *repo;
@@ -431,6 +556,13 @@ typedef struct {
 	git_index_entry entry;
 	git_buf path;
 	int is_ignored;
+	git_index *index;
+	git_untracked_cache *untracked;
+#ifdef GIT_THREADS
+	workdir_prefetch *prefetch;
+	size_t prefetched; /* directories which were read ahead */
+	unsigned int no_prefetch:1;
+#endif
 } workdir_iterator;
 
 static int git_path_with_stat_cmp_case(const void *a, const void *b)
@@ -463,15 +595,294 @@ static workdir_iterator_frame *workdir_iterator__alloc_frame(workdir_iterator *w
 	return wf;
 }
 
+static void workdir_iterator__free_entries(git_vector *entries);
+
 static void workdir_iterator__free_frame(workdir_iterator_frame *wf)
+{
+	workdir_iterator__free_entries(&wf->entries);
+	git__free(wf);
+}
+
+static void workdir_iterator__free_entries(git_vector *entries)
 {
 	unsigned int i;
-	git_path_with_stat *path;
+	git_path_with_stat *ps;
 
-	git_vector_foreach(&wf->entries, i, path)
-		git__free(path);
-	git_vector_free(&wf->entries);
-	git__free(wf);
+	git_vector_foreach(entries, i, ps)
+		git__free(ps);
+	git_vector_free(entries);
+}
+
+#ifdef GIT_THREADS
+
+static void workdir_prefetch__free_job(workdir_prefetch_job *job)
+{
+	workdir_iterator__free_entries(&job->entries);
+	git__free(job);
+}
+
+static void *workdir_prefetch__run(void *data)
+{
+	workdir_prefetch *pf = data;
+	workdir_prefetch_job *job;
+	int error;
+
+	git_mutex_lock(&pf->lock);
+
+	for (;;) {
+		while (!pf->shutdown && pf->queue == NULL)
+			git_cond_wait(&pf->wake, &pf->lock);
+
+		if (pf->shutdown)
+			break;
+
+		job = pf->queue;
+		pf->queue = job->next;
+		job->state = PREFETCH_RUNNING;
+
+		git_mutex_unlock(&pf->lock);
+		error = git_path_dirload_with_stat(job->path, pf->prefix_len, &job->entries);
+		git_mutex_lock(&pf->lock);
+
+		job->error = error;
+		job->state = PREFETCH_DONE;
+		git_cond_signal(&pf->done);
+	}
+
+	/* pass the news on to the next thread */
+	git_cond_signal(&pf->wake);
+	git_mutex_unlock(&pf->lock);
+
+	return NULL;
+}
+
+static int workdir_prefetch__new(workdir_prefetch **out, size_t prefix_len)
+{
+	workdir_prefetch *pf = git__calloc(1, sizeof(workdir_prefetch));
+	GITERR_CHECK_ALLOC(pf);
+
+	if (git_vector_init(&pf->jobs, WORKDIR_PREFETCH_MAX, NULL) < 0) {
+		git__free(pf);
+		return -1;
+	}
+
+	git_mutex_init(&pf->lock);
+	git_cond_init(&pf->wake);
+	git_cond_init(&pf->done);
+	pf->prefix_len = prefix_len;
+
+	for (pf->nr_threads = 0; pf->nr_threads < WORKDIR_PREFETCH_THREADS; pf->nr_threads++) {
+		if (git_thread_create(
+				&pf->threads[pf->nr_threads], NULL, workdir_prefetch__run, pf) != 0)
+			break;
+	}
+
+	*out = pf;
+	return pf->nr_threads > 0 ? 0 : -1;
+}
+
+static void workdir_prefetch__free(workdir_prefetch *pf)
+{
+	unsigned int i;
+	workdir_prefetch_job *job;
+
+	if (pf == NULL)
+		return;
+
+	git_mutex_lock(&pf->lock);
+	pf->shutdown = 1;
+	git_cond_signal(&pf->wake);
+	git_mutex_unlock(&pf->lock);
+
+	for (i = 0; i < pf->nr_threads; ++i)
+		git_thread_join(pf->threads[i], NULL);
+
+	git_vector_foreach(&pf->jobs, i, job)
+		workdir_prefetch__free_job(job);
+	git_vector_free(&pf->jobs);
+
+	git_cond_free(&pf->wake);
+	git_cond_free(&pf->done);
+	git_mutex_free(&pf->lock);
+	git__free(pf);
+}
+
+/*
+ * Whether the iterator will go into the directory `ps`, that is whether
+ * it has something in the index; -1 when the iterator won't get as far
+ * as `ps`, and so won't get to anything after it either.
+ */
+static int workdir_prefetch__wanted(workdir_iterator *wi, git_path_with_stat *ps)
+{
+	git_index_entry *entry;
+	unsigned int pos;
+
+	if (wi->base.end &&
+		ITERATOR_PREFIXCMP(wi->base, ps->path, wi->base.end) > 0)
+		return -1;
+
+	/* the slash after a directory's name isn't in `path_len` */
+	if (!S_ISDIR(ps->st.st_mode) ||
+		STRCMP_CASESELECT(wi->base.ignore_case, ps->path, DOT_GIT "/") == 0)
+		return 0;
+
+	pos = git_index__prefix_position(wi->index, ps->path);
+	entry = git_index_get_byindex(wi->index, pos);
+
+	return (entry != NULL && ITERATOR_PREFIXCMP(wi->base, entry->path, ps->path) == 0);
+}
+
+/*
+ * Queue up the subdirectories of the directory in `wi->path` which the
+ * iterator will go into. They're put at the front of the queue, so
+ * directories get read in about the same order as they're iterated over.
+ */
+static void workdir_prefetch__add(workdir_iterator *wi, workdir_iterator_frame *wf)
+{
+	workdir_prefetch *pf = wi->prefetch;
+	workdir_prefetch_job *job, **tail;
+	git_path_with_stat *ps;
+	size_t i;
+	int wanted;
+
+	git_mutex_lock(&pf->lock);
+
+	/* new jobs go in order, ahead of the ones already queued */
+	tail = &pf->queue;
+
+	for (i = wf->index; i < wf->entries.length && pf->jobs.length < WORKDIR_PREFETCH_MAX; ++i) {
+		ps = wf->entries.contents[i];
+
+		if ((wanted = workdir_prefetch__wanted(wi, ps)) < 0)
+			break;
+		if (!wanted)
+			continue;
+
+		/* the entries go to a frame as they are, so they sort like one */
+		job = git__calloc(1, sizeof(workdir_prefetch_job) + wi->root_len + ps->path_len + 1);
+		if (job == NULL ||
+			git_vector_init(&job->entries, 0, CASESELECT(wi->base.ignore_case,
+				git_path_with_stat_cmp_icase, git_path_with_stat_cmp_case)) < 0 ||
+			git_vector_insert(&pf->jobs, job) < 0) {
+			/* it'll just get read when it's needed */
+			if (job != NULL)
+				git_vector_free(&job->entries);
+			git__free(job);
+			giterr_clear();
+			break;
+		}
+
+		memcpy(job->path, wi->path.ptr, wi->root_len);
+		memcpy(job->path + wi->root_len, ps->path, ps->path_len);
+		job->state = PREFETCH_QUEUED;
+
+		job->next = *tail;
+		*tail = job;
+		tail = &job->next;
+
+		git_cond_signal(&pf->wake);
+	}
+
+	git_mutex_unlock(&pf->lock);
+}
+
+/*
+ * Take the contents of the directory in `wi->path` if they were read
+ * ahead of time, waiting for them if they're being read right now.
+ * Returns GIT_ENOTFOUND if the directory has to be read after all.
+ */
+static int workdir_prefetch__take(workdir_iterator *wi, git_vector *entries)
+{
+	workdir_prefetch *pf = wi->prefetch;
+	workdir_prefetch_job *job = NULL, **link;
+	size_t i;
+	int error = GIT_ENOTFOUND;
+
+	git_mutex_lock(&pf->lock);
+
+	for (i = 0; i < pf->jobs.length; ++i) {
+		job = pf->jobs.contents[i];
+		if (strcmp(job->path, wi->path.ptr) == 0)
+			break;
+	}
+
+	if (i == pf->jobs.length) {
+		git_mutex_unlock(&pf->lock);
+		return GIT_ENOTFOUND;
+	}
+
+	git_vector_remove(&pf->jobs, i);
+
+	if (job->state == PREFETCH_QUEUED) {
+		for (link = &pf->queue; *link != job; link = &(*link)->next)
+			/* find it */;
+		*link = job->next;
+	}
+
+	while (job->state == PREFETCH_RUNNING)
+		git_cond_wait(&pf->done, &pf->lock);
+
+	git_mutex_unlock(&pf->lock);
+
+	/* failures get repeated here, so the error is reported properly */
+	if (job->state == PREFETCH_DONE && job->error == 0) {
+		git_vector_swap(entries, &job->entries);
+		error = 0;
+	}
+
+	workdir_prefetch__free_job(job);
+	return error;
+}
+
+static void workdir_iterator__prefetch(workdir_iterator *wi, workdir_iterator_frame *wf)
+{
+	size_t i, wanted = 0;
+	int want;
+
+	if (wi->no_prefetch)
+		return;
+
+	if (wi->prefetch == NULL) {
+		/* the threads only pay off when there's more than one directory */
+		for (i = wf->index; i < wf->entries.length && wanted < 2; ++i) {
+			if ((want = workdir_prefetch__wanted(wi, wf->entries.contents[i])) < 0)
+				break;
+			wanted += want;
+		}
+
+		if (wanted < 2)
+			return;
+
+		if (workdir_prefetch__new(&wi->prefetch, wi->root_len) < 0) {
+			/* no threads, so read everything as we go */
+			workdir_prefetch__free(wi->prefetch);
+			wi->prefetch = NULL;
+			wi->no_prefetch = 1;
+			giterr_clear();
+			return;
+		}
+	}
+
+	workdir_prefetch__add(wi, wf);
+}
+
+#endif
+
+/* Read the directory in `wi->path` into `wf`, unless it was read already */
+static int workdir_iterator__dirload(workdir_iterator *wi, workdir_iterator_frame *wf)
+{
+#ifdef GIT_THREADS
+	int error;
+
+	if (wi->prefetch != NULL &&
+		(error = workdir_prefetch__take(wi, &wf->entries)) != GIT_ENOTFOUND) {
+		if (!error)
+			wi->prefetched++;
+		return error;
+	}
+#endif
+
+	return git_path_dirload_with_stat(wi->path.ptr, wi->root_len, &wf->entries);
 }
 
 static int workdir_iterator__update_entry(workdir_iterator *wi);
@@ -488,13 +899,292 @@ static int workdir_iterator__entry_cmp_icase(const void *prefix, const void *ite
 	return git__prefixcmp_icase((const char *)prefix, ps->path);
 }
 
+/* What we'd get from lstat() on an entry which hasn't changed */
+static void workdir_iterator__stat_from_entry(
+	struct stat *st, const git_index_entry *entry)
+{
+	memset(st, 0x0, sizeof(struct stat));
+
+	st->st_mode = entry->mode;
+	st->st_size = entry->file_size;
+	st->st_mtime = (time_t)entry->mtime.seconds;
+	st->st_ctime = (time_t)entry->ctime.seconds;
+	st->st_dev = entry->dev;
+	st->st_ino = entry->ino;
+	st->st_uid = entry->uid;
+	st->st_gid = entry->gid;
+}
+
+static int workdir_iterator__load_cached_entry(
+	workdir_iterator *wi,
+	workdir_iterator_frame *wf,
+	const char *path,
+	size_t path_len,
+	const git_index_entry *entry)
+{
+	git_path_with_stat *ps;
+
+	git_buf_truncate(&wi->path, wi->root_len);
+
+	/* directories have a trailing slash */
+	if (path[path_len - 1] == '/')
+		path_len--;
+
+	if (git_buf_put(&wi->path, path, path_len) < 0)
+		return -1;
+
+	ps = git__malloc(sizeof(git_path_with_stat) + path_len + 2);
+	GITERR_CHECK_ALLOC(ps);
+
+	/* the filesystem monitor vouches for files it didn't report */
+	if (entry != NULL && (S_ISREG(entry->mode) || S_ISLNK(entry->mode)) &&
+		git_index__fsmonitor_valid(wi->index, entry))
+		workdir_iterator__stat_from_entry(&ps->st, entry);
+
+	else if (git_path_lstat(wi->path.ptr, &ps->st) < 0) {
+		/* it's gone, just like it wouldn't be in the directory */
+		git__free(ps);
+		giterr_clear();
+		return 0;
+	}
+
+	memcpy(ps->path, path, path_len);
+	if (S_ISDIR(ps->st.st_mode))
+		ps->path[path_len++] = '/';
+	ps->path[path_len] = '\0';
+	ps->path_len = path_len;
+
+	if (git_vector_insert(&wf->entries, ps) < 0) {
+		git__free(ps);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * List a directory which hasn't changed: whatever the index has in it,
+ * and the untracked files which were there the last time we looked.
+ */
+static int workdir_iterator__load_cached(
+	workdir_iterator *wi, workdir_iterator_frame *wf, const char *dir)
+{
+	git_buf dir_path = GIT_BUF_INIT;
+	git_index_entry *entry;
+	const char *name, *slash, *last = NULL;
+	size_t dir_len, name_len, last_len = 0;
+	unsigned int pos, i;
+	git_path_with_stat *ps, *prev = NULL;
+	int error = 0;
+
+	/* the directory name lives in wi->path, which gets reused */
+	if (git_buf_sets(&dir_path, dir) < 0)
+		return -1;
+
+	dir_len = dir_path.size;
+	pos = git_index__prefix_position(wi->index, dir_path.ptr);
+
+	for (; (entry = git_index_get_byindex(wi->index, pos)) != NULL; ++pos) {
+		if (git__prefixcmp(entry->path, dir_path.ptr) != 0)
+			break;
+
+		/* just the directory's own children */
+		name = entry->path + dir_len;
+		slash = strchr(name, '/');
+		name_len = slash ? (size_t)(slash - name) + 1 : strlen(name);
+
+		if (last != NULL && name_len == last_len && !memcmp(name, last, name_len))
+			continue;
+
+		last = name;
+		last_len = name_len;
+
+		if ((error = workdir_iterator__load_cached_entry(wi, wf,
+				entry->path, dir_len + name_len, slash ? NULL : entry)) < 0)
+			goto done;
+	}
+
+	git_vector_foreach(&wf->untracked->untracked, i, name) {
+		git_buf_truncate(&dir_path, dir_len);
+
+		if ((error = git_buf_puts(&dir_path, name)) < 0 ||
+			(error = workdir_iterator__load_cached_entry(
+				wi, wf, dir_path.ptr, dir_path.size, NULL)) < 0)
+			goto done;
+	}
+
+	/* files which were added since the listing show up twice */
+	git_vector_sort(&wf->entries);
+
+	for (i = 0; i < wf->entries.length; ) {
+		ps = wf->entries.contents[i];
+
+		if (prev != NULL && strcmp(prev->path, ps->path) == 0) {
+			git_vector_remove(&wf->entries, i);
+			git__free(ps);
+		} else {
+			prev = ps;
+			i++;
+		}
+	}
+
+done:
+	/* put back the directory's own path, which has no trailing slash */
+	git_buf_truncate(&wi->path, wi->root_len);
+	if (git_buf_put(&wi->path, dir_path.ptr, dir_len ? dir_len - 1 : 0) < 0)
+		error = -1;
+
+	git_buf_free(&dir_path);
+	return error;
+}
+
+/*
+ * Use the listing in the untracked cache if the directory and its
+ * .gitignore haven't changed since it was made, otherwise remember what
+ * the listing has to be made for.  When there's a filesystem monitor,
+ * any change would already have thrown the listing out.
+ */
+static int workdir_iterator__load_untracked(
+	workdir_iterator *wi, workdir_iterator_frame *wf)
+{
+	git_untracked_dir *udir;
+	git_buf dir = GIT_BUF_INIT, ignore_path = GIT_BUF_INIT;
+	git_oid exclude_oid;
+	struct stat st;
+	int error;
+
+	/* the cache knows directories by their path with a trailing slash */
+	if ((error = git_buf_sets(&dir, wi->path.ptr + wi->root_len)) < 0 ||
+		(dir.size > 0 && (error = git_path_to_dir(&dir)) < 0) ||
+		(error = git_untracked_cache_lookup(&udir, wi->untracked, dir.ptr)) < 0)
+		goto done;
+
+	wf->untracked = udir;
+
+	if (udir->valid && wi->index->fsmonitor_ready) {
+		wf->cached = 1;
+		error = workdir_iterator__load_cached(wi, wf, dir.ptr);
+		goto done;
+	}
+
+	if (p_stat(wi->path.ptr, &st) < 0) {
+		wf->untracked = NULL;
+		error = workdir_iterator__dirload(wi, wf);
+		goto done;
+	}
+
+	git_untracked_stat_init(&wf->untracked_st, &st);
+
+	memset(&exclude_oid, 0x0, sizeof(git_oid));
+
+	if ((error = git_buf_joinpath(&ignore_path, wi->path.ptr, GIT_IGNORE_FILE)) < 0 ||
+		(git_path_isfile(ignore_path.ptr) &&
+		 (error = git_odb_hashfile(&exclude_oid, ignore_path.ptr, GIT_OBJ_BLOB)) < 0))
+		goto done;
+
+	/* new ignore rules here could change anything below */
+	if (git_oid_cmp(&udir->exclude_oid, &exclude_oid) != 0) {
+		git_untracked_dir_invalidate(udir);
+		git_oid_cpy(&udir->exclude_oid, &exclude_oid);
+		wi->untracked->dirty = 1;
+	}
+
+	if (udir->valid &&
+		git_untracked_stat_equal(&udir->st, &wf->untracked_st) &&
+		!git_index__is_racy_time(wi->index, &udir->st.mtime)) {
+		wf->cached = 1;
+		error = workdir_iterator__load_cached(wi, wf, dir.ptr);
+	} else
+		error = workdir_iterator__dirload(wi, wf);
+
+done:
+	git_buf_free(&dir);
+	git_buf_free(&ignore_path);
+	return error;
+}
+
+static bool workdir_iterator__is_tracked(workdir_iterator *wi, git_path_with_stat *ps)
+{
+	git_index_entry *entry;
+	bool tracked;
+
+	if (!S_ISDIR(ps->st.st_mode))
+		return (git_index_find(wi->index, ps->path) >= 0);
+
+	/* a directory is tracked if there's anything in it, or a submodule;
+	 * its path has a slash after `path_len` */
+	entry = git_index_get_byindex(
+		wi->index, git_index__prefix_position(wi->index, ps->path));
+	if (entry != NULL && git__prefixcmp(entry->path, ps->path) == 0)
+		return true;
+
+	ps->path[ps->path_len] = '\0';
+	tracked = (git_index_find(wi->index, ps->path) >= 0);
+	ps->path[ps->path_len] = '/';
+
+	return tracked;
+}
+
+/* Record which names in a directory we just read are untracked */
+static int workdir_iterator__update_untracked(
+	workdir_iterator *wi, workdir_iterator_frame *wf)
+{
+	git_vector untracked = GIT_VECTOR_INIT;
+	git_path_with_stat *ps;
+	size_t dir_len = wi->path.size - wi->root_len;
+	unsigned int i;
+	int ignored;
+	char *name;
+
+	/* skip the directory's path and the slash after it */
+	if (dir_len > 0)
+		dir_len++;
+
+	git_vector_foreach(&wf->entries, i, ps) {
+		name = ps->path + dir_len;
+
+		if (strcmp(name, DOT_GIT "/") == 0 || strcmp(name, DOT_GIT) == 0 ||
+			git_futils_canonical_mode(ps->st.st_mode) == 0 ||
+			workdir_iterator__is_tracked(wi, ps))
+			continue;
+
+		if (git_ignore__lookup(&wi->ignores, ps->path, &ignored) < 0)
+			goto on_error;
+
+		if (ignored)
+			continue;
+
+		if ((name = git__strdup(name)) == NULL ||
+			git_vector_insert(&untracked, name) < 0) {
+			git__free(name);
+			goto on_error;
+		}
+	}
+
+	git_untracked_dir_update(wf->untracked, &wf->untracked_st, &untracked);
+	wi->untracked->dirty = 1;
+
+	git_vector_free(&untracked);
+	return 0;
+
+on_error:
+	git_vector_foreach(&untracked, i, name)
+		git__free(name);
+	git_vector_free(&untracked);
+	return -1;
+}
+
 static int workdir_iterator__expand_dir(workdir_iterator *wi)
 {
 	int error;
 	workdir_iterator_frame *wf = workdir_iterator__alloc_frame(wi);
 	GITERR_CHECK_ALLOC(wf);
 
-	error = git_path_dirload_with_stat(wi->path.ptr, wi->root_len, &wf->entries);
+	if (wi->untracked != NULL)
+		error = workdir_iterator__load_untracked(wi, wf);
+	else
+		error = workdir_iterator__dirload(wi, wf);
+
 	if (error < 0 || wf->entries.length == 0) {
 		workdir_iterator__free_frame(wf);
 		return GIT_ENOTFOUND;
@@ -515,6 +1205,12 @@ static int workdir_iterator__expand_dir(workdir_iterator *wi)
 			CASESELECT(wi->base.ignore_case, workdir_iterator__entry_cmp_icase, workdir_iterator__entry_cmp_case),
 			wf->start);
 
+#ifdef GIT_THREADS
+	/* with the untracked cache, most directories don't get read at all */
+	if (wi->untracked == NULL)
+		workdir_iterator__prefetch(wi, wf);
+#endif
+
 	wf->next  = wi->stack;
 	wi->stack = wf;
 
@@ -524,6 +1220,10 @@ static int workdir_iterator__expand_dir(workdir_iterator *wi)
 		(void)git_ignore__push_dir(&wi->ignores, &wi->path.ptr[slash_pos + 1]);
 	}
 
+	if (wf->untracked != NULL && !wf->cached &&
+		workdir_iterator__update_untracked(wi, wf) < 0)
+		return -1;
+
 	return workdir_iterator__update_entry(wi);
 }
 
@@ -618,8 +1318,13 @@ static void workdir_iterator__free(git_iterator *self)
 		workdir_iterator__free_frame(wf);
 	}
 
+#ifdef GIT_THREADS
+	workdir_prefetch__free(wi->prefetch);
+#endif
+
 	git_ignore__free(&wi->ignores);
 	git_buf_free(&wi->path);
+	git_index_free(wi->index);
 }
 
 static int workdir_iterator__update_entry(workdir_iterator *wi)
@@ -658,8 +1363,14 @@ static int workdir_iterator__update_entry(workdir_iterator *wi)
 	if (wi->entry.mode == 0)
 		return 0;
 
+	/* files listed from the untracked cache aren't ignored, and it
+	 * doesn't matter whether the tracked ones are
+	 */
+	if (wi->stack->cached && !S_ISDIR(wi->entry.mode))
+		wi->is_ignored = 0;
+
 	/* okay, we are far enough along to look up real ignore rule */
-	if (git_ignore__lookup(&wi->ignores, wi->entry.path, &wi->is_ignored) < 0)
+	else if (git_ignore__lookup(&wi->ignores, wi->entry.path, &wi->is_ignored) < 0)
 		return 0; /* if error, ignore it and ignore file */
 
 	/* detect submodules */
@@ -681,15 +1392,43 @@ static int workdir_iterator__update_entry(workdir_iterator *wi)
 	return 0;
 }
 
-int git_iterator_for_workdir_range(
+static int workdir_iterator__use_untracked_cache(workdir_iterator *wi)
+{
+	const char *workdir = git_repository_workdir(wi->repo);
+	git_index *index = wi->index;
+
+	/* rules added at runtime aren't part of what the cache records */
+	if (!index->untracked_cache || index->ignore_case ||
+		wi->ignores.ign_internal->rules.length > 0)
+		return 0;
+
+	if (index->untracked != NULL &&
+		!git_untracked_cache_matches(index->untracked, workdir)) {
+		git_untracked_cache_free(index->untracked);
+		index->untracked = NULL;
+	}
+
+	if (index->untracked == NULL &&
+		git_untracked_cache_new(&index->untracked, workdir) < 0)
+		return -1;
+
+	if (git_untracked_cache_check_excludes(index->untracked, wi->repo) < 0)
+		return -1;
+
+	wi->untracked = index->untracked;
+
+	return 0;
+}
+
+static int workdir_iterator__create(
 	git_iterator **iter,
 	git_repository *repo,
 	const char *start,
-	const char *end)
+	const char *end,
+	bool use_untracked_cache)
 {
 	int error;
 	workdir_iterator *wi;
-	git_index *index;
 
 	assert(iter && repo);
 
@@ -700,27 +1439,34 @@ int git_iterator_for_workdir_range(
 
 	wi->repo = repo;
 
-	if ((error = git_repository_index(&index, repo)) < 0) {
+	if ((error = git_repository_index(&wi->index, repo)) < 0) {
 		git__free(wi);
 		return error;
 	}
 
 	/* Set the ignore_case flag for the workdir iterator to match
 	 * that of the index. */
-	wi->base.ignore_case = index->ignore_case;
-
-	git_index_free(index);
+	wi->base.ignore_case = wi->index->ignore_case;
 
 	if (git_buf_sets(&wi->path, git_repository_workdir(repo)) < 0 ||
 		git_path_to_dir(&wi->path) < 0 ||
 		git_ignore__for_path(repo, "", &wi->ignores) < 0)
 	{
+		git_index_free(wi->index);
 		git__free(wi);
 		return -1;
 	}
 
 	wi->root_len = wi->path.size;
 
+	/* anything the filesystem monitor vouched for before may have changed */
+	if ((error = git_index__fsmonitor_refresh(wi->index)) < 0 ||
+		(use_untracked_cache &&
+		 (error = workdir_iterator__use_untracked_cache(wi)) < 0)) {
+		git_iterator_free((git_iterator *)wi);
+		return error;
+	}
+
 	if ((error = workdir_iterator__expand_dir(wi)) < 0) {
 		if (error == GIT_ENOTFOUND)
 			error = 0;
@@ -735,6 +1481,24 @@ int git_iterator_for_workdir_range(
 	return error;
 }
 
+int git_iterator_for_workdir_range(
+	git_iterator **iter,
+	git_repository *repo,
+	const char *start,
+	const char *end)
+{
+	return workdir_iterator__create(iter, repo, start, end, false);
+}
+
+int git_iterator_for_workdir_untracked(
+	git_iterator **iter,
+	git_repository *repo,
+	const char *start,
+	const char *end)
+{
+	return workdir_iterator__create(iter, repo, start, end, true);
+}
+
 typedef struct {
 	git_iterator base;
 	git_iterator *wrapped;
@@ -906,6 +1670,15 @@ notfound:
 	return 0;
 }
 
+git_index *git_iterator_get_index(git_iterator *iter)
+{
+	if (iter->type == GIT_ITERATOR_SPOOLANDSORT)
+		iter = ((spoolandsort_iterator *)iter)->wrapped;
+
+	return (iter->type != GIT_ITERATOR_INDEX) ? NULL :
+		((index_iterator *)iter)->index;
+}
+
 int git_iterator_current_is_ignored(git_iterator *iter)
 {
 	return (iter->type != GIT_ITERATOR_WORKDIR) ? 0 :
@@ -917,6 +1690,14 @@ int git_iterator_advance_into_directory(
 {
 	workdir_iterator *wi = (workdir_iterator *)iter;
 
+	if (iter->type == GIT_ITERATOR_TREE) {
+		tree_iterator *ti = (tree_iterator *)iter;
+		const git_tree_entry *te = tree_iterator__tree_entry(ti);
+
+		if (ti->include_trees && te != NULL && git_tree_entry__is_tree(te))
+			return tree_iterator__advance_into_subtree(ti, entry);
+	}
+
 	if (iter->type == GIT_ITERATOR_WORKDIR &&
 		wi->entry.path &&
 		S_ISDIR(wi->entry.mode) &&
@@ -959,3 +1740,26 @@ int git_iterator_current_workdir_path(git_iterator *iter, git_buf **path)
 	return 0;
 }
 
+
+void git_iterator__workdir_prefetched(
+	git_iterator *iter, size_t *threads, size_t *prefetched, size_t *pending)
+{
+	*threads = *prefetched = *pending = 0;
+
+#ifdef GIT_THREADS
+	if (iter->type == GIT_ITERATOR_WORKDIR) {
+		workdir_iterator *wi = (workdir_iterator *)iter;
+		workdir_prefetch *pf = wi->prefetch;
+
+		*prefetched = wi->prefetched;
+		if (pf != NULL) {
+			git_mutex_lock(&pf->lock);
+			*threads = pf->nr_threads;
+			*pending = pf->jobs.length;
+			git_mutex_unlock(&pf->lock);
+		}
+	}
+#else
+	GIT_UNUSED(iter);
+#endif
+}
@@ -51,6 +51,16 @@ GIT_INLINE(int) git_iterator_for_tree(
 	return git_iterator_for_tree_range(iter, repo, tree, NULL, NULL);
 }
 
+/*
+ * Like git_iterator_for_tree_range, but subtrees are not gone into on
+ * their own.  Each one shows up as an entry with its tree oid and a
+ * trailing slash on the path, and git_iterator_advance_into_directory
+ * goes into it; advancing past it skips it without loading it.
+ */
+extern int git_iterator_for_tree_range_with_subtrees(
+	git_iterator **iter, git_repository *repo, git_tree *tree,
+	const char *start, const char *end);
+
 extern int git_iterator_for_index_range(
 	git_iterator **iter, git_repository *repo,
 	const char *start, const char *end);
@@ -61,6 +71,7 @@ GIT_INLINE(int) git_iterator_for_index(
 	return git_iterator_for_index_range(iter, repo, NULL, NULL);
 }
 
+/* The index's filesystem monitor, if any, is asked what changed first */
 extern int git_iterator_for_workdir_range(
 	git_iterator **iter, git_repository *repo,
 	const char *start, const char *end);
@@ -71,6 +82,16 @@ GIT_INLINE(int) git_iterator_for_workdir(
 	return git_iterator_for_workdir_range(iter, repo, NULL, NULL);
 }
 
+/*
+ * Like git_iterator_for_workdir_range, but when the index has an
+ * untracked cache, directories which haven't changed are listed from it
+ * instead of being read, and the cache is updated for the others.  The
+ * listings leave out ignored files which aren't tracked.
+ */
+extern int git_iterator_for_workdir_untracked(
+	git_iterator **iter, git_repository *repo,
+	const char *start, const char *end);
+
 extern int git_iterator_spoolandsort_range(
 	git_iterator **iter, git_iterator *towrap,
 	git_vector_cmp comparer, bool ignore_case,
@@ -147,6 +168,9 @@ extern int git_iterator_current_parent_tree(
 
 extern int git_iterator_current_is_ignored(git_iterator *iter);
 
+/* The index being iterated over, or NULL for other kinds of iterator */
+extern git_index *git_iterator_get_index(git_iterator *iter);
+
 /**
  * Iterate into a workdir directory.
  *
@@ -161,7 +185,10 @@ extern int git_iterator_current_is_ignored(git_iterator *iter);
  * regular advance and will skip past the directory, so you should be
  * prepared for that case.
  *
- * On non-workdir iterators or if not pointing at a directory, this is a
+ * Tree iterators made with git_iterator_for_tree_range_with_subtrees
+ * return subtrees the same way, and this goes into them too.
+ *
+ * On other iterators or if not pointing at a directory, this is a
  * no-op and will not advance the iterator.
  */
 extern int git_iterator_advance_into_directory(
@@ -177,4 +204,12 @@ extern int git_iterator_cmp(
 extern int git_iterator_current_workdir_path(
 	git_iterator *iter, git_buf **path);
 
+/*
+ * How many threads a workdir iterator has reading directories ahead of
+ * time, how many directories it got from them rather than reading them
+ * itself, and how many they were given which it didn't get to (yet).
+ */
+extern void git_iterator__workdir_prefetched(
+	git_iterator *iter, size_t *threads, size_t *prefetched, size_t *pending);
+
 #endif
@@ -12,6 +12,7 @@
 #include "iterator.h"
 #include "netops.h"
 #include "pack.h"
+#include "pool.h"
 #include "thread-utils.h"
 #include "tree.h"
 
@@ -20,6 +21,8 @@
 #include "git2/tag.h"
 #include "git2/indexer.h"
 #include "git2/config.h"
+#include "git2/refs.h"
+#include "git2/revwalk.h"
 
 GIT__USE_OIDMAP;
 
@@ -69,6 +72,38 @@ static unsigned name_hash(const char *name)
 	return hash;
 }
 
+int git_packbuilder_add_island(git_packbuilder *pb, const char *regex)
+{
+	regex_t *preg;
+	int error;
+
+	assert(pb && regex);
+
+	preg = git__malloc(sizeof(regex_t));
+	GITERR_CHECK_ALLOC(preg);
+
+	if ((error = regcomp(preg, regex, REG_EXTENDED)) != 0) {
+		giterr_set_regex(preg, error);
+		regfree(preg);
+		git__free(preg);
+		return -1;
+	}
+
+	if (git_vector_insert(&pb->island_regexes, preg) < 0) {
+		regfree(preg);
+		git__free(preg);
+		return -1;
+	}
+
+	pb->done = false;
+	return 0;
+}
+
+static int island_config_cb(const git_config_entry *entry, void *payload)
+{
+	return git_packbuilder_add_island(payload, entry->value);
+}
+
 static int packbuilder_config(git_packbuilder *pb)
 {
 	git_config *config;
@@ -94,6 +129,10 @@ static int packbuilder_config(git_packbuilder *pb)
 
 #undef config_get
 
+	if (git_config_get_multivar(config, "pack.island", NULL,
+				    island_config_cb, pb) < 0)
+		return -1;
+
 	return 0;
 }
 
@@ -324,8 +363,13 @@ static int write_object(git_buf *buf, git_packbuilder *pb, git_pobject *po)
 
 	git_hash_update(pb->ctx, data, size);
 
-	if (po->delta_data)
+	if (po->delta_data) {
+		/* it has been written out for good; give the memory back */
 		git__free(po->delta_data);
+		po->delta_data = NULL;
+		pb->delta_cache_size -= po->z_delta_size;
+		po->z_delta_size = 0;
+	}
 
 	git_odb_object_free(obj);
 	git_buf_free(&zbuf);
@@ -463,6 +507,9 @@ static git_pobject **compute_write_order(git_packbuilder *pb)
 
 	git_pobject **wo = git__malloc(sizeof(*wo) * pb->nr_objects);
 
+	if (wo == NULL)
+		return NULL;
+
 	for (i = 0; i < pb->nr_objects; i++) {
 		git_pobject *po = pb->object_list + i;
 		po->tagged = 0;
@@ -488,8 +535,10 @@ static git_pobject **compute_write_order(git_packbuilder *pb)
 	/*
 	 * Mark objects that are at the tip of tags.
 	 */
-	if (git_tag_foreach(pb->repo, &cb_tag_foreach, pb) < 0)
+	if (git_tag_foreach(pb->repo, &cb_tag_foreach, pb) < 0) {
+		git__free(wo);
 		return NULL;
+	}
 
 	/*
 	 * Give the objects in the original recency order until
@@ -544,6 +593,7 @@ static git_pobject **compute_write_order(git_packbuilder *pb)
 
 	if (wo_end != pb->nr_objects) {
 		giterr_set(GITERR_INVALID, "invalid write order");
+		git__free(wo);
 		return NULL;
 	}
 
@@ -679,6 +729,414 @@ static int delta_cacheable(git_packbuilder *pb, unsigned long src_size,
 	return 0;
 }
 
+/*
+ * Delta islands
+ *
+ * Each reference matching one of the island patterns puts everything
+ * reachable from it into an island; the objects being packed carry a
+ * bitmap of the islands they belong to.  A delta is only allowed when
+ * the base is in every island the target is in.
+ */
+
+#define ISLAND_MAX_GROUPS 8
+
+struct island_ref {
+	size_t island;
+	git_oid oid;
+};
+
+/*
+ * The islands which reach a commit or tree.  Everything is walked once,
+ * passing marks down from commits to their parents and trees, and from
+ * trees to what they contain; a tree is only gone into again when it
+ * turns out to be in an island it wasn't known to be in.
+ */
+struct island_marks {
+	git_oid oid;
+	uint32_t bits[GIT_FLEX_ARRAY];
+};
+
+struct island_walk {
+	git_packbuilder *pb;
+	git_oidmap *marks;
+	git_pool pool;
+};
+
+GIT_INLINE(uint32_t *) island_bits(git_packbuilder *pb, const git_pobject *po)
+{
+	return pb->island_marks + (po - pb->object_list) * pb->island_words;
+}
+
+static int in_same_island(git_packbuilder *pb,
+			  const git_pobject *trg, const git_pobject *src)
+{
+	const uint32_t *trg_bits, *src_bits;
+	size_t i;
+
+	if (!pb->island_marks)
+		return 1;
+
+	trg_bits = island_bits(pb, trg);
+	src_bits = island_bits(pb, src);
+
+	for (i = 0; i < pb->island_words; ++i)
+		if (trg_bits[i] & ~src_bits[i])
+			return 0;
+
+	return 1;
+}
+
+/* Put an object into islands, if it's one we're packing */
+static void island_mark(git_packbuilder *pb, const git_oid *oid,
+			const uint32_t *bits)
+{
+	khiter_t pos;
+	uint32_t *obj_bits;
+	size_t i;
+
+	pos = kh_get(oid, pb->object_ix, oid);
+	if (pos == kh_end(pb->object_ix))
+		return;
+
+	obj_bits = island_bits(pb, kh_value(pb->object_ix, pos));
+	for (i = 0; i < pb->island_words; ++i)
+		obj_bits[i] |= bits[i];
+}
+
+static struct island_marks *island_marks_get(struct island_walk *w,
+					     const git_oid *oid)
+{
+	struct island_marks *marks;
+	khiter_t pos;
+	int ret;
+
+	pos = kh_get(oid, w->marks, oid);
+	if (pos != kh_end(w->marks))
+		return kh_value(w->marks, pos);
+
+	marks = git_pool_mallocz(&w->pool, 1);
+	if (!marks)
+		return NULL;
+	git_oid_cpy(&marks->oid, oid);
+
+	pos = kh_put(oid, w->marks, &marks->oid, &ret);
+	if (ret < 0)
+		return NULL;
+	kh_value(w->marks, pos) = marks;
+
+	return marks;
+}
+
+/* Add islands to the marks, returning whether any of them are new */
+static int island_marks_add(struct island_walk *w,
+			    struct island_marks *marks, const uint32_t *bits)
+{
+	size_t i;
+	int added = 0;
+
+	for (i = 0; i < w->pb->island_words; ++i) {
+		if (bits[i] & ~marks->bits[i]) {
+			marks->bits[i] |= bits[i];
+			added = 1;
+		}
+	}
+
+	return added;
+}
+
+static int island_mark_tree(struct island_walk *w, const git_oid *oid,
+			    const uint32_t *bits)
+{
+	struct island_marks *marks;
+	git_tree *tree;
+	unsigned int i, n;
+	int error = 0;
+
+	if ((marks = island_marks_get(w, oid)) == NULL)
+		return -1;
+
+	if (!island_marks_add(w, marks, bits))
+		return 0;
+
+	island_mark(w->pb, oid, marks->bits);
+
+	if (git_tree_lookup(&tree, w->pb->repo, oid) < 0)
+		return -1;
+
+	for (i = 0, n = git_tree_entrycount(tree); i < n && !error; ++i) {
+		const git_tree_entry *entry = git_tree_entry_byindex(tree, i);
+
+		switch (git_tree_entry_type(entry)) {
+		case GIT_OBJ_TREE:
+			error = island_mark_tree(w, git_tree_entry_id(entry), marks->bits);
+			break;
+		case GIT_OBJ_BLOB:
+			island_mark(w->pb, git_tree_entry_id(entry), marks->bits);
+			break;
+		default:
+			break; /* submodule commits are not ours to pack */
+		}
+	}
+
+	git_tree_free(tree);
+	return error;
+}
+
+/*
+ * Put what a reference points to into its islands; commits are queued
+ * in the revision walker, to be marked along with their history.
+ */
+static int island_mark_tip(struct island_walk *w, git_revwalk *walk,
+			   const git_oid *oid, const uint32_t *bits)
+{
+	struct island_marks *marks;
+	git_object *obj;
+	git_oid id;
+	int error = 0;
+
+	git_oid_cpy(&id, oid);
+
+	for (;;) {
+		if (git_object_lookup(&obj, w->pb->repo, &id, GIT_OBJ_ANY) < 0)
+			return -1;
+
+		if (git_object_type(obj) != GIT_OBJ_TAG)
+			break;
+
+		island_mark(w->pb, &id, bits);
+		git_oid_cpy(&id, git_tag_target_oid((git_tag *)obj));
+		git_object_free(obj);
+	}
+
+	switch (git_object_type(obj)) {
+	case GIT_OBJ_COMMIT:
+		if ((marks = island_marks_get(w, &id)) == NULL)
+			error = -1;
+		else {
+			island_marks_add(w, marks, bits);
+			error = git_revwalk_push(walk, &id);
+		}
+		break;
+	case GIT_OBJ_TREE:
+		error = island_mark_tree(w, &id, bits);
+		break;
+	default:
+		island_mark(w->pb, &id, bits);
+		break;
+	}
+
+	git_object_free(obj);
+	return error;
+}
+
+/*
+ * Children come before their parents, so a commit has all of its
+ * islands by the time it's reached, and passes them on.
+ */
+static int island_mark_commits(struct island_walk *w, git_revwalk *walk)
+{
+	struct island_marks *marks, *parent;
+	git_commit *commit;
+	git_oid oid;
+	unsigned int i, n;
+	int error;
+
+	while ((error = git_revwalk_next(&oid, walk)) == 0) {
+		if ((marks = island_marks_get(w, &oid)) == NULL)
+			return -1;
+
+		island_mark(w->pb, &oid, marks->bits);
+
+		if (git_commit_lookup(&commit, w->pb->repo, &oid) < 0)
+			return -1;
+
+		for (i = 0, n = git_commit_parentcount(commit); i < n; ++i) {
+			if ((parent = island_marks_get(
+					w, git_commit_parent_oid(commit, i))) == NULL) {
+				git_commit_free(commit);
+				return -1;
+			}
+			island_marks_add(w, parent, marks->bits);
+		}
+
+		error = island_mark_tree(w, git_commit_tree_oid(commit), marks->bits);
+		git_commit_free(commit);
+
+		if (error < 0)
+			return error;
+	}
+
+	return (error == GIT_ITEROVER) ? 0 : error;
+}
+
+static int island_name_index(git_packbuilder *pb, size_t *out,
+			     const char *refname, const regmatch_t *match)
+{
+	git_buf name = GIT_BUF_INIT;
+	const char *existing;
+	char *island;
+	unsigned int i;
+
+	for (i = 1; i < ISLAND_MAX_GROUPS; ++i) {
+		if (match[i].rm_so < 0)
+			continue;
+
+		if (name.size)
+			git_buf_putc(&name, '-');
+		git_buf_put(&name, refname + match[i].rm_so,
+			    match[i].rm_eo - match[i].rm_so);
+	}
+
+	if (git_buf_oom(&name))
+		return -1;
+
+	git_vector_foreach(&pb->island_names, i, existing) {
+		if (strcmp(existing, git_buf_cstr(&name)) == 0) {
+			git_buf_free(&name);
+			*out = i;
+			return 0;
+		}
+	}
+
+	island = git_buf_detach(&name);
+	if (!island)
+		island = git__strdup("");
+	GITERR_CHECK_ALLOC(island);
+
+	if (git_vector_insert(&pb->island_names, island) < 0) {
+		git__free(island);
+		return -1;
+	}
+
+	*out = pb->island_names.length - 1;
+	return 0;
+}
+
+struct island_refs_data {
+	git_packbuilder *pb;
+	git_vector *refs;
+};
+
+static int cb_island_refs(const char *refname, void *payload)
+{
+	struct island_refs_data *data = payload;
+	git_packbuilder *pb = data->pb;
+	regmatch_t match[ISLAND_MAX_GROUPS];
+	struct island_ref *ref;
+	regex_t *preg;
+	unsigned int i;
+
+	git_vector_foreach(&pb->island_regexes, i, preg) {
+		if (regexec(preg, refname, ISLAND_MAX_GROUPS, match, 0) == 0)
+			break;
+	}
+
+	if (i == pb->island_regexes.length)
+		return 0;
+
+	ref = git__malloc(sizeof(*ref));
+	GITERR_CHECK_ALLOC(ref);
+
+	if (island_name_index(pb, &ref->island, refname, match) < 0 ||
+	    git_reference_name_to_oid(&ref->oid, pb->repo, refname) < 0 ||
+	    git_vector_insert(data->refs, ref) < 0) {
+		git__free(ref);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void free_islands(git_packbuilder *pb)
+{
+	unsigned int i;
+	char *name;
+
+	git_vector_foreach(&pb->island_names, i, name)
+		git__free(name);
+	git_vector_clear(&pb->island_names);
+
+	git__free(pb->island_marks);
+	pb->island_marks = NULL;
+	pb->island_words = 0;
+}
+
+static int resolve_islands(git_packbuilder *pb)
+{
+	struct island_refs_data data;
+	struct island_walk w;
+	struct island_ref *ref;
+	git_revwalk *walk = NULL;
+	git_vector refs = GIT_VECTOR_INIT;
+	uint32_t *bits = NULL;
+	unsigned int i;
+	int error = -1;
+
+	free_islands(pb);
+
+	if (!pb->island_regexes.length)
+		return 0;
+
+	memset(&w, 0, sizeof(w));
+	w.pb = pb;
+
+	data.pb = pb;
+	data.refs = &refs;
+
+	if (git_reference_foreach(pb->repo, GIT_REF_LISTALL,
+				  cb_island_refs, &data) < 0)
+		goto cleanup;
+
+	if (!pb->island_names.length) {
+		error = 0;
+		goto cleanup;
+	}
+
+	pb->island_words = (pb->island_names.length + 31) / 32;
+	pb->island_marks = git__calloc(pb->nr_objects * pb->island_words,
+				       sizeof(uint32_t));
+	bits = git__calloc(pb->island_words, sizeof(uint32_t));
+
+	if (!pb->island_marks || !bits ||
+	    (w.marks = git_oidmap_alloc()) == NULL ||
+	    git_pool_init(&w.pool, (uint32_t)(sizeof(struct island_marks) +
+			pb->island_words * sizeof(uint32_t)), 0) < 0 ||
+	    git_revwalk_new(&walk, pb->repo) < 0)
+		goto cleanup;
+
+	git_revwalk_sorting(walk, GIT_SORT_TOPOLOGICAL);
+
+	git_vector_foreach(&refs, i, ref) {
+		memset(bits, 0, pb->island_words * sizeof(uint32_t));
+		bits[ref->island / 32] |= 1u << (ref->island % 32);
+
+		if (island_mark_tip(&w, walk, &ref->oid, bits) < 0)
+			goto cleanup;
+	}
+
+	if (island_mark_commits(&w, walk) < 0)
+		goto cleanup;
+
+	error = 0;
+
+cleanup:
+	if (w.marks) {
+		git_oidmap_free(w.marks);
+		git_pool_clear(&w.pool);
+	}
+	git_revwalk_free(walk);
+	git__free(bits);
+
+	git_vector_foreach(&refs, i, ref)
+		git__free(ref);
+	git_vector_free(&refs);
+
+	if (error < 0)
+		free_islands(pb);
+
+	return error;
+}
+
 static int try_delta(git_packbuilder *pb, struct unpacked *trg,
 		     struct unpacked *src, unsigned int max_depth,
 		     unsigned long *mem_usage, int *ret)
@@ -699,6 +1157,10 @@ static int try_delta(git_packbuilder *pb, struct unpacked *trg,
 
 	*ret = 0;
 
+	/* Don't make a delta that a fetch of some island could not use */
+	if (!in_same_island(pb, trg_object, src_object))
+		return 0;
+
 	/* TODO: support reuse-delta */
 
 	/* Let's not bust the allowed depth. */
@@ -984,10 +1446,8 @@ static int find_deltas(git_packbuilder *pb, git_pobject **list,
 	error = 0;
 
 on_error:
-	for (i = 0; i < window; ++i) {
-		git__free(array[i].index);
-		git__free(array[i].data);
-	}
+	for (i = 0; i < window; ++i)
+		free_unpacked(&array[i]);
 	git__free(array);
 	git_buf_free(&zbuf);
 
@@ -1215,6 +1675,11 @@ static int prepare_pack(git_packbuilder *pb)
 	}
 
 	if (n > 1) {
+		if (resolve_islands(pb) < 0) {
+			git__free(delta_list);
+			return -1;
+		}
+
 		git__tsort((void **)delta_list, n, type_size_sort);
 		if (ll_find_deltas(pb, delta_list, n,
 				   GIT_PACK_WINDOW + 1,
@@ -1237,6 +1702,14 @@ int git_packbuilder_send(git_packbuilder *pb, git_transport *t)
 	return write_pack(pb, &send_pack_file, t);
 }
 
+int git_packbuilder_foreach(git_packbuilder *pb,
+			    int (*cb)(void *buf, size_t size, void *payload),
+			    void *payload)
+{
+	PREPARE_PACK;
+	return write_pack(pb, cb, payload);
+}
+
 int git_packbuilder_write_buf(git_buf *buf, git_packbuilder *pb)
 {
 	PREPARE_PACK;
@@ -1249,6 +1722,16 @@ int git_packbuilder_write(git_packbuilder *pb, const char *path)
 	return write_pack_file(pb, path);
 }
 
+uint32_t git_packbuilder_object_count(git_packbuilder *pb)
+{
+	return pb->nr_objects;
+}
+
+uint32_t git_packbuilder_written(git_packbuilder *pb)
+{
+	return pb->nr_written;
+}
+
 #undef PREPARE_PACK
 
 static int cb_tree_walk(const char *root, const git_tree_entry *entry, void *payload)
@@ -1288,6 +1771,9 @@ int git_packbuilder_insert_tree(git_packbuilder *pb, const git_oid *oid)
 
 void git_packbuilder_free(git_packbuilder *pb)
 {
+	regex_t *preg;
+	unsigned int i;
+
 	if (pb == NULL)
 		return;
 
@@ -1311,5 +1797,14 @@ void git_packbuilder_free(git_packbuilder *pb)
 	if (pb->object_list)
 		git__free(pb->object_list);
 
+	free_islands(pb);
+	git_vector_free(&pb->island_names);
+
+	git_vector_foreach(&pb->island_regexes, i, preg) {
+		regfree(preg);
+		git__free(preg);
+	}
+	git_vector_free(&pb->island_regexes);
+
 	git__free(pb);
 }
@@ -13,6 +13,7 @@
 #include "buffer.h"
 #include "hash.h"
 #include "oidmap.h"
+#include "vector.h"
 
 #include "git2/oid.h"
 
@@ -25,12 +26,10 @@
 typedef struct git_pobject {
 	git_oid id;
 	git_otype type;
-	git_off_t offset;
+	unsigned int hash; /* name hint hash */
 
 	size_t size;
 
-	unsigned int hash; /* name hint hash */
-
 	struct git_pobject *delta; /* delta base object */
 	struct git_pobject *delta_child; /* deltified objects who bases me */
 	struct git_pobject *delta_sibling; /* other deltified objects
@@ -64,6 +63,12 @@ struct git_packbuilder {
 
 	git_oid pack_oid; /* hash of written pack */
 
+	/* delta islands: one bitmap of island_words words per object */
+	git_vector island_regexes;
+	git_vector island_names;
+	uint32_t *island_marks;
+	size_t island_words;
+
 	/* synchronization objects */
 	git_mutex cache_mutex;
 	git_mutex progress_mutex;
@@ -78,6 +78,32 @@ void git_pool_swap(git_pool *a, git_pool *b)
 	memcpy(b, &temp, sizeof(temp));
 }
 
+void git_pool_merge(git_pool *into, git_pool *from)
+{
+	git_pool_page *scan, *next;
+
+	assert(into->item_size == from->item_size);
+
+	for (scan = from->open; scan != NULL; scan = next) {
+		next = scan->next;
+		pool_insert_page(into, scan);
+	}
+
+	for (scan = from->full; scan != NULL; scan = next) {
+		next = scan->next;
+		scan->next = into->full;
+		into->full = scan;
+	}
+
+	into->items += from->items;
+	into->has_string_alloc |= from->has_string_alloc;
+	into->has_multi_item_alloc |= from->has_multi_item_alloc;
+	into->has_large_page_alloc |= from->has_large_page_alloc;
+
+	from->open = from->full = NULL;
+	git_pool_clear(from);
+}
+
 static void pool_insert_page(git_pool *pool, git_pool_page *page)
 {
 	git_pool_page *scan;
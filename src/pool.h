@@ -70,6 +70,13 @@ extern void git_pool_clear(git_pool *pool);
  */
 extern void git_pool_swap(git_pool *a, git_pool *b);
 
+/**
+ * Move all the pages of `from` into `into`, leaving `from` empty.
+ *
+ * Both pools must have the same item size.
+ */
+extern void git_pool_merge(git_pool *into, git_pool *from);
+
 /**
  * Allocate space for one or more items from a pool.
  */
@@ -28,6 +28,18 @@
 
 typedef int git_file;
 
+/* Sub-second part of the stat timestamps, where the platform has one */
+#if defined(__linux__)
+# define GIT_STAT_MTIME_NSEC(st) ((unsigned int)(st)->st_mtim.tv_nsec)
+# define GIT_STAT_CTIME_NSEC(st) ((unsigned int)(st)->st_ctim.tv_nsec)
+#elif defined(__APPLE__)
+# define GIT_STAT_MTIME_NSEC(st) ((unsigned int)(st)->st_mtimespec.tv_nsec)
+# define GIT_STAT_CTIME_NSEC(st) ((unsigned int)(st)->st_ctimespec.tv_nsec)
+#else
+# define GIT_STAT_MTIME_NSEC(st) 0
+# define GIT_STAT_CTIME_NSEC(st) 0
+#endif
+
 /**
  * Standard POSIX Methods
  *
@@ -6,29 +6,34 @@
  */
 
 #include "tree-cache.h"
+#include "tree.h"
 
-static git_tree_cache *find_child(const git_tree_cache *tree, const char *path)
+git_tree_cache *git_tree_cache_child(const git_tree_cache *tree, const char *name, size_t name_len)
 {
-	size_t i, dirlen;
-	const char *end;
-
-	end = strchr(path, '/');
-	if (end == NULL) {
-		end = strrchr(path, '\0');
-	}
-
-	dirlen = end - path;
+	size_t i;
 
 	for (i = 0; i < tree->children_count; ++i) {
 		const char *childname = tree->children[i]->name;
 
-		if (strlen(childname) == dirlen && !memcmp(path, childname, dirlen))
+		if (strlen(childname) == name_len && !memcmp(name, childname, name_len))
 			return tree->children[i];
 	}
 
 	return NULL;
 }
 
+static git_tree_cache *find_child(const git_tree_cache *tree, const char *path)
+{
+	const char *end;
+
+	end = strchr(path, '/');
+	if (end == NULL) {
+		end = strrchr(path, '\0');
+	}
+
+	return git_tree_cache_child(tree, path, end - path);
+}
+
 void git_tree_cache_invalidate_path(git_tree_cache *tree, const char *path)
 {
 	const char *ptr = path, *end;
@@ -92,16 +97,10 @@ static int read_tree_internal(git_tree_cache **out,
 	if (++buffer >= buffer_end)
 		goto corrupted;
 
-	name_len = strlen(name_start);
-	tree = git__malloc(sizeof(git_tree_cache) + name_len + 1);
-	GITERR_CHECK_ALLOC(tree);
-
-	memset(tree, 0x0, sizeof(git_tree_cache));
-	tree->parent = parent;
-
 	/* NUL-terminated tree name */
-	memcpy(tree->name, name_start, name_len);
-	tree->name[name_len] = '\0';
+	name_len = strlen(name_start);
+	if (git_tree_cache_new(&tree, name_start, name_len, parent) < 0)
+		return -1;
 
 	/* Blank-terminated ASCII decimal number of entries in this tree */
 	if (git__strtol32(&count, buffer, &buffer, 10) < 0 || count < -1)
@@ -135,12 +134,14 @@ static int read_tree_internal(git_tree_cache **out,
 	if (tree->children_count > 0) {
 		unsigned int i;
 
-		tree->children = git__malloc(tree->children_count * sizeof(git_tree_cache *));
+		tree->children = git__calloc(tree->children_count, sizeof(git_tree_cache *));
 		GITERR_CHECK_ALLOC(tree->children);
 
 		for (i = 0; i < tree->children_count; ++i) {
-			if (read_tree_internal(&tree->children[i], &buffer, buffer_end, tree) < 0)
+			if (read_tree_internal(&tree->children[i], &buffer, buffer_end, tree) < 0) {
+				git_tree_cache_free(tree);
 				return -1;
+			}
 		}
 	}
 
@@ -169,6 +170,107 @@ int git_tree_cache_read(git_tree_cache **tree, const char *buffer, size_t buffer
 	return 0;
 }
 
+static int read_tree_recursive(git_tree_cache *cache, const git_tree *tree)
+{
+	git_repository *repo = git_object_owner((const git_object *)tree);
+	git_tree_entry *entry;
+	git_tree_cache *child;
+	unsigned int i, j = 0;
+
+	git_oid_cpy(&cache->oid, git_tree_id(tree));
+	cache->entries = 0;
+
+	git_vector_foreach(&tree->entries, i, entry) {
+		if (git_tree_entry__is_tree(entry))
+			cache->children_count++;
+		else
+			cache->entries++;
+	}
+
+	if (cache->children_count == 0)
+		return 0;
+
+	cache->children = git__calloc(cache->children_count, sizeof(git_tree_cache *));
+	GITERR_CHECK_ALLOC(cache->children);
+
+	git_vector_foreach(&tree->entries, i, entry) {
+		git_tree *subtree;
+		int error;
+
+		if (!git_tree_entry__is_tree(entry))
+			continue;
+
+		if (git_tree_cache_new(&child, entry->filename, entry->filename_len, cache) < 0)
+			return -1;
+
+		cache->children[j++] = child;
+
+		if (git_tree_lookup(&subtree, repo, &entry->oid) < 0)
+			return -1;
+
+		error = read_tree_recursive(child, subtree);
+		git_tree_free(subtree);
+
+		if (error < 0)
+			return error;
+
+		cache->entries += child->entries;
+	}
+
+	return 0;
+}
+
+int git_tree_cache_read_tree(git_tree_cache **out, const git_tree *tree)
+{
+	git_tree_cache *cache;
+
+	if (git_tree_cache_new(&cache, "", 0, NULL) < 0)
+		return -1;
+
+	if (read_tree_recursive(cache, tree) < 0) {
+		git_tree_cache_free(cache);
+		return -1;
+	}
+
+	*out = cache;
+	return 0;
+}
+
+int git_tree_cache_write(git_buf *out, const git_tree_cache *tree)
+{
+	size_t i;
+
+	git_buf_put(out, tree->name, strlen(tree->name) + 1);
+	git_buf_printf(out, "%d %d\n", (int)tree->entries, (int)tree->children_count);
+
+	if (tree->entries >= 0)
+		git_buf_put(out, (const char *)tree->oid.id, GIT_OID_RAWSZ);
+
+	for (i = 0; i < tree->children_count; ++i)
+		if (git_tree_cache_write(out, tree->children[i]) < 0)
+			return -1;
+
+	return git_buf_oom(out) ? -1 : 0;
+}
+
+int git_tree_cache_new(git_tree_cache **out, const char *name, size_t name_len, git_tree_cache *parent)
+{
+	git_tree_cache *tree;
+
+	tree = git__malloc(sizeof(git_tree_cache) + name_len + 1);
+	GITERR_CHECK_ALLOC(tree);
+
+	memset(tree, 0x0, sizeof(git_tree_cache));
+	tree->parent = parent;
+	tree->entries = -1;
+
+	memcpy(tree->name, name, name_len);
+	tree->name[name_len] = '\0';
+
+	*out = tree;
+	return 0;
+}
+
 void git_tree_cache_free(git_tree_cache *tree)
 {
 	unsigned int i;
@@ -10,6 +10,8 @@
 
 #include "common.h"
 #include "git2/oid.h"
+#include "git2/tree.h"
+#include "buffer.h"
 
 struct git_tree_cache {
 	struct git_tree_cache *parent;
@@ -24,6 +26,10 @@ struct git_tree_cache {
 typedef struct git_tree_cache git_tree_cache;
 
 int git_tree_cache_read(git_tree_cache **tree, const char *buffer, size_t buffer_size);
+int git_tree_cache_read_tree(git_tree_cache **tree, const git_tree *source);
+int git_tree_cache_write(git_buf *out, const git_tree_cache *tree);
+int git_tree_cache_new(git_tree_cache **tree, const char *name, size_t name_len, git_tree_cache *parent);
+git_tree_cache *git_tree_cache_child(const git_tree_cache *tree, const char *name, size_t name_len);
 void git_tree_cache_invalidate_path(git_tree_cache *tree, const char *path);
 const git_tree_cache *git_tree_cache_get(const git_tree_cache *tree, const char *path);
 void git_tree_cache_free(git_tree_cache *tree);
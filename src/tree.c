@@ -346,24 +346,6 @@ int git_tree__parse(git_tree *tree, git_odb_object *obj)
 	return tree_parse_buffer(tree, (char *)obj->raw.data, (char *)obj->raw.data + obj->raw.len);
 }
 
-static unsigned int find_next_dir(const char *dirname, git_index *index, unsigned int start)
-{
-	unsigned int i, entries = git_index_entrycount(index);
-	size_t dirlen;
-
-	dirlen = strlen(dirname);
-	for (i = start; i < entries; ++i) {
-		git_index_entry *entry = git_index_get_byindex(index, i);
-		if (strlen(entry->path) < dirlen ||
-		    memcmp(entry->path, dirname, dirlen) ||
-			(dirlen > 0 && entry->path[dirlen] != '/')) {
-			break;
-		}
-	}
-
-	return i;
-}
-
 static int append_entry(
 	git_treebuilder *bld,
 	const char *filename,
@@ -384,24 +366,76 @@ static int append_entry(
 	return 0;
 }
 
+/*
+ * Drop the children of `cache` which didn't make it into the tree we
+ * just wrote, and keep the ones that did in tree order.
+ */
+static void prune_tree_cache(git_tree_cache *cache, git_vector *kept)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < cache->children_count; ++i) {
+		for (j = 0; j < kept->length; ++j)
+			if (kept->contents[j] == cache->children[i])
+				break;
+
+		if (j == kept->length)
+			git_tree_cache_free(cache->children[i]);
+	}
+
+	git__free(cache->children);
+	cache->children_count = kept->length;
+	cache->children = (git_tree_cache **)kept->contents;
+}
+
+static int tree_cache_child(
+	git_tree_cache **out, git_tree_cache *cache, const char *name)
+{
+	git_tree_cache **children;
+	size_t name_len = strlen(name);
+
+	if ((*out = git_tree_cache_child(cache, name, name_len)) != NULL)
+		return 0;
+
+	if (git_tree_cache_new(out, name, name_len, cache) < 0)
+		return -1;
+
+	children = git__realloc(cache->children,
+		(cache->children_count + 1) * sizeof(git_tree_cache *));
+	if (children == NULL) {
+		git_tree_cache_free(*out);
+		return -1;
+	}
+
+	cache->children = children;
+	cache->children[cache->children_count++] = *out;
+	return 0;
+}
+
+/*
+ * Write the tree for `dirname`, whose entries start at position `start`
+ * in the index.  Trees which are still valid in the tree cache aren't
+ * written again; the others are written and recorded in `cache`, so the
+ * next write only has to look at the directories which changed.
+ */
 static int write_tree(
 	git_oid *oid,
 	git_repository *repo,
 	git_index *index,
 	const char *dirname,
-	unsigned int start)
+	unsigned int start,
+	git_tree_cache *cache)
 {
 	git_treebuilder *bld = NULL;
+	git_vector kept = GIT_VECTOR_INIT;
 
 	unsigned int i, entries = git_index_entrycount(index);
 	int error;
 	size_t dirname_len = strlen(dirname);
-	const git_tree_cache *cache;
 
-	cache = git_tree_cache_get(index->tree, dirname);
-	if (cache != NULL && cache->entries >= 0){
+	if (cache->entries >= 0 && start + cache->entries <= entries) {
 		git_oid_cpy(oid, &cache->oid);
-		return find_next_dir(dirname, index, start);
+		return start + (unsigned int)cache->entries;
 	}
 
 	error = git_treebuilder_create(&bld, NULL);
@@ -440,19 +474,11 @@ static int write_tree(
 			git_oid sub_oid;
 			int written;
 			char *subdir, *last_comp;
+			git_tree_cache *subcache;
 
 			subdir = git__strndup(entry->path, next_slash - entry->path);
 			GITERR_CHECK_ALLOC(subdir);
 
-			/* Write out the subtree */
-			written = write_tree(&sub_oid, repo, index, subdir, i);
-			if (written < 0) {
-				tree_error("Failed to write subtree");
-				goto on_error;
-			} else {
-				i = written - 1; /* -1 because of the loop increment */
-			}
-
 			/*
 			 * We need to figure out what we want toinsert
 			 * into this tree. If we're traversing
@@ -465,6 +491,23 @@ static int write_tree(
 			} else {
 				last_comp = subdir;
 			}
+
+			if (tree_cache_child(&subcache, cache, last_comp) < 0 ||
+				git_vector_insert(&kept, subcache) < 0) {
+				git__free(subdir);
+				goto on_error;
+			}
+
+			/* Write out the subtree */
+			written = write_tree(&sub_oid, repo, index, subdir, i, subcache);
+			if (written < 0) {
+				git__free(subdir);
+				tree_error("Failed to write subtree");
+				goto on_error;
+			} else {
+				i = written - 1; /* -1 because of the loop increment */
+			}
+
 			error = append_entry(bld, last_comp, &sub_oid, S_IFDIR);
 			git__free(subdir);
 			if (error < 0) {
@@ -484,9 +527,15 @@ static int write_tree(
 		goto on_error;
 
 	git_treebuilder_free(bld);
+
+	prune_tree_cache(cache, &kept);
+	git_oid_cpy(&cache->oid, oid);
+	cache->entries = i - start;
+
 	return i;
 
 on_error:
+	git_vector_free(&kept);
 	git_treebuilder_free(bld);
 	return -1;
 }
@@ -507,8 +556,12 @@ int git_tree_create_fromindex(git_oid *oid, git_index *index)
 		return 0;
 	}
 
-	/* The tree cache didn't help us */
-	ret = write_tree(oid, repo, index, "", 0);
+	/* The tree cache didn't help us; rebuild what it's missing */
+	if (index->tree == NULL &&
+		git_tree_cache_new(&index->tree, "", 0, NULL) < 0)
+		return -1;
+
+	ret = write_tree(oid, repo, index, "", 0, index->tree);
 	return ret < 0 ? ret : 0;
 }
 
@@ -0,0 +1,719 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+
+#ifndef GIT_WIN32
+#include <sys/utsname.h>
+#endif
+
+#include "untracked.h"
+#include "posix.h"
+#include "ewah.h"
+#include "varint.h"
+#include "repository.h"
+#include "attr.h"
+#include "ignore.h"
+#include "git2/odb.h"
+
+/*
+ * Untracked directories are listed by name rather than descended into,
+ * and empty ones are listed too, which is what git calls
+ * DIR_SHOW_OTHER_DIRECTORIES.  Git itself hides empty directories, so it
+ * will start over rather than use a cache which we wrote, and the other
+ * way around.
+ */
+#define UNTRACKED_DIR_FLAGS 0x2
+
+/* ctime, mtime, dev, ino, uid, gid, size */
+#define UNTRACKED_STAT_SIZE (9 * 4)
+#define UNTRACKED_HEADER_SIZE (2 * UNTRACKED_STAT_SIZE + 4 + 2 * GIT_OID_RAWSZ)
+
+static int untracked_dir_cmp(const void *a, const void *b)
+{
+	const git_untracked_dir *dir_a = a, *dir_b = b;
+	return strcmp(dir_a->name, dir_b->name);
+}
+
+static int untracked_dir_new(
+	git_untracked_dir **out, const char *name, size_t name_len)
+{
+	git_untracked_dir *dir;
+
+	dir = git__calloc(1, sizeof(git_untracked_dir) + name_len + 1);
+	GITERR_CHECK_ALLOC(dir);
+
+	memcpy(dir->name, name, name_len);
+
+	if (git_vector_init(&dir->untracked, 0, git__strcmp_cb) < 0 ||
+		git_vector_init(&dir->dirs, 0, untracked_dir_cmp) < 0) {
+		git_vector_free(&dir->untracked);
+		git__free(dir);
+		return -1;
+	}
+
+	*out = dir;
+	return 0;
+}
+
+static void untracked_dir_clear(git_untracked_dir *dir)
+{
+	unsigned int i;
+	char *name;
+
+	git_vector_foreach(&dir->untracked, i, name)
+		git__free(name);
+	git_vector_clear(&dir->untracked);
+}
+
+static void untracked_dir_free(git_untracked_dir *dir)
+{
+	unsigned int i;
+	git_untracked_dir *child;
+
+	if (dir == NULL)
+		return;
+
+	git_vector_foreach(&dir->dirs, i, child)
+		untracked_dir_free(child);
+	git_vector_free(&dir->dirs);
+
+	untracked_dir_clear(dir);
+	git_vector_free(&dir->untracked);
+
+	git__free(dir);
+}
+
+static int untracked_ident(git_buf *out, const char *workdir)
+{
+	size_t len = strlen(workdir);
+	const char *sysname;
+#ifdef GIT_WIN32
+	sysname = "Windows";
+#else
+	struct utsname uts;
+
+	sysname = (uname(&uts) < 0) ? "" : uts.sysname;
+#endif
+
+	/* git leaves the trailing slash off the working directory */
+	if (len > 1 && workdir[len - 1] == '/')
+		len--;
+
+	git_buf_puts(out, "Location ");
+	git_buf_put(out, workdir, len);
+	git_buf_printf(out, ", system %s", sysname);
+	git_buf_putc(out, '\0');
+
+	return git_buf_oom(out) ? -1 : 0;
+}
+
+static git_untracked_cache *untracked_cache_alloc(void)
+{
+	git_untracked_cache *cache = git__calloc(1, sizeof(git_untracked_cache));
+	if (cache == NULL)
+		return NULL;
+
+	git_buf_init(&cache->ident, 0);
+	return cache;
+}
+
+int git_untracked_cache_new(git_untracked_cache **out, const char *workdir)
+{
+	git_untracked_cache *cache = untracked_cache_alloc();
+	GITERR_CHECK_ALLOC(cache);
+
+	cache->dir_flags = UNTRACKED_DIR_FLAGS;
+	cache->exclude_per_dir = git__strdup(GIT_IGNORE_FILE);
+	cache->dirty = 1;
+
+	if (cache->exclude_per_dir == NULL ||
+		untracked_ident(&cache->ident, workdir) < 0) {
+		git_untracked_cache_free(cache);
+		return -1;
+	}
+
+	*out = cache;
+	return 0;
+}
+
+void git_untracked_cache_free(git_untracked_cache *cache)
+{
+	if (cache == NULL)
+		return;
+
+	untracked_dir_free(cache->root);
+	git__free(cache->exclude_per_dir);
+	git_buf_free(&cache->ident);
+	git__free(cache);
+}
+
+bool git_untracked_cache_matches(const git_untracked_cache *cache, const char *workdir)
+{
+	git_buf ident = GIT_BUF_INIT;
+	bool matches;
+
+	if (untracked_ident(&ident, workdir) < 0) {
+		giterr_clear();
+		return false;
+	}
+
+	matches = cache->dir_flags == UNTRACKED_DIR_FLAGS &&
+		strcmp(cache->exclude_per_dir, GIT_IGNORE_FILE) == 0 &&
+		ident.size == cache->ident.size &&
+		memcmp(ident.ptr, cache->ident.ptr, ident.size) == 0;
+
+	git_buf_free(&ident);
+	return matches;
+}
+
+void git_untracked_stat_init(git_untracked_stat *out, const struct stat *st)
+{
+	out->ctime.seconds = (git_time_t)st->st_ctime;
+	out->ctime.nanoseconds = GIT_STAT_CTIME_NSEC(st);
+	out->mtime.seconds = (git_time_t)st->st_mtime;
+	out->mtime.nanoseconds = GIT_STAT_MTIME_NSEC(st);
+	out->dev = (unsigned int)st->st_dev;
+	out->ino = (unsigned int)st->st_ino;
+	out->uid = (unsigned int)st->st_uid;
+	out->gid = (unsigned int)st->st_gid;
+	out->size = (unsigned int)st->st_size;
+}
+
+/*
+ * The stat data and contents of one of the global exclude files.  A
+ * missing file has all of them zeroed.
+ */
+static int exclude_file_state(
+	git_untracked_stat *st, git_oid *oid, const char *path)
+{
+	struct stat fst;
+
+	memset(st, 0x0, sizeof(git_untracked_stat));
+	memset(oid, 0x0, sizeof(git_oid));
+
+	if (path == NULL || p_stat(path, &fst) < 0 || !S_ISREG(fst.st_mode))
+		return 0;
+
+	git_untracked_stat_init(st, &fst);
+
+	return git_odb_hashfile(oid, path, GIT_OBJ_BLOB);
+}
+
+static int check_exclude_file(
+	git_untracked_cache *cache,
+	git_untracked_stat *cached_st,
+	git_oid *cached_oid,
+	const char *path)
+{
+	git_untracked_stat st;
+	git_oid oid;
+
+	if (exclude_file_state(&st, &oid, path) < 0)
+		return -1;
+
+	if (git_untracked_stat_equal(&st, cached_st))
+		return 0;
+
+	if (git_oid_cmp(&oid, cached_oid) != 0) {
+		untracked_dir_free(cache->root);
+		cache->root = NULL;
+		git_oid_cpy(cached_oid, &oid);
+	}
+
+	memcpy(cached_st, &st, sizeof(git_untracked_stat));
+	cache->dirty = 1;
+
+	return 0;
+}
+
+int git_untracked_cache_check_excludes(git_untracked_cache *cache, git_repository *repo)
+{
+	git_buf path = GIT_BUF_INIT;
+	int error;
+
+	if ((error = git_attr_cache__init(repo)) < 0 ||
+		(error = git_buf_joinpath(
+			&path, git_repository_path(repo), "info/exclude")) < 0)
+		goto done;
+
+	if ((error = check_exclude_file(cache,
+			&cache->info_exclude_st, &cache->info_exclude_oid, path.ptr)) < 0)
+		goto done;
+
+	error = check_exclude_file(cache,
+		&cache->excludes_file_st, &cache->excludes_file_oid,
+		git_repository_attr_cache(repo)->cfg_excl_file);
+
+done:
+	git_buf_free(&path);
+	return error;
+}
+
+static git_untracked_dir *untracked_child(
+	git_untracked_dir *dir, const char *name, size_t name_len)
+{
+	unsigned int i;
+	git_untracked_dir *child;
+
+	git_vector_foreach(&dir->dirs, i, child) {
+		if (strlen(child->name) == name_len &&
+			memcmp(child->name, name, name_len) == 0)
+			return child;
+	}
+
+	return NULL;
+}
+
+int git_untracked_cache_lookup(
+	git_untracked_dir **out, git_untracked_cache *cache, const char *path)
+{
+	git_untracked_dir *dir, *child;
+	const char *end;
+
+	if (cache->root == NULL &&
+		untracked_dir_new(&cache->root, "", 0) < 0)
+		return -1;
+
+	for (dir = cache->root; (end = strchr(path, '/')) != NULL; path = end + 1) {
+		child = untracked_child(dir, path, end - path);
+
+		if (child == NULL) {
+			if (untracked_dir_new(&child, path, end - path) < 0)
+				return -1;
+
+			if (git_vector_insert(&dir->dirs, child) < 0) {
+				untracked_dir_free(child);
+				return -1;
+			}
+
+			git_vector_sort(&dir->dirs);
+			cache->dirty = 1;
+		}
+
+		dir = child;
+	}
+
+	*out = dir;
+	return 0;
+}
+
+void git_untracked_dir_update(
+	git_untracked_dir *dir, const git_untracked_stat *st, git_vector *untracked)
+{
+	untracked_dir_clear(dir);
+	git_vector_swap(&dir->untracked, untracked);
+	git_vector_sort(&dir->untracked);
+
+	memcpy(&dir->st, st, sizeof(git_untracked_stat));
+	dir->valid = 1;
+	dir->check_only = 0;
+}
+
+void git_untracked_dir_invalidate(git_untracked_dir *dir)
+{
+	unsigned int i;
+	git_untracked_dir *child;
+
+	untracked_dir_clear(dir);
+	dir->valid = 0;
+
+	git_vector_foreach(&dir->dirs, i, child)
+		git_untracked_dir_invalidate(child);
+}
+
+void git_untracked_cache_invalidate_path(git_untracked_cache *cache, const char *path)
+{
+	git_untracked_dir *dir;
+	const char *end;
+
+	if (cache == NULL || (dir = cache->root) == NULL)
+		return;
+
+	while (dir != NULL) {
+		if (dir->valid) {
+			untracked_dir_clear(dir);
+			dir->valid = 0;
+			cache->dirty = 1;
+		}
+
+		if ((end = strchr(path, '/')) == NULL)
+			break;
+
+		dir = untracked_child(dir, path, end - path);
+		path = end + 1;
+	}
+
+	/* a directory which changed could have anything in it now */
+	if (dir != NULL && *path != '\0' &&
+		(dir = untracked_child(dir, path, strlen(path))) != NULL) {
+		git_untracked_dir_invalidate(dir);
+		cache->dirty = 1;
+	}
+}
+
+/*
+ * Reading and writing git's UNTR extension: a header with what the cache
+ * applies to, then the directories in depth-first order, and finally the
+ * stat data and .gitignore ids of those directories which have them.
+ */
+struct untracked_reader {
+	const unsigned char *data;
+	const unsigned char *end;
+	git_untracked_dir **dirs;
+	size_t nr_dirs;
+	size_t nr_read;
+};
+
+static uint32_t get_uint32(const unsigned char *buffer)
+{
+	return ((uint32_t)buffer[0] << 24) | ((uint32_t)buffer[1] << 16) |
+		((uint32_t)buffer[2] << 8) | buffer[3];
+}
+
+static void read_stat(git_untracked_stat *st, const unsigned char *data)
+{
+	st->ctime.seconds = (git_time_t)get_uint32(data);
+	st->ctime.nanoseconds = get_uint32(data + 4);
+	st->mtime.seconds = (git_time_t)get_uint32(data + 8);
+	st->mtime.nanoseconds = get_uint32(data + 12);
+	st->dev = get_uint32(data + 16);
+	st->ino = get_uint32(data + 20);
+	st->uid = get_uint32(data + 24);
+	st->gid = get_uint32(data + 28);
+	st->size = get_uint32(data + 32);
+}
+
+static int read_varint(size_t *out, struct untracked_reader *rd)
+{
+	size_t len = git_decode_varint(out, rd->data, rd->end - rd->data);
+
+	if (len == 0)
+		return -1;
+
+	rd->data += len;
+	return 0;
+}
+
+static const char *read_string(struct untracked_reader *rd, size_t *len)
+{
+	const char *str = (const char *)rd->data;
+	const unsigned char *nul = memchr(rd->data, '\0', rd->end - rd->data);
+
+	if (nul == NULL)
+		return NULL;
+
+	*len = nul - rd->data;
+	rd->data = nul + 1;
+	return str;
+}
+
+/*
+ * Directories are linked into their parent as soon as they're made, so
+ * freeing the root frees everything if we fail part way.
+ */
+static int read_dir(
+	git_untracked_dir **out, git_untracked_dir *parent, struct untracked_reader *rd)
+{
+	git_untracked_dir *dir = NULL, *child;
+	size_t nr_untracked, nr_dirs, len, i;
+	const char *name;
+	char *copy;
+
+	if (rd->nr_read >= rd->nr_dirs ||
+		read_varint(&nr_untracked, rd) < 0 ||
+		read_varint(&nr_dirs, rd) < 0 ||
+		(name = read_string(rd, &len)) == NULL ||
+		untracked_dir_new(&dir, name, len) < 0)
+		return -1;
+
+	if (parent != NULL && git_vector_insert(&parent->dirs, dir) < 0) {
+		untracked_dir_free(dir);
+		return -1;
+	}
+
+	rd->dirs[rd->nr_read++] = dir;
+	*out = dir;
+
+	for (i = 0; i < nr_untracked; ++i) {
+		if ((name = read_string(rd, &len)) == NULL ||
+			(copy = git__strndup(name, len)) == NULL)
+			return -1;
+
+		if (git_vector_insert(&dir->untracked, copy) < 0) {
+			git__free(copy);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < nr_dirs; ++i) {
+		if (read_dir(&child, dir, rd) < 0)
+			return -1;
+	}
+
+	git_vector_sort(&dir->untracked);
+	git_vector_sort(&dir->dirs);
+
+	return 0;
+}
+
+static int read_dirs(git_untracked_cache *cache, struct untracked_reader *rd)
+{
+	git_ewah valid, check_only, exclude_valid;
+	size_t len, i;
+	int error = -1;
+
+	memset(&valid, 0x0, sizeof(git_ewah));
+	memset(&check_only, 0x0, sizeof(git_ewah));
+	memset(&exclude_valid, 0x0, sizeof(git_ewah));
+
+	rd->dirs = git__calloc(rd->nr_dirs, sizeof(git_untracked_dir *));
+	GITERR_CHECK_ALLOC(rd->dirs);
+
+	rd->nr_read = 0;
+	if (read_dir(&cache->root, NULL, rd) < 0 || rd->nr_read != rd->nr_dirs)
+		goto done;
+
+	if (git_ewah_read(&valid, &len, (const char *)rd->data, rd->end - rd->data) < 0)
+		goto done;
+	rd->data += len;
+
+	if (git_ewah_read(&check_only, &len, (const char *)rd->data, rd->end - rd->data) < 0)
+		goto done;
+	rd->data += len;
+
+	if (git_ewah_read(&exclude_valid, &len, (const char *)rd->data, rd->end - rd->data) < 0)
+		goto done;
+	rd->data += len;
+
+	for (i = 0; i < rd->nr_dirs; ++i) {
+		if (!git_ewah_get(&valid, i))
+			continue;
+
+		if ((size_t)(rd->end - rd->data) < UNTRACKED_STAT_SIZE)
+			goto done;
+
+		read_stat(&rd->dirs[i]->st, rd->data);
+		rd->dirs[i]->valid = 1;
+		rd->dirs[i]->check_only = git_ewah_get(&check_only, i);
+		rd->data += UNTRACKED_STAT_SIZE;
+	}
+
+	for (i = 0; i < rd->nr_dirs; ++i) {
+		if (!git_ewah_get(&exclude_valid, i))
+			continue;
+
+		if ((size_t)(rd->end - rd->data) < GIT_OID_RAWSZ)
+			goto done;
+
+		git_oid_fromraw(&rd->dirs[i]->exclude_oid, rd->data);
+		rd->data += GIT_OID_RAWSZ;
+	}
+
+	error = 0;
+
+done:
+	git_ewah_free(&valid);
+	git_ewah_free(&check_only);
+	git_ewah_free(&exclude_valid);
+	git__free(rd->dirs);
+	return error;
+}
+
+int git_untracked_cache_read(git_untracked_cache **out, const char *buffer, size_t buffer_size)
+{
+	git_untracked_cache *cache;
+	struct untracked_reader rd;
+	const char *exclude_per_dir;
+	size_t len;
+
+	memset(&rd, 0x0, sizeof(rd));
+	rd.data = (const unsigned char *)buffer;
+	rd.end = rd.data + buffer_size;
+
+	cache = untracked_cache_alloc();
+	GITERR_CHECK_ALLOC(cache);
+
+	if (read_varint(&len, &rd) < 0 || (size_t)(rd.end - rd.data) < len)
+		goto corrupted;
+
+	git_buf_put(&cache->ident, (const char *)rd.data, len);
+	rd.data += len;
+
+	if ((size_t)(rd.end - rd.data) < UNTRACKED_HEADER_SIZE)
+		goto corrupted;
+
+	read_stat(&cache->info_exclude_st, rd.data);
+	read_stat(&cache->excludes_file_st, rd.data + UNTRACKED_STAT_SIZE);
+	rd.data += 2 * UNTRACKED_STAT_SIZE;
+
+	cache->dir_flags = get_uint32(rd.data);
+	rd.data += 4;
+
+	git_oid_fromraw(&cache->info_exclude_oid, rd.data);
+	git_oid_fromraw(&cache->excludes_file_oid, rd.data + GIT_OID_RAWSZ);
+	rd.data += 2 * GIT_OID_RAWSZ;
+
+	if ((exclude_per_dir = read_string(&rd, &len)) == NULL ||
+		(cache->exclude_per_dir = git__strndup(exclude_per_dir, len)) == NULL ||
+		read_varint(&rd.nr_dirs, &rd) < 0)
+		goto corrupted;
+
+	if (rd.nr_dirs > 0 && read_dirs(cache, &rd) < 0)
+		goto corrupted;
+
+	if (git_buf_oom(&cache->ident))
+		goto corrupted;
+
+	*out = cache;
+	return 0;
+
+corrupted:
+	git_untracked_cache_free(cache);
+	giterr_set(GITERR_INDEX, "Corrupted untracked cache extension");
+	return -1;
+}
+
+struct untracked_writer {
+	git_buf dirs;
+	git_buf stats;
+	git_buf excludes;
+	git_ewah valid;
+	git_ewah check_only;
+	git_ewah exclude_valid;
+	size_t nr_written;
+};
+
+static void put_uint32(git_buf *out, uint32_t value)
+{
+	unsigned char raw[4];
+
+	raw[0] = (unsigned char)(value >> 24);
+	raw[1] = (unsigned char)(value >> 16);
+	raw[2] = (unsigned char)(value >> 8);
+	raw[3] = (unsigned char)value;
+
+	git_buf_put(out, (char *)raw, 4);
+}
+
+static void put_varint(git_buf *out, size_t value)
+{
+	unsigned char varint[16];
+	git_buf_put(out, (char *)varint, git_encode_varint(varint, value));
+}
+
+static void write_stat(git_buf *out, const git_untracked_stat *st)
+{
+	put_uint32(out, (uint32_t)st->ctime.seconds);
+	put_uint32(out, st->ctime.nanoseconds);
+	put_uint32(out, (uint32_t)st->mtime.seconds);
+	put_uint32(out, st->mtime.nanoseconds);
+	put_uint32(out, st->dev);
+	put_uint32(out, st->ino);
+	put_uint32(out, st->uid);
+	put_uint32(out, st->gid);
+	put_uint32(out, st->size);
+}
+
+static size_t count_dirs(const git_untracked_dir *dir)
+{
+	size_t i, count = 1;
+
+	for (i = 0; i < dir->dirs.length; ++i)
+		count += count_dirs(dir->dirs.contents[i]);
+
+	return count;
+}
+
+static void write_dir(struct untracked_writer *wr, const git_untracked_dir *dir)
+{
+	size_t i, pos = wr->nr_written++;
+
+	if (dir->valid) {
+		git_ewah_set(&wr->valid, pos);
+		if (dir->check_only)
+			git_ewah_set(&wr->check_only, pos);
+		write_stat(&wr->stats, &dir->st);
+	}
+
+	if (!git_oid_iszero(&dir->exclude_oid)) {
+		git_ewah_set(&wr->exclude_valid, pos);
+		git_buf_put(&wr->excludes, (const char *)dir->exclude_oid.id, GIT_OID_RAWSZ);
+	}
+
+	put_varint(&wr->dirs, dir->valid ? dir->untracked.length : 0);
+	put_varint(&wr->dirs, dir->dirs.length);
+	git_buf_put(&wr->dirs, dir->name, strlen(dir->name) + 1);
+
+	if (dir->valid) {
+		for (i = 0; i < dir->untracked.length; ++i) {
+			const char *name = dir->untracked.contents[i];
+			git_buf_put(&wr->dirs, name, strlen(name) + 1);
+		}
+	}
+
+	for (i = 0; i < dir->dirs.length; ++i)
+		write_dir(wr, dir->dirs.contents[i]);
+}
+
+int git_untracked_cache_write(git_buf *out, const git_untracked_cache *cache)
+{
+	struct untracked_writer wr;
+	size_t nr_dirs;
+	int error = -1;
+
+	put_varint(out, cache->ident.size);
+	git_buf_put(out, cache->ident.ptr, cache->ident.size);
+
+	write_stat(out, &cache->info_exclude_st);
+	write_stat(out, &cache->excludes_file_st);
+	put_uint32(out, cache->dir_flags);
+	git_buf_put(out, (const char *)cache->info_exclude_oid.id, GIT_OID_RAWSZ);
+	git_buf_put(out, (const char *)cache->excludes_file_oid.id, GIT_OID_RAWSZ);
+	git_buf_put(out, cache->exclude_per_dir, strlen(cache->exclude_per_dir) + 1);
+
+	if (cache->root == NULL) {
+		put_varint(out, 0);
+		return git_buf_oom(out) ? -1 : 0;
+	}
+
+	memset(&wr, 0x0, sizeof(wr));
+	git_buf_init(&wr.dirs, 0);
+	git_buf_init(&wr.stats, 0);
+	git_buf_init(&wr.excludes, 0);
+
+	nr_dirs = count_dirs(cache->root);
+
+	if (git_ewah_init(&wr.valid, nr_dirs) < 0 ||
+		git_ewah_init(&wr.check_only, nr_dirs) < 0 ||
+		git_ewah_init(&wr.exclude_valid, nr_dirs) < 0)
+		goto done;
+
+	write_dir(&wr, cache->root);
+
+	put_varint(out, nr_dirs);
+	git_buf_put(out, wr.dirs.ptr, wr.dirs.size);
+
+	if (git_ewah_write(out, &wr.valid) < 0 ||
+		git_ewah_write(out, &wr.check_only) < 0 ||
+		git_ewah_write(out, &wr.exclude_valid) < 0)
+		goto done;
+
+	git_buf_put(out, wr.stats.ptr, wr.stats.size);
+	git_buf_put(out, wr.excludes.ptr, wr.excludes.size);
+	git_buf_putc(out, '\0');
+
+	error = (git_buf_oom(out) || git_buf_oom(&wr.dirs) ||
+		git_buf_oom(&wr.stats) || git_buf_oom(&wr.excludes)) ? -1 : 0;
+
+done:
+	git_ewah_free(&wr.valid);
+	git_ewah_free(&wr.check_only);
+	git_ewah_free(&wr.exclude_valid);
+	git_buf_free(&wr.dirs);
+	git_buf_free(&wr.stats);
+	git_buf_free(&wr.excludes);
+	return error;
+}
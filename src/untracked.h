@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+#ifndef INCLUDE_untracked_h__
+#define INCLUDE_untracked_h__
+
+#include "common.h"
+#include "buffer.h"
+#include "vector.h"
+#include "git2/oid.h"
+#include "git2/index.h"
+
+/* Stat data as the cache stores it, with the same fields as git */
+typedef struct {
+	git_index_time ctime;
+	git_index_time mtime;
+	unsigned int dev;
+	unsigned int ino;
+	unsigned int uid;
+	unsigned int gid;
+	unsigned int size;
+} git_untracked_stat;
+
+typedef struct git_untracked_dir git_untracked_dir;
+
+/*
+ * What we found in a directory the last time we read it: the names in
+ * it which are neither tracked nor ignored (with a trailing slash for
+ * directories), valid for as long as neither the directory's stat data
+ * nor its .gitignore change.
+ */
+struct git_untracked_dir {
+	git_untracked_stat st;
+	git_oid exclude_oid; /* .gitignore in this directory, zero if none */
+	git_vector untracked;
+	git_vector dirs; /* subdirectories we know about, sorted by name */
+	unsigned int valid:1;
+	unsigned int check_only:1;
+	char name[GIT_FLEX_ARRAY];
+};
+
+/*
+ * The untracked cache index extension.  It only applies to the working
+ * directory and ignore rules which it was made for.
+ */
+typedef struct {
+	git_buf ident;
+	git_untracked_stat info_exclude_st;
+	git_untracked_stat excludes_file_st;
+	git_oid info_exclude_oid;
+	git_oid excludes_file_oid;
+	uint32_t dir_flags;
+	char *exclude_per_dir;
+	git_untracked_dir *root;
+	unsigned int dirty:1; /* changed since it was read */
+} git_untracked_cache;
+
+int git_untracked_cache_new(git_untracked_cache **cache, const char *workdir);
+int git_untracked_cache_read(git_untracked_cache **cache, const char *buffer, size_t buffer_size);
+int git_untracked_cache_write(git_buf *out, const git_untracked_cache *cache);
+void git_untracked_cache_free(git_untracked_cache *cache);
+
+/* Whether a cache read from an index was made for this working directory */
+bool git_untracked_cache_matches(const git_untracked_cache *cache, const char *workdir);
+
+/*
+ * Check $GIT_DIR/info/exclude and core.excludesfile, and forget about
+ * every directory if either of them changed.
+ */
+int git_untracked_cache_check_excludes(git_untracked_cache *cache, git_repository *repo);
+
+/*
+ * Find the directory at `path`, which is relative to the working
+ * directory and ends in a slash (or is empty for the top level).
+ * Directories which aren't in the cache yet get added to it.
+ */
+int git_untracked_cache_lookup(
+	git_untracked_dir **dir, git_untracked_cache *cache, const char *path);
+
+/*
+ * Replace what's known about a directory's contents, taking the names
+ * out of `untracked`.
+ */
+void git_untracked_dir_update(
+	git_untracked_dir *dir, const git_untracked_stat *st, git_vector *untracked);
+
+/* Forget the contents of the directory and all directories below it */
+void git_untracked_dir_invalidate(git_untracked_dir *dir);
+
+/*
+ * Forget the contents of all the directories leading up to `path`, and
+ * of everything below it if it's a directory
+ */
+void git_untracked_cache_invalidate_path(git_untracked_cache *cache, const char *path);
+
+void git_untracked_stat_init(git_untracked_stat *out, const struct stat *st);
+
+GIT_INLINE(bool) git_untracked_stat_equal(
+	const git_untracked_stat *a, const git_untracked_stat *b)
+{
+	return (memcmp(a, b, sizeof(git_untracked_stat)) == 0);
+}
+
+#endif
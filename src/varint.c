@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+
+#include "varint.h"
+
+size_t git_decode_varint(size_t *out, const unsigned char *buffer, size_t buffer_size)
+{
+	size_t i = 0, value;
+
+	if (buffer_size == 0)
+		return 0;
+
+	value = buffer[0] & 0x7f;
+
+	while (buffer[i++] & 0x80) {
+		if (i >= buffer_size || (value + 1) >> (8 * sizeof(size_t) - 7))
+			return 0;
+
+		value = ((value + 1) << 7) | (buffer[i] & 0x7f);
+	}
+
+	*out = value;
+	return i;
+}
+
+size_t git_encode_varint(unsigned char *buffer, size_t value)
+{
+	unsigned char varint[16];
+	size_t pos = sizeof(varint) - 1;
+
+	varint[pos] = value & 0x7f;
+	while (value >>= 7)
+		varint[--pos] = 0x80 | (--value & 0x7f);
+
+	memcpy(buffer, varint + pos, sizeof(varint) - pos);
+	return sizeof(varint) - pos;
+}
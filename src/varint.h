@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2009-2012 the libgit2 contributors
+ *
+ * This file is part of libgit2, distributed under the GNU GPL v2 with
+ * a Linking Exception. For full terms see the included COPYING file.
+ */
+#ifndef INCLUDE_varint_h__
+#define INCLUDE_varint_h__
+
+#include "common.h"
+
+/*
+ * Variable length integers as used in the index: seven bits per byte,
+ * most significant first, with one added to all but the last group.
+ */
+
+/*
+ * Returns the number of bytes used, or 0 if the integer is truncated or
+ * doesn't fit.
+ */
+extern size_t git_decode_varint(
+	size_t *out, const unsigned char *buffer, size_t buffer_size);
+
+/* `buffer` needs room for 16 bytes; returns how many were used */
+extern size_t git_encode_varint(unsigned char *buffer, size_t value);
+
+#endif
@@ -24,6 +24,20 @@ static int resize_vector(git_vector *v)
 	return 0;
 }
 
+int git_vector_reserve(git_vector *v, size_t size)
+{
+	assert(v);
+
+	if (size <= v->_alloc_size)
+		return 0;
+
+	v->contents = git__realloc(v->contents, size * sizeof(void *));
+	GITERR_CHECK_ALLOC(v->contents);
+	v->_alloc_size = size;
+
+	return 0;
+}
+
 int git_vector_dup(git_vector *v, git_vector *src, git_vector_cmp cmp)
 {
 	assert(v && src);
@@ -149,25 +149,20 @@ void *xdl_cha_next(chastore_t *cha) {
 }
 
 
-long xdl_guess_lines(mmfile_t *mf, long sample) {
-	long nl = 0, size, tsize = 0;
-	char const *data, *cur, *top;
+long xdl_count_lines(mmfile_t *mf) {
+	long nl = 0, size;
+	char const *cur, *top;
 
-	if ((cur = data = xdl_mmfile_first(mf, &size)) != NULL) {
-		for (top = data + size; nl < sample && cur < top; ) {
+	if ((cur = xdl_mmfile_first(mf, &size)) != NULL) {
+		for (top = cur + size; cur < top; ) {
 			nl++;
 			if (!(cur = memchr(cur, '\n', top - cur)))
-				cur = top;
-			else
-				cur++;
+				break;
+			cur++;
 		}
-		tsize += (long) (cur - data);
 	}
 
-	if (nl && tsize)
-		nl = xdl_mmfile_size(mf) / (tsize / nl);
-
-	return nl + 1;
+	return nl;
 }
 
 int xdl_recmatch(const char *l1, long s1, const char *l2, long s2, long flags)
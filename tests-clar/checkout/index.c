@@ -377,3 +377,259 @@ void test_checkout_index__calls_progress_callback(void)
 	cl_git_pass(git_checkout_index(g_repo, &g_opts));
 	cl_assert_equal_i(was_called, true);
 }
+
+struct progress_order {
+	git_buf last_path;
+	size_t last_step;
+	int files;
+	bool in_order;
+};
+
+static void check_progress_order(
+	const char *path, size_t cur, size_t tot, void *payload)
+{
+	struct progress_order *order = payload;
+
+	GIT_UNUSED(tot);
+
+	if (path == NULL)
+		return;
+
+	if (cur != order->last_step + 1 ||
+		strcmp(git_buf_cstr(&order->last_path), path) >= 0)
+		order->in_order = false;
+
+	order->last_step = cur;
+	order->files += (git__prefixcmp(path, "many/") == 0);
+	git_buf_sets(&order->last_path, path);
+}
+
+static void progress_order_init(struct progress_order *order)
+{
+	memset(order, 0, sizeof(*order));
+	git_buf_init(&order->last_path, 0);
+	order->in_order = true;
+}
+
+/* more files than are written at once, in and out of directories */
+static void add_many_missing_files(void)
+{
+	git_index *index;
+	git_buf path = GIT_BUF_INIT, content = GIT_BUF_INIT;
+	unsigned int i;
+
+	cl_git_pass(git_repository_index(&index, g_repo));
+
+	for (i = 0; i < 150; ++i) {
+		git_buf_clear(&path);
+		git_buf_clear(&content);
+		cl_git_pass(git_buf_printf(&path, "testrepo/many/dir%02u/sub/file%03u", i / 10, i));
+		cl_git_pass(git_buf_printf(&content, "content of file %u\n", i));
+
+		cl_git_pass(git_futils_mkpath2file(path.ptr, 0777));
+		cl_git_mkfile(path.ptr, content.ptr);
+		cl_git_pass(git_index_add_from_workdir(index, path.ptr + strlen("testrepo/")));
+	}
+
+	cl_git_pass(git_index_write(index));
+	git_index_free(index);
+
+	cl_git_pass(git_futils_rmdir_r("testrepo/many", NULL, GIT_DIRREMOVAL_FILES_AND_DIRS));
+
+	git_buf_free(&path);
+	git_buf_free(&content);
+}
+
+void test_checkout_index__writes_many_files_in_order(void)
+{
+	git_buf path = GIT_BUF_INIT, content = GIT_BUF_INIT;
+	struct progress_order order;
+	unsigned int i;
+
+	add_many_missing_files();
+	progress_order_init(&order);
+
+	g_opts.progress_cb = check_progress_order;
+	g_opts.progress_payload = &order;
+
+	cl_git_pass(git_checkout_index(g_repo, &g_opts));
+
+	cl_assert(order.in_order);
+	cl_assert_equal_i(150, order.files);
+
+	for (i = 0; i < 150; ++i) {
+		git_buf_clear(&path);
+		git_buf_clear(&content);
+		cl_git_pass(git_buf_printf(&path, "./testrepo/many/dir%02u/sub/file%03u", i / 10, i));
+		cl_git_pass(git_buf_printf(&content, "content of file %u\n", i));
+
+		test_file_contents(path.ptr, content.ptr);
+	}
+
+	git_buf_free(&order.last_path);
+	git_buf_free(&path);
+	git_buf_free(&content);
+}
+
+static void assert_entry_matches_file(git_index *index, const char *path)
+{
+	git_index_entry *entry;
+	git_buf full = GIT_BUF_INIT;
+	struct stat st;
+
+	cl_git_pass(git_buf_joinpath(&full, "testrepo", path));
+	cl_git_pass(p_stat(full.ptr, &st));
+
+	cl_assert((entry = git_index_get_bypath(index, path, 0)) != NULL);
+	cl_assert(entry->mtime.seconds != 0);
+	cl_assert_equal_i((git_time_t)st.st_mtime, entry->mtime.seconds);
+	cl_assert_equal_i((git_time_t)st.st_ctime, entry->ctime.seconds);
+	cl_assert_equal_i(st.st_size, entry->file_size);
+	cl_assert_equal_i(st.st_ino, entry->ino);
+
+	git_buf_free(&full);
+}
+
+void test_checkout_index__refreshes_the_index_stat_data(void)
+{
+	git_index *index;
+	unsigned int status;
+
+	cl_git_pass(git_checkout_index(g_repo, &g_opts));
+
+	cl_git_pass(git_repository_index(&index, g_repo));
+	assert_entry_matches_file(index, "README");
+	assert_entry_matches_file(index, "branch_file.txt");
+	assert_entry_matches_file(index, "new.txt");
+	git_index_free(index);
+
+	/* and it was written out */
+	cl_git_pass(git_index_open(&index, "testrepo/.git/index"));
+	assert_entry_matches_file(index, "README");
+	assert_entry_matches_file(index, "new.txt");
+	git_index_free(index);
+
+	cl_git_pass(git_status_file(&status, g_repo, "README"));
+	cl_assert_equal_i(GIT_STATUS_CURRENT, status);
+	cl_git_pass(git_status_file(&status, g_repo, "new.txt"));
+	cl_assert_equal_i(GIT_STATUS_CURRENT, status);
+}
+
+struct failing_write {
+	struct progress_order order;
+	bool blocked;
+};
+
+static void block_a_later_file(
+	const char *path, size_t cur, size_t tot, void *payload)
+{
+	struct failing_write *failing = payload;
+
+	check_progress_order(path, cur, tot, &failing->order);
+
+	/* it's further on than the files which can be queued up by now */
+	if (!failing->blocked && path != NULL &&
+		strcmp(path, "many/dir01/sub/file010") == 0)
+	{
+		cl_git_pass(git_futils_mkdir_r(
+			"testrepo/many/dir11/sub/file110", NULL, 0777));
+		failing->blocked = true;
+	}
+}
+
+void test_checkout_index__stops_at_a_file_which_cant_be_written(void)
+{
+	git_index *index;
+	struct failing_write failing;
+	const char *last;
+
+	add_many_missing_files();
+
+	memset(&failing, 0, sizeof(failing));
+	progress_order_init(&failing.order);
+
+	g_opts.progress_cb = block_a_later_file;
+	g_opts.progress_payload = &failing;
+
+	cl_git_fail(git_checkout_index(g_repo, &g_opts));
+	cl_assert(failing.blocked);
+
+	/* the ones before it were all reported, and the ones written with it */
+	cl_assert(failing.order.in_order);
+#ifdef GIT_THREADS
+	/* there's room for all of them by then, so they're all written */
+	cl_assert_equal_i(150, failing.order.files);
+#else
+	cl_assert_equal_i(111, failing.order.files);
+#endif
+
+	test_file_contents("./testrepo/many/dir10/sub/file109", "content of file 109\n");
+
+	cl_git_pass(git_index_open(&index, "testrepo/.git/index"));
+	assert_entry_matches_file(index, "many/dir10/sub/file109");
+
+	last = git_buf_cstr(&failing.order.last_path);
+	if (strcmp(last, "many/dir11/sub/file110") != 0)
+		assert_entry_matches_file(index, last);
+
+	git_index_free(index);
+	git_buf_free(&failing.order.last_path);
+}
+
+struct aborting_notify {
+	struct progress_order order;
+	int files_before;
+};
+
+static int abort_notify_cb(
+	const char *skipped_file,
+	const git_oid *blob_oid,
+	int file_mode,
+	void *payload)
+{
+	struct aborting_notify *notify = payload;
+
+	GIT_UNUSED(blob_oid);
+	GIT_UNUSED(file_mode);
+
+	cl_assert_equal_s("many/dir07/sub/file075", skipped_file);
+	notify->files_before = notify->order.files;
+
+	return -1;
+}
+
+void test_checkout_index__notify_callback_can_stop_the_writes(void)
+{
+	git_index *index;
+	struct aborting_notify notify;
+
+	add_many_missing_files();
+	cl_git_pass(git_futils_mkpath2file("testrepo/many/dir07/sub/file075", 0777));
+	cl_git_mkfile("testrepo/many/dir07/sub/file075", "modified\n");
+
+	memset(&notify, 0, sizeof(notify));
+	progress_order_init(&notify.order);
+	notify.files_before = -1;
+
+	g_opts.progress_cb = check_progress_order;
+	g_opts.progress_payload = &notify.order;
+	g_opts.skipped_notify_cb = abort_notify_cb;
+	g_opts.notify_payload = &notify;
+
+	cl_assert_equal_i(GIT_EUSER, git_checkout_index(g_repo, &g_opts));
+
+	/* it's told about the file after the ones before it, and is the last */
+	cl_assert_equal_i(75, notify.files_before);
+	cl_assert_equal_i(75, notify.order.files);
+	cl_assert(notify.order.in_order);
+
+	test_file_contents("./testrepo/many/dir07/sub/file074", "content of file 74\n");
+	test_file_contents("./testrepo/many/dir07/sub/file075", "modified\n");
+	cl_assert(!git_path_exists("testrepo/many/dir07/sub/file076"));
+
+	cl_git_pass(git_index_open(&index, "testrepo/.git/index"));
+	assert_entry_matches_file(index, "many/dir07/sub/file074");
+
+	git_index_free(index);
+	git_buf_free(&notify.order.last_path);
+}
@@ -0,0 +1,1105 @@
+#ifndef __CLAR_TEST_H__
+#define __CLAR_TEST_H__
+
+#include <stdlib.h>
+
+void clar__assert(
+	int condition,
+	const char *file,
+	int line,
+	const char *error,
+	const char *description,
+	int should_abort);
+
+void clar__assert_equal_s(const char *,const char *,const char *,int,const char *,int);
+void clar__assert_equal_i(int,int,const char *,int,const char *,int);
+
+void cl_set_cleanup(void (*cleanup)(void *), void *opaque);
+void cl_fs_cleanup(void);
+
+#ifdef CLAR_FIXTURE_PATH
+const char *cl_fixture(const char *fixture_name);
+void cl_fixture_sandbox(const char *fixture_name);
+void cl_fixture_cleanup(const char *fixture_name);
+#endif
+
+#define CL_IN_CATEGORY(CAT)
+
+/**
+ * Assertion macros with explicit error message
+ */
+#define cl_must_pass_(expr, desc) clar__assert((expr) >= 0, __FILE__, __LINE__, "Function call failed: " #expr, desc, 1)
+#define cl_must_fail_(expr, desc) clar__assert((expr) < 0, __FILE__, __LINE__, "Expected function call to fail: " #expr, desc, 1)
+#define cl_assert_(expr, desc) clar__assert((expr) != 0, __FILE__, __LINE__, "Expression is not true: " #expr, desc, 1)
+
+/**
+ * Check macros with explicit error message
+ */
+#define cl_check_pass_(expr, desc) clar__assert((expr) >= 0, __FILE__, __LINE__, "Function call failed: " #expr, desc, 0)
+#define cl_check_fail_(expr, desc) clar__assert((expr) < 0, __FILE__, __LINE__, "Expected function call to fail: " #expr, desc, 0)
+#define cl_check_(expr, desc) clar__assert((expr) != 0, __FILE__, __LINE__, "Expression is not true: " #expr, desc, 0)
+
+/**
+ * Assertion macros with no error message
+ */
+#define cl_must_pass(expr) cl_must_pass_(expr, NULL)
+#define cl_must_fail(expr) cl_must_fail_(expr, NULL)
+#define cl_assert(expr) cl_assert_(expr, NULL)
+
+/**
+ * Check macros with no error message
+ */
+#define cl_check_pass(expr) cl_check_pass_(expr, NULL)
+#define cl_check_fail(expr) cl_check_fail_(expr, NULL)
+#define cl_check(expr) cl_check_(expr, NULL)
+
+/**
+ * Forced failure/warning
+ */
+#define cl_fail(desc) clar__assert(0, __FILE__, __LINE__, "Test failed.", desc, 1)
+#define cl_warning(desc) clar__assert(0, __FILE__, __LINE__, "Warning during test execution:", desc, 0)
+
+/**
+ * Typed assertion macros
+ */
+#define cl_assert_equal_s(s1,s2) clar__assert_equal_s((s1),(s2),__FILE__,__LINE__,"String mismatch: " #s1 " != " #s2, 1)
+#define cl_assert_equal_i(i1,i2) clar__assert_equal_i((i1),(i2),__FILE__,__LINE__,#i1 " != " #i2, 1)
+#define cl_assert_equal_b(b1,b2) clar__assert_equal_i(!!(b1),!!(b2),__FILE__,__LINE__,#b1 " != " #b2, 1)
+#define cl_assert_equal_p(p1,p2) cl_assert((p1) == (p2))
+
+/**
+ * Test method declarations
+ */
+extern void clar_on_init(void);
+extern void clar_on_shutdown(void);
+extern void test_attr_file__assign_variants(void);
+extern void test_attr_file__check_attr_examples(void);
+extern void test_attr_file__match_variants(void);
+extern void test_attr_file__simple_read(void);
+extern void test_attr_flags__bare(void);
+extern void test_attr_flags__cleanup(void);
+extern void test_attr_flags__index_vs_workdir(void);
+extern void test_attr_flags__subdir(void);
+extern void test_attr_lookup__assign_variants(void);
+extern void test_attr_lookup__check_attr_examples(void);
+extern void test_attr_lookup__from_buffer(void);
+extern void test_attr_lookup__match_variants(void);
+extern void test_attr_lookup__simple(void);
+extern void test_attr_repo__bad_macros(void);
+extern void test_attr_repo__cleanup(void);
+extern void test_attr_repo__foreach(void);
+extern void test_attr_repo__get_many(void);
+extern void test_attr_repo__get_one(void);
+extern void test_attr_repo__initialize(void);
+extern void test_attr_repo__macros(void);
+extern void test_attr_repo__manpage_example(void);
+extern void test_attr_repo__staging_properly_normalizes_line_endings_according_to_gitattributes_directives(void);
+extern void test_buf_basic__printf(void);
+extern void test_buf_basic__resize(void);
+extern void test_buf_splice__append(void);
+extern void test_buf_splice__cleanup(void);
+extern void test_buf_splice__dont_do_anything(void);
+extern void test_buf_splice__initialize(void);
+extern void test_buf_splice__insert_at(void);
+extern void test_buf_splice__preprend(void);
+extern void test_buf_splice__remove_at(void);
+extern void test_buf_splice__replace(void);
+extern void test_buf_splice__replace_with_longer(void);
+extern void test_buf_splice__replace_with_shorter(void);
+extern void test_buf_splice__truncate(void);
+extern void test_checkout_head__checking_out_an_orphaned_head_returns_GIT_EORPHANEDHEAD(void);
+extern void test_checkout_head__cleanup(void);
+extern void test_checkout_head__initialize(void);
+extern void test_checkout_index__calls_progress_callback(void);
+extern void test_checkout_index__can_create_missing_files(void);
+extern void test_checkout_index__can_notify_of_skipped_files(void);
+extern void test_checkout_index__can_overwrite_modified_file(void);
+extern void test_checkout_index__can_remove_untracked_files(void);
+extern void test_checkout_index__cannot_checkout_a_bare_repository(void);
+extern void test_checkout_index__cleanup(void);
+extern void test_checkout_index__donot_overwrite_modified_file_by_default(void);
+extern void test_checkout_index__honor_coreautocrlf_setting_set_to_true(void);
+extern void test_checkout_index__honor_coresymlinks_setting_set_to_false(void);
+extern void test_checkout_index__honor_coresymlinks_setting_set_to_true(void);
+extern void test_checkout_index__honor_the_gitattributes_directives(void);
+extern void test_checkout_index__honor_the_specified_pathspecs(void);
+extern void test_checkout_index__initialize(void);
+extern void test_checkout_index__notify_callback_can_stop_the_writes(void);
+extern void test_checkout_index__options_dir_modes(void);
+extern void test_checkout_index__options_disable_filters(void);
+extern void test_checkout_index__options_open_flags(void);
+extern void test_checkout_index__options_override_file_modes(void);
+extern void test_checkout_index__refreshes_the_index_stat_data(void);
+extern void test_checkout_index__stops_at_a_file_which_cant_be_written(void);
+extern void test_checkout_index__wont_notify_of_expected_line_ending_changes(void);
+extern void test_checkout_index__writes_many_files_in_order(void);
+extern void test_checkout_tree__calls_progress_callback(void);
+extern void test_checkout_tree__can_checkout_a_subdirectory_from_a_commit(void);
+extern void test_checkout_tree__can_checkout_a_subdirectory_from_a_subtree(void);
+extern void test_checkout_tree__cannot_checkout_a_non_treeish(void);
+extern void test_checkout_tree__cleanup(void);
+extern void test_checkout_tree__initialize(void);
+extern void test_checkout_typechange__checkout_typechanges(void);
+extern void test_checkout_typechange__cleanup(void);
+extern void test_checkout_typechange__initialize(void);
+extern void test_clone_network__can_checkout_a_cloned_repo(void);
+extern void test_clone_network__can_prevent_the_checkout_of_a_standard_repo(void);
+extern void test_clone_network__cope_with_already_existing_directory(void);
+extern void test_clone_network__empty_repository(void);
+extern void test_clone_network__initialize(void);
+extern void test_clone_network__network_bare(void);
+extern void test_clone_network__network_full(void);
+extern void test_clone_nonetwork__bad_url(void);
+extern void test_clone_nonetwork__fail_when_the_target_is_a_file(void);
+extern void test_clone_nonetwork__fail_with_already_existing_but_non_empty_directory(void);
+extern void test_clone_nonetwork__initialize(void);
+extern void test_clone_nonetwork__local(void);
+extern void test_clone_nonetwork__local_bare(void);
+extern void test_commit_commit__cleanup(void);
+extern void test_commit_commit__create_unexisting_update_ref(void);
+extern void test_commit_commit__initialize(void);
+extern void test_commit_parent__can_retrieve_nth_generation_parent(void);
+extern void test_commit_parent__cleanup(void);
+extern void test_commit_parent__initialize(void);
+extern void test_commit_parse__cleanup(void);
+extern void test_commit_parse__details0(void);
+extern void test_commit_parse__entire_commit(void);
+extern void test_commit_parse__header(void);
+extern void test_commit_parse__initialize(void);
+extern void test_commit_parse__signature(void);
+extern void test_commit_signature__angle_brackets_in_email_are_not_supported(void);
+extern void test_commit_signature__angle_brackets_in_names_are_not_supported(void);
+extern void test_commit_signature__create_empties(void);
+extern void test_commit_signature__create_one_char(void);
+extern void test_commit_signature__create_two_char(void);
+extern void test_commit_signature__create_zero_char(void);
+extern void test_commit_signature__leading_and_trailing_spaces_are_trimmed(void);
+extern void test_commit_write__cleanup(void);
+extern void test_commit_write__from_memory(void);
+extern void test_commit_write__initialize(void);
+extern void test_commit_write__root(void);
+extern void test_config_add__cleanup(void);
+extern void test_config_add__initialize(void);
+extern void test_config_add__to_existing_section(void);
+extern void test_config_add__to_new_section(void);
+extern void test_config_configlevel__adding_the_same_level_twice_returns_EEXISTS(void);
+extern void test_config_configlevel__can_read_from_a_single_level_focused_file_after_parent_config_has_been_freed(void);
+extern void test_config_configlevel__can_replace_a_config_file_at_an_existing_level(void);
+extern void test_config_multivar__add(void);
+extern void test_config_multivar__cleanup(void);
+extern void test_config_multivar__foreach(void);
+extern void test_config_multivar__get(void);
+extern void test_config_multivar__initialize(void);
+extern void test_config_multivar__replace(void);
+extern void test_config_multivar__replace_multiple(void);
+extern void test_config_new__write_new_config(void);
+extern void test_config_read__blank_lines(void);
+extern void test_config_read__case_sensitive(void);
+extern void test_config_read__empty_files(void);
+extern void test_config_read__escaping_quotes(void);
+extern void test_config_read__fallback_from_local_to_global_and_from_global_to_system(void);
+extern void test_config_read__foreach(void);
+extern void test_config_read__foreach_match(void);
+extern void test_config_read__header_in_last_line(void);
+extern void test_config_read__invalid_ext_headers(void);
+extern void test_config_read__local_config_overrides_global_config_overrides_system_config(void);
+extern void test_config_read__lone_variable(void);
+extern void test_config_read__multiline_value(void);
+extern void test_config_read__number_suffixes(void);
+extern void test_config_read__prefixes(void);
+extern void test_config_read__read_git_config_entry(void);
+extern void test_config_read__simple_read(void);
+extern void test_config_read__simple_read_from_specific_level(void);
+extern void test_config_read__subsection_header(void);
+extern void test_config_read__whitespace_not_required_around_assignment(void);
+extern void test_config_stress__cleanup(void);
+extern void test_config_stress__comments(void);
+extern void test_config_stress__dont_break_on_invalid_input(void);
+extern void test_config_stress__escape_subsection_names(void);
+extern void test_config_stress__initialize(void);
+extern void test_config_write__add_value_at_file_with_no_clrf_at_the_end(void);
+extern void test_config_write__add_value_at_specific_level(void);
+extern void test_config_write__cleanup(void);
+extern void test_config_write__delete_inexistent(void);
+extern void test_config_write__delete_value(void);
+extern void test_config_write__delete_value_at_specific_level(void);
+extern void test_config_write__escape_value(void);
+extern void test_config_write__initialize(void);
+extern void test_config_write__replace_value(void);
+extern void test_config_write__value_containing_quotes(void);
+extern void test_config_write__write_subsection(void);
+extern void test_core_buffer__0(void);
+extern void test_core_buffer__1(void);
+extern void test_core_buffer__10(void);
+extern void test_core_buffer__11(void);
+extern void test_core_buffer__2(void);
+extern void test_core_buffer__3(void);
+extern void test_core_buffer__4(void);
+extern void test_core_buffer__5(void);
+extern void test_core_buffer__6(void);
+extern void test_core_buffer__7(void);
+extern void test_core_buffer__8(void);
+extern void test_core_buffer__9(void);
+extern void test_core_buffer__base64(void);
+extern void test_core_buffer__puts_escaped(void);
+extern void test_core_buffer__rfind_variants(void);
+extern void test_core_buffer__unescape(void);
+extern void test_core_copy__file(void);
+extern void test_core_copy__file_in_dir(void);
+extern void test_core_copy__tree(void);
+extern void test_core_dirent__dont_traverse_dot(void);
+extern void test_core_dirent__dont_traverse_empty_folders(void);
+extern void test_core_dirent__length_limits(void);
+extern void test_core_dirent__traverse_slash_terminated_folder(void);
+extern void test_core_dirent__traverse_subfolder(void);
+extern void test_core_dirent__traverse_weird_filenames(void);
+extern void test_core_env__0(void);
+extern void test_core_env__1(void);
+extern void test_core_env__cleanup(void);
+extern void test_core_env__initialize(void);
+extern void test_core_errors__new_school(void);
+extern void test_core_errors__public_api(void);
+extern void test_core_filebuf__0(void);
+extern void test_core_filebuf__1(void);
+extern void test_core_filebuf__2(void);
+extern void test_core_filebuf__4(void);
+extern void test_core_filebuf__5(void);
+extern void test_core_hex__fromhex(void);
+extern void test_core_mkdir__basic(void);
+extern void test_core_mkdir__chmods(void);
+extern void test_core_mkdir__with_base(void);
+extern void test_core_oid__initialize(void);
+extern void test_core_oid__streq(void);
+extern void test_core_path__00_dirname(void);
+extern void test_core_path__01_basename(void);
+extern void test_core_path__02_topdir(void);
+extern void test_core_path__05_joins(void);
+extern void test_core_path__06_long_joins(void);
+extern void test_core_path__07_path_to_dir(void);
+extern void test_core_path__08_self_join(void);
+extern void test_core_path__09_percent_decode(void);
+extern void test_core_path__10_fromurl(void);
+extern void test_core_path__11_walkup(void);
+extern void test_core_path__12_offset_to_path_root(void);
+extern void test_core_path__13_cannot_prettify_a_non_existing_file(void);
+extern void test_core_path__14_apply_relative(void);
+extern void test_core_pool__0(void);
+extern void test_core_pool__1(void);
+extern void test_core_pool__2(void);
+extern void test_core_rmdir__can_skip__non_empty_dir(void);
+extern void test_core_rmdir__delete_recursive(void);
+extern void test_core_rmdir__fail_to_delete_non_empty_dir(void);
+extern void test_core_rmdir__initialize(void);
+extern void test_core_string__0(void);
+extern void test_core_string__1(void);
+extern void test_core_strmap__0(void);
+extern void test_core_strmap__1(void);
+extern void test_core_strmap__2(void);
+extern void test_core_strmap__3(void);
+extern void test_core_strtol__int32(void);
+extern void test_core_strtol__int64(void);
+extern void test_core_vector__0(void);
+extern void test_core_vector__1(void);
+extern void test_core_vector__2(void);
+extern void test_core_vector__3(void);
+extern void test_core_vector__4(void);
+extern void test_core_vector__5(void);
+extern void test_core_vector__remove_matching(void);
+extern void test_date_date__overflow(void);
+extern void test_diff_blob__can_compare_a_binary_blob_and_a_text_blob(void);
+extern void test_diff_blob__can_compare_against_null_blobs(void);
+extern void test_diff_blob__can_compare_identical_blobs(void);
+extern void test_diff_blob__can_compare_text_blobs(void);
+extern void test_diff_blob__can_compare_two_binary_blobs(void);
+extern void test_diff_blob__can_use_the_histogram_algorithm(void);
+extern void test_diff_blob__can_use_the_patience_algorithm(void);
+extern void test_diff_blob__cleanup(void);
+extern void test_diff_blob__comparing_two_text_blobs_honors_interhunkcontext(void);
+extern void test_diff_blob__initialize(void);
+extern void test_diff_diffiter__cleanup(void);
+extern void test_diff_diffiter__create(void);
+extern void test_diff_diffiter__initialize(void);
+extern void test_diff_diffiter__iterate_all(void);
+extern void test_diff_diffiter__iterate_files(void);
+extern void test_diff_diffiter__iterate_files_2(void);
+extern void test_diff_diffiter__iterate_files_and_hunks(void);
+extern void test_diff_diffiter__iterate_randomly_while_saving_state(void);
+extern void test_diff_diffiter__max_size_threshold(void);
+extern void test_diff_index__0(void);
+extern void test_diff_index__1(void);
+extern void test_diff_index__cleanup(void);
+extern void test_diff_index__initialize(void);
+extern void test_diff_iterator__cleanup(void);
+extern void test_diff_iterator__index_0(void);
+extern void test_diff_iterator__index_1(void);
+extern void test_diff_iterator__index_range(void);
+extern void test_diff_iterator__index_range_empty_0(void);
+extern void test_diff_iterator__index_range_empty_1(void);
+extern void test_diff_iterator__index_range_empty_2(void);
+extern void test_diff_iterator__initialize(void);
+extern void test_diff_iterator__tree_0(void);
+extern void test_diff_iterator__tree_1(void);
+extern void test_diff_iterator__tree_2(void);
+extern void test_diff_iterator__tree_3(void);
+extern void test_diff_iterator__tree_4(void);
+extern void test_diff_iterator__tree_4_ranged(void);
+extern void test_diff_iterator__tree_range_empty_0(void);
+extern void test_diff_iterator__tree_range_empty_1(void);
+extern void test_diff_iterator__tree_range_empty_2(void);
+extern void test_diff_iterator__tree_ranged_0(void);
+extern void test_diff_iterator__tree_ranged_1(void);
+extern void test_diff_iterator__tree_special_functions(void);
+extern void test_diff_iterator__tree_with_subtrees(void);
+extern void test_diff_iterator__workdir_0(void);
+extern void test_diff_iterator__workdir_1(void);
+extern void test_diff_iterator__workdir_1_ranged_0(void);
+extern void test_diff_iterator__workdir_1_ranged_1(void);
+extern void test_diff_iterator__workdir_1_ranged_3(void);
+extern void test_diff_iterator__workdir_1_ranged_4(void);
+extern void test_diff_iterator__workdir_1_ranged_5(void);
+extern void test_diff_iterator__workdir_1_ranged_empty_0(void);
+extern void test_diff_iterator__workdir_1_ranged_empty_1(void);
+extern void test_diff_iterator__workdir_1_ranged_empty_2(void);
+extern void test_diff_iterator__workdir_directories_past_the_range_are_not_read_ahead(void);
+extern void test_diff_iterator__workdir_many_directories_stay_in_order(void);
+extern void test_diff_iterator__workdir_single_directory_is_not_read_ahead(void);
+extern void test_diff_parallel__callbacks_can_stop_it(void);
+extern void test_diff_parallel__cleanup(void);
+extern void test_diff_parallel__initialize(void);
+extern void test_diff_parallel__tree_to_tree(void);
+extern void test_diff_parallel__workdir_to_index(void);
+extern void test_diff_patch__can_properly_display_the_removal_of_a_file(void);
+extern void test_diff_patch__cleanup(void);
+extern void test_diff_patch__initialize(void);
+extern void test_diff_rename__a_file_is_only_renamed_once(void);
+extern void test_diff_rename__cleanup(void);
+extern void test_diff_rename__copies_of_unmodified_files_can_be_found(void);
+extern void test_diff_rename__exact_renames_are_found(void);
+extern void test_diff_rename__initialize(void);
+extern void test_diff_rename__many_similar_files_are_paired_up(void);
+extern void test_diff_rename__patches_say_where_files_came_from(void);
+extern void test_diff_rename__similar_files_are_found(void);
+extern void test_diff_rename__untracked_files_are_only_used_when_asked(void);
+extern void test_diff_stats__cleanup(void);
+extern void test_diff_stats__initialize(void);
+extern void test_diff_stats__tree_to_tree(void);
+extern void test_diff_stats__workdir_to_index(void);
+extern void test_diff_tree__0(void);
+extern void test_diff_tree__bare(void);
+extern void test_diff_tree__cleanup(void);
+extern void test_diff_tree__initialize(void);
+extern void test_diff_tree__larger_hunks(void);
+extern void test_diff_tree__merge(void);
+extern void test_diff_tree__options(void);
+extern void test_diff_tree__same_subtrees_are_not_loaded(void);
+extern void test_diff_workdir__binary_check_reads_only_the_start_of_files(void);
+extern void test_diff_workdir__cannot_diff_against_a_bare_repository(void);
+extern void test_diff_workdir__cleanup(void);
+extern void test_diff_workdir__eof_newline_changes(void);
+extern void test_diff_workdir__filemode_changes(void);
+extern void test_diff_workdir__filemode_changes_with_filemode_false(void);
+extern void test_diff_workdir__head_index_and_workdir_all_differ(void);
+extern void test_diff_workdir__initialize(void);
+extern void test_diff_workdir__larger_hunks(void);
+extern void test_diff_workdir__many_files_to_hash(void);
+extern void test_diff_workdir__submodules(void);
+extern void test_diff_workdir__to_index(void);
+extern void test_diff_workdir__to_index_with_pathspec(void);
+extern void test_diff_workdir__to_tree(void);
+extern void test_index_conflicts__add(void);
+extern void test_index_conflicts__add_fixes_incorrect_stage(void);
+extern void test_index_conflicts__cleanup(void);
+extern void test_index_conflicts__get(void);
+extern void test_index_conflicts__initialize(void);
+extern void test_index_conflicts__moved_to_reuc(void);
+extern void test_index_conflicts__partial(void);
+extern void test_index_conflicts__remove(void);
+extern void test_index_conflicts__remove_all_conflicts(void);
+extern void test_index_filemodes__cleanup(void);
+extern void test_index_filemodes__initialize(void);
+extern void test_index_filemodes__read(void);
+extern void test_index_filemodes__trusted(void);
+extern void test_index_filemodes__untrusted(void);
+extern void test_index_racy__cleanup(void);
+extern void test_index_racy__diff_does_not_trust_racy_entries(void);
+extern void test_index_racy__entries_record_subsecond_times(void);
+extern void test_index_racy__initialize(void);
+extern void test_index_racy__write_leaves_racily_clean_entries(void);
+extern void test_index_racy__write_smudges_racily_modified_entries(void);
+extern void test_index_read_tree__read_write_involution(void);
+extern void test_index_rename__single_file(void);
+extern void test_index_reuc__cleanup(void);
+extern void test_index_reuc__ignore_case(void);
+extern void test_index_reuc__initialize(void);
+extern void test_index_reuc__read_byindex(void);
+extern void test_index_reuc__read_bypath(void);
+extern void test_index_reuc__remove(void);
+extern void test_index_reuc__updates_existing(void);
+extern void test_index_reuc__write(void);
+extern void test_index_split__cleanup(void);
+extern void test_index_split__initialize(void);
+extern void test_index_split__many_changes_rewrite_the_shared_index(void);
+extern void test_index_split__missing_shared_index(void);
+extern void test_index_split__rewriting_the_shared_index_reuses_memory(void);
+extern void test_index_split__small_changes_leave_the_shared_index(void);
+extern void test_index_split__turning_it_off_writes_a_whole_index(void);
+extern void test_index_split__write_shared_and_split_index(void);
+extern void test_index_stage__add_always_adds_stage_0(void);
+extern void test_index_stage__cleanup(void);
+extern void test_index_stage__find_gets_first_stage(void);
+extern void test_index_stage__initialize(void);
+extern void test_index_tests__add(void);
+extern void test_index_tests__change_entries_read_from_disk(void);
+extern void test_index_tests__cleanup(void);
+extern void test_index_tests__default_test_index(void);
+extern void test_index_tests__empty_index(void);
+extern void test_index_tests__find_in_empty(void);
+extern void test_index_tests__find_in_existing(void);
+extern void test_index_tests__gitgit_index(void);
+extern void test_index_tests__initialize(void);
+extern void test_index_tests__sort0(void);
+extern void test_index_tests__sort1(void);
+extern void test_index_tests__write(void);
+extern void test_index_tests__write_and_read_offset_table(void);
+extern void test_index_tests__write_and_read_version_4(void);
+extern void test_index_tree_cache__adding_invalidates_the_path(void);
+extern void test_index_tree_cache__cleanup(void);
+extern void test_index_tree_cache__initialize(void);
+extern void test_index_tree_cache__read_tree_primes_the_cache(void);
+extern void test_index_tree_cache__removed_directories_leave_the_cache(void);
+extern void test_index_tree_cache__survives_writing_the_index(void);
+extern void test_index_tree_cache__write_tree_fills_the_cache(void);
+extern void test_network_createremotethenload__cleanup(void);
+extern void test_network_createremotethenload__initialize(void);
+extern void test_network_createremotethenload__parsing(void);
+extern void test_network_fetch__cleanup(void);
+extern void test_network_fetch__default_git(void);
+extern void test_network_fetch__default_http(void);
+extern void test_network_fetch__initialize(void);
+extern void test_network_fetch__no_tags_git(void);
+extern void test_network_fetch__no_tags_http(void);
+extern void test_network_refspecs__parsing(void);
+extern void test_network_remotelocal__cleanup(void);
+extern void test_network_remotelocal__connected(void);
+extern void test_network_remotelocal__initialize(void);
+extern void test_network_remotelocal__nested_tags_are_completely_peeled(void);
+extern void test_network_remotelocal__retrieve_advertised_references(void);
+extern void test_network_remotelocal__retrieve_advertised_references_from_spaced_repository(void);
+extern void test_network_remoterename__cannot_overwrite_an_existing_remote(void);
+extern void test_network_remoterename__cleanup(void);
+extern void test_network_remoterename__initialize(void);
+extern void test_network_remoterename__new_name_can_contain_dots(void);
+extern void test_network_remoterename__new_name_must_conform_to_reference_naming_conventions(void);
+extern void test_network_remoterename__renamed_name_is_persisted(void);
+extern void test_network_remoterename__renaming_a_remote_moves_related_configuration_section(void);
+extern void test_network_remoterename__renaming_a_remote_moves_the_underlying_reference(void);
+extern void test_network_remoterename__renaming_a_remote_notifies_of_non_default_fetchrefspec(void);
+extern void test_network_remoterename__renaming_a_remote_updates_branch_related_configuration_entries(void);
+extern void test_network_remoterename__renaming_a_remote_updates_default_fetchrefspec(void);
+extern void test_network_remoterename__renaming_a_remote_without_a_fetchrefspec_doesnt_create_one(void);
+extern void test_network_remoterename__renaming_an_inmemory_nameless_remote_notifies_the_inability_to_update_the_fetch_refspec(void);
+extern void test_network_remoterename__renaming_an_inmemory_remote_persists_it(void);
+extern void test_network_remotes__add(void);
+extern void test_network_remotes__cannot_add_a_nameless_remote(void);
+extern void test_network_remotes__cannot_save_a_nameless_remote(void);
+extern void test_network_remotes__cleanup(void);
+extern void test_network_remotes__fnmatch(void);
+extern void test_network_remotes__initialize(void);
+extern void test_network_remotes__list(void);
+extern void test_network_remotes__loading_a_missing_remote_returns_ENOTFOUND(void);
+extern void test_network_remotes__missing_refspecs(void);
+extern void test_network_remotes__parsing(void);
+extern void test_network_remotes__parsing_local_path_fails_if_path_not_found(void);
+extern void test_network_remotes__parsing_ssh_remote(void);
+extern void test_network_remotes__pushurl(void);
+extern void test_network_remotes__refspec_parsing(void);
+extern void test_network_remotes__save(void);
+extern void test_network_remotes__set_fetchspec(void);
+extern void test_network_remotes__set_pushspec(void);
+extern void test_network_remotes__supported_transport_methods_are_supported(void);
+extern void test_network_remotes__tagopt(void);
+extern void test_network_remotes__transform(void);
+extern void test_network_remotes__transform_r(void);
+extern void test_network_remotes__unsupported_transport_methods_are_unsupported(void);
+extern void test_notes_notes__can_cancel_foreach(void);
+extern void test_notes_notes__can_insert_a_note_in_an_existing_fanout(void);
+extern void test_notes_notes__can_insert_a_note_with_a_custom_namespace(void);
+extern void test_notes_notes__can_read_a_note_in_an_existing_fanout(void);
+extern void test_notes_notes__can_remove_a_note_in_an_existing_fanout(void);
+extern void test_notes_notes__can_retrieve_a_list_of_notes_for_a_given_namespace(void);
+extern void test_notes_notes__cleanup(void);
+extern void test_notes_notes__creating_a_note_on_a_target_which_already_has_one_returns_EEXISTS(void);
+extern void test_notes_notes__initialize(void);
+extern void test_notes_notes__inserting_a_note_without_passing_a_namespace_uses_the_default_namespace(void);
+extern void test_notes_notes__removing_a_note_which_doesnt_exists_returns_ENOTFOUND(void);
+extern void test_notes_notes__retrieving_a_list_of_notes_for_an_unknown_namespace_returns_ENOTFOUND(void);
+extern void test_notes_notesref__cleanup(void);
+extern void test_notes_notesref__config_corenotesref(void);
+extern void test_notes_notesref__initialize(void);
+extern void test_object_blob_filter__cleanup(void);
+extern void test_object_blob_filter__initialize(void);
+extern void test_object_blob_filter__stats(void);
+extern void test_object_blob_filter__to_odb(void);
+extern void test_object_blob_filter__unfiltered(void);
+extern void test_object_blob_fromchunks__can_create_a_blob_from_a_in_memory_chunk_provider(void);
+extern void test_object_blob_fromchunks__cleanup(void);
+extern void test_object_blob_fromchunks__creating_a_blob_from_chunks_honors_the_attributes_directives(void);
+extern void test_object_blob_fromchunks__initialize(void);
+extern void test_object_blob_write__can_create_a_blob_in_a_bare_repo_from_a_absolute_filepath(void);
+extern void test_object_blob_write__can_create_a_blob_in_a_standard_repo_from_a_absolute_filepath_pointing_outside_of_the_working_directory(void);
+extern void test_object_blob_write__can_create_a_blob_in_a_standard_repo_from_a_file_located_in_the_working_directory(void);
+extern void test_object_blob_write__cleanup(void);
+extern void test_object_commit_commitstagedfile__cleanup(void);
+extern void test_object_commit_commitstagedfile__generate_predictable_object_ids(void);
+extern void test_object_commit_commitstagedfile__initialize(void);
+extern void test_object_lookup__cleanup(void);
+extern void test_object_lookup__initialize(void);
+extern void test_object_lookup__lookup_nonexisting_returns_enotfound(void);
+extern void test_object_lookup__lookup_wrong_type_by_abbreviated_id_returns_enotfound(void);
+extern void test_object_lookup__lookup_wrong_type_eventually_returns_enotfound(void);
+extern void test_object_lookup__lookup_wrong_type_returns_enotfound(void);
+extern void test_object_message__consecutive_blank_lines_at_the_beginning_should_be_removed(void);
+extern void test_object_message__consecutive_blank_lines_at_the_end_should_be_removed(void);
+extern void test_object_message__consecutive_blank_lines_should_be_unified(void);
+extern void test_object_message__consecutive_text_lines_should_be_unchanged(void);
+extern void test_object_message__keep_comments(void);
+extern void test_object_message__lines_with_intermediate_spaces_should_be_unchanged(void);
+extern void test_object_message__lines_with_spaces_at_the_beginning_should_be_unchanged(void);
+extern void test_object_message__long_lines_without_spaces_should_be_unchanged(void);
+extern void test_object_message__message_prettify(void);
+extern void test_object_message__only_consecutive_blank_lines_should_be_completely_removed(void);
+extern void test_object_message__spaces_with_newline_at_end_should_be_replaced_with_empty_string(void);
+extern void test_object_message__spaces_without_newline_at_end_should_be_replaced_with_empty_string(void);
+extern void test_object_message__strip_comments(void);
+extern void test_object_message__text_plus_spaces_ending_with_newline_should_be_cleaned_and_newline_must_remain(void);
+extern void test_object_message__text_plus_spaces_without_newline_should_not_show_spaces_and_end_with_newline(void);
+extern void test_object_message__text_without_newline_at_end_should_end_with_newline(void);
+extern void test_object_peel__can_peel_a_commit(void);
+extern void test_object_peel__can_peel_a_tag(void);
+extern void test_object_peel__cannot_peel_a_blob(void);
+extern void test_object_peel__cannot_peel_a_tree(void);
+extern void test_object_peel__cleanup(void);
+extern void test_object_peel__initialize(void);
+extern void test_object_peel__peeling_an_object_into_its_own_type_returns_another_instance_of_it(void);
+extern void test_object_peel__target_any_object_for_type_change(void);
+extern void test_object_raw_chars__build_valid_oid_from_raw_bytes(void);
+extern void test_object_raw_chars__find_invalid_chars_in_oid(void);
+extern void test_object_raw_compare__compare_allocfmt_oids(void);
+extern void test_object_raw_compare__compare_fmt_oids(void);
+extern void test_object_raw_compare__compare_pathfmt_oids(void);
+extern void test_object_raw_compare__succeed_on_copy_oid(void);
+extern void test_object_raw_compare__succeed_on_oid_comparison_equal(void);
+extern void test_object_raw_compare__succeed_on_oid_comparison_greater(void);
+extern void test_object_raw_compare__succeed_on_oid_comparison_lesser(void);
+extern void test_object_raw_convert__succeed_on_oid_to_string_conversion(void);
+extern void test_object_raw_convert__succeed_on_oid_to_string_conversion_big(void);
+extern void test_object_raw_fromstr__fail_on_invalid_oid_string(void);
+extern void test_object_raw_fromstr__succeed_on_valid_oid_string(void);
+extern void test_object_raw_hash__hash_buffer_in_single_call(void);
+extern void test_object_raw_hash__hash_by_blocks(void);
+extern void test_object_raw_hash__hash_commit_object(void);
+extern void test_object_raw_hash__hash_junk_data(void);
+extern void test_object_raw_hash__hash_multi_byte_object(void);
+extern void test_object_raw_hash__hash_one_byte_object(void);
+extern void test_object_raw_hash__hash_tag_object(void);
+extern void test_object_raw_hash__hash_tree_object(void);
+extern void test_object_raw_hash__hash_two_byte_object(void);
+extern void test_object_raw_hash__hash_vector(void);
+extern void test_object_raw_hash__hash_zero_length_object(void);
+extern void test_object_raw_short__oid_shortener_no_duplicates(void);
+extern void test_object_raw_short__oid_shortener_stresstest_git_oid_shorten(void);
+extern void test_object_raw_size__validate_oid_size(void);
+extern void test_object_raw_type2string__check_type_is_loose(void);
+extern void test_object_raw_type2string__convert_string_to_type(void);
+extern void test_object_raw_type2string__convert_type_to_string(void);
+extern void test_object_raw_write__loose_object(void);
+extern void test_object_raw_write__loose_tag(void);
+extern void test_object_raw_write__loose_tree(void);
+extern void test_object_raw_write__one_byte(void);
+extern void test_object_raw_write__several_bytes(void);
+extern void test_object_raw_write__two_byte(void);
+extern void test_object_raw_write__zero_length(void);
+extern void test_object_tag_list__cleanup(void);
+extern void test_object_tag_list__initialize(void);
+extern void test_object_tag_list__list_all(void);
+extern void test_object_tag_list__list_by_pattern(void);
+extern void test_object_tag_peel__can_peel_several_nested_tags_to_a_commit(void);
+extern void test_object_tag_peel__can_peel_to_a_commit(void);
+extern void test_object_tag_peel__can_peel_to_a_non_commit(void);
+extern void test_object_tag_peel__cleanup(void);
+extern void test_object_tag_peel__initialize(void);
+extern void test_object_tag_read__cleanup(void);
+extern void test_object_tag_read__initialize(void);
+extern void test_object_tag_read__parse(void);
+extern void test_object_tag_read__parse_without_tagger(void);
+extern void test_object_tag_write__basic(void);
+extern void test_object_tag_write__cleanup(void);
+extern void test_object_tag_write__delete(void);
+extern void test_object_tag_write__initialize(void);
+extern void test_object_tag_write__lightweight(void);
+extern void test_object_tag_write__lightweight_over_existing(void);
+extern void test_object_tag_write__overwrite(void);
+extern void test_object_tag_write__replace(void);
+extern void test_object_tree_attributes__ensure_correctness_of_attributes_on_insertion(void);
+extern void test_object_tree_attributes__group_writable_tree_entries_created_with_an_antique_git_version_can_still_be_accessed(void);
+extern void test_object_tree_attributes__normalize_attributes_when_creating_a_tree_from_an_existing_one(void);
+extern void test_object_tree_attributes__normalize_attributes_when_inserting_in_a_new_tree(void);
+extern void test_object_tree_frompath__cleanup(void);
+extern void test_object_tree_frompath__fail_when_processing_an_invalid_path(void);
+extern void test_object_tree_frompath__initialize(void);
+extern void test_object_tree_frompath__retrieve_tree_from_path_to_treeentry(void);
+extern void test_object_tree_read__cleanup(void);
+extern void test_object_tree_read__initialize(void);
+extern void test_object_tree_read__loaded(void);
+extern void test_object_tree_read__two(void);
+extern void test_object_tree_walk__0(void);
+extern void test_object_tree_walk__1(void);
+extern void test_object_tree_walk__cleanup(void);
+extern void test_object_tree_walk__initialize(void);
+extern void test_object_tree_write__cleanup(void);
+extern void test_object_tree_write__from_memory(void);
+extern void test_object_tree_write__initialize(void);
+extern void test_object_tree_write__sorted_subtrees(void);
+extern void test_object_tree_write__subtree(void);
+extern void test_odb_foreach__cleanup(void);
+extern void test_odb_foreach__foreach(void);
+extern void test_odb_foreach__interrupt_foreach(void);
+extern void test_odb_foreach__one_pack(void);
+extern void test_odb_loose__cleanup(void);
+extern void test_odb_loose__exists(void);
+extern void test_odb_loose__initialize(void);
+extern void test_odb_loose__simple_reads(void);
+extern void test_odb_mixed__cleanup(void);
+extern void test_odb_mixed__dup_oid(void);
+extern void test_odb_mixed__initialize(void);
+extern void test_odb_packed__cleanup(void);
+extern void test_odb_packed__initialize(void);
+extern void test_odb_packed__mass_read(void);
+extern void test_odb_packed__read_header_0(void);
+extern void test_odb_packed__read_header_1(void);
+extern void test_odb_packed_one__cleanup(void);
+extern void test_odb_packed_one__initialize(void);
+extern void test_odb_packed_one__mass_read(void);
+extern void test_odb_packed_one__read_header_0(void);
+extern void test_odb_sorting__alternate_backends_sorting(void);
+extern void test_odb_sorting__basic_backends_sorting(void);
+extern void test_odb_sorting__cleanup(void);
+extern void test_odb_sorting__initialize(void);
+extern void test_pack_indexer__cleanup(void);
+extern void test_pack_indexer__corrupt_object_is_an_error(void);
+extern void test_pack_indexer__dropped_stream_can_be_started_over(void);
+extern void test_pack_indexer__initialize(void);
+extern void test_pack_indexer__pack_a_byte_at_a_time(void);
+extern void test_pack_indexer__pack_in_4k_pieces(void);
+extern void test_pack_indexer__truncated_pack_is_an_error(void);
+extern void test_pack_indexer__whole_pack_at_once(void);
+extern void test_pack_packbuilder__cleanup(void);
+extern void test_pack_packbuilder__create_pack(void);
+extern void test_pack_packbuilder__deltas_stay_within_islands(void);
+extern void test_pack_packbuilder__foreach_streams_the_pack(void);
+extern void test_pack_packbuilder__initialize(void);
+extern void test_pack_packbuilder__stream_indexer_verifies_trailer(void);
+extern void test_refs_branches_create__can_create_a_local_branch(void);
+extern void test_refs_branches_create__can_force_create_over_an_existing_branch(void);
+extern void test_refs_branches_create__can_not_create_a_branch_if_its_name_collide_with_an_existing_one(void);
+extern void test_refs_branches_create__can_not_create_a_branch_pointing_to_a_non_commit_object(void);
+extern void test_refs_branches_create__cleanup(void);
+extern void test_refs_branches_create__creating_a_branch_targeting_a_tag_dereferences_it_to_its_commit(void);
+extern void test_refs_branches_create__initialize(void);
+extern void test_refs_branches_delete__can_delete_a_branch_even_if_HEAD_is_missing(void);
+extern void test_refs_branches_delete__can_delete_a_branch_pointed_at_by_detached_HEAD(void);
+extern void test_refs_branches_delete__can_delete_a_branch_when_HEAD_is_orphaned(void);
+extern void test_refs_branches_delete__can_delete_a_local_branch(void);
+extern void test_refs_branches_delete__can_delete_a_remote_branch(void);
+extern void test_refs_branches_delete__can_not_delete_a_branch_pointed_at_by_HEAD(void);
+extern void test_refs_branches_delete__cleanup(void);
+extern void test_refs_branches_delete__deleting_a_branch_removes_related_configuration_data(void);
+extern void test_refs_branches_delete__initialize(void);
+extern void test_refs_branches_foreach__can_cancel(void);
+extern void test_refs_branches_foreach__cleanup(void);
+extern void test_refs_branches_foreach__initialize(void);
+extern void test_refs_branches_foreach__retrieve_all_branches(void);
+extern void test_refs_branches_foreach__retrieve_local_branches(void);
+extern void test_refs_branches_foreach__retrieve_remote_branches(void);
+extern void test_refs_branches_foreach__retrieve_remote_symbolic_HEAD_when_present(void);
+extern void test_refs_branches_ishead__can_properly_handle_orphaned_HEAD(void);
+extern void test_refs_branches_ishead__can_tell_if_a_branch_is_not_pointed_at_by_HEAD(void);
+extern void test_refs_branches_ishead__can_tell_if_a_branch_is_pointed_at_by_HEAD(void);
+extern void test_refs_branches_ishead__cleanup(void);
+extern void test_refs_branches_ishead__initialize(void);
+extern void test_refs_branches_ishead__only_direct_references_are_considered(void);
+extern void test_refs_branches_ishead__wont_be_fooled_by_a_non_branch(void);
+extern void test_refs_branches_lookup__can_retrieve_a_local_branch(void);
+extern void test_refs_branches_lookup__can_retrieve_a_remote_tracking_branch(void);
+extern void test_refs_branches_lookup__cleanup(void);
+extern void test_refs_branches_lookup__initialize(void);
+extern void test_refs_branches_lookup__trying_to_retrieve_an_unknown_branch_returns_ENOTFOUND(void);
+extern void test_refs_branches_move__can_force_move_over_an_existing_branch(void);
+extern void test_refs_branches_move__can_move_a_local_branch(void);
+extern void test_refs_branches_move__can_move_a_local_branch_to_a_different_namespace(void);
+extern void test_refs_branches_move__can_move_a_local_branch_to_a_partially_colliding_namespace(void);
+extern void test_refs_branches_move__can_not_move_a_branch_if_its_destination_name_collide_with_an_existing_one(void);
+extern void test_refs_branches_move__can_not_move_a_non_branch(void);
+extern void test_refs_branches_move__cleanup(void);
+extern void test_refs_branches_move__initialize(void);
+extern void test_refs_branches_move__moving_a_branch_moves_related_configuration_data(void);
+extern void test_refs_branches_move__moving_the_branch_pointed_at_by_HEAD_updates_HEAD(void);
+extern void test_refs_branches_tracking__can_retrieve_the_local_tracking_reference_of_a_local_branch(void);
+extern void test_refs_branches_tracking__can_retrieve_the_remote_tracking_reference_of_a_local_branch(void);
+extern void test_refs_branches_tracking__cannot_retrieve_a_remote_tracking_reference_from_a_non_branch(void);
+extern void test_refs_branches_tracking__cleanup(void);
+extern void test_refs_branches_tracking__initialize(void);
+extern void test_refs_branches_tracking__trying_to_retrieve_a_remote_tracking_reference_from_a_branch_with_no_fetchspec_returns_GIT_ENOTFOUND(void);
+extern void test_refs_branches_tracking__trying_to_retrieve_a_remote_tracking_reference_from_a_plain_local_branch_returns_GIT_ENOTFOUND(void);
+extern void test_refs_crashes__double_free(void);
+extern void test_refs_create__cleanup(void);
+extern void test_refs_create__deep_symbolic(void);
+extern void test_refs_create__initialize(void);
+extern void test_refs_create__oid(void);
+extern void test_refs_create__oid_unknown(void);
+extern void test_refs_create__propagate_eexists(void);
+extern void test_refs_create__symbolic(void);
+extern void test_refs_delete__cleanup(void);
+extern void test_refs_delete__initialize(void);
+extern void test_refs_delete__packed_loose(void);
+extern void test_refs_delete__packed_only(void);
+extern void test_refs_foreachglob__can_cancel(void);
+extern void test_refs_foreachglob__cleanup(void);
+extern void test_refs_foreachglob__initialize(void);
+extern void test_refs_foreachglob__retrieve_all_refs(void);
+extern void test_refs_foreachglob__retrieve_local_branches(void);
+extern void test_refs_foreachglob__retrieve_partially_named_references(void);
+extern void test_refs_foreachglob__retrieve_remote_branches(void);
+extern void test_refs_isvalidname__can_detect_invalid_formats(void);
+extern void test_refs_isvalidname__wont_hopefully_choke_on_valid_formats(void);
+extern void test_refs_list__all(void);
+extern void test_refs_list__cleanup(void);
+extern void test_refs_list__do_not_retrieve_references_which_name_end_with_a_lock_extension(void);
+extern void test_refs_list__initialize(void);
+extern void test_refs_list__symbolic_only(void);
+extern void test_refs_listall__from_repository_opened_through_gitdir_path(void);
+extern void test_refs_listall__from_repository_opened_through_workdir_path(void);
+extern void test_refs_lookup__cleanup(void);
+extern void test_refs_lookup__initialize(void);
+extern void test_refs_lookup__oid(void);
+extern void test_refs_lookup__with_resolve(void);
+extern void test_refs_normalize__buffer_has_to_be_big_enough_to_hold_the_normalized_version(void);
+extern void test_refs_normalize__can_normalize_a_direct_reference_name(void);
+extern void test_refs_normalize__cannot_normalize_any_direct_reference_name(void);
+extern void test_refs_normalize__jgit_suite(void);
+extern void test_refs_normalize__refspec_pattern(void);
+extern void test_refs_normalize__symbolic(void);
+extern void test_refs_overwrite__cleanup(void);
+extern void test_refs_overwrite__initialize(void);
+extern void test_refs_overwrite__object_id(void);
+extern void test_refs_overwrite__object_id_with_symbolic(void);
+extern void test_refs_overwrite__symbolic(void);
+extern void test_refs_overwrite__symbolic_with_object_id(void);
+extern void test_refs_pack__cleanup(void);
+extern void test_refs_pack__empty(void);
+extern void test_refs_pack__initialize(void);
+extern void test_refs_pack__loose(void);
+extern void test_refs_peel__can_peel_a_branch(void);
+extern void test_refs_peel__can_peel_a_symbolic_reference(void);
+extern void test_refs_peel__can_peel_a_tag(void);
+extern void test_refs_peel__can_peel_into_any_non_tag_object(void);
+extern void test_refs_peel__cannot_peel_into_a_non_existing_target(void);
+extern void test_refs_peel__cleanup(void);
+extern void test_refs_peel__initialize(void);
+extern void test_refs_read__can_determine_if_a_reference_is_a_local_branch(void);
+extern void test_refs_read__chomped(void);
+extern void test_refs_read__cleanup(void);
+extern void test_refs_read__head_then_master(void);
+extern void test_refs_read__initialize(void);
+extern void test_refs_read__loose_first(void);
+extern void test_refs_read__loose_tag(void);
+extern void test_refs_read__master_then_head(void);
+extern void test_refs_read__nested_symbolic(void);
+extern void test_refs_read__nonexisting_tag(void);
+extern void test_refs_read__packed(void);
+extern void test_refs_read__symbolic(void);
+extern void test_refs_read__trailing(void);
+extern void test_refs_read__unfound_return_ENOTFOUND(void);
+extern void test_refs_reflog_drop__can_drop_all_the_entries(void);
+extern void test_refs_reflog_drop__can_drop_an_entry(void);
+extern void test_refs_reflog_drop__can_drop_an_entry_and_rewrite_the_log_history(void);
+extern void test_refs_reflog_drop__can_drop_the_oldest_entry(void);
+extern void test_refs_reflog_drop__can_drop_the_oldest_entry_and_rewrite_the_log_history(void);
+extern void test_refs_reflog_drop__can_persist_deletion_on_disk(void);
+extern void test_refs_reflog_drop__cleanup(void);
+extern void test_refs_reflog_drop__dropping_a_non_exisiting_entry_from_the_log_returns_ENOTFOUND(void);
+extern void test_refs_reflog_drop__initialize(void);
+extern void test_refs_reflog_reflog__append_then_read(void);
+extern void test_refs_reflog_reflog__cannot_write_a_moved_reflog(void);
+extern void test_refs_reflog_reflog__cleanup(void);
+extern void test_refs_reflog_reflog__initialize(void);
+extern void test_refs_reflog_reflog__reading_the_reflog_from_a_reference_with_no_log_returns_an_empty_one(void);
+extern void test_refs_reflog_reflog__reference_has_reflog(void);
+extern void test_refs_reflog_reflog__renaming_the_reference_moves_the_reflog(void);
+extern void test_refs_rename__cleanup(void);
+extern void test_refs_rename__force_loose(void);
+extern void test_refs_rename__force_loose_packed(void);
+extern void test_refs_rename__initialize(void);
+extern void test_refs_rename__invalid_name(void);
+extern void test_refs_rename__loose(void);
+extern void test_refs_rename__move_up(void);
+extern void test_refs_rename__name_collision(void);
+extern void test_refs_rename__overwrite(void);
+extern void test_refs_rename__packed(void);
+extern void test_refs_rename__packed_doesnt_pack_others(void);
+extern void test_refs_rename__prefix(void);
+extern void test_refs_rename__propagate_eexists(void);
+extern void test_refs_revparse__a_too_short_objectid_returns_EAMBIGUOUS(void);
+extern void test_refs_revparse__chaining(void);
+extern void test_refs_revparse__cleanup(void);
+extern void test_refs_revparse__colon(void);
+extern void test_refs_revparse__date(void);
+extern void test_refs_revparse__describe_output(void);
+extern void test_refs_revparse__disambiguation(void);
+extern void test_refs_revparse__full_refs(void);
+extern void test_refs_revparse__head(void);
+extern void test_refs_revparse__initialize(void);
+extern void test_refs_revparse__invalid_reference_name(void);
+extern void test_refs_revparse__issue_994(void);
+extern void test_refs_revparse__linear_history(void);
+extern void test_refs_revparse__nonexistant_object(void);
+extern void test_refs_revparse__not_tag(void);
+extern void test_refs_revparse__nth_parent(void);
+extern void test_refs_revparse__ordinal(void);
+extern void test_refs_revparse__partial_refs(void);
+extern void test_refs_revparse__previous_head(void);
+extern void test_refs_revparse__reflog_of_a_ref_under_refs(void);
+extern void test_refs_revparse__revwalk(void);
+extern void test_refs_revparse__shas(void);
+extern void test_refs_revparse__to_type(void);
+extern void test_refs_revparse__upstream(void);
+extern void test_refs_unicode__cleanup(void);
+extern void test_refs_unicode__create_and_lookup(void);
+extern void test_refs_unicode__initialize(void);
+extern void test_repo_discover__0(void);
+extern void test_repo_getters__cleanup(void);
+extern void test_repo_getters__empty(void);
+extern void test_repo_getters__initialize(void);
+extern void test_repo_getters__retrieving_the_odb_honors_the_refcount(void);
+extern void test_repo_hashfile__cleanup(void);
+extern void test_repo_hashfile__filtered(void);
+extern void test_repo_hashfile__initialize(void);
+extern void test_repo_hashfile__simple(void);
+extern void test_repo_head__can_tell_if_an_orphaned_head_is_detached(void);
+extern void test_repo_head__cleanup(void);
+extern void test_repo_head__detach_head_Detaches_HEAD_and_make_it_point_to_the_peeled_commit(void);
+extern void test_repo_head__detach_head_Fails_if_HEAD_and_point_to_a_non_commitish(void);
+extern void test_repo_head__detaching_an_orphaned_head_returns_GIT_EORPHANEDHEAD(void);
+extern void test_repo_head__head_detached(void);
+extern void test_repo_head__head_orphan(void);
+extern void test_repo_head__initialize(void);
+extern void test_repo_head__retrieving_an_orphaned_head_returns_GIT_EORPHANEDHEAD(void);
+extern void test_repo_head__set_head_Attaches_HEAD_to_un_unborn_branch_when_the_branch_doesnt_exist(void);
+extern void test_repo_head__set_head_Attaches_HEAD_when_the_reference_points_to_a_branch(void);
+extern void test_repo_head__set_head_Detaches_HEAD_when_the_reference_doesnt_point_to_a_branch(void);
+extern void test_repo_head__set_head_Fails_when_the_reference_points_to_a_non_commitish(void);
+extern void test_repo_head__set_head_Returns_ENOTFOUND_when_the_reference_doesnt_exist(void);
+extern void test_repo_head__set_head_detached_Detaches_HEAD_and_make_it_point_to_the_peeled_commit(void);
+extern void test_repo_head__set_head_detached_Fails_when_the_object_isnt_a_commitish(void);
+extern void test_repo_head__set_head_detached_Return_ENOTFOUND_when_the_object_doesnt_exist(void);
+extern void test_repo_init__additional_templates(void);
+extern void test_repo_init__bare_repo(void);
+extern void test_repo_init__bare_repo_escaping_current_workdir(void);
+extern void test_repo_init__bare_repo_noslash(void);
+extern void test_repo_init__can_reinit_an_initialized_repository(void);
+extern void test_repo_init__detect_filemode(void);
+extern void test_repo_init__detect_ignorecase(void);
+extern void test_repo_init__extended_0(void);
+extern void test_repo_init__extended_1(void);
+extern void test_repo_init__extended_with_template(void);
+extern void test_repo_init__initialize(void);
+extern void test_repo_init__reinit_bare_repo(void);
+extern void test_repo_init__reinit_doesnot_overwrite_ignorecase(void);
+extern void test_repo_init__reinit_overwrites_filemode(void);
+extern void test_repo_init__reinit_too_recent_bare_repo(void);
+extern void test_repo_init__sets_logAllRefUpdates_according_to_type_of_repository(void);
+extern void test_repo_init__standard_repo(void);
+extern void test_repo_init__standard_repo_noslash(void);
+extern void test_repo_message__cleanup(void);
+extern void test_repo_message__initialize(void);
+extern void test_repo_message__message(void);
+extern void test_repo_message__none(void);
+extern void test_repo_open__bad_gitlinks(void);
+extern void test_repo_open__bare_empty_repo(void);
+extern void test_repo_open__cleanup(void);
+extern void test_repo_open__failures(void);
+extern void test_repo_open__from_git_new_workdir(void);
+extern void test_repo_open__gitlinked(void);
+extern void test_repo_open__open_with_discover(void);
+extern void test_repo_open__opening_a_non_existing_repository_returns_ENOTFOUND(void);
+extern void test_repo_open__standard_empty_repo_through_gitdir(void);
+extern void test_repo_open__standard_empty_repo_through_workdir(void);
+extern void test_repo_open__win32_path(void);
+extern void test_repo_setters__cleanup(void);
+extern void test_repo_setters__initialize(void);
+extern void test_repo_setters__setting_a_new_index_on_a_repo_which_has_already_loaded_one_properly_honors_the_refcount(void);
+extern void test_repo_setters__setting_a_new_odb_on_a_repo_which_already_loaded_one_properly_honors_the_refcount(void);
+extern void test_repo_setters__setting_a_workdir_creates_a_gitlink(void);
+extern void test_repo_setters__setting_a_workdir_prettifies_its_path(void);
+extern void test_repo_setters__setting_a_workdir_turns_a_bare_repository_into_a_standard_one(void);
+extern void test_repo_state__cherry_pick(void);
+extern void test_repo_state__cleanup(void);
+extern void test_repo_state__initialize(void);
+extern void test_repo_state__merge(void);
+extern void test_repo_state__none(void);
+extern void test_repo_state__revert(void);
+extern void test_reset_hard__cannot_reset_in_a_bare_repository(void);
+extern void test_reset_hard__cleans_up_merge(void);
+extern void test_reset_hard__cleanup(void);
+extern void test_reset_hard__initialize(void);
+extern void test_reset_hard__resetting_culls_empty_directories(void);
+extern void test_reset_mixed__cannot_reset_in_a_bare_repository(void);
+extern void test_reset_mixed__cleanup(void);
+extern void test_reset_mixed__initialize(void);
+extern void test_reset_mixed__resetting_refreshes_the_index_to_the_commit_tree(void);
+extern void test_reset_soft__can_reset_the_detached_Head_to_the_specified_commit(void);
+extern void test_reset_soft__can_reset_the_non_detached_Head_to_the_specified_commit(void);
+extern void test_reset_soft__cannot_reset_to_a_tag_not_pointing_at_a_commit(void);
+extern void test_reset_soft__cleanup(void);
+extern void test_reset_soft__fails_when_merging(void);
+extern void test_reset_soft__initialize(void);
+extern void test_reset_soft__resetting_against_an_orphaned_head_repo_makes_the_head_no_longer_orphaned(void);
+extern void test_reset_soft__resetting_to_a_tag_sets_the_Head_to_the_peeled_commit(void);
+extern void test_reset_soft__resetting_to_the_commit_pointed_at_by_the_Head_does_not_change_the_target_of_the_Head(void);
+extern void test_revwalk_basic__cleanup(void);
+extern void test_revwalk_basic__disallow_non_commit(void);
+extern void test_revwalk_basic__glob_heads(void);
+extern void test_revwalk_basic__initialize(void);
+extern void test_revwalk_basic__push_head(void);
+extern void test_revwalk_basic__push_head_hide_ref(void);
+extern void test_revwalk_basic__push_head_hide_ref_nobase(void);
+extern void test_revwalk_basic__sorting_modes(void);
+extern void test_revwalk_mergebase__cleanup(void);
+extern void test_revwalk_mergebase__initialize(void);
+extern void test_revwalk_mergebase__many_merge_branch(void);
+extern void test_revwalk_mergebase__many_no_common_ancestor_returns_ENOTFOUND(void);
+extern void test_revwalk_mergebase__merged_branch(void);
+extern void test_revwalk_mergebase__no_common_ancestor_returns_ENOTFOUND(void);
+extern void test_revwalk_mergebase__no_off_by_one_missing(void);
+extern void test_revwalk_mergebase__single1(void);
+extern void test_revwalk_mergebase__single2(void);
+extern void test_revwalk_signatureparsing__cleanup(void);
+extern void test_revwalk_signatureparsing__do_not_choke_when_name_contains_angle_brackets(void);
+extern void test_revwalk_signatureparsing__initialize(void);
+extern void test_stash_drop__can_purge_the_stash_from_the_bottom(void);
+extern void test_stash_drop__can_purge_the_stash_from_the_top(void);
+extern void test_stash_drop__cannot_drop_a_non_existing_stashed_state(void);
+extern void test_stash_drop__cannot_drop_from_an_empty_stash(void);
+extern void test_stash_drop__cleanup(void);
+extern void test_stash_drop__dropping_an_entry_rewrites_reflog_history(void);
+extern void test_stash_drop__dropping_the_last_entry_removes_the_stash(void);
+extern void test_stash_drop__initialize(void);
+extern void test_stash_foreach__can_enumerate_a_repository(void);
+extern void test_stash_foreach__cleanup(void);
+extern void test_stash_foreach__enumerating_a_empty_repository_doesnt_fail(void);
+extern void test_stash_foreach__initialize(void);
+extern void test_stash_save__can_accept_a_message(void);
+extern void test_stash_save__can_include_untracked_and_ignored_files(void);
+extern void test_stash_save__can_include_untracked_files(void);
+extern void test_stash_save__can_keep_index(void);
+extern void test_stash_save__can_stage_normal_then_stage_untracked(void);
+extern void test_stash_save__can_stash_against_a_detached_head(void);
+extern void test_stash_save__cannot_stash_against_a_bare_repository(void);
+extern void test_stash_save__cannot_stash_against_an_unborn_branch(void);
+extern void test_stash_save__cannot_stash_when_there_are_no_local_change(void);
+extern void test_stash_save__cleanup(void);
+extern void test_stash_save__does_not_keep_index_by_default(void);
+extern void test_stash_save__including_untracked_without_any_untracked_file_creates_an_empty_tree(void);
+extern void test_stash_save__initialize(void);
+extern void test_stash_save__stashing_updates_the_reflog(void);
+extern void test_status_fsmonitor__cleanup(void);
+extern void test_status_fsmonitor__everything_can_be_reported(void);
+extern void test_status_fsmonitor__failing_monitor_fails_status(void);
+extern void test_status_fsmonitor__initialize(void);
+extern void test_status_fsmonitor__monitor_is_asked_with_its_last_token(void);
+extern void test_status_fsmonitor__reported_changes_match_a_full_scan(void);
+extern void test_status_fsmonitor__token_and_unchanged_entries_are_saved(void);
+extern void test_status_fsmonitor__unreported_changes_are_not_looked_for(void);
+extern void test_status_ignore__0(void);
+extern void test_status_ignore__1(void);
+extern void test_status_ignore__add_internal_as_first_thing(void);
+extern void test_status_ignore__adding_internal_ignores(void);
+extern void test_status_ignore__cleanup(void);
+extern void test_status_ignore__empty_repo_with_gitignore_rewrite(void);
+extern void test_status_ignore__ignore_pattern_contains_space(void);
+extern void test_status_ignore__ignore_pattern_ignorecase(void);
+extern void test_status_ignore__initialize(void);
+extern void test_status_ignore__internal_ignores_inside_deep_paths(void);
+extern void test_status_ignore__subdirectories(void);
+extern void test_status_single__hash_single_empty_file(void);
+extern void test_status_single__hash_single_file(void);
+extern void test_status_submodules__0(void);
+extern void test_status_submodules__1(void);
+extern void test_status_submodules__api(void);
+extern void test_status_submodules__cleanup(void);
+extern void test_status_submodules__initialize(void);
+extern void test_status_submodules__single_file(void);
+extern void test_status_untracked_cache__changed_ignore_rules_invalidate(void);
+extern void test_status_untracked_cache__cleanup(void);
+extern void test_status_untracked_cache__initialize(void);
+extern void test_status_untracked_cache__is_not_written_unless_enabled(void);
+extern void test_status_untracked_cache__is_written_to_the_index(void);
+extern void test_status_untracked_cache__new_files_are_found(void);
+extern void test_status_untracked_cache__removing_from_the_index_invalidates(void);
+extern void test_status_untracked_cache__tracked_directories_are_not_listed(void);
+extern void test_status_untracked_cache__unchanged_directories_are_not_reread(void);
+extern void test_status_worktree__bracket_in_filename(void);
+extern void test_status_worktree__cannot_retrieve_the_status_of_a_bare_repository(void);
+extern void test_status_worktree__cleanup(void);
+extern void test_status_worktree__disable_pathspec_match(void);
+extern void test_status_worktree__empty_repository(void);
+extern void test_status_worktree__filemode_changes(void);
+extern void test_status_worktree__first_commit_in_progress(void);
+extern void test_status_worktree__ignores(void);
+extern void test_status_worktree__initialize(void);
+extern void test_status_worktree__interruptable_foreach(void);
+extern void test_status_worktree__issue_592(void);
+extern void test_status_worktree__issue_592_2(void);
+extern void test_status_worktree__issue_592_3(void);
+extern void test_status_worktree__issue_592_4(void);
+extern void test_status_worktree__issue_592_5(void);
+extern void test_status_worktree__issue_592_ignored_dirs_with_tracked_content(void);
+extern void test_status_worktree__issue_592_ignores_0(void);
+extern void test_status_worktree__line_endings_dont_count_as_changes_with_autocrlf(void);
+extern void test_status_worktree__new_staged_file_must_handle_crlf(void);
+extern void test_status_worktree__purged_worktree(void);
+extern void test_status_worktree__single_file(void);
+extern void test_status_worktree__single_file_empty_repo(void);
+extern void test_status_worktree__single_folder(void);
+extern void test_status_worktree__single_nonexistent_file(void);
+extern void test_status_worktree__single_nonexistent_file_empty_repo(void);
+extern void test_status_worktree__space_in_filename(void);
+extern void test_status_worktree__status_file_with_clean_index_and_empty_workdir(void);
+extern void test_status_worktree__status_file_without_index_or_workdir(void);
+extern void test_status_worktree__swap_subdir_and_file(void);
+extern void test_status_worktree__swap_subdir_with_recurse_and_pathspec(void);
+extern void test_status_worktree__update_index_records_stat_of_unchanged_files(void);
+extern void test_status_worktree__whole_repository(void);
+extern void test_submodule_lookup__accessors(void);
+extern void test_submodule_lookup__cleanup(void);
+extern void test_submodule_lookup__foreach(void);
+extern void test_submodule_lookup__initialize(void);
+extern void test_submodule_lookup__simple_lookup(void);
+extern void test_submodule_modify__add(void);
+extern void test_submodule_modify__cleanup(void);
+extern void test_submodule_modify__edit_and_save(void);
+extern void test_submodule_modify__init(void);
+extern void test_submodule_modify__initialize(void);
+extern void test_submodule_modify__sync(void);
+extern void test_submodule_status__cleanup(void);
+extern void test_submodule_status__ignore_all(void);
+extern void test_submodule_status__ignore_dirty(void);
+extern void test_submodule_status__ignore_none(void);
+extern void test_submodule_status__ignore_untracked(void);
+extern void test_submodule_status__initialize(void);
+extern void test_submodule_status__unchanged(void);
+extern void test_threads_basic__cache(void);
+extern void test_threads_basic__cleanup(void);
+extern void test_threads_basic__initialize(void);
+
+#endif
@@ -312,3 +312,172 @@ void test_diff_blob__comparing_two_text_blobs_honors_interhunkcontext(void)
 
 	git_blob_free(old_d);
 }
+
+static int diff_hunk_skip(
+	void *cb_data,
+	const git_diff_delta *delta,
+	const git_diff_range *range,
+	const char *header,
+	size_t header_len)
+{
+	GIT_UNUSED(cb_data);
+	GIT_UNUSED(delta);
+	GIT_UNUSED(range);
+	GIT_UNUSED(header);
+	GIT_UNUSED(header_len);
+	return 0;
+}
+
+static int diff_line_to_buf(
+	void *cb_data,
+	const git_diff_delta *delta,
+	const git_diff_range *range,
+	char line_origin,
+	const char *content,
+	size_t content_len)
+{
+	git_buf *out = cb_data;
+
+	GIT_UNUSED(delta);
+	GIT_UNUSED(range);
+
+	git_buf_putc(out, line_origin);
+	git_buf_put(out, content, content_len);
+
+	return git_buf_oom(out) ? -1 : 0;
+}
+
+static const char *frobnitz_old =
+	"#include <stdio.h>\n"
+	"\n"
+	"// Frobs foo heartily\n"
+	"int frobnitz(int foo)\n"
+	"{\n"
+	"    int i;\n"
+	"    for(i = 0; i < 10; i++)\n"
+	"    {\n"
+	"        printf(\"Your answer is: \");\n"
+	"        printf(\"%d\\n\", foo);\n"
+	"    }\n"
+	"}\n"
+	"\n"
+	"int fact(int n)\n"
+	"{\n"
+	"    if(n > 1)\n"
+	"    {\n"
+	"        return fact(n-1) * n;\n"
+	"    }\n"
+	"    return 1;\n"
+	"}\n"
+	"\n"
+	"int main(int argc, char **argv)\n"
+	"{\n"
+	"    frobnitz(fact(10));\n"
+	"}\n";
+
+static const char *frobnitz_new =
+	"#include <stdio.h>\n"
+	"\n"
+	"int fib(int n)\n"
+	"{\n"
+	"    if(n > 2)\n"
+	"    {\n"
+	"        return fib(n-1) + fib(n-2);\n"
+	"    }\n"
+	"    return 1;\n"
+	"}\n"
+	"\n"
+	"// Frobs foo heartily\n"
+	"int frobnitz(int foo)\n"
+	"{\n"
+	"    int i;\n"
+	"    for(i = 0; i < 10; i++)\n"
+	"    {\n"
+	"        printf(\"%d\\n\", foo);\n"
+	"    }\n"
+	"}\n"
+	"\n"
+	"int main(int argc, char **argv)\n"
+	"{\n"
+	"    frobnitz(fib(10));\n"
+	"}\n";
+
+/* what core git gives with --patience or --histogram */
+static const char *frobnitz_patience =
+	" #include <stdio.h>\n"
+	" \n"
+	"+int fib(int n)\n"
+	"+{\n"
+	"+    if(n > 2)\n"
+	"+    {\n"
+	"+        return fib(n-1) + fib(n-2);\n"
+	"+    }\n"
+	"+    return 1;\n"
+	"+}\n"
+	"+\n"
+	" // Frobs foo heartily\n"
+	" int frobnitz(int foo)\n"
+	" {\n"
+	"     int i;\n"
+	"     for(i = 0; i < 10; i++)\n"
+	"     {\n"
+	"-        printf(\"Your answer is: \");\n"
+	"         printf(\"%d\\n\", foo);\n"
+	"     }\n"
+	" }\n"
+	" \n"
+	"-int fact(int n)\n"
+	"-{\n"
+	"-    if(n > 1)\n"
+	"-    {\n"
+	"-        return fact(n-1) * n;\n"
+	"-    }\n"
+	"-    return 1;\n"
+	"-}\n"
+	"-\n"
+	" int main(int argc, char **argv)\n"
+	" {\n"
+	"-    frobnitz(fact(10));\n"
+	"+    frobnitz(fib(10));\n"
+	" }\n";
+
+static void assert_frobnitz_diff(uint32_t flags, bool expect_patience)
+{
+	git_blob *old_blob, *new_blob;
+	git_oid oid;
+	git_buf out = GIT_BUF_INIT;
+
+	cl_git_pass(git_blob_create_frombuffer(
+		&oid, g_repo, frobnitz_old, strlen(frobnitz_old)));
+	cl_git_pass(git_blob_lookup(&old_blob, g_repo, &oid));
+	cl_git_pass(git_blob_create_frombuffer(
+		&oid, g_repo, frobnitz_new, strlen(frobnitz_new)));
+	cl_git_pass(git_blob_lookup(&new_blob, g_repo, &oid));
+
+	opts.context_lines = 30;
+	opts.flags = flags;
+
+	cl_git_pass(git_diff_blobs(
+		old_blob, new_blob, &opts, &out, NULL, diff_hunk_skip, diff_line_to_buf));
+
+	if (expect_patience)
+		cl_assert_equal_s(frobnitz_patience, out.ptr);
+	else
+		cl_assert(strcmp(frobnitz_patience, out.ptr) != 0);
+
+	git_buf_free(&out);
+	git_blob_free(old_blob);
+	git_blob_free(new_blob);
+}
+
+void test_diff_blob__can_use_the_patience_algorithm(void)
+{
+	assert_frobnitz_diff(GIT_DIFF_NORMAL, false);
+	assert_frobnitz_diff(GIT_DIFF_PATIENCE, true);
+}
+
+void test_diff_blob__can_use_the_histogram_algorithm(void)
+{
+	assert_frobnitz_diff(GIT_DIFF_HISTOGRAM, true);
+	assert_frobnitz_diff(GIT_DIFF_HISTOGRAM | GIT_DIFF_PATIENCE, true);
+}
@@ -44,6 +44,8 @@ int diff_file_fn(
 	case GIT_DELTA_IGNORED: e->file_ignored++; break;
 	case GIT_DELTA_UNTRACKED: e->file_untracked++; break;
 	case GIT_DELTA_UNMODIFIED: e->file_unmodified++; break;
+	case GIT_DELTA_RENAMED: e->file_renamed++; break;
+	case GIT_DELTA_COPIED: e->file_copied++; break;
 	default: break;
 	}
 	return 0;
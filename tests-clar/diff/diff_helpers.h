@@ -25,6 +25,9 @@ typedef struct {
 	int line_dels;
 
 	bool at_least_one_of_them_is_binary;
+
+	int file_renamed;
+	int file_copied;
 } diff_expects;
 
 extern int diff_file_fn(
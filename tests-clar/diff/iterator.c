@@ -238,6 +238,67 @@ void test_diff_iterator__tree_range_empty_2(void)
 		NULL, ".aaa_empty_before", 0, NULL);
 }
 
+/* results of walking 24fa9a9 with subtrees, going into "sub/" only */
+const char *expected_tree_subtrees[] = {
+	"attr0",
+	"attr1",
+	"attr2",
+	"attr3",
+	"binfile",
+	"gitattributes",
+	"macro_bad",
+	"macro_test",
+	"root_test1",
+	"root_test2",
+	"root_test3",
+	"root_test4.txt",
+	"sub/",
+	"sub/abc",
+	"sub/file",
+	"sub/sub/",
+	"sub/subdir_test1",
+	"sub/subdir_test2.txt",
+	"subdir/",
+	"subdir2/",
+	NULL
+};
+
+void test_diff_iterator__tree_with_subtrees(void)
+{
+	git_repository *repo = cl_git_sandbox_init("attr");
+	git_tree *t;
+	git_iterator *i;
+	const git_index_entry *entry;
+	const git_tree_entry *te;
+	int count = 0;
+
+	cl_assert(t = resolve_commit_oid_to_tree(
+		repo, "24fa9a9fc4e202313e24b648087495441dab432b"));
+	cl_git_pass(git_iterator_for_tree_range_with_subtrees(
+		&i, repo, t, NULL, NULL));
+	cl_git_pass(git_iterator_current(i, &entry));
+
+	while (entry != NULL) {
+		cl_assert_equal_s(expected_tree_subtrees[count], entry->path);
+		count++;
+
+		if (S_ISDIR(entry->mode)) {
+			cl_git_pass(git_iterator_current_tree_entry(i, &te));
+			cl_assert(git_oid_cmp(&te->oid, &entry->oid) == 0);
+		}
+
+		if (strcmp(entry->path, "sub/") == 0)
+			cl_git_pass(git_iterator_advance_into_directory(i, &entry));
+		else
+			cl_git_pass(git_iterator_advance(i, &entry));
+	}
+
+	cl_assert_equal_i(20, count);
+
+	git_iterator_free(i);
+	git_tree_free(t);
+}
+
 static void check_tree_entry(
 	git_iterator *i,
 	const char *oid,
@@ -668,3 +729,137 @@ void test_diff_iterator__workdir_1_ranged_empty_2(void)
 		"status", NULL, "aaaa_empty_before",
 		0, 0, NULL, NULL);
 }
+
+static void make_many_directories(git_repository *repo)
+{
+	git_index *index;
+	git_buf path = GIT_BUF_INIT;
+	int d, e;
+
+	cl_git_pass(git_repository_index(&index, repo));
+
+	/* tracked directories get read ahead, untracked ones as we go */
+	for (d = 0; d < 20; ++d) {
+		for (e = 0; e < 5; ++e) {
+			cl_git_pass(git_buf_printf(&path, "empty_standard_repo/d%02d/e%d", d, e));
+			cl_git_pass(git_futils_mkdir_r(path.ptr, NULL, 0777));
+
+			cl_git_pass(git_buf_puts(&path, "/file"));
+			cl_git_mkfile(path.ptr, "content\n");
+			if (e % 2 == 0)
+				cl_git_pass(git_index_add_from_workdir(
+					index, path.ptr + strlen("empty_standard_repo/")));
+
+			git_buf_clear(&path);
+		}
+	}
+
+	cl_git_pass(git_index_write(index));
+	git_index_free(index);
+	git_buf_free(&path);
+}
+
+static int walk_into_directories(git_iterator *i, git_buf *last)
+{
+	const git_index_entry *entry;
+	int count = 0;
+
+	cl_git_pass(git_iterator_current(i, &entry));
+
+	while (entry != NULL) {
+		if (S_ISDIR(entry->mode)) {
+			cl_git_pass(git_iterator_advance_into_directory(i, &entry));
+			continue;
+		}
+
+		cl_assert(strcmp(last->ptr, entry->path) < 0);
+		cl_git_pass(git_buf_sets(last, entry->path));
+		count++;
+
+		cl_git_pass(git_iterator_advance(i, &entry));
+	}
+
+	return count;
+}
+
+static size_t assert_prefetched(git_iterator *i, bool threads)
+{
+	size_t nr_threads, prefetched, pending;
+
+	git_iterator__workdir_prefetched(i, &nr_threads, &prefetched, &pending);
+
+	/* nothing gets read ahead which the iterator doesn't go into */
+	cl_assert_equal_i(0, pending);
+#ifdef GIT_THREADS
+	cl_assert_equal_i(threads, nr_threads > 0);
+#else
+	GIT_UNUSED(threads);
+#endif
+
+	return prefetched;
+}
+
+void test_diff_iterator__workdir_many_directories_stay_in_order(void)
+{
+	git_repository *repo = cl_git_sandbox_init("empty_standard_repo");
+	git_iterator *i;
+	git_buf last = GIT_BUF_INIT;
+
+	make_many_directories(repo);
+
+	cl_git_pass(git_iterator_for_workdir_range(&i, repo, NULL, NULL));
+	cl_assert_equal_i(100, walk_into_directories(i, &last));
+	cl_assert_equal_s("d19/e4/file", last.ptr);
+
+	/* the order has to hold up with listings which were read ahead */
+#ifdef GIT_THREADS
+	cl_assert(assert_prefetched(i, true) > 0);
+#else
+	assert_prefetched(i, true);
+#endif
+
+	git_iterator_free(i);
+	git_buf_free(&last);
+}
+
+void test_diff_iterator__workdir_directories_past_the_range_are_not_read_ahead(void)
+{
+	git_repository *repo = cl_git_sandbox_init("empty_standard_repo");
+	git_iterator *i;
+	git_buf last = GIT_BUF_INIT;
+
+	make_many_directories(repo);
+
+	cl_git_pass(git_iterator_for_workdir_range(&i, repo, NULL, "d05/"));
+	cl_assert_equal_i(30, walk_into_directories(i, &last));
+	cl_assert_equal_s("d05/e4/file", last.ptr);
+
+	assert_prefetched(i, true);
+
+	git_iterator_free(i);
+	git_buf_free(&last);
+}
+
+void test_diff_iterator__workdir_single_directory_is_not_read_ahead(void)
+{
+	git_repository *repo = cl_git_sandbox_init("empty_standard_repo");
+	git_index *index;
+	git_iterator *i;
+	git_buf last = GIT_BUF_INIT;
+
+	cl_git_pass(git_repository_index(&index, repo));
+	cl_git_pass(git_futils_mkdir_r("empty_standard_repo/only", NULL, 0777));
+	cl_git_mkfile("empty_standard_repo/only/file", "content\n");
+	cl_git_pass(git_index_add_from_workdir(index, "only/file"));
+	cl_git_pass(git_index_write(index));
+
+	cl_git_pass(git_iterator_for_workdir_range(&i, repo, NULL, NULL));
+	cl_assert_equal_i(1, walk_into_directories(i, &last));
+
+	/* there's nothing to do alongside it, so no threads either */
+	assert_prefetched(i, false);
+
+	git_iterator_free(i);
+	git_index_free(index);
+	git_buf_free(&last);
+}
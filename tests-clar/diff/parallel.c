@@ -0,0 +1,167 @@
+#include "clar_libgit2.h"
+#include "diff_helpers.h"
+
+static git_repository *g_repo = NULL;
+
+void test_diff_parallel__initialize(void)
+{
+}
+
+void test_diff_parallel__cleanup(void)
+{
+	cl_git_sandbox_cleanup();
+}
+
+static int print_to_buf(
+	void *cb_data,
+	const git_diff_delta *delta,
+	const git_diff_range *range,
+	char line_origin,
+	const char *content,
+	size_t content_len)
+{
+	git_buf *out = cb_data;
+
+	GIT_UNUSED(delta);
+	GIT_UNUSED(range);
+
+	if (line_origin == GIT_DIFF_LINE_ADDITION ||
+		line_origin == GIT_DIFF_LINE_DELETION ||
+		line_origin == GIT_DIFF_LINE_CONTEXT)
+		git_buf_putc(out, line_origin);
+
+	git_buf_put(out, content, content_len);
+	return git_buf_oom(out) ? -1 : 0;
+}
+
+typedef int (*make_diff_fn)(git_diff_list **diff, git_diff_options *opts);
+
+/* The patch text has to come out the same, however it was made */
+static void assert_parallel_patch_matches(make_diff_fn make_diff, uint32_t flags)
+{
+	git_diff_options opts = {0};
+	git_diff_list *diff;
+	git_buf expected = GIT_BUF_INIT, actual = GIT_BUF_INIT;
+	diff_expects exp, par_exp;
+
+	opts.flags = flags;
+	cl_git_pass(make_diff(&diff, &opts));
+	cl_git_pass(git_diff_print_patch(diff, &expected, print_to_buf));
+	memset(&exp, 0, sizeof(exp));
+	cl_git_pass(git_diff_foreach(
+		diff, &exp, diff_file_fn, diff_hunk_fn, diff_line_fn));
+	git_diff_list_free(diff);
+
+	opts.flags = flags | GIT_DIFF_PARALLEL;
+	cl_git_pass(make_diff(&diff, &opts));
+	cl_git_pass(git_diff_print_patch(diff, &actual, print_to_buf));
+	git_diff_list_free(diff);
+
+	cl_git_pass(make_diff(&diff, &opts));
+	memset(&par_exp, 0, sizeof(par_exp));
+	cl_git_pass(git_diff_foreach(
+		diff, &par_exp, diff_file_fn, diff_hunk_fn, diff_line_fn));
+	git_diff_list_free(diff);
+
+	cl_assert(expected.size > 0);
+	cl_assert_equal_s(expected.ptr, actual.ptr);
+
+	cl_assert_equal_i(exp.files, par_exp.files);
+	cl_assert_equal_i(exp.files_binary, par_exp.files_binary);
+	cl_assert_equal_i(exp.file_unmodified, par_exp.file_unmodified);
+	cl_assert_equal_i(exp.hunks, par_exp.hunks);
+	cl_assert_equal_i(exp.lines, par_exp.lines);
+
+	git_buf_free(&expected);
+	git_buf_free(&actual);
+}
+
+static int make_tree_diff(git_diff_list **diff, git_diff_options *opts)
+{
+	git_tree *a, *b;
+	int error;
+
+	cl_assert((a = resolve_commit_oid_to_tree(g_repo, "605812a")) != NULL);
+	cl_assert((b = resolve_commit_oid_to_tree(g_repo, "370fe9ec22")) != NULL);
+
+	error = git_diff_tree_to_tree(g_repo, opts, a, b, diff);
+
+	git_tree_free(a);
+	git_tree_free(b);
+	return error;
+}
+
+void test_diff_parallel__tree_to_tree(void)
+{
+	g_repo = cl_git_sandbox_init("attr");
+
+	assert_parallel_patch_matches(make_tree_diff, 0);
+	assert_parallel_patch_matches(make_tree_diff, GIT_DIFF_REVERSE);
+	assert_parallel_patch_matches(make_tree_diff, GIT_DIFF_FORCE_TEXT);
+}
+
+static int make_workdir_diff(git_diff_list **diff, git_diff_options *opts)
+{
+	return git_diff_workdir_to_index(g_repo, opts, diff);
+}
+
+void test_diff_parallel__workdir_to_index(void)
+{
+	git_buf path = GIT_BUF_INIT, content = GIT_BUF_INIT;
+	unsigned int i;
+
+	g_repo = cl_git_sandbox_init("status");
+
+	/* more files than are ever read ahead of the callbacks */
+	cl_git_pass(p_mkdir("status/many", 0777));
+
+	for (i = 0; i < 100; ++i) {
+		git_buf_clear(&path);
+		cl_git_pass(git_buf_printf(&path, "status/many/file%02u", i));
+		cl_git_pass(git_buf_printf(&content, "line %u\n", i));
+		cl_git_mkfile(path.ptr, content.ptr);
+	}
+
+	cl_git_mkfile("status/many/binary", "some\0binary\0data");
+	cl_git_mkfile("status/.gitattributes", "many/file1* -diff\n");
+
+	assert_parallel_patch_matches(make_workdir_diff,
+		GIT_DIFF_INCLUDE_UNTRACKED | GIT_DIFF_RECURSE_UNTRACKED_DIRS |
+		GIT_DIFF_INCLUDE_UNTRACKED_CONTENT);
+	assert_parallel_patch_matches(make_workdir_diff,
+		GIT_DIFF_INCLUDE_UNTRACKED | GIT_DIFF_RECURSE_UNTRACKED_DIRS |
+		GIT_DIFF_INCLUDE_UNTRACKED_CONTENT | GIT_DIFF_INCLUDE_UNMODIFIED);
+
+	git_buf_free(&path);
+	git_buf_free(&content);
+}
+
+static int stop_at_third_file(
+	void *cb_data, const git_diff_delta *delta, float progress)
+{
+	int *files = cb_data;
+
+	GIT_UNUSED(delta);
+	GIT_UNUSED(progress);
+
+	return (++(*files) == 3);
+}
+
+void test_diff_parallel__callbacks_can_stop_it(void)
+{
+	git_diff_options opts = {0};
+	git_diff_list *diff;
+	int files = 0;
+
+	g_repo = cl_git_sandbox_init("status");
+
+	opts.flags = GIT_DIFF_INCLUDE_UNTRACKED | GIT_DIFF_PARALLEL;
+	cl_git_pass(git_diff_workdir_to_index(g_repo, &opts, &diff));
+	cl_assert(git_diff_num_deltas(diff) > 3);
+
+	cl_assert_equal_i(GIT_EUSER, git_diff_foreach(
+		diff, &files, stop_at_third_file, NULL, NULL));
+	cl_assert_equal_i(3, files);
+
+	git_diff_list_free(diff);
+}
@@ -0,0 +1,385 @@
+#include "clar_libgit2.h"
+#include "diff_helpers.h"
+#include "posix.h"
+#include "diff.h"
+
+static git_repository *g_repo = NULL;
+
+void test_diff_rename__initialize(void)
+{
+	g_repo = cl_git_sandbox_init("status");
+}
+
+void test_diff_rename__cleanup(void)
+{
+	cl_git_sandbox_cleanup();
+}
+
+static git_diff_list *diff_workdir(uint32_t flags)
+{
+	git_diff_options opts = {0};
+	git_diff_list *diff;
+
+	opts.flags = GIT_DIFF_INCLUDE_UNTRACKED | GIT_DIFF_RECURSE_UNTRACKED_DIRS | flags;
+	cl_git_pass(git_diff_workdir_to_index(g_repo, &opts, &diff));
+
+	return diff;
+}
+
+static void find_similar(git_diff_list *diff, unsigned int flags, uint16_t threshold)
+{
+	git_diff_find_options opts;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.flags = flags;
+	opts.rename_threshold = threshold;
+	opts.copy_threshold = threshold;
+
+	cl_git_pass(git_diff_find_similar(diff, &opts));
+}
+
+static void count_deltas(diff_expects *exp, git_diff_list *diff)
+{
+	memset(exp, 0, sizeof(*exp));
+	cl_git_pass(git_diff_foreach(diff, exp, diff_file_fn, NULL, NULL));
+}
+
+static const git_diff_delta *find_delta(git_diff_list *diff, const char *new_path)
+{
+	git_diff_delta *delta;
+	unsigned int i;
+
+	git_vector_foreach(&diff->deltas, i, delta) {
+		if (strcmp(delta->new_file.path, new_path) == 0)
+			return delta;
+	}
+
+	return NULL;
+}
+
+static void add_to_index(const char *path, const char *content)
+{
+	git_index *index;
+	git_buf full = GIT_BUF_INIT;
+
+	cl_git_pass(git_buf_joinpath(&full, "status", path));
+	cl_git_mkfile(full.ptr, content);
+
+	cl_git_pass(git_repository_index(&index, g_repo));
+	cl_git_pass(git_index_add_from_workdir(index, path));
+	cl_git_pass(git_index_write(index));
+
+	git_index_free(index);
+	git_buf_free(&full);
+}
+
+static void numbered_lines(git_buf *out, const char *what, int changed_line)
+{
+	int i;
+
+	git_buf_clear(out);
+	for (i = 1; i <= 20; ++i) {
+		if (i == changed_line)
+			cl_git_pass(git_buf_printf(out, "this line was changed\n"));
+		else
+			cl_git_pass(git_buf_printf(out, "%s line %d of twenty\n", what, i));
+	}
+}
+
+/* The status fixture has 4 deleted files and 4 untracked ones to start with */
+
+void test_diff_rename__exact_renames_are_found(void)
+{
+	git_diff_list *diff;
+	const git_diff_delta *delta;
+	diff_expects exp;
+
+	cl_git_pass(p_rename("status/current_file", "status/moved_file"));
+
+	diff = diff_workdir(0);
+	find_similar(diff, GIT_DIFF_FIND_RENAMES | GIT_DIFF_FIND_FOR_UNTRACKED, 0);
+
+	count_deltas(&exp, diff);
+	cl_assert_equal_i(1, exp.file_renamed);
+	cl_assert_equal_i(4, exp.file_dels);
+	cl_assert_equal_i(4, exp.file_untracked);
+
+	cl_assert((delta = find_delta(diff, "moved_file")) != NULL);
+	cl_assert_equal_i(GIT_DELTA_RENAMED, delta->status);
+	cl_assert_equal_s("current_file", delta->old_file.path);
+	cl_assert_equal_i(100, delta->similarity);
+
+	git_diff_list_free(diff);
+}
+
+void test_diff_rename__untracked_files_are_only_used_when_asked(void)
+{
+	git_diff_list *diff;
+	diff_expects exp;
+
+	cl_git_pass(p_rename("status/current_file", "status/moved_file"));
+
+	diff = diff_workdir(0);
+	cl_git_pass(git_diff_find_similar(diff, NULL));
+
+	count_deltas(&exp, diff);
+	cl_assert_equal_i(0, exp.file_renamed);
+	cl_assert_equal_i(5, exp.file_dels);
+	cl_assert_equal_i(5, exp.file_untracked);
+
+	git_diff_list_free(diff);
+}
+
+void test_diff_rename__similar_files_are_found(void)
+{
+	git_diff_list *diff;
+	const git_diff_delta *delta;
+	git_buf content = GIT_BUF_INIT;
+	diff_expects exp;
+
+	numbered_lines(&content, "original", 0);
+	add_to_index("numbered", content.ptr);
+
+	numbered_lines(&content, "original", 10);
+	cl_git_mkfile("status/renumbered", content.ptr);
+	cl_git_pass(p_unlink("status/numbered"));
+
+	diff = diff_workdir(0);
+	find_similar(diff, GIT_DIFF_FIND_RENAMES | GIT_DIFF_FIND_FOR_UNTRACKED, 0);
+
+	count_deltas(&exp, diff);
+	cl_assert_equal_i(1, exp.file_renamed);
+
+	cl_assert((delta = find_delta(diff, "renumbered")) != NULL);
+	cl_assert_equal_i(GIT_DELTA_RENAMED, delta->status);
+	cl_assert_equal_s("numbered", delta->old_file.path);
+	cl_assert(delta->similarity >= 80 && delta->similarity < 100);
+
+	git_diff_list_free(diff);
+
+	/* but not if they have to be more similar than that */
+	diff = diff_workdir(0);
+	find_similar(diff, GIT_DIFF_FIND_RENAMES | GIT_DIFF_FIND_FOR_UNTRACKED, 99);
+
+	count_deltas(&exp, diff);
+	cl_assert_equal_i(0, exp.file_renamed);
+	cl_assert_equal_i(5, exp.file_dels);
+	cl_assert_equal_i(5, exp.file_untracked);
+
+	git_diff_list_free(diff);
+
+	/* nor if only exact matches count */
+	diff = diff_workdir(0);
+	find_similar(diff, GIT_DIFF_FIND_RENAMES | GIT_DIFF_FIND_FOR_UNTRACKED |
+		GIT_DIFF_FIND_EXACT_MATCH_ONLY, 0);
+
+	count_deltas(&exp, diff);
+	cl_assert_equal_i(0, exp.file_renamed);
+
+	git_diff_list_free(diff);
+	git_buf_free(&content);
+}
+
+void test_diff_rename__a_file_is_only_renamed_once(void)
+{
+	git_diff_list *diff;
+	diff_expects exp;
+
+	cl_git_pass(p_rename("status/current_file", "status/moved_file"));
+	cl_git_mkfile("status/other_moved_file", "current_file\n");
+
+	diff = diff_workdir(0);
+	find_similar(diff, GIT_DIFF_FIND_RENAMES | GIT_DIFF_FIND_FOR_UNTRACKED, 0);
+
+	count_deltas(&exp, diff);
+	cl_assert_equal_i(1, exp.file_renamed);
+	cl_assert_equal_i(0, exp.file_copied);
+	cl_assert_equal_i(4, exp.file_dels);
+	cl_assert_equal_i(5, exp.file_untracked);
+
+	git_diff_list_free(diff);
+
+	/* the other one is a copy, if those are looked for */
+	diff = diff_workdir(0);
+	find_similar(diff, GIT_DIFF_FIND_RENAMES | GIT_DIFF_FIND_COPIES |
+		GIT_DIFF_FIND_FOR_UNTRACKED, 0);
+
+	count_deltas(&exp, diff);
+	cl_assert_equal_i(1, exp.file_renamed);
+	cl_assert_equal_i(1, exp.file_copied);
+	cl_assert_equal_i(4, exp.file_untracked);
+
+	git_diff_list_free(diff);
+}
+
+void test_diff_rename__copies_of_unmodified_files_can_be_found(void)
+{
+	git_diff_list *diff;
+	const git_diff_delta *delta;
+	diff_expects exp;
+
+	cl_git_mkfile("status/copied_file", "subdir/current_file\n");
+
+	/* unmodified files are only copied from when they're in the diff */
+	diff = diff_workdir(0);
+	find_similar(diff, GIT_DIFF_FIND_COPIES_FROM_UNMODIFIED |
+		GIT_DIFF_FIND_FOR_UNTRACKED, 0);
+
+	count_deltas(&exp, diff);
+	cl_assert_equal_i(0, exp.file_copied);
+
+	git_diff_list_free(diff);
+
+	diff = diff_workdir(GIT_DIFF_INCLUDE_UNMODIFIED);
+	find_similar(diff, GIT_DIFF_FIND_COPIES_FROM_UNMODIFIED |
+		GIT_DIFF_FIND_FOR_UNTRACKED, 0);
+
+	count_deltas(&exp, diff);
+	cl_assert_equal_i(1, exp.file_copied);
+	cl_assert_equal_i(0, exp.file_renamed);
+	cl_assert_equal_i(4, exp.file_dels);
+
+	cl_assert((delta = find_delta(diff, "copied_file")) != NULL);
+	cl_assert_equal_i(GIT_DELTA_COPIED, delta->status);
+	cl_assert_equal_s("subdir/current_file", delta->old_file.path);
+	cl_assert((delta = find_delta(diff, "subdir/current_file")) != NULL);
+	cl_assert_equal_i(GIT_DELTA_UNMODIFIED, delta->status);
+
+	git_diff_list_free(diff);
+}
+
+static int print_to_buf(
+	void *cb_data,
+	const git_diff_delta *delta,
+	const git_diff_range *range,
+	char line_origin,
+	const char *content,
+	size_t content_len)
+{
+	git_buf *out = cb_data;
+
+	GIT_UNUSED(delta);
+	GIT_UNUSED(range);
+
+	if (line_origin == GIT_DIFF_LINE_ADDITION ||
+		line_origin == GIT_DIFF_LINE_DELETION ||
+		line_origin == GIT_DIFF_LINE_CONTEXT)
+		git_buf_putc(out, line_origin);
+
+	git_buf_put(out, content, content_len);
+	return git_buf_oom(out) ? -1 : 0;
+}
+
+void test_diff_rename__patches_say_where_files_came_from(void)
+{
+	git_diff_list *diff;
+	git_diff_options opts = {0};
+	git_buf content = GIT_BUF_INIT, patch = GIT_BUF_INIT;
+	char *paths[] = { "current_file", "moved_file", "numbered", "renumbered" };
+
+	cl_git_pass(p_rename("status/current_file", "status/moved_file"));
+
+	numbered_lines(&content, "original", 0);
+	add_to_index("numbered", content.ptr);
+	numbered_lines(&content, "original", 10);
+	cl_git_mkfile("status/renumbered", content.ptr);
+	cl_git_pass(p_unlink("status/numbered"));
+
+	opts.pathspec.count = 4;
+	opts.pathspec.strings = paths;
+	opts.flags = GIT_DIFF_INCLUDE_UNTRACKED;
+
+	cl_git_pass(git_diff_workdir_to_index(g_repo, &opts, &diff));
+	find_similar(diff, GIT_DIFF_FIND_RENAMES | GIT_DIFF_FIND_FOR_UNTRACKED, 0);
+	cl_git_pass(git_diff_print_patch(diff, &patch, print_to_buf));
+
+	/* a file which was only moved has nothing else to show */
+	cl_assert(strstr(patch.ptr,
+		"diff --git a/current_file b/moved_file\n"
+		"similarity index 100%\n"
+		"rename from current_file\n"
+		"rename to moved_file\n"
+		"diff --git") != NULL);
+
+	cl_assert(strstr(patch.ptr,
+		"diff --git a/numbered b/renumbered\n"
+		"similarity index ") != NULL);
+	cl_assert(strstr(patch.ptr,
+		"rename from numbered\n"
+		"rename to renumbered\n"
+		"index ") != NULL);
+	cl_assert(strstr(patch.ptr,
+		"--- a/numbered\n"
+		"+++ b/renumbered\n") != NULL);
+	cl_assert(strstr(patch.ptr, "-original line 10 of twenty\n") != NULL);
+	cl_assert(strstr(patch.ptr, "+this line was changed\n") != NULL);
+
+	git_diff_list_free(diff);
+	git_buf_free(&content);
+	git_buf_free(&patch);
+}
+
+void test_diff_rename__many_similar_files_are_paired_up(void)
+{
+	git_index *index;
+	git_diff_list *diff;
+	const git_diff_delta *delta;
+	git_buf path = GIT_BUF_INIT, content = GIT_BUF_INIT, what = GIT_BUF_INIT;
+	diff_expects exp;
+	int i;
+
+	cl_git_pass(p_mkdir("status/before", 0777));
+	cl_git_pass(p_mkdir("status/after", 0777));
+	cl_git_pass(git_repository_index(&index, g_repo));
+
+	for (i = 0; i < 500; ++i) {
+		git_buf_clear(&what);
+		git_buf_clear(&path);
+		cl_git_pass(git_buf_printf(&what, "file %d", i));
+		cl_git_pass(git_buf_printf(&path, "status/before/file%03d", i));
+
+		numbered_lines(&content, what.ptr, 0);
+		cl_git_mkfile(path.ptr, content.ptr);
+		cl_git_pass(git_index_add_from_workdir(index, path.ptr + strlen("status/")));
+	}
+
+	cl_git_pass(git_index_write(index));
+
+	/* move all of them, changing a line in each */
+	for (i = 0; i < 500; ++i) {
+		git_buf_clear(&what);
+		git_buf_clear(&path);
+		cl_git_pass(git_buf_printf(&what, "file %d", i));
+		cl_git_pass(git_buf_printf(&path, "status/before/file%03d", i));
+		cl_git_pass(p_unlink(path.ptr));
+
+		git_buf_clear(&path);
+		cl_git_pass(git_buf_printf(&path, "status/after/file%03d", i));
+		numbered_lines(&content, what.ptr, i % 20 + 1);
+		cl_git_mkfile(path.ptr, content.ptr);
+	}
+
+	diff = diff_workdir(0);
+	find_similar(diff, GIT_DIFF_FIND_RENAMES | GIT_DIFF_FIND_FOR_UNTRACKED, 0);
+
+	count_deltas(&exp, diff);
+	cl_assert_equal_i(500, exp.file_renamed);
+	cl_assert_equal_i(4, exp.file_dels);
+	cl_assert_equal_i(4, exp.file_untracked);
+
+	for (i = 0; i < 500; ++i) {
+		git_buf_clear(&path);
+		cl_git_pass(git_buf_printf(&path, "after/file%03d", i));
+		cl_assert((delta = find_delta(diff, path.ptr)) != NULL);
+
+		git_buf_clear(&path);
+		cl_git_pass(git_buf_printf(&path, "before/file%03d", i));
+		cl_assert_equal_s(path.ptr, delta->old_file.path);
+	}
+
+	git_diff_list_free(diff);
+	git_index_free(index);
+	git_buf_free(&what);
+	git_buf_free(&path);
+	git_buf_free(&content);
+}
@@ -0,0 +1,123 @@
+#include "clar_libgit2.h"
+#include "diff_helpers.h"
+
+static git_repository *g_repo = NULL;
+
+void test_diff_stats__initialize(void)
+{
+}
+
+void test_diff_stats__cleanup(void)
+{
+	cl_git_sandbox_cleanup();
+}
+
+/* count what the patch of each delta has, to check the stats against */
+static void assert_stats_match_patches(git_diff_list *diff)
+{
+	git_diff_stats *stats;
+	git_diff_patch *patch;
+	const git_diff_delta *delta;
+	size_t d, h, l, adds, dels, total_adds = 0, total_dels = 0;
+	size_t files = 0;
+	char origin;
+
+	cl_git_pass(git_diff_get_stats(&stats, diff));
+
+	for (d = 0; d < git_diff_num_deltas(diff); ++d) {
+		size_t expect_adds = 0, expect_dels = 0;
+
+		cl_git_pass(git_diff_get_patch(&patch, &delta, diff, d));
+
+		if (delta->status != GIT_DELTA_UNMODIFIED)
+			files++;
+
+		for (h = 0; patch && h < git_diff_patch_num_hunks(patch); ++h) {
+			for (l = 0; l < (size_t)git_diff_patch_num_lines_in_hunk(patch, h); ++l) {
+				cl_git_pass(git_diff_patch_get_line_in_hunk(
+					&origin, NULL, NULL, NULL, NULL, patch, h, l));
+
+				if (origin == GIT_DIFF_LINE_ADDITION)
+					expect_adds++;
+				else if (origin == GIT_DIFF_LINE_DELETION)
+					expect_dels++;
+			}
+		}
+
+		cl_git_pass(git_diff_stats_for_delta(&adds, &dels, stats, d));
+		cl_assert_equal_i((int)expect_adds, (int)adds);
+		cl_assert_equal_i((int)expect_dels, (int)dels);
+
+		total_adds += adds;
+		total_dels += dels;
+
+		git_diff_patch_free(patch);
+	}
+
+	cl_assert_equal_i(GIT_ENOTFOUND, git_diff_stats_for_delta(
+		&adds, &dels, stats, git_diff_num_deltas(diff)));
+
+	cl_assert_equal_i((int)files, (int)git_diff_stats_files_changed(stats));
+	cl_assert_equal_i((int)total_adds, (int)git_diff_stats_insertions(stats));
+	cl_assert_equal_i((int)total_dels, (int)git_diff_stats_deletions(stats));
+
+	git_diff_stats_free(stats);
+}
+
+void test_diff_stats__tree_to_tree(void)
+{
+	git_tree *a, *b;
+	git_diff_options opts = {0};
+	git_diff_list *diff = NULL;
+	git_diff_stats *stats;
+
+	g_repo = cl_git_sandbox_init("attr");
+
+	cl_assert((a = resolve_commit_oid_to_tree(g_repo, "605812a")) != NULL);
+	cl_assert((b = resolve_commit_oid_to_tree(g_repo, "370fe9ec22")) != NULL);
+
+	cl_git_pass(git_diff_tree_to_tree(g_repo, &opts, a, b, &diff));
+
+	cl_git_pass(git_diff_get_stats(&stats, diff));
+	cl_assert_equal_i(5, (int)git_diff_stats_files_changed(stats));
+	cl_assert_equal_i(24 + 1 + 5 + 5, (int)git_diff_stats_insertions(stats));
+	cl_assert_equal_i(7 + 1, (int)git_diff_stats_deletions(stats));
+	git_diff_stats_free(stats);
+
+	assert_stats_match_patches(diff);
+
+	git_diff_list_free(diff);
+	git_tree_free(a);
+	git_tree_free(b);
+}
+
+void test_diff_stats__workdir_to_index(void)
+{
+	git_diff_options opts = {0};
+	git_diff_list *diff = NULL;
+	git_diff_stats *stats;
+
+	g_repo = cl_git_sandbox_init("status");
+
+	opts.flags = GIT_DIFF_INCLUDE_UNTRACKED | GIT_DIFF_INCLUDE_UNTRACKED_CONTENT;
+
+	cl_git_pass(git_diff_workdir_to_index(g_repo, &opts, &diff));
+
+	assert_stats_match_patches(diff);
+
+	git_diff_list_free(diff);
+
+	/* binary files are changed, but have no lines */
+	cl_git_append2file("status/current_file", "more\n");
+	cl_git_mkfile("status/.gitattributes", "current_file -diff\n");
+
+	cl_git_pass(git_diff_workdir_to_index(g_repo, NULL, &diff));
+
+	cl_git_pass(git_diff_get_stats(&stats, diff));
+	cl_assert_equal_i(4 + 4 + 1, (int)git_diff_stats_files_changed(stats));
+	git_diff_stats_free(stats);
+
+	assert_stats_match_patches(diff);
+
+	git_diff_list_free(diff);
+}
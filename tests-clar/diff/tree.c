@@ -80,6 +80,46 @@ void test_diff_tree__0(void)
 	git_tree_free(c);
 }
 
+void test_diff_tree__same_subtrees_are_not_loaded(void)
+{
+	git_tree *a, *b;
+	git_diff_options opts = {0};
+	git_diff_list *diff = NULL;
+	diff_expects exp;
+
+	g_repo = cl_git_sandbox_init("attr");
+
+	cl_assert((a = resolve_commit_oid_to_tree(g_repo, "605812a")) != NULL);
+	cl_assert((b = resolve_commit_oid_to_tree(g_repo, "370fe9ec22")) != NULL);
+
+	/* "subdir" and "subdir2" are the same in both trees; if the diff
+	 * doesn't need them, it's fine for them to be gone
+	 */
+	cl_git_pass(p_unlink(
+		"attr/.git/objects/9f/b40b6675dde60b5697afceae91b66d908c02d9"));
+	cl_git_pass(p_unlink(
+		"attr/.git/objects/29/29de282ce999e95183aedac6451d3384559c4b"));
+
+	memset(&exp, 0, sizeof(exp));
+
+	cl_git_pass(git_diff_tree_to_tree(g_repo, &opts, a, b, &diff));
+	cl_git_pass(git_diff_foreach(diff, &exp, diff_file_fn, NULL, NULL));
+
+	cl_assert_equal_i(5, exp.files);
+	cl_assert_equal_i(2, exp.file_adds);
+	cl_assert_equal_i(1, exp.file_dels);
+	cl_assert_equal_i(2, exp.file_mods);
+
+	git_diff_list_free(diff);
+
+	/* unless it has to list unmodified files too */
+	opts.flags = GIT_DIFF_INCLUDE_UNMODIFIED;
+	cl_git_fail(git_diff_tree_to_tree(g_repo, &opts, a, b, &diff));
+
+	git_tree_free(a);
+	git_tree_free(b);
+}
+
 void test_diff_tree__options(void)
 {
 	/* grabbed a couple of commit oids from the history of the attr repo */
@@ -1,6 +1,7 @@
 #include "clar_libgit2.h"
 #include "diff_helpers.h"
 #include "repository.h"
+#include "diff.h"
 
 static git_repository *g_repo = NULL;
 
@@ -835,3 +836,138 @@ void test_diff_workdir__cannot_diff_against_a_bare_repository(void)
 
 	git_tree_free(tree);
 }
+
+void test_diff_workdir__many_files_to_hash(void)
+{
+	git_diff_options opts = {0};
+	git_diff_list *diff = NULL;
+	git_diff_delta *delta, *prev = NULL;
+	git_index *index;
+	git_index_entry *entry;
+	git_buf path = GIT_BUF_INIT;
+	diff_expects exp;
+	unsigned int i;
+
+	g_repo = cl_git_sandbox_init("status");
+
+	/* enough files whose stat data is off that they are hashed on
+	 * several threads, when there are threads
+	 */
+	cl_git_pass(git_repository_index(&index, g_repo));
+	cl_git_pass(p_mkdir("status/many", 0777));
+
+	for (i = 0; i < 64; ++i) {
+		cl_git_pass(git_buf_printf(&path, "status/many/file%02u", i));
+		cl_git_rewritefile(path.ptr, "same old content\n");
+		cl_git_pass(git_index_add_from_workdir(index, path.ptr + strlen("status/")));
+
+		entry = git_index_get_bypath(index, path.ptr + strlen("status/"), 0);
+		entry->mtime.seconds -= 100;
+
+		/* every fourth file really changes */
+		if (i % 4 == 0)
+			cl_git_rewritefile(path.ptr, "new content\n");
+
+		git_buf_clear(&path);
+	}
+
+	cl_git_pass(git_index_write(index));
+
+	opts.flags = GIT_DIFF_INCLUDE_UNMODIFIED;
+
+	cl_git_pass(git_diff_workdir_to_index(g_repo, &opts, &diff));
+
+	memset(&exp, 0, sizeof(exp));
+	cl_git_pass(git_diff_foreach(diff, &exp, diff_file_fn, NULL, NULL));
+
+	cl_assert_equal_i(4 + 16, exp.file_mods);
+	cl_assert_equal_i(4, exp.file_dels);
+	cl_assert_equal_i(48 + 5, exp.file_unmodified);
+
+	git_vector_foreach(&diff->deltas, i, delta) {
+		cl_assert(prev == NULL ||
+			strcmp(prev->old_file.path, delta->old_file.path) < 0);
+		cl_assert(delta->new_file.flags & GIT_DIFF_FILE_VALID_OID);
+		prev = delta;
+	}
+
+	git_diff_list_free(diff);
+
+	/* unmodified files are dropped from the list if they aren't wanted */
+	opts.flags = GIT_DIFF_REVERSE;
+
+	cl_git_pass(git_diff_workdir_to_index(g_repo, &opts, &diff));
+
+	memset(&exp, 0, sizeof(exp));
+	git_vector_foreach(&diff->deltas, i, delta)
+		cl_git_pass(diff_file_fn(&exp, delta, 0));
+
+	cl_assert_equal_i(4 + 16, exp.file_mods);
+	cl_assert_equal_i(4, exp.file_adds);
+	cl_assert_equal_i(0, exp.file_unmodified);
+	cl_assert_equal_i(24, (int)diff->deltas.length);
+
+	git_diff_list_free(diff);
+	git_buf_free(&path);
+	git_index_free(index);
+}
+
+void test_diff_workdir__binary_check_reads_only_the_start_of_files(void)
+{
+	git_diff_options opts = {0};
+	git_diff_list *diff = NULL;
+	git_diff_delta *delta;
+	git_buf content = GIT_BUF_INIT, path = GIT_BUF_INIT;
+	char *pathspec[] = { "current_file", "modified_file" };
+	diff_expects exp;
+	git_oid oid;
+	unsigned int i;
+	int fd;
+
+	g_repo = cl_git_sandbox_init("status");
+
+	/* a text file much larger than what's looked at for the check */
+	cl_git_pass(git_buf_puts(&content, "modified_file\n"));
+	for (i = 0; i < 10000; ++i)
+		cl_git_pass(git_buf_printf(&content, "line %u\n", i));
+	cl_git_rewritefile("status/modified_file", content.ptr);
+
+	cl_assert((fd = p_open("status/current_file", O_WRONLY | O_TRUNC)) >= 0);
+	cl_git_pass(p_write(fd, "bin\0ary\n", 8));
+	cl_git_pass(p_close(fd));
+
+	opts.pathspec.strings = pathspec;
+	opts.pathspec.count = 2;
+
+	cl_git_pass(git_diff_workdir_to_index(g_repo, &opts, &diff));
+
+	/* with only the file callback, the files aren't loaded entirely */
+	memset(&exp, 0, sizeof(exp));
+	cl_git_pass(git_diff_foreach(diff, &exp, diff_file_fn, NULL, NULL));
+
+	cl_assert_equal_i(2, exp.files);
+	cl_assert_equal_i(2, exp.file_mods);
+	cl_assert_equal_i(1, exp.files_binary);
+
+	/* but the oids are still those of the whole files */
+	git_vector_foreach(&diff->deltas, i, delta) {
+		cl_assert(delta->new_file.flags & GIT_DIFF_FILE_VALID_OID);
+
+		cl_git_pass(git_buf_joinpath(&path, "status", delta->new_file.path));
+		cl_git_pass(git_odb_hashfile(&oid, path.ptr, GIT_OBJ_BLOB));
+		cl_assert(git_oid_cmp(&oid, &delta->new_file.oid) == 0);
+	}
+
+	memset(&exp, 0, sizeof(exp));
+	cl_git_pass(git_diff_foreach(
+		diff, &exp, diff_file_fn, diff_hunk_fn, diff_line_fn));
+
+	cl_assert_equal_i(2, exp.files);
+	cl_assert_equal_i(1, exp.files_binary);
+	cl_assert_equal_i(1, exp.hunks);
+	cl_assert_equal_i(10000, exp.line_adds);
+
+	git_diff_list_free(diff);
+	git_buf_free(&content);
+	git_buf_free(&path);
+}
@@ -0,0 +1,120 @@
+#include "clar_libgit2.h"
+#include "posix.h"
+#include "index.h"
+
+static git_repository *_repo;
+static git_index *_index;
+
+void test_index_racy__initialize(void)
+{
+	cl_git_pass(git_repository_init(&_repo, "racy", 0));
+	cl_git_pass(git_repository_index(&_index, _repo));
+}
+
+void test_index_racy__cleanup(void)
+{
+	git_index_free(_index);
+	_index = NULL;
+	git_repository_free(_repo);
+	_repo = NULL;
+
+	cl_fixture_cleanup("racy");
+}
+
+/*
+ * Change the contents of "racy/A" without changing its size, and give
+ * the index entry the stat data of the changed file, as if it had been
+ * modified in the same instant it was added.
+ */
+static git_index_entry *add_racily_modified_file(void)
+{
+	git_index_entry *entry, changed;
+	struct stat st;
+
+	cl_git_mkfile("racy/A", "hello\n");
+	cl_git_pass(git_index_add_from_workdir(_index, "A"));
+	cl_git_pass(git_index_write(_index));
+
+	cl_git_rewritefile("racy/A", "world\n");
+	cl_git_pass(p_stat("racy/A", &st));
+
+	entry = git_index_get_bypath(_index, "A", 0);
+	memcpy(&changed, entry, sizeof(git_index_entry));
+	git_index__init_entry_from_stat(&st, &changed);
+	cl_git_pass(git_index_add(_index, &changed));
+
+	entry = git_index_get_bypath(_index, "A", 0);
+	memcpy(&_index->last_modified, &entry->mtime, sizeof(git_index_time));
+
+	return entry;
+}
+
+static size_t count_modified(void)
+{
+	git_diff_list *diff;
+	size_t count;
+
+	cl_git_pass(git_diff_workdir_to_index(_repo, NULL, &diff));
+	count = git_diff_num_deltas_of_type(diff, GIT_DELTA_MODIFIED);
+	git_diff_list_free(diff);
+
+	return count;
+}
+
+void test_index_racy__entries_record_subsecond_times(void)
+{
+	git_index_entry *entry;
+	struct stat st;
+
+	cl_git_mkfile("racy/A", "hello\n");
+	cl_git_pass(git_index_add_from_workdir(_index, "A"));
+	cl_git_pass(p_stat("racy/A", &st));
+
+	entry = git_index_get_bypath(_index, "A", 0);
+	cl_assert(entry->mtime.seconds == (git_time_t)st.st_mtime);
+	cl_assert(entry->mtime.nanoseconds == GIT_STAT_MTIME_NSEC(&st));
+	cl_assert(entry->ctime.nanoseconds == GIT_STAT_CTIME_NSEC(&st));
+}
+
+void test_index_racy__diff_does_not_trust_racy_entries(void)
+{
+	git_index_entry *entry = add_racily_modified_file();
+
+	cl_assert(git_index__is_racy(_index, entry));
+	cl_assert_equal_i(1, (int)count_modified());
+
+	/* The same stat data is trusted once the index is newer */
+	_index->last_modified.seconds = entry->mtime.seconds + 1;
+	cl_assert(!git_index__is_racy(_index, entry));
+	cl_assert_equal_i(0, (int)count_modified());
+}
+
+void test_index_racy__write_smudges_racily_modified_entries(void)
+{
+	git_index_entry *entry = add_racily_modified_file();
+
+	cl_git_pass(git_index_write(_index));
+	cl_assert(entry->file_size == 0);
+
+	/* The smudged size is on disk, so the change can't be missed */
+	_index->last_modified.seconds = 0;
+	cl_git_pass(git_index_read(_index));
+	entry = git_index_get_bypath(_index, "A", 0);
+	cl_assert(entry->file_size == 0);
+	cl_assert_equal_i(1, (int)count_modified());
+}
+
+void test_index_racy__write_leaves_racily_clean_entries(void)
+{
+	git_index_entry *entry;
+
+	cl_git_mkfile("racy/A", "hello\n");
+	cl_git_pass(git_index_add_from_workdir(_index, "A"));
+
+	entry = git_index_get_bypath(_index, "A", 0);
+	memcpy(&_index->last_modified, &entry->mtime, sizeof(git_index_time));
+
+	cl_git_pass(git_index_write(_index));
+	cl_assert(entry->file_size == 6);
+	cl_assert_equal_i(0, (int)count_modified());
+}
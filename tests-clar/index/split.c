@@ -0,0 +1,225 @@
+#include "clar_libgit2.h"
+#include "posix.h"
+#include "index.h"
+
+#define TEST_INDEX2_PATH cl_fixture("gitgit.index")
+
+static git_index *_index;
+
+void test_index_split__initialize(void)
+{
+	cl_git_pass(p_mkdir("split", 0777));
+	cl_git_pass(git_futils_cp(TEST_INDEX2_PATH, "split/index", 0666));
+
+	cl_git_pass(git_index_open(&_index, "split/index"));
+	cl_git_pass(git_index_set_caps(_index, GIT_INDEXCAP_SPLIT_INDEX));
+}
+
+void test_index_split__cleanup(void)
+{
+	git_index_free(_index);
+	_index = NULL;
+
+	cl_fixture_cleanup("split");
+}
+
+static void shared_index_path(git_buf *out, const git_oid *oid)
+{
+	char hex[GIT_OID_HEXSZ + 1];
+
+	git_oid_tostr(hex, sizeof(hex), oid);
+	cl_git_pass(git_buf_joinpath(out, "split", "sharedindex."));
+	cl_git_pass(git_buf_puts(out, hex));
+}
+
+static size_t file_size(const char *path)
+{
+	struct stat st;
+
+	cl_git_pass(p_stat(path, &st));
+	return (size_t)st.st_size;
+}
+
+static void assert_same_entries(git_index *a, git_index *b)
+{
+	unsigned int i;
+
+	cl_assert_equal_i(git_index_entrycount(a), git_index_entrycount(b));
+
+	for (i = 0; i < git_index_entrycount(a); ++i) {
+		git_index_entry *x = git_index_get_byindex(a, i);
+		git_index_entry *y = git_index_get_byindex(b, i);
+
+		cl_assert_equal_s(x->path, y->path);
+		cl_assert(git_oid_cmp(&x->oid, &y->oid) == 0);
+		cl_assert(x->flags == y->flags);
+		cl_assert(x->mtime.seconds == y->mtime.seconds);
+	}
+}
+
+void test_index_split__write_shared_and_split_index(void)
+{
+	git_index *index, *expected;
+	git_buf shared = GIT_BUF_INIT;
+
+	cl_git_pass(git_index_write(_index));
+
+	cl_assert(_index->split_base != NULL);
+	shared_index_path(&shared, &_index->split_base_oid);
+	cl_assert(git_path_isfile(shared.ptr));
+
+	/* Everything lives in the shared index */
+	cl_assert(file_size("split/index") * 10 < file_size(shared.ptr));
+
+	cl_git_pass(git_index_open(&index, "split/index"));
+	cl_git_pass(git_index_open(&expected, TEST_INDEX2_PATH));
+	assert_same_entries(expected, index);
+	cl_assert(index->tree != NULL);
+
+	git_index_free(expected);
+	git_index_free(index);
+	git_buf_free(&shared);
+}
+
+void test_index_split__small_changes_leave_the_shared_index(void)
+{
+	git_index *index;
+	git_index_entry *entry, added;
+	git_oid base, id;
+	size_t split_size;
+
+	cl_git_pass(git_index_write(_index));
+	git_oid_cpy(&base, &_index->split_base_oid);
+	split_size = file_size("split/index");
+
+	cl_git_pass(git_oid_fromstr(&id, "a8233120f6ad708f843d861ce2b7228ec4e3dec6"));
+
+	/* Replace one, remove one and add one */
+	entry = git_index_get_bypath(_index, "Makefile", 0);
+	cl_assert(entry != NULL);
+	memcpy(&added, entry, sizeof(git_index_entry));
+	git_oid_cpy(&added.oid, &id);
+	cl_git_pass(git_index_add(_index, &added));
+
+	cl_git_pass(git_index_remove(_index, "README", 0));
+
+	added.path = "zzz-new-file";
+	cl_git_pass(git_index_add(_index, &added));
+
+	cl_git_pass(git_index_write(_index));
+
+	cl_assert(git_oid_cmp(&base, &_index->split_base_oid) == 0);
+	cl_assert(file_size("split/index") > split_size);
+	cl_assert(file_size("split/index") < split_size + 512);
+
+	cl_git_pass(git_index_open(&index, "split/index"));
+	assert_same_entries(_index, index);
+
+	entry = git_index_get_bypath(index, "Makefile", 0);
+	cl_assert(git_oid_cmp(&entry->oid, &id) == 0);
+	cl_assert(git_index_get_bypath(index, "README", 0) == NULL);
+	cl_assert(git_index_get_bypath(index, "zzz-new-file", 0) != NULL);
+
+	git_index_free(index);
+}
+
+void test_index_split__many_changes_rewrite_the_shared_index(void)
+{
+	git_index *index;
+	git_buf old_shared = GIT_BUF_INIT, shared = GIT_BUF_INIT;
+	git_oid base;
+
+	cl_git_pass(git_index_write(_index));
+	git_oid_cpy(&base, &_index->split_base_oid);
+	shared_index_path(&old_shared, &base);
+
+	/* Drop about a third of the entries */
+	while (git_index_entrycount(_index) > 1000)
+		cl_git_pass(git_index_remove(_index, git_index_get_byindex(_index, 0)->path, 0));
+
+	cl_git_pass(git_index_write(_index));
+
+	cl_assert(git_oid_cmp(&base, &_index->split_base_oid) != 0);
+	shared_index_path(&shared, &_index->split_base_oid);
+	cl_assert(git_path_isfile(shared.ptr));
+	cl_assert(!git_path_exists(old_shared.ptr));
+
+	cl_git_pass(git_index_open(&index, "split/index"));
+	assert_same_entries(_index, index);
+	git_index_free(index);
+
+	git_buf_free(&old_shared);
+	git_buf_free(&shared);
+}
+
+void test_index_split__turning_it_off_writes_a_whole_index(void)
+{
+	git_index *index, *expected;
+
+	cl_git_pass(git_index_write(_index));
+	git_index_free(_index);
+
+	cl_git_pass(git_index_open(&_index, "split/index"));
+	cl_git_pass(git_index_set_caps(_index, 0));
+	cl_git_pass(git_index_write(_index));
+
+	cl_git_pass(git_index_open(&index, "split/index"));
+	cl_git_pass(git_index_open(&expected, TEST_INDEX2_PATH));
+	assert_same_entries(expected, index);
+	cl_assert(index->split_base == NULL);
+
+	git_index_free(expected);
+	git_index_free(index);
+}
+
+void test_index_split__missing_shared_index(void)
+{
+	git_index *index;
+	git_buf shared = GIT_BUF_INIT;
+
+	cl_git_pass(git_index_write(_index));
+	shared_index_path(&shared, &_index->split_base_oid);
+	cl_git_pass(p_unlink(shared.ptr));
+
+	cl_git_fail(git_index_open(&index, "split/index"));
+	git_index_free(index);
+
+	git_buf_free(&shared);
+}
+
+static uint32_t pool_pages(git_pool *pool)
+{
+	return git_pool__open_pages(pool) + git_pool__full_pages(pool);
+}
+
+void test_index_split__rewriting_the_shared_index_reuses_memory(void)
+{
+	git_index_entry *entry, changed;
+	git_oid base;
+	uint32_t path_pages, base_pages;
+	int i;
+
+	/* every change rewrites the shared index */
+	_index->split_max_change = 0;
+
+	cl_git_pass(git_index_write(_index));
+	path_pages = pool_pages(&_index->path_pool);
+	base_pages = pool_pages(&_index->split_base_pool);
+	cl_assert(base_pages > 0);
+
+	for (i = 0; i < 5; ++i) {
+		git_oid_cpy(&base, &_index->split_base_oid);
+
+		entry = git_index_get_bypath(_index, "Makefile", 0);
+		cl_assert(entry != NULL);
+		memcpy(&changed, entry, sizeof(git_index_entry));
+		changed.file_size++;
+		cl_git_pass(git_index_add(_index, &changed));
+
+		cl_git_pass(git_index_write(_index));
+		cl_assert(git_oid_cmp(&base, &_index->split_base_oid) != 0);
+
+		cl_assert_equal_i(path_pages, pool_pages(&_index->path_pool));
+		cl_assert_equal_i(base_pages, pool_pages(&_index->split_base_pool));
+	}
+}
@@ -176,6 +176,128 @@ void test_index_tests__write(void)
    p_unlink("index_rewrite");
 }
 
+void test_index_tests__change_entries_read_from_disk(void)
+{
+   git_index *index;
+   git_index_entry *entry, replacement;
+   git_oid id;
+
+   copy_file(TEST_INDEXBIG_PATH, "index_changed");
+
+   cl_git_pass(git_index_open(&index, "index_changed"));
+   cl_assert(git_index_entrycount(index) > 2);
+
+   cl_git_pass(git_oid_fromstr(&id, "a8233120f6ad708f843d861ce2b7228ec4e3dec6"));
+
+   /* Replace an entry which lives in the on-disk entry array */
+   entry = git_index_get_byindex(index, 0);
+   memcpy(&replacement, entry, sizeof(git_index_entry));
+   git_oid_cpy(&replacement.oid, &id);
+   cl_git_pass(git_index_add(index, &replacement));
+
+   entry = git_index_get_byindex(index, 0);
+   cl_assert(git_oid_cmp(&entry->oid, &id) == 0);
+
+   /* Remove one and add a brand new one */
+   entry = git_index_get_byindex(index, 1);
+   cl_git_pass(git_index_remove(index, entry->path, 0));
+
+   replacement.path = "zzz-new-file";
+   cl_git_pass(git_index_add(index, &replacement));
+
+   cl_git_pass(git_index_write(index));
+   git_index_free(index);
+
+   /* Read it back */
+   cl_git_pass(git_index_open(&index, "index_changed"));
+   entry = git_index_get_byindex(index, 0);
+   cl_assert(git_oid_cmp(&entry->oid, &id) == 0);
+   cl_assert(git_index_get_bypath(index, "zzz-new-file", 0) != NULL);
+   git_index_free(index);
+
+   p_unlink("index_changed");
+}
+
+void test_index_tests__write_and_read_offset_table(void)
+{
+   git_index *index, *expected;
+   git_buf contents = GIT_BUF_INIT;
+   unsigned int i;
+
+   copy_file(TEST_INDEX2_PATH, "index_offsets");
+
+   cl_git_pass(git_index_open(&index, "index_offsets"));
+   cl_git_pass(git_index_set_caps(index, GIT_INDEXCAP_OFFSET_TABLE));
+   cl_assert(git_index_caps(index) & GIT_INDEXCAP_OFFSET_TABLE);
+   cl_git_pass(git_index_write(index));
+   git_index_free(index);
+
+   cl_git_pass(git_futils_readbuffer(&contents, "index_offsets"));
+   /* The end of entries extension comes last, just before the checksum */
+   cl_assert(contents.size > 52);
+   cl_assert(memcmp(contents.ptr + contents.size - 52, "EOIE", 4) == 0);
+   git_buf_free(&contents);
+
+   cl_git_pass(git_index_open(&index, "index_offsets"));
+   cl_git_pass(git_index_open(&expected, TEST_INDEX2_PATH));
+
+   cl_assert(git_index_entrycount(index) == (unsigned int)index_entry_count_2);
+   cl_assert(index->tree != NULL);
+
+   for (i = 0; i < git_index_entrycount(expected); ++i) {
+      git_index_entry *a = git_index_get_byindex(expected, i);
+      git_index_entry *b = git_index_get_byindex(index, i);
+
+      cl_assert_equal_s(a->path, b->path);
+      cl_assert(git_oid_cmp(&a->oid, &b->oid) == 0);
+      cl_assert(a->flags == b->flags);
+      cl_assert(a->mtime.seconds == b->mtime.seconds);
+      cl_assert(a->file_size == b->file_size);
+   }
+
+   git_index_free(expected);
+   git_index_free(index);
+
+   p_unlink("index_offsets");
+}
+
+void test_index_tests__write_and_read_version_4(void)
+{
+   git_index *index;
+   git_buf v2 = GIT_BUF_INIT, v4 = GIT_BUF_INIT;
+
+   copy_file(TEST_INDEX2_PATH, "index_v4");
+
+   cl_git_pass(git_index_open(&index, "index_v4"));
+   cl_assert_equal_i(2, git_index_version(index));
+   cl_git_fail(git_index_set_version(index, 5));
+   cl_git_pass(git_index_set_version(index, 4));
+   cl_git_pass(git_index_write(index));
+   git_index_free(index);
+
+   /* The paths share most of their prefixes */
+   cl_git_pass(git_futils_readbuffer(&v2, TEST_INDEX2_PATH));
+   cl_git_pass(git_futils_readbuffer(&v4, "index_v4"));
+   cl_assert(v4.size < v2.size);
+   git_buf_free(&v2);
+   git_buf_free(&v4);
+
+   cl_git_pass(git_index_open(&index, "index_v4"));
+   cl_assert_equal_i(4, git_index_version(index));
+   cl_assert(git_index_entrycount(index) == (unsigned int)index_entry_count_2);
+   cl_assert(git_index_get_bypath(index, "builtin-add.c", 0) != NULL);
+   cl_assert(git_index_get_bypath(index, "xdiff/xutils.h", 0) != NULL);
+
+   /* And going back gives us the original file */
+   cl_git_pass(git_index_set_version(index, 2));
+   cl_git_pass(git_index_write(index));
+   files_are_equal(TEST_INDEX2_PATH, "index_v4");
+
+   git_index_free(index);
+
+   p_unlink("index_v4");
+}
+
 void test_index_tests__sort0(void)
 {
    // sort the entires in an index
@@ -0,0 +1,152 @@
+#include "clar_libgit2.h"
+#include "posix.h"
+#include "index.h"
+#include "tree-cache.h"
+
+static git_repository *_repo;
+static git_index *_index;
+
+void test_index_tree_cache__initialize(void)
+{
+	cl_git_pass(p_mkdir("tree_cache", 0700));
+	cl_git_pass(git_repository_init(&_repo, "tree_cache", 0));
+	cl_git_pass(git_repository_index(&_index, _repo));
+
+	cl_git_pass(p_mkdir("tree_cache/a", 0700));
+	cl_git_pass(p_mkdir("tree_cache/a/b", 0700));
+	cl_git_pass(p_mkdir("tree_cache/c", 0700));
+
+	cl_git_mkfile("tree_cache/README", "readme\n");
+	cl_git_mkfile("tree_cache/a/one", "one\n");
+	cl_git_mkfile("tree_cache/a/b/two", "two\n");
+	cl_git_mkfile("tree_cache/c/three", "three\n");
+
+	cl_git_pass(git_index_add_from_workdir(_index, "README"));
+	cl_git_pass(git_index_add_from_workdir(_index, "a/one"));
+	cl_git_pass(git_index_add_from_workdir(_index, "a/b/two"));
+	cl_git_pass(git_index_add_from_workdir(_index, "c/three"));
+}
+
+void test_index_tree_cache__cleanup(void)
+{
+	git_index_free(_index);
+	_index = NULL;
+	git_repository_free(_repo);
+	_repo = NULL;
+
+	cl_fixture_cleanup("tree_cache");
+}
+
+static void assert_cache_matches_tree(const git_tree_cache *cache, const git_oid *oid)
+{
+	git_tree *tree;
+	const git_tree_entry *entry;
+	unsigned int i;
+	size_t subtrees = 0;
+
+	cl_assert(cache->entries >= 0);
+	cl_assert(git_oid_cmp(&cache->oid, oid) == 0);
+
+	cl_git_pass(git_tree_lookup(&tree, _repo, oid));
+
+	for (i = 0; i < git_tree_entrycount(tree); ++i) {
+		entry = git_tree_entry_byindex(tree, i);
+		if (git_tree_entry_type(entry) != GIT_OBJ_TREE)
+			continue;
+
+		subtrees++;
+		assert_cache_matches_tree(
+			git_tree_cache_child(cache, git_tree_entry_name(entry), strlen(git_tree_entry_name(entry))),
+			git_tree_entry_id(entry));
+	}
+
+	cl_assert_equal_i(subtrees, cache->children_count);
+	git_tree_free(tree);
+}
+
+void test_index_tree_cache__write_tree_fills_the_cache(void)
+{
+	git_oid oid;
+
+	cl_git_pass(git_tree_create_fromindex(&oid, _index));
+
+	cl_assert(_index->tree != NULL);
+	cl_assert_equal_i(4, _index->tree->entries);
+	assert_cache_matches_tree(_index->tree, &oid);
+}
+
+void test_index_tree_cache__survives_writing_the_index(void)
+{
+	git_index *index;
+	git_oid oid;
+
+	cl_git_pass(git_tree_create_fromindex(&oid, _index));
+	cl_git_pass(git_index_write(_index));
+
+	cl_git_pass(git_index_open(&index, "tree_cache/.git/index"));
+	cl_assert(index->tree != NULL);
+	cl_assert_equal_i(4, index->tree->entries);
+
+	/* assert_cache_matches_tree() looks trees up in _repo */
+	assert_cache_matches_tree(index->tree, &oid);
+
+	git_index_free(index);
+}
+
+void test_index_tree_cache__adding_invalidates_the_path(void)
+{
+	const git_tree_cache *c;
+	git_oid oid, expected;
+
+	cl_git_pass(git_tree_create_fromindex(&oid, _index));
+
+	cl_git_mkfile("tree_cache/a/b/four", "four\n");
+	cl_git_pass(git_index_add_from_workdir(_index, "a/b/four"));
+
+	cl_assert(_index->tree->entries < 0);
+	cl_assert(git_tree_cache_get(_index->tree, "a")->entries < 0);
+	cl_assert(git_tree_cache_get(_index->tree, "a/b")->entries < 0);
+
+	c = git_tree_cache_get(_index->tree, "c");
+	cl_assert(c->entries == 1);
+
+	cl_git_pass(git_tree_create_fromindex(&oid, _index));
+	assert_cache_matches_tree(_index->tree, &oid);
+	cl_assert_equal_i(5, _index->tree->entries);
+
+	/* Writing everything from scratch gives the same tree */
+	git_tree_cache_free(_index->tree);
+	_index->tree = NULL;
+	cl_git_pass(git_tree_create_fromindex(&expected, _index));
+	cl_assert(git_oid_cmp(&oid, &expected) == 0);
+}
+
+void test_index_tree_cache__removed_directories_leave_the_cache(void)
+{
+	git_oid oid;
+
+	cl_git_pass(git_tree_create_fromindex(&oid, _index));
+	cl_assert(git_tree_cache_get(_index->tree, "c") != NULL);
+
+	cl_git_pass(git_index_remove(_index, "c/three", 0));
+	cl_git_pass(git_tree_create_fromindex(&oid, _index));
+
+	cl_assert(git_tree_cache_get(_index->tree, "c") == NULL);
+	assert_cache_matches_tree(_index->tree, &oid);
+}
+
+void test_index_tree_cache__read_tree_primes_the_cache(void)
+{
+	git_tree *tree;
+	git_oid oid;
+
+	cl_git_pass(git_tree_create_fromindex(&oid, _index));
+	cl_git_pass(git_tree_lookup(&tree, _repo, &oid));
+
+	cl_git_pass(git_index_read_tree(_index, tree));
+	git_tree_free(tree);
+
+	cl_assert(_index->tree != NULL);
+	cl_assert_equal_i(4, _index->tree->entries);
+	assert_cache_matches_tree(_index->tree, &oid);
+}
@@ -0,0 +1,139 @@
+#include "clar_libgit2.h"
+#include "fileops.h"
+
+#define PACK_DIR "testrepo.git/objects/pack"
+#define PACK_NAME "pack-a81e489679b7d3418f9ab594bda8ceb37dd4c695"
+
+static git_indexer_stream *_stream;
+static git_buf _pack, _expected_idx;
+
+void test_pack_indexer__initialize(void)
+{
+	git_buf path = GIT_BUF_INIT;
+
+	cl_git_pass(git_buf_joinpath(&path, cl_fixture(PACK_DIR), PACK_NAME ".pack"));
+	cl_git_pass(git_futils_readbuffer(&_pack, path.ptr));
+	cl_git_pass(git_buf_joinpath(&path, cl_fixture(PACK_DIR), PACK_NAME ".idx"));
+	cl_git_pass(git_futils_readbuffer(&_expected_idx, path.ptr));
+	git_buf_free(&path);
+
+	cl_git_pass(p_mkdir("indexed", 0777));
+	cl_git_pass(git_indexer_stream_new(&_stream, "indexed", NULL, NULL));
+}
+
+void test_pack_indexer__cleanup(void)
+{
+	git_indexer_stream_free(_stream);
+	_stream = NULL;
+	git_buf_free(&_pack);
+	git_buf_free(&_expected_idx);
+	cl_git_pass(git_futils_rmdir_r("indexed", NULL, GIT_DIRREMOVAL_FILES_AND_DIRS));
+}
+
+static void feed_in_pieces(size_t piece, git_transfer_progress *stats)
+{
+	size_t off, len;
+
+	for (off = 0; off < _pack.size; off += len) {
+		len = min(piece, _pack.size - off);
+		cl_git_pass(git_indexer_stream_add(_stream, _pack.ptr + off, len, stats));
+	}
+}
+
+static void assert_index_matches(git_transfer_progress *stats)
+{
+	git_buf idx = GIT_BUF_INIT;
+
+	cl_git_pass(git_indexer_stream_finalize(_stream, stats));
+	cl_assert_equal_i(stats->total_objects, stats->indexed_objects);
+	cl_assert_equal_i(stats->total_objects, stats->received_objects);
+
+	cl_git_pass(git_futils_readbuffer(&idx, "indexed/" PACK_NAME ".idx"));
+	cl_assert_equal_i(_expected_idx.size, idx.size);
+	cl_assert(memcmp(_expected_idx.ptr, idx.ptr, idx.size) == 0);
+	git_buf_free(&idx);
+}
+
+void test_pack_indexer__whole_pack_at_once(void)
+{
+	git_transfer_progress stats = {0};
+
+	feed_in_pieces(_pack.size, &stats);
+	assert_index_matches(&stats);
+}
+
+void test_pack_indexer__pack_in_4k_pieces(void)
+{
+	git_transfer_progress stats = {0};
+
+	feed_in_pieces(4096, &stats);
+	assert_index_matches(&stats);
+}
+
+void test_pack_indexer__pack_a_byte_at_a_time(void)
+{
+	git_transfer_progress stats = {0};
+
+	feed_in_pieces(1, &stats);
+	assert_index_matches(&stats);
+}
+
+void test_pack_indexer__truncated_pack_is_an_error(void)
+{
+	git_transfer_progress stats = {0};
+
+	cl_git_pass(git_indexer_stream_add(_stream, _pack.ptr, _pack.size / 2, &stats));
+	cl_assert(stats.received_objects < stats.total_objects);
+	cl_git_fail(git_indexer_stream_finalize(_stream, &stats));
+}
+
+void test_pack_indexer__corrupt_object_is_an_error(void)
+{
+	git_transfer_progress stats = {0};
+
+	/* Garble the zlib stream of the first object */
+	_pack.ptr[14] ^= 0xff;
+	cl_git_fail(git_indexer_stream_add(_stream, _pack.ptr, _pack.size, &stats));
+}
+
+static void assert_lowest_free_fds(int *fds)
+{
+	int i, fd[2];
+
+	/* new descriptors are always the lowest free ones */
+	for (i = 0; i < 2; i++)
+		cl_assert((fd[i] = p_open("indexed/marker", O_RDONLY | O_CREAT, 0666)) >= 0);
+	for (i = 0; i < 2; i++) {
+		if (fds[i] < 0)
+			fds[i] = fd[i];
+		cl_assert_equal_i(fds[i], fd[i]);
+		cl_git_pass(p_close(fd[i]));
+	}
+	cl_git_pass(p_unlink("indexed/marker"));
+}
+
+void test_pack_indexer__dropped_stream_can_be_started_over(void)
+{
+	git_transfer_progress stats = {0};
+	git_vector contents = GIT_VECTOR_INIT;
+	int fds[2] = { -1, -1 };
+
+	git_indexer_stream_free(_stream);
+	assert_lowest_free_fds(fds);
+
+	cl_git_pass(git_indexer_stream_new(&_stream, "indexed", NULL, NULL));
+	cl_git_pass(git_indexer_stream_add(_stream, _pack.ptr, _pack.size / 2, &stats));
+	git_indexer_stream_free(_stream);
+	_stream = NULL;
+
+	/* the temporary pack is gone, and so is our hold on it */
+	cl_git_pass(git_path_dirload("indexed", 0, 0, &contents));
+	cl_assert_equal_i(0, contents.length);
+	git_vector_free(&contents);
+	assert_lowest_free_fds(fds);
+
+	memset(&stats, 0, sizeof(stats));
+	cl_git_pass(git_indexer_stream_new(&_stream, "indexed", NULL, NULL));
+	feed_in_pieces(4096, &stats);
+	assert_index_matches(&stats);
+}
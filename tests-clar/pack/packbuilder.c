@@ -1,11 +1,14 @@
 #include "clar_libgit2.h"
 #include "iterator.h"
 #include "vector.h"
+#include "pack-objects.h"
+#include "git2/odb_backend.h"
 
 static git_repository *_repo;
 static git_revwalk *_revwalker;
 static git_packbuilder *_packbuilder;
 static git_indexer *_indexer;
+static git_indexer_stream *_stream;
 static git_vector _commits;
 
 void test_pack_packbuilder__initialize(void)
@@ -28,12 +31,14 @@ void test_pack_packbuilder__cleanup(void)
 	git_packbuilder_free(_packbuilder);
 	git_revwalk_free(_revwalker);
 	git_indexer_free(_indexer);
+	_indexer = NULL;
+	git_indexer_stream_free(_stream);
+	_stream = NULL;
 	git_repository_free(_repo);
 }
 
-void test_pack_packbuilder__create_pack(void)
+static void seed_packbuilder(void)
 {
-	git_transfer_progress stats;
 	git_oid oid, *o;
 	unsigned int i;
 
@@ -58,6 +63,13 @@ void test_pack_packbuilder__create_pack(void)
 					git_commit_tree_oid((git_commit *)obj)));
 		git_object_free(obj);
 	}
+}
+
+void test_pack_packbuilder__create_pack(void)
+{
+	git_transfer_progress stats;
+
+	seed_packbuilder();
 
 	cl_git_pass(git_packbuilder_write(_packbuilder, "testpack.pack"));
 
@@ -65,3 +77,114 @@ void test_pack_packbuilder__create_pack(void)
 	cl_git_pass(git_indexer_run(_indexer, &stats));
 	cl_git_pass(git_indexer_write(_indexer));
 }
+
+void test_pack_packbuilder__deltas_stay_within_islands(void)
+{
+	git_transfer_progress stats;
+	unsigned int i, j, master;
+
+	cl_git_fail(git_packbuilder_add_island(_packbuilder, "refs/heads/(["));
+	cl_git_pass(git_packbuilder_add_island(_packbuilder, "^refs/heads/([^/]+)$"));
+	seed_packbuilder();
+
+	cl_git_pass(git_packbuilder_write(_packbuilder, "testpack.pack"));
+
+	cl_assert(_packbuilder->island_marks != NULL);
+	cl_assert(_packbuilder->island_names.length > 1);
+
+	for (master = 0; master < _packbuilder->island_names.length; ++master)
+		if (!strcmp(git_vector_get(&_packbuilder->island_names, master), "master"))
+			break;
+	cl_assert(master < _packbuilder->island_names.length);
+
+	for (i = 0; i < _packbuilder->nr_objects; ++i) {
+		git_pobject *po = &_packbuilder->object_list[i];
+		git_pobject *base = po->delta;
+		uint32_t *trg, *src;
+
+		/* everything was found from HEAD, so all of it is in master */
+		trg = _packbuilder->island_marks + i * _packbuilder->island_words;
+		cl_assert(trg[master / 32] & (1u << (master % 32)));
+
+		if (!base)
+			continue;
+
+		trg = _packbuilder->island_marks + i * _packbuilder->island_words;
+		src = _packbuilder->island_marks +
+			(base - _packbuilder->object_list) * _packbuilder->island_words;
+
+		for (j = 0; j < _packbuilder->island_words; ++j)
+			cl_assert((trg[j] & ~src[j]) == 0);
+	}
+
+	cl_git_pass(git_indexer_new(&_indexer, "testpack.pack"));
+	cl_git_pass(git_indexer_run(_indexer, &stats));
+	cl_git_pass(git_indexer_write(_indexer));
+}
+
+static int feed_indexer(void *ptr, size_t len, void *payload)
+{
+	git_transfer_progress *stats = (git_transfer_progress *)payload;
+
+	return git_indexer_stream_add(_stream, ptr, len, stats);
+}
+
+void test_pack_packbuilder__foreach_streams_the_pack(void)
+{
+	git_transfer_progress stats;
+	git_odb *odb;
+	git_odb_backend *backend;
+	git_buf path = GIT_BUF_INIT;
+	char hex[GIT_OID_HEXSZ + 1] = {0};
+	unsigned int i;
+
+	memset(&stats, 0, sizeof(stats));
+	seed_packbuilder();
+
+	cl_git_pass(git_indexer_stream_new(&_stream, ".", NULL, NULL));
+	cl_git_pass(git_packbuilder_foreach(_packbuilder, feed_indexer, &stats));
+	cl_git_pass(git_indexer_stream_finalize(_stream, &stats));
+
+	cl_assert_equal_i(git_packbuilder_object_count(_packbuilder), stats.total_objects);
+	cl_assert_equal_i(stats.total_objects, stats.indexed_objects);
+	cl_assert_equal_i(git_packbuilder_object_count(_packbuilder), git_packbuilder_written(_packbuilder));
+	cl_assert_equal_i(0, _packbuilder->delta_cache_size);
+
+	/* every object can be found through the index we just wrote */
+	git_oid_fmt(hex, git_indexer_stream_hash(_stream));
+	cl_git_pass(git_buf_printf(&path, "pack-%s.idx", hex));
+
+	cl_git_pass(git_odb_new(&odb));
+	cl_git_pass(git_odb_backend_one_pack(&backend, git_buf_cstr(&path)));
+	cl_git_pass(git_odb_add_backend(odb, backend, 1));
+
+	for (i = 0; i < _packbuilder->nr_objects; ++i)
+		cl_assert(git_odb_exists(odb, &_packbuilder->object_list[i].id));
+
+	git_odb_free(odb);
+	git_buf_free(&path);
+}
+
+static int feed_corrupt_trailer(void *ptr, size_t len, void *payload)
+{
+	git_transfer_progress *stats = (git_transfer_progress *)payload;
+	char *data = ptr;
+
+	/* the trailer is handed over on its own */
+	if (len == GIT_OID_RAWSZ && _packbuilder->nr_remaining == 0)
+		data[0] ^= 0xff;
+
+	return git_indexer_stream_add(_stream, data, len, stats);
+}
+
+void test_pack_packbuilder__stream_indexer_verifies_trailer(void)
+{
+	git_transfer_progress stats;
+
+	memset(&stats, 0, sizeof(stats));
+	seed_packbuilder();
+
+	cl_git_pass(git_indexer_stream_new(&_stream, ".", NULL, NULL));
+	cl_git_pass(git_packbuilder_foreach(_packbuilder, feed_corrupt_trailer, &stats));
+	cl_git_fail(git_indexer_stream_finalize(_stream, &stats));
+}
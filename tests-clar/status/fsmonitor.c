@@ -0,0 +1,212 @@
+#include "clar_libgit2.h"
+#include "posix.h"
+#include "index.h"
+#include "status_helpers.h"
+
+static git_repository *_repo;
+static git_index *_index;
+
+/* A pretend filesystem monitor, which reports what it's told to */
+struct monitor {
+	git_vector changed;
+	int queries;
+	char last_token[16]; /* empty if there was none */
+	int fail;
+};
+
+static struct monitor _monitor;
+
+static int monitor_cb(git_index *index, const char *token, void *payload)
+{
+	struct monitor *monitor = payload;
+	char new_token[16];
+	unsigned int i;
+	char *path;
+	int error = 0;
+
+	if (monitor->fail)
+		return -1;
+
+	p_snprintf(monitor->last_token, sizeof(monitor->last_token),
+		"%s", token ? token : "");
+	monitor->queries++;
+
+	git_vector_foreach(&monitor->changed, i, path) {
+		if (!error)
+			error = git_index_fsmonitor_changed(index, path);
+		git__free(path);
+	}
+	git_vector_clear(&monitor->changed);
+
+	p_snprintf(new_token, sizeof(new_token), "%d", monitor->queries);
+
+	return error ? error : git_index_fsmonitor_set_token(index, new_token);
+}
+
+static void report(const char *path)
+{
+	cl_git_pass(git_vector_insert(&_monitor.changed, git__strdup(path)));
+}
+
+void test_status_fsmonitor__initialize(void)
+{
+	_repo = cl_git_sandbox_init("status");
+	cl_git_pass(git_repository_index(&_index, _repo));
+
+	/* the fixture ignores case, which the untracked cache doesn't work with */
+	cl_git_pass(git_index_set_caps(_index, GIT_INDEXCAP_UNTRACKED_CACHE));
+
+	memset(&_monitor, 0x0, sizeof(_monitor));
+	cl_git_pass(git_vector_init(&_monitor.changed, 0, NULL));
+	git_index_set_fsmonitor(_index, monitor_cb, &_monitor);
+}
+
+void test_status_fsmonitor__cleanup(void)
+{
+	unsigned int i;
+	char *path;
+
+	git_vector_foreach(&_monitor.changed, i, path)
+		git__free(path);
+	git_vector_free(&_monitor.changed);
+
+	git_index_free(_index);
+	_index = NULL;
+	cl_git_sandbox_cleanup();
+}
+
+/*
+ * Get the status with the monitor, then check it against what looking at
+ * everything finds.
+ */
+static void assert_monitored_status_matches(void)
+{
+	git_buf expected = GIT_BUF_INIT, actual = GIT_BUF_INIT;
+
+	cl_git_pass(status__get(&actual, _repo, GIT_STATUS_OPT_UPDATE_INDEX));
+
+	git_index_set_fsmonitor(_index, NULL, NULL);
+	cl_git_pass(git_index_set_caps(_index, 0));
+	cl_git_pass(status__get(&expected, _repo, 0));
+
+	cl_git_pass(git_index_set_caps(_index, GIT_INDEXCAP_UNTRACKED_CACHE));
+	git_index_set_fsmonitor(_index, monitor_cb, &_monitor);
+
+	cl_assert_equal_s(expected.ptr, actual.ptr);
+
+	git_buf_free(&expected);
+	git_buf_free(&actual);
+}
+
+void test_status_fsmonitor__monitor_is_asked_with_its_last_token(void)
+{
+	assert_monitored_status_matches();
+	cl_assert_equal_i(1, _monitor.queries);
+	cl_assert_equal_s("", _monitor.last_token);
+
+	assert_monitored_status_matches();
+	cl_assert_equal_i(2, _monitor.queries);
+	cl_assert_equal_s("1", _monitor.last_token);
+	cl_assert_equal_s("2", _index->fsmonitor_token);
+}
+
+void test_status_fsmonitor__token_and_unchanged_entries_are_saved(void)
+{
+	git_index *index;
+	git_index_entry *entry;
+
+	assert_monitored_status_matches();
+
+	cl_git_pass(git_index_open(&index, "status/.git/index"));
+	cl_assert_equal_s("1", index->fsmonitor_token);
+
+	entry = git_index_get_bypath(index, "current_file", 0);
+	cl_assert((entry->flags_extended & GIT_IDXENTRY_FSMONITOR_VALID) != 0);
+	entry = git_index_get_bypath(index, "modified_file", 0);
+	cl_assert((entry->flags_extended & GIT_IDXENTRY_FSMONITOR_VALID) == 0);
+
+	git_index_free(index);
+}
+
+void test_status_fsmonitor__unreported_changes_are_not_looked_for(void)
+{
+	git_buf status = GIT_BUF_INIT;
+
+	assert_monitored_status_matches();
+
+	/* the monitor would know, so nothing else checks */
+	cl_git_rewritefile("status/current_file", "something else entirely\n");
+	cl_git_mkfile("status/subdir/unreported", "new\n");
+
+	cl_git_pass(status__get(&status, _repo, 0));
+	cl_assert(!status__has(&status, "current_file"));
+	cl_assert(!status__has(&status, "subdir/unreported"));
+
+	report("current_file");
+	report("subdir/unreported");
+	assert_monitored_status_matches();
+
+	cl_git_pass(status__get(&status, _repo, 0));
+	cl_assert(status__has(&status, "current_file"));
+	cl_assert(status__has(&status, "subdir/unreported"));
+
+	git_buf_free(&status);
+}
+
+void test_status_fsmonitor__reported_changes_match_a_full_scan(void)
+{
+	assert_monitored_status_matches();
+
+	cl_git_mkfile("status/subdir/brand_new", "new\n");
+	report("subdir/brand_new");
+	assert_monitored_status_matches();
+
+	cl_git_pass(p_unlink("status/subdir/current_file"));
+	report("subdir/current_file");
+	assert_monitored_status_matches();
+
+	cl_git_rewritefile("status/subdir/modified_file", "changed again\n");
+	report("subdir/modified_file");
+	assert_monitored_status_matches();
+
+	cl_git_mkfile("status/subdir/.gitignore", "new_file\n");
+	report("subdir/.gitignore");
+	assert_monitored_status_matches();
+
+	cl_git_pass(p_mkdir("status/fresh", 0777));
+	cl_git_mkfile("status/fresh/file", "new\n");
+	report("fresh");
+	assert_monitored_status_matches();
+
+	cl_git_pass(git_futils_rmdir_r("status/subdir", NULL, GIT_DIRREMOVAL_FILES_AND_DIRS));
+	report("subdir");
+	assert_monitored_status_matches();
+}
+
+void test_status_fsmonitor__everything_can_be_reported(void)
+{
+	assert_monitored_status_matches();
+
+	cl_git_rewritefile("status/current_file", "something else entirely\n");
+	cl_git_mkfile("status/subdir/brand_new", "new\n");
+	report("");
+	assert_monitored_status_matches();
+}
+
+void test_status_fsmonitor__failing_monitor_fails_status(void)
+{
+	git_buf status = GIT_BUF_INIT;
+
+	assert_monitored_status_matches();
+
+	_monitor.fail = 1;
+	cl_assert_equal_i(GIT_EUSER, status__get(&status, _repo, 0));
+	cl_assert_equal_s("1", _index->fsmonitor_token);
+
+	_monitor.fail = 0;
+	cl_git_rewritefile("status/current_file", "something else entirely\n");
+	report("current_file");
+	assert_monitored_status_matches();
+
+	git_buf_free(&status);
+}
@@ -47,3 +47,36 @@ int cb_status__single(const char *p, unsigned int s, void *payload)
 
 	return 0;
 }
+
+int cb_status__append(const char *p, unsigned int s, void *payload)
+{
+	git_buf *out = payload;
+
+	git_buf_printf(out, "%s:%u\n", p, s);
+	return git_buf_oom(out) ? -1 : 0;
+}
+
+int status__get(git_buf *out, git_repository *repo, unsigned int flags)
+{
+	git_status_options opts;
+
+	memset(&opts, 0x0, sizeof(opts));
+	opts.show  = GIT_STATUS_SHOW_INDEX_AND_WORKDIR;
+	opts.flags = GIT_STATUS_OPT_INCLUDE_UNTRACKED | flags;
+
+	git_buf_clear(out);
+	return git_status_foreach_ext(repo, &opts, cb_status__append, out);
+}
+
+bool status__has(git_buf *status, const char *path)
+{
+	git_buf line = GIT_BUF_INIT;
+	bool found;
+
+	cl_git_pass(git_buf_printf(&line, "\n%s:", path));
+	found = (strstr(status->ptr, line.ptr + 1) == status->ptr ||
+		strstr(status->ptr, line.ptr) != NULL);
+
+	git_buf_free(&line);
+	return found;
+}
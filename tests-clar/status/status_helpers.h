@@ -1,6 +1,8 @@
 #ifndef INCLUDE_cl_status_helpers_h__
 #define INCLUDE_cl_status_helpers_h__
 
+#include "buffer.h"
+
 typedef struct {
 	int wrong_status_flags_count;
 	int wrong_sorted_path;
@@ -30,4 +32,15 @@ typedef struct {
 
 extern int cb_status__single(const char *p, unsigned int s, void *payload);
 
+
+/* cb_status__append takes payload of "git_buf *", and adds "path:status\n" */
+
+extern int cb_status__append(const char *p, unsigned int s, void *payload);
+
+/* The index and workdir status, untracked files included, as above */
+extern int status__get(git_buf *out, git_repository *repo, unsigned int flags);
+
+/* Whether a path is in the status from status__get */
+extern bool status__has(git_buf *status, const char *path);
+
 #endif
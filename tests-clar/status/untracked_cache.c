@@ -0,0 +1,195 @@
+#include "clar_libgit2.h"
+#include "posix.h"
+#include "index.h"
+#include "status_helpers.h"
+
+static git_repository *_repo;
+static git_index *_index;
+
+void test_status_untracked_cache__initialize(void)
+{
+	_repo = cl_git_sandbox_init("status");
+	cl_git_pass(git_repository_index(&_index, _repo));
+}
+
+void test_status_untracked_cache__cleanup(void)
+{
+	git_index_free(_index);
+	_index = NULL;
+	cl_git_sandbox_cleanup();
+}
+
+/* The fixture ignores case, which the cache doesn't work with */
+static void set_untracked_cache(bool enabled)
+{
+	unsigned int caps = git_index_caps(_index) & ~GIT_INDEXCAP_IGNORE_CASE;
+
+	if (enabled)
+		caps |= GIT_INDEXCAP_UNTRACKED_CACHE;
+	else
+		caps &= ~GIT_INDEXCAP_UNTRACKED_CACHE;
+
+	cl_git_pass(git_index_set_caps(_index, caps));
+}
+
+/*
+ * Get the status with the cache, updating it, and check that it's what
+ * we'd have found without it
+ */
+static void assert_cached_status_matches(void)
+{
+	git_buf expected = GIT_BUF_INIT, actual = GIT_BUF_INIT;
+
+	set_untracked_cache(false);
+	cl_git_pass(status__get(&expected, _repo, 0));
+
+	set_untracked_cache(true);
+	cl_git_pass(status__get(&actual, _repo, GIT_STATUS_OPT_UPDATE_INDEX));
+
+	cl_assert_equal_s(expected.ptr, actual.ptr);
+
+	git_buf_free(&expected);
+	git_buf_free(&actual);
+}
+
+/* Pretend that a while has passed, so the cache isn't racy */
+static void age_index(void)
+{
+	_index->last_modified.seconds += 10;
+}
+
+void test_status_untracked_cache__is_written_to_the_index(void)
+{
+	git_index *index;
+	git_untracked_dir *subdir;
+
+	assert_cached_status_matches();
+	cl_assert(_index->untracked != NULL);
+	cl_assert(!_index->untracked->dirty);
+
+	cl_git_pass(git_index_open(&index, "status/.git/index"));
+	cl_assert(index->untracked != NULL);
+	cl_assert(index->untracked->root->valid);
+	cl_assert_equal_i(
+		(int)_index->untracked->root->untracked.length,
+		(int)index->untracked->root->untracked.length);
+
+	cl_git_pass(git_untracked_cache_lookup(&subdir, index->untracked, "subdir/"));
+	cl_assert(subdir->valid);
+
+	git_index_free(index);
+}
+
+void test_status_untracked_cache__is_not_written_unless_enabled(void)
+{
+	git_buf status = GIT_BUF_INIT;
+	git_index *index;
+
+	set_untracked_cache(false);
+	cl_git_pass(status__get(&status, _repo, GIT_STATUS_OPT_UPDATE_INDEX));
+	cl_assert(_index->untracked == NULL);
+
+	cl_git_pass(git_index_open(&index, "status/.git/index"));
+	cl_assert(index->untracked == NULL);
+
+	git_index_free(index);
+	git_buf_free(&status);
+}
+
+void test_status_untracked_cache__unchanged_directories_are_not_reread(void)
+{
+	git_buf before = GIT_BUF_INIT, after = GIT_BUF_INIT;
+	git_index_time stamp;
+
+	set_untracked_cache(true);
+	cl_git_pass(status__get(&before, _repo, GIT_STATUS_OPT_UPDATE_INDEX));
+	age_index();
+	stamp = _index->last_modified;
+
+	cl_git_pass(status__get(&after, _repo, GIT_STATUS_OPT_UPDATE_INDEX));
+	cl_assert_equal_s(before.ptr, after.ptr);
+
+	/* nothing new was learned, so the index wasn't written */
+	cl_assert(!memcmp(&stamp, &_index->last_modified, sizeof(stamp)));
+	cl_assert(_index->untracked->root->valid);
+
+	git_buf_free(&before);
+	git_buf_free(&after);
+}
+
+void test_status_untracked_cache__new_files_are_found(void)
+{
+	assert_cached_status_matches();
+	age_index();
+
+	cl_git_mkfile("status/subdir/brand_new_file", "new\n");
+	cl_git_mkfile("status/another_new_file", "new\n");
+	assert_cached_status_matches();
+}
+
+void test_status_untracked_cache__removing_from_the_index_invalidates(void)
+{
+	assert_cached_status_matches();
+	age_index();
+
+	cl_git_pass(git_index_remove(_index, "subdir/current_file", 0));
+	cl_git_pass(git_index_write(_index));
+	age_index();
+
+	assert_cached_status_matches();
+}
+
+void test_status_untracked_cache__changed_ignore_rules_invalidate(void)
+{
+	git_buf status = GIT_BUF_INIT;
+
+	assert_cached_status_matches();
+	age_index();
+
+	cl_git_mkfile("status/subdir/.gitignore", "new_file\n");
+	assert_cached_status_matches();
+
+	cl_git_pass(status__get(&status, _repo, 0));
+	cl_assert(status__has(&status, "new_file"));
+	cl_assert(!status__has(&status, "subdir/new_file"));
+
+	age_index();
+	cl_git_rewritefile("status/.git/info/exclude", "*_file\n");
+	assert_cached_status_matches();
+
+	cl_git_pass(status__get(&status, _repo, 0));
+	cl_assert(!status__has(&status, "new_file"));
+
+	git_buf_free(&status);
+}
+
+static bool is_cached_untracked(git_untracked_dir *dir, const char *name)
+{
+	unsigned int i;
+	char *untracked;
+
+	git_vector_foreach(&dir->untracked, i, untracked)
+		if (strcmp(untracked, name) == 0)
+			return true;
+
+	return false;
+}
+
+void test_status_untracked_cache__tracked_directories_are_not_listed(void)
+{
+	git_untracked_dir *subdir;
+
+	cl_git_pass(p_mkdir("status/untracked_dir", 0777));
+	cl_git_mkfile("status/untracked_dir/file", "new\n");
+
+	assert_cached_status_matches();
+
+	cl_assert(is_cached_untracked(_index->untracked->root, "new_file"));
+	cl_assert(is_cached_untracked(_index->untracked->root, "untracked_dir/"));
+	cl_assert(!is_cached_untracked(_index->untracked->root, "subdir/"));
+	cl_assert(!is_cached_untracked(_index->untracked->root, "subdir"));
+
+	cl_git_pass(git_untracked_cache_lookup(&subdir, _index->untracked, "subdir/"));
+	cl_assert(is_cached_untracked(subdir, "new_file"));
+	cl_assert(!is_cached_untracked(subdir, "current_file"));
+}
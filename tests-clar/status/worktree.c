@@ -843,3 +843,66 @@ void test_status_worktree__line_endings_dont_count_as_changes_with_autocrlf(void
 
 	cl_assert_equal_i(GIT_STATUS_CURRENT, status);
 }
+
+static void assert_stat_matches(
+	const git_index_entry *entry, const char *path, bool expected)
+{
+	struct stat st;
+
+	cl_git_pass(p_stat(path, &st));
+
+	cl_assert_equal_i(expected,
+		entry->ino == (unsigned int)st.st_ino &&
+		entry->mtime.seconds == (git_time_t)st.st_mtime &&
+		entry->file_size == (git_off_t)st.st_size);
+}
+
+void test_status_worktree__update_index_records_stat_of_unchanged_files(void)
+{
+	git_repository *repo = cl_git_sandbox_init("status");
+	git_status_options opts;
+	status_entry_counts counts;
+	git_index *index;
+	int pass = 0;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.flags = GIT_STATUS_OPT_INCLUDE_IGNORED |
+		GIT_STATUS_OPT_INCLUDE_UNTRACKED |
+		GIT_STATUS_OPT_RECURSE_UNTRACKED_DIRS;
+
+	/* Without the flag, the index is left alone */
+	cl_git_pass(git_status_foreach_ext(repo, &opts, cb_status__count, &pass));
+
+	cl_git_pass(git_index_open(&index, "status/.git/index"));
+	assert_stat_matches(
+		git_index_get_bypath(index, "current_file", 0),
+		"status/current_file", false);
+	git_index_free(index);
+
+	opts.flags |= GIT_STATUS_OPT_UPDATE_INDEX;
+
+	/* Refreshing the index doesn't change the results */
+	for (pass = 0; pass < 2; ++pass) {
+		memset(&counts, 0x0, sizeof(status_entry_counts));
+		counts.expected_entry_count = entry_count0;
+		counts.expected_paths = entry_paths0;
+		counts.expected_statuses = entry_statuses0;
+
+		cl_git_pass(git_status_foreach_ext(
+			repo, &opts, cb_status__normal, &counts));
+
+		cl_assert_equal_i(counts.expected_entry_count, counts.entry_count);
+		cl_assert_equal_i(0, counts.wrong_status_flags_count);
+		cl_assert_equal_i(0, counts.wrong_sorted_path);
+	}
+
+	cl_git_pass(git_index_open(&index, "status/.git/index"));
+	assert_stat_matches(
+		git_index_get_bypath(index, "current_file", 0),
+		"status/current_file", true);
+	/* but modified files keep the stat data of what was added */
+	assert_stat_matches(
+		git_index_get_bypath(index, "modified_file", 0),
+		"status/modified_file", false);
+	git_index_free(index);
+}